@@ -0,0 +1,180 @@
+#!/usr/bin/env bash
+#
+# Workload benchmarks. Expects nufs to be mounted on mnt (make mount).
+#
+#   ./bench.sh fsync [count]    append log and sqlite, fsync after each record
+#   ./bench.sh compress [kib]   write and read a text log, plain and compressed
+#   ./bench.sh dedup [copies]   write copies of one file and report sharing;
+#                               run once mounted with NUFS_OPTS="-o dedup" and
+#                               once without to see the write-path overhead
+#   ./bench.sh checksum [kib]   write and read a file, report checksum GB/s
+#   ./bench.sh xattr [rounds]   label 50 files with small and shared large
+#                               attributes, then read and list them
+
+bench_fsync() {
+	local count=${1:-1000}
+	rm -f mnt/fsync.log mnt/nosync.log
+
+	echo -e "append log: $count x 40 bytes, no fsync\n"
+	time perl -MIO::Handle -e '
+		open(my $fh, ">>", "mnt/nosync.log") or die "open: $!";
+		for (1..$ARGV[0]) {
+			print $fh "=This string is fourty characters long.=";
+			$fh->flush;
+		}
+	' "$count"
+
+	echo -e "\nappend log: $count x 40 bytes, fsync after each\n"
+	time perl -MIO::Handle -e '
+		open(my $fh, ">>", "mnt/fsync.log") or die "open: $!";
+		for (1..$ARGV[0]) {
+			print $fh "=This string is fourty characters long.=";
+			$fh->flush;
+			$fh->sync or die "fsync: $!";
+		}
+	' "$count"
+
+	if command -v sqlite3 > /dev/null; then
+		rm -f mnt/bench.db mnt/bench.db-journal
+		echo -e "\nsqlite: $count single-row transactions\n"
+		time (
+			echo "CREATE TABLE log(id INTEGER PRIMARY KEY, line TEXT);"
+			for ((i = 0; i < count; i++)); do
+				echo "INSERT INTO log(line) VALUES('record $i');"
+			done
+		) | sqlite3 mnt/bench.db
+	fi
+}
+
+bench_compress() {
+	local kib=${1:-256}
+	rm -rf mnt/plain mnt/packed
+	mkdir mnt/plain mnt/packed
+	chattr +c mnt/packed || return 1
+
+	for dir in plain packed; do
+		echo -e "\n$dir: write $kib KiB of 40-byte lines\n"
+		time perl -e '
+			print "=This string is fourty characters long.=" x ($ARGV[0] * 1024 / 40);
+		' "$kib" > mnt/$dir/log
+
+		# Dropping the page cache needs root; otherwise the read is cached
+		sync
+		echo 3 2> /dev/null > /proc/sys/vm/drop_caches
+
+		echo -e "\n$dir: read it back\n"
+		time cat mnt/$dir/log > /dev/null
+		echo -e "\n$dir: $(du -k mnt/$dir/log | cut -f1) KiB on disk"
+	done
+}
+
+bench_dedup() {
+	local copies=${1:-16}
+	rm -rf mnt/dedup
+	mkdir mnt/dedup
+	head -c 32768 /dev/urandom > /tmp/nufs-dedup.src
+
+	echo -e "dedup: write $copies copies of 32 KiB\n"
+	time (
+		for ((i = 0; i < copies; i++)); do
+			cp /tmp/nufs-dedup.src mnt/dedup/copy$i
+		done
+		sync
+	)
+
+	echo
+	./nufs-dedup mnt
+	echo -e "\n$(du -sk mnt/dedup | cut -f1) KiB on disk"
+	rm -f /tmp/nufs-dedup.src
+}
+
+bench_checksum() {
+	local kib=${1:-512}
+	rm -f mnt/checksum.bin
+
+	echo -e "checksum: write $kib KiB\n"
+	time head -c $((kib * 1024)) /dev/urandom > mnt/checksum.bin
+
+	sync
+	echo 3 2> /dev/null > /proc/sys/vm/drop_caches
+
+	echo -e "\nchecksum: read it back\n"
+	time cat mnt/checksum.bin > /dev/null
+
+	echo
+	./nufs-checksum mnt
+}
+
+bench_xattr() {
+	local rounds=${1:-200}
+	rm -rf mnt/xattr
+	mkdir mnt/xattr
+
+	python3 - "$rounds" <<'EOF'
+import os, sys, time
+
+rounds = int(sys.argv[1])
+files = ["mnt/xattr/f%d" % ii for ii in range(50)]
+for path in files:
+    open(path, "w").close()
+
+# One label shared by every file, as with security contexts; security.*
+# needs root
+name = "security.label" if os.geteuid() == 0 else "user.label"
+label = b"system_u:object_r:build_cache_t:s0:" + b"c%d," * 40 % tuple(range(40))
+
+def bench(name, ops, fn):
+    start = time.perf_counter()
+    for _ in range(ops):
+        fn()
+    secs = time.perf_counter() - start
+    print("%-34s %8d ops %9.0f ops/s" % (name, ops, ops / secs))
+
+state = {"ii": 0}
+def each(fn):
+    def step():
+        fn(files[state["ii"] % len(files)])
+        state["ii"] += 1
+    return step
+
+bench("setxattr user.hash (inline)", len(files) * rounds,
+      each(lambda p: os.setxattr(p, "user.hash", os.urandom(8))))
+bench("setxattr security.label (shared)", len(files),
+      each(lambda p: os.setxattr(p, name, label)))
+bench("getxattr inline, across files", len(files) * rounds,
+      each(lambda p: os.getxattr(p, "user.hash")))
+bench("getxattr block, one hot file", len(files) * rounds,
+      lambda: os.getxattr(files[0], name))
+bench("getxattr block, across files", len(files) * rounds,
+      each(lambda p: os.getxattr(p, name)))
+bench("listxattr, across files", len(files) * rounds,
+      each(lambda p: os.listxattr(p)))
+EOF
+}
+
+case "$1" in
+	fsync)
+		shift
+		bench_fsync "$@"
+		;;
+	compress)
+		shift
+		bench_compress "$@"
+		;;
+	dedup)
+		shift
+		bench_dedup "$@"
+		;;
+	checksum)
+		shift
+		bench_checksum "$@"
+		;;
+	xattr)
+		shift
+		bench_xattr "$@"
+		;;
+	*)
+		echo "usage: $0 fsync [count] | compress [kib] | dedup [copies] | checksum [kib] | xattr [rounds]"
+		exit 1
+		;;
+esac
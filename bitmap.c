@@ -11,7 +11,7 @@ void bitmap_put(void* bm, int ii, int vv){
 	int byte = ii / 8;
 	int bit = ii % 8;
 	if (vv == 0) {
-		((uint8_t*)bm) [byte] &= ~(1 << (ii & 7));
+		((uint8_t*)bm) [byte] &= ~(1 << (7 - (bit)));
 	} else {
 		((uint8_t*)bm) [byte] |= 1 << (7 - (bit));
 	}
@@ -25,5 +25,5 @@ int bitmap_get(void* bm, int ii) {
 	int byte = ii / 8;
 	int bit = ii % 8;
 	uint8_t* bmu = bm;
-	return ((bmu[byte] >> 7 - bit) & 0x01);
+	return ((bmu[byte] >> (7 - bit)) & 0x01);
 }
@@ -9,63 +9,1245 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include "blocks.h"  
 #include "func.h"
 #include "bitmap.h"
 #include "directory.h"
+#include "inode.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "checksum.h"
+#include "io.h"
+#include "crc32c.h"
+#include "tier.h"
+#include "tail.h"
 
-const int BLOCK_COUNT = 256;  
-const int NUFS_SIZE = 4096 * 256; 
 int BLOCK_SIZE = 4096;
+int BLOCK_SHIFT = 12;
 
-static int   blocks_fd   = -1; 
-static void* blocks_base =  0;  
+// Geometry of the images blocks_init() formats on its own
+static const blocks_geometry_t blocks_default = { 256, 128, 16, 4096 };
+
+static void*  blocks_base  =  0;  
+static int    blocks_count =  0;  // Blocks in the mapped image
+static size_t blocks_size  =  0;  // Bytes in the mapped image
+static int    blocks_map   =  0;  // BLOCKS_MAP_* policies of the next mount
+
+// Backing files of the mapped image, the first holding the superblock
+static int blocks_fds[BLOCKS_STRIPE_MAX];
+static int blocks_members = 0;   // Backing files open
+static int blocks_unit    = 0;   // Blocks per stripe unit
+static int blocks_tier    = 0;   // Blocks in the fast tier, 0 if not tiered
+
+// Members and stripe unit of the next mount, see blocks_set_stripe()
+static const char* stripe_paths[BLOCKS_STRIPE_MAX - 1];
+static int stripe_count = 0;
+static int stripe_unit  = 0;
+
+// Slow file and fast tier size of the next mount, see blocks_set_tier()
+static const char* slow_path = 0;
+static long long fast_size   = 0;
+
+// The image is kept in anonymous memory, see blocks_set_checkpoint()
+static int blocks_memory = 0;
+
+// Identifies a checkpoint record ("CKPT")
+#define CKPT_MAGIC 0x54504b43
+
+/*
+ * An image kept in memory reaches its files only through checkpoints. Each
+ * is first written to a log past the end of the first file: two record
+ * blocks, a list of the block numbers in it, then the blocks. Writing its
+ * record, to the record blocks in turn, commits it; only then are the
+ * blocks copied to their home locations. A record only counts while the
+ * log it describes is intact, which it is until the next checkpoint, after
+ * this one's copy is done.
+ */
+typedef struct blocks_ckpt {
+    uint32_t magic;       // CKPT_MAGIC
+    uint32_t count;       // Blocks in the log
+    uint64_t gen;         // Checkpoint number; the larger record is current
+    uint32_t log_crc;     // CRC-32C of the block list and the blocks
+    uint32_t crc;         // CRC-32C of the fields above
+} blocks_ckpt_t;
+
+static int ckpt_interval = 10;   // Seconds between checkpoints
+static uint64_t ckpt_gen = 0;    // Number of the last checkpoint written
+static int ckpt_due = 0;         // The next writeback captures the changed blocks
+
+// Blocks captured for the next checkpoint, with their contents
+static int* ckpt_bnums = 0;
+static uint8_t* ckpt_data = 0;
+static int ckpt_count = 0;
+
+static pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ckpt_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t ckpt_thread;
+static int ckpt_running = 0;
+static int ckpt_stop = 0;
+
+// Alignment of the mapping for transparent huge pages
+#define HUGE_PAGE (2 << 20)
+
+// Blocks modified since they were last flushed
+static uint8_t* blocks_dirty_bm = 0;
+// Blocks queued for the next group flush
+static uint8_t* blocks_queued_bm = 0;
+// Blocks mapped copy-on-write until written back
+static uint8_t* blocks_pinned_bm = 0;
+// Blocks used by a snapshot
+static uint8_t* blocks_frozen_bm = 0;
+// Blocks frozen but free in the block bitmap, which cannot be allocated
+static int blocks_frozen_free = 0;
+
+// Serializes the block bitmap and reference counts of one allocation
+// group. Each lock has a cache line of its own.
+typedef struct blocks_group {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) blocks_group_t;
+
+static blocks_group_t blocks_groups[BLOCKS_GROUP_MAX] = {
+    [0 ... BLOCKS_GROUP_MAX - 1] = { PTHREAD_MUTEX_INITIALIZER }
+};
+
+// Home allocation group of this thread, counted from the first group with
+// data blocks, and the mount it was handed out for
+static __thread int blocks_home = 0;
+static __thread int blocks_home_mount = -1;
+// Home groups handed out since the image was mounted, and mounts so far
+static int blocks_homes = 0;
+static int blocks_mounts = 0;
+
+// Serializes the dirty/queued/pinned bitmaps and group flush bookkeeping
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sync_cond = PTHREAD_COND_INITIALIZER;
+static int  sync_busy    = 0;  // a group flush is running
+static long sync_started = 0;  // number of group flushes started
+static long sync_done    = 0;  // number of group flushes finished
+static int  sync_rv      = 0;  // result of the last finished flush
+
+/*
+ * Lays out a blank image: superblock, bitmaps, inode table, reference
+ * counts, snapshot table and journal.
+ *
+ * Every region before the first data block is marked used in the block
+ * bitmap. The image is flushed before returning, so the journal can take
+ * over from here.
+ */
+static void blocks_format(const blocks_geometry_t* geo)
+{
+    superblock_t* sb = get_superblock();
+
+    sb->magic = NUFS_MAGIC;
+    sb->version = NUFS_VERSION;
+    sb->block_size = BLOCK_SIZE;
+    sb->block_count = geo->block_count;
+    sb->stripe_count = blocks_members - (blocks_tier != 0);
+    sb->stripe_blocks = blocks_unit;
+    sb->tier_blocks = blocks_tier;
+    sb->bbm_block = 1;
+    sb->ibm_block = 2;
+    sb->itab_block = 3;
+    sb->itab_blocks = bytes_to_blocks(geo->inode_count * sizeof(inode_t));
+    sb->inode_count = sb->itab_blocks * BLOCK_SIZE / sizeof(inode_t);
+    sb->refc_block = sb->itab_block + sb->itab_blocks;
+    sb->refc_blocks = bytes_to_blocks(geo->block_count * sizeof(uint16_t));
+    sb->snap_block = sb->refc_block + sb->refc_blocks;
+    sb->dedup_block = sb->snap_block + 1;
+    sb->dedup_blocks = bytes_to_blocks(2 * geo->block_count * sizeof(dedup_entry_t));
+    sb->csum_block = sb->dedup_block + sb->dedup_blocks;
+    sb->csum_blocks = bytes_to_blocks(geo->block_count * sizeof(uint32_t));
+    sb->journal_block = sb->csum_block + sb->csum_blocks;
+    sb->journal_blocks = geo->journal_blocks;
+    sb->data_block = sb->journal_block + sb->journal_blocks;
+
+    void* bbm = get_blocks_bitmap();
+    for (int ii = 0; ii < sb->data_block; ++ii) {
+        bitmap_put(bbm, ii, 1);
+    }
+    sb->group_count = (geo->block_count + BLOCKS_GROUP - 1) / BLOCKS_GROUP;
+    blocks_recount(1);
+
+    journal_format();
+
+    if (blocks_memory) {
+        // Goes out with the checkpoint that ends the mount
+        for (int ii = 0; ii < sb->data_block; ++ii) {
+            blocks_dirty(ii);
+        }
+        return;
+    }
+    int rv = msync(blocks_base, blocks_size, MS_SYNC);
+    assert(rv == 0);
+}
+
+/*
+ * Returns whether an image may have blocks of the given size.
+ */
+int blocks_size_valid(int size)
+{
+    return size == 4096 || size == 16384 || size == 65536;
+}
+
+/*
+ * Sets the block size of the image being opened, and picks the data paths
+ * specialized for it.
+ */
+static void blocks_set_size(int size)
+{
+    BLOCK_SIZE = size;
+    BLOCK_SHIFT = __builtin_ctz(size);
+    io_init(BLOCK_SHIFT);
+}
+
+/*
+ * Returns the backing file holding the specified block, storing the
+ * block's offset in it in *offset.
+ */
+static int blocks_locate(int bnum, off_t* offset)
+{
+    if (blocks_tier) {
+        int slow = bnum >= blocks_tier;
+        *offset = (off_t)(bnum - slow * blocks_tier) << BLOCK_SHIFT;
+        return blocks_fds[slow];
+    }
+    int unit = bnum / blocks_unit;
+    *offset = ((off_t)(unit / blocks_members) * blocks_unit + bnum % blocks_unit) << BLOCK_SHIFT;
+    return blocks_fds[unit % blocks_members];
+}
+
+/*
+ * Returns the number of blocks from bnum on that are adjacent in their
+ * backing file, up to count.
+ */
+static int blocks_contiguous(int bnum, int count)
+{
+    int left = blocks_unit - bnum % blocks_unit;
+    if (blocks_tier) {
+        left = bnum < blocks_tier ? blocks_tier - bnum : blocks_count - bnum;
+    }
+    return left < count ? left : count;
+}
+
+/*
+ * Returns the bytes the specified backing file needs. A striped image
+ * gives each as many whole stripe units as the first, which gets the
+ * most; a tiered one gives the fast tier to the first and the rest to the
+ * second.
+ */
+static size_t blocks_member_size(int member)
+{
+    if (blocks_tier) {
+        return (size_t)(member == 0 ? blocks_tier : blocks_count - blocks_tier) << BLOCK_SHIFT;
+    }
+    int units = (blocks_count + blocks_unit - 1) / blocks_unit;
+    return (size_t)((units + blocks_members - 1) / blocks_members) * blocks_unit << BLOCK_SHIFT;
+}
+
+/*
+ * Maps the whole image shared, each stripe unit from its backing file, so
+ * that the blocks stay adjacent in memory. An image kept in memory gets
+ * anonymous memory instead, see blocks_load(). For huge pages the mapping
+ * starts on a huge page boundary, so the kernel can back aligned runs of
+ * it with them. Returns MAP_FAILED if a unit cannot be mapped.
+ */
+static void* blocks_mmap()
+{
+    if (blocks_members == 1 && !(blocks_map & BLOCKS_MAP_HUGE) && !blocks_memory) {
+        return mmap(0, blocks_size, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fds[0], 0);
+    }
+
+    // Reserve enough address space to align within, then trim the slack
+    size_t slack = blocks_map & BLOCKS_MAP_HUGE ? HUGE_PAGE : 0;
+    int prot = blocks_memory ? PROT_READ | PROT_WRITE : PROT_NONE;
+    uint8_t* area = mmap(0, blocks_size + slack, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                         -1, 0);
+    if (area == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    uint8_t* base = area;
+    if (slack) {
+        base = (uint8_t*)(((uintptr_t)area + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    }
+
+    int run;
+    for (int bnum = 0; bnum < blocks_count && !blocks_memory; bnum += run) {
+        off_t offset;
+        int fd = blocks_locate(bnum, &offset);
+        run = blocks_contiguous(bnum, blocks_count - bnum);
+        size_t len = (size_t)run << BLOCK_SHIFT;
+        void* addr = mmap(base + ((size_t)bnum << BLOCK_SHIFT), len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_FIXED, fd, offset);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            munmap(area, blocks_size + slack);
+            errno = err;
+            return MAP_FAILED;
+        }
+    }
+
+    if (base > area) {
+        munmap(area, base - area);
+    }
+    if (slack) {
+        munmap(base + blocks_size, area + slack - base);
+    }
+    if (slack && blocks_memory) {
+        madvise(base, blocks_size, MADV_HUGEPAGE);
+    }
+    return base;
+}
+
+/*
+ * Applies the mapping policies once the metadata is pinned: advice on how
+ * the data blocks are accessed, and prefaulting of the metadata that every
+ * operation reads.
+ */
+static void blocks_advise()
+{
+    superblock_t* sb = get_superblock();
+    uint8_t* data = blocks_get_block(sb->data_block);
+    size_t data_size = (size_t)BLOCK_SIZE * (sb->block_count - sb->data_block);
+
+    if (blocks_map & BLOCKS_MAP_HUGE) {
+        madvise(data, data_size, MADV_HUGEPAGE);
+    }
+    if (blocks_map & BLOCKS_MAP_RANDOM) {
+        madvise(data, data_size, MADV_RANDOM);
+    } else if (blocks_map & BLOCKS_MAP_SEQUENTIAL) {
+        madvise(data, data_size, MADV_SEQUENTIAL);
+    }
+
+    if (blocks_map & BLOCKS_MAP_POPULATE) {
+        // Superblock through snapshot table, then the checksums. Read only:
+        // populating a private mapping for writing would copy every page.
+#ifdef MADV_POPULATE_READ
+        int advice = MADV_POPULATE_READ;
+#else
+        int advice = MADV_WILLNEED;
+#endif
+        madvise(blocks_base, (size_t)BLOCK_SIZE * sb->dedup_block, advice);
+        madvise(blocks_get_block(sb->csum_block), (size_t)BLOCK_SIZE * sb->csum_blocks, advice);
+    }
+}
+
+/*
+ * Reads or writes len bytes at offset in full. Returns 0 on success or a
+ * negative errno.
+ */
+static int blocks_rw(int fd, void* buf, size_t len, off_t offset, int write)
+{
+    while (len > 0) {
+        ssize_t done = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return done < 0 ? -errno : -EIO;
+        }
+        buf = (uint8_t*)buf + done;
+        len -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+/*
+ * Writes the given contents of a block to its home location.
+ */
+static int blocks_put(int bnum, const void* data)
+{
+    off_t offset;
+    int fd = blocks_locate(bnum, &offset);
+    return blocks_rw(fd, (void*)data, BLOCK_SIZE, offset, 1);
+}
+
+/*
+ * Waits for everything written to the backing files to reach storage.
+ */
+static int blocks_sync_files()
+{
+    int rv = 0;
+    for (int ii = 0; ii < blocks_members; ++ii) {
+        if (fdatasync(blocks_fds[ii]) != 0) {
+            rv = -errno;
+        }
+    }
+    return rv;
+}
+
+/*
+ * Reads the image into anonymous memory, skipping the holes in its files,
+ * which stay untouched zero pages.
+ */
+static int blocks_load()
+{
+    int run;
+    for (int bnum = 0; bnum < blocks_count; bnum += run) {
+        off_t start;
+        int fd = blocks_locate(bnum, &start);
+        run = blocks_contiguous(bnum, blocks_count - bnum);
+        off_t end = start + ((off_t)run << BLOCK_SHIFT);
+        uint8_t* dest = blocks_get_block(bnum);
+
+        off_t pos = start;
+        while (pos < end) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if (data < 0 || data >= end) {
+                break;
+            }
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            hole = hole < 0 || hole > end ? end : hole;
+            int rv = blocks_rw(fd, dest + (data - start), hole - data, data, 0);
+            if (rv < 0) {
+                return rv;
+            }
+            pos = hole;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns where the checkpoint log starts in the first file.
+ */
+static off_t blocks_log_offset()
+{
+    return blocks_member_size(0);
+}
+
+/*
+ * Returns the bytes of the block list of a log of count blocks.
+ */
+static size_t blocks_log_list(int count)
+{
+    return (size_t)bytes_to_blocks((int64_t)count * sizeof(int)) << BLOCK_SHIFT;
+}
+
+/*
+ * Returns the CRC-32C of a log: its block list, then its blocks.
+ */
+static uint32_t blocks_log_crc(const uint8_t* list, const uint8_t* data, int count)
+{
+    uint32_t crc = crc32c(0, list, blocks_log_list(count));
+    for (int ii = 0; ii < count; ++ii) {
+        crc = crc32c(crc, data + ((size_t)ii << BLOCK_SHIFT), BLOCK_SIZE);
+    }
+    return crc;
+}
+
+/*
+ * Finishes the copy of a committed checkpoint a crash may have cut short,
+ * then cuts the log off the first file. Returns 0 on success or a negative
+ * errno.
+ */
+static int blocks_recover()
+{
+    int fd = blocks_fds[0];
+    off_t log = blocks_log_offset();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= log) {
+        return 0;
+    }
+
+    blocks_ckpt_t best;
+    memset(&best, 0, sizeof(best));
+    for (int slot = 0; slot < 2; ++slot) {
+        blocks_ckpt_t rec;
+        if (blocks_rw(fd, &rec, sizeof(rec), log + ((off_t)slot << BLOCK_SHIFT), 0) == 0 &&
+            rec.magic == CKPT_MAGIC && rec.crc == crc32c(0, &rec, offsetof(blocks_ckpt_t, crc)) &&
+            rec.count <= blocks_count && rec.gen > best.gen) {
+            best = rec;
+        }
+    }
+
+    int rv = 0;
+    int copied = 0;
+    if (best.gen > 0) {
+        size_t list = blocks_log_list(best.count);
+        uint8_t* buf = malloc(list + ((size_t)best.count << BLOCK_SHIFT));
+        assert(buf);
+        rv = blocks_rw(fd, buf, list + ((size_t)best.count << BLOCK_SHIFT),
+                       log + ((off_t)2 << BLOCK_SHIFT), 0);
+
+        // A log torn by the next checkpoint was copied already
+        if (rv == 0 && blocks_log_crc(buf, buf + list, best.count) == best.log_crc) {
+            int* bnums = (int*)buf;
+            for (int ii = 0; ii < best.count && rv == 0; ++ii) {
+                if (bnums[ii] >= 0 && bnums[ii] < blocks_count) {
+                    rv = blocks_put(bnums[ii], buf + list + ((size_t)ii << BLOCK_SHIFT));
+                }
+            }
+            rv = rv == 0 ? blocks_sync_files() : rv;
+            copied = best.count;
+        }
+        free(buf);
+    }
+
+    if (rv == 0 && (ftruncate(fd, log) != 0 || fdatasync(fd) != 0)) {
+        rv = -errno;
+    }
+
+    printf("+ blocks_recover() -> %d (%d blocks)\n", rv, copied);
+    return rv;
+}
+
+/*
+ * Copies every block changed since the last capture for the next
+ * checkpoint, unless the last capture is still waiting to be written.
+ *
+ * Called while no transaction is open, so the copies hold the effect of
+ * exactly the committed ones: writes change data inside transactions too.
+ */
+static void blocks_capture()
+{
+    pthread_mutex_lock(&sync_lock);
+    if (ckpt_count == 0) {
+        int count = 0;
+        for (int ii = 0; ii < blocks_count / 8; ++ii) {
+            count += __builtin_popcount(blocks_dirty_bm[ii]);
+        }
+
+        ckpt_bnums = malloc(count * sizeof(int));
+        ckpt_data = malloc((size_t)count << BLOCK_SHIFT);
+        assert(count == 0 || (ckpt_bnums && ckpt_data));
+        for (int ii = 0; ii < blocks_count; ++ii) {
+            if (ii % 8 == 0 && !blocks_dirty_bm[ii / 8]) {
+                ii += 7;
+                continue;
+            }
+            if (bitmap_get(blocks_dirty_bm, ii)) {
+                bitmap_put(blocks_dirty_bm, ii, 0);
+                ckpt_bnums[ckpt_count] = ii;
+                memcpy(ckpt_data + ((size_t)ckpt_count << BLOCK_SHIFT), blocks_get_block(ii),
+                       BLOCK_SIZE);
+                ckpt_count += 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Writes the captured blocks to the log, commits them with a record and
+ * copies them to their home locations. Returns 0 on success or a negative
+ * errno; the blocks of a failed checkpoint are marked changed again, so
+ * the next one takes them along.
+ */
+static int blocks_store()
+{
+    pthread_mutex_lock(&sync_lock);
+    int* bnums = ckpt_bnums;
+    uint8_t* data = ckpt_data;
+    int count = ckpt_count;
+    ckpt_bnums = 0;
+    ckpt_data = 0;
+    ckpt_count = 0;
+    pthread_mutex_unlock(&sync_lock);
+
+    int rv = 0;
+    if (count > 0) {
+        int fd = blocks_fds[0];
+        off_t log = blocks_log_offset();
+        size_t list = blocks_log_list(count);
+        uint8_t* head = calloc(list, 1);
+        memcpy(head, bnums, count * sizeof(int));
+
+        blocks_ckpt_t rec = { CKPT_MAGIC, count, ckpt_gen + 1, 0, 0 };
+        rec.log_crc = blocks_log_crc(head, data, count);
+        rec.crc = crc32c(0, &rec, offsetof(blocks_ckpt_t, crc));
+        uint8_t* slot = calloc(BLOCK_SIZE, 1);
+        memcpy(slot, &rec, sizeof(rec));
+
+        rv = blocks_rw(fd, head, list, log + ((off_t)2 << BLOCK_SHIFT), 1);
+        if (rv == 0) {
+            rv = blocks_rw(fd, data, (size_t)count << BLOCK_SHIFT,
+                           log + ((off_t)2 << BLOCK_SHIFT) + list, 1);
+        }
+        if (rv == 0 && fdatasync(fd) != 0) {
+            rv = -errno;
+        }
+        if (rv == 0) {
+            rv = blocks_rw(fd, slot, BLOCK_SIZE, log + ((off_t)(rec.gen % 2) << BLOCK_SHIFT), 1);
+        }
+        if (rv == 0 && fdatasync(fd) != 0) {
+            rv = -errno;
+        }
+        if (rv == 0) {
+            ckpt_gen = rec.gen;
+            for (int ii = 0; ii < count && rv == 0; ++ii) {
+                rv = blocks_put(bnums[ii], data + ((size_t)ii << BLOCK_SHIFT));
+            }
+        }
+        if (rv == 0) {
+            rv = blocks_sync_files();
+        }
+
+        if (rv < 0) {
+            pthread_mutex_lock(&sync_lock);
+            for (int ii = 0; ii < count; ++ii) {
+                bitmap_put(blocks_dirty_bm, bnums[ii], 1);
+            }
+            pthread_mutex_unlock(&sync_lock);
+        }
+        free(slot);
+        free(head);
+    }
+    free(bnums);
+    free(data);
+
+    printf("+ blocks_checkpoint() -> %d (%d blocks)\n", rv, count);
+    return rv;
+}
+
+/*
+ * Closes the backing files.
+ */
+static void blocks_close()
+{
+    for (int ii = 0; ii < blocks_members; ++ii) {
+        close(blocks_fds[ii]);
+    }
+    blocks_members = 0;
+}
+
+/*
+ * Returns the path of the specified backing file of the next mount: the
+ * image's own, then the stripe members, then the slow tier.
+ */
+static const char* blocks_member_path(const char* path, int member)
+{
+    if (member == 0) {
+        return path;
+    }
+    return member <= stripe_count ? stripe_paths[member - 1] : slow_path;
+}
+
+/*
+ * Maps the image at the given path, and the members it is striped across
+ * or its slow tier, formatting it with the given geometry if it is blank.
+ * Returns 0 on success or a negative errno.
+ *
+ * The size of an existing image is taken from its superblock.
+ */
+static int blocks_open(const char* path, const blocks_geometry_t* geo)
+{
+    int rv;
+    if (slow_path && stripe_count > 0) {
+        fprintf(stderr, "%s: an image is either striped or tiered\n", path);
+        return -EINVAL;
+    }
+
+    blocks_members = 0;
+    for (int ii = 0; ii <= stripe_count + (slow_path != 0); ++ii) {
+        const char* member = blocks_member_path(path, ii);
+        int fd = open(member, O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+            rv = -errno;
+            fprintf(stderr, "%s: %s\n", member, strerror(-rv));
+            blocks_close();
+            return rv;
+        }
+        blocks_fds[blocks_members++] = fd;
+    }
+
+    blocks_memory = (blocks_map & BLOCKS_MAP_MEMORY) != 0;
+
+    superblock_t head;
+    memset(&head, 0, sizeof(head));
+    int blank = pread(blocks_fds[0], &head, sizeof(head), 0) < (ssize_t)sizeof(head) || head.magic == 0;
+
+    if (blank) {
+        blocks_set_size(geo->block_size);
+        blocks_count = geo->block_count;
+        blocks_size = (size_t)BLOCK_SIZE * blocks_count;
+        int unit = stripe_unit ? stripe_unit : BLOCKS_STRIPE_UNIT;
+        if (unit % BLOCK_SIZE != 0) {
+            fprintf(stderr, "%s: stripe unit of %d bytes is not a whole number of blocks\n",
+                    path, unit);
+            blocks_close();
+            return -EINVAL;
+        }
+        blocks_unit = stripe_count > 0 ? unit / BLOCK_SIZE : blocks_count;
+
+        // The fast tier is whole allocation groups, a quarter of the image
+        // unless told otherwise
+        blocks_tier = 0;
+        if (slow_path) {
+            long long fast = fast_size ? fast_size / BLOCK_SIZE : blocks_count / 4;
+            fast = (fast + BLOCKS_GROUP - 1) / BLOCKS_GROUP * BLOCKS_GROUP;
+            if (fast >= blocks_count) {
+                fprintf(stderr, "%s: a fast tier of %lld blocks leaves none of %d for %s\n",
+                        path, fast, blocks_count, slow_path);
+                blocks_close();
+                return -EINVAL;
+            }
+            blocks_tier = fast;
+        }
+
+        for (int ii = 0; ii < blocks_members; ++ii) {
+            if (ftruncate(blocks_fds[ii], blocks_member_size(ii)) != 0) {
+                rv = -errno;
+                blocks_close();
+                return rv;
+            }
+        }
+    } else if (head.magic != NUFS_MAGIC || head.version != NUFS_VERSION ||
+               !blocks_size_valid(head.block_size) || head.stripe_blocks == 0) {
+        fprintf(stderr, "%s: not a nufs v%d image\n", path, NUFS_VERSION);
+        blocks_close();
+        return -EINVAL;
+    } else if (head.stripe_count != blocks_members - (slow_path != 0)) {
+        fprintf(stderr, "%s: image is striped across %u files, %d given\n", path,
+                head.stripe_count, blocks_members - (slow_path != 0));
+        blocks_close();
+        return -EINVAL;
+    } else if ((head.tier_blocks != 0) != (slow_path != 0)) {
+        fprintf(stderr, head.tier_blocks ? "%s: image keeps cold data in a slow file, none given\n"
+                                         : "%s: image has no slow tier\n", path);
+        blocks_close();
+        return -EINVAL;
+    } else {
+        blocks_set_size(head.block_size);
+        blocks_count = head.block_count;
+        blocks_size = (size_t)BLOCK_SIZE * blocks_count;
+        blocks_unit = head.stripe_blocks;
+        blocks_tier = head.tier_blocks;
+        for (int ii = 0; ii < blocks_members; ++ii) {
+            struct stat st;
+            rv = fstat(blocks_fds[ii], &st);
+            assert(rv == 0);
+            if ((size_t)st.st_size < blocks_member_size(ii)) {
+                fprintf(stderr, "%s: image is truncated\n", blocks_member_path(path, ii));
+                blocks_close();
+                return -EINVAL;
+            }
+        }
+
+        rv = blocks_recover();
+        if (rv < 0) {
+            fprintf(stderr, "%s: cannot finish the last checkpoint: %s\n", path, strerror(-rv));
+            blocks_close();
+            return rv;
+        }
+    }
+
+    blocks_base = blocks_mmap();
+    if (blocks_base == MAP_FAILED) {
+        rv = -errno;
+        fprintf(stderr, "%s: cannot map the image: %s\n", path, strerror(-rv));
+        blocks_close();
+        return rv;
+    }
+    if (blocks_memory && !blank && (rv = blocks_load()) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(-rv));
+        munmap(blocks_base, blocks_size);
+        blocks_close();
+        return rv;
+    }
+
+    blocks_dirty_bm = calloc(blocks_count / 8, 1);
+    blocks_queued_bm = calloc(blocks_count / 8, 1);
+    blocks_pinned_bm = calloc(blocks_count / 8, 1);
+    blocks_frozen_bm = calloc(blocks_count / 8, 1);
+    assert(blocks_dirty_bm && blocks_queued_bm && blocks_pinned_bm && blocks_frozen_bm);
+
+    // Home groups are handed out from the first one again
+    __atomic_store_n(&blocks_homes, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&blocks_mounts, 1, __ATOMIC_RELAXED);
+    inode_reset_homes();
+
+    if (blank) {
+        blocks_format(geo);
+    }
+
+    journal_init();
+    snapshot_init();
+    checksum_init();
+    tier_init();
+    tail_init();
+    blocks_advise();
+
+    if (blank) {
+        journal_begin();
+        directory_init();
+        journal_end();
+        journal_commit();
+    }
+
+    // Whatever formatting or replay changed is checkpointed right away
+    if (blocks_memory) {
+        blocks_capture();
+        blocks_store();
+    }
+    return 0;
+}
+
+/*
+ * Chooses the backing files and stripe unit of the next mount.
+ */
+int blocks_set_stripe(const char* const* members, int count, int unit)
+{
+    if (count < 0 || count > BLOCKS_STRIPE_MAX - 1 || unit < 0) {
+        return -EINVAL;
+    }
+    for (int ii = 0; ii < count; ++ii) {
+        stripe_paths[ii] = members[ii];
+    }
+    stripe_count = count;
+    stripe_unit = unit;
+    return 0;
+}
+
+/*
+ * Chooses the slow tier and fast tier size of the next mount.
+ */
+int blocks_set_tier(const char* slow, long long fast)
+{
+    if (fast < 0) {
+        return -EINVAL;
+    }
+    slow_path = slow;
+    fast_size = fast;
+    return 0;
+}
+
+/*
+ * Chooses the mapping policies of the next mount.
+ */
+void blocks_set_map(int policies)
+{
+    blocks_map = policies;
+}
+
+/*
+ * Sets the seconds between the checkpoints of an image kept in memory.
+ */
+void blocks_set_checkpoint(int seconds)
+{
+    ckpt_interval = seconds;
+}
+
+/*
+ * Checkpoints an image kept in memory on a timer. The journal checkpoint
+ * waits for the open transactions and captures the changed blocks while
+ * none is open; they are written after it lets the next ones in.
+ */
+static void* blocks_main(void* arg)
+{
+    pthread_mutex_lock(&ckpt_lock);
+    while (!ckpt_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ckpt_interval;
+        pthread_cond_timedwait(&ckpt_cond, &ckpt_lock, &deadline);
+        if (ckpt_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&ckpt_lock);
+
+        __atomic_store_n(&ckpt_due, 1, __ATOMIC_RELEASE);
+        journal_checkpoint();
+        blocks_store();
+
+        pthread_mutex_lock(&ckpt_lock);
+    }
+    pthread_mutex_unlock(&ckpt_lock);
+    return 0;
+}
+
+/*
+ * Starts the checkpoint thread of an image kept in memory.
+ */
+void blocks_start()
+{
+    if (!blocks_memory) {
+        return;
+    }
+    ckpt_stop = 0;
+    int rv = pthread_create(&ckpt_thread, 0, blocks_main, 0);
+    assert(rv == 0);
+    ckpt_running = 1;
+}
+
+/*
+ * Initializes the blocks at the given path.
+ *
+ * A blank image is formatted with the default geometry and given a root
+ * directory; an existing one has its metadata journal replayed.
+ */
+void blocks_init(const char* path)  
+{
+    if (blocks_open(path, &blocks_default) < 0) {
+        exit(1);
+    }
+}
+
+/*
+ * Creates a blank image with the given geometry.
+ *
+ * Each file is truncated first, so every region that starts out zero is a
+ * hole until it is first written.
+ */
+int blocks_mkfs(const char* path, const blocks_geometry_t* geo)
+{
+    if (!blocks_size_valid(geo->block_size)) {
+        return -EINVAL;
+    }
+    blocks_set_size(geo->block_size);
+
+    // The bitmaps are one block each; the root directory takes two blocks
+    int count = geo->block_count;
+    int reserved = 3 + bytes_to_blocks(geo->inode_count * sizeof(inode_t)) +
+                   bytes_to_blocks(count * sizeof(uint16_t)) + 1 +
+                   bytes_to_blocks(2 * count * sizeof(dedup_entry_t)) +
+                   bytes_to_blocks(count * sizeof(uint32_t)) + geo->journal_blocks;
+    if (count % 8 != 0 || count > BLOCK_SIZE * 8 || count < reserved + 2 ||
+        geo->inode_count < 1 || geo->inode_count > BLOCK_SIZE * 8 || geo->journal_blocks < 2) {
+        return -EINVAL;
+    }
+
+    // The metadata and the root directory stay in the fast tier
+    if (slow_path && (fast_size ? fast_size >> BLOCK_SHIFT : count / 4) < reserved + 2) {
+        return -EINVAL;
+    }
+
+    for (int ii = 0; ii <= stripe_count + (slow_path != 0); ++ii) {
+        int fd = open(blocks_member_path(path, ii), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd < 0) {
+            return -errno;
+        }
+        close(fd);
+    }
+
+    int rv = blocks_open(path, geo);
+    if (rv < 0) {
+        return rv;
+    }
+    blocks_free();
+    return 0;
+}
+
+/*
+ * Frees the memory mapped blocks.
+ *
+ * This function checkpoints the journal, so the image is consistent without
+ * replay, and unmaps the memory region used for block storage. An image
+ * kept in memory is checkpointed to its files first.
+ */
+void blocks_free()
+{
+    tier_free();
+    tail_free();
+
+    if (ckpt_running) {
+        pthread_mutex_lock(&ckpt_lock);
+        ckpt_stop = 1;
+        pthread_cond_signal(&ckpt_cond);
+        pthread_mutex_unlock(&ckpt_lock);
+        pthread_join(ckpt_thread, 0);
+        ckpt_running = 0;
+    }
+
+    journal_free();
+
+    // A clean image needs no log
+    if (blocks_memory) {
+        blocks_capture();
+        if (blocks_store() == 0 && ftruncate(blocks_fds[0], blocks_log_offset()) == 0) {
+            fdatasync(blocks_fds[0]);
+        }
+    }
+
+    int rv = munmap(blocks_base, blocks_size);
+    assert(rv == 0);
+    blocks_close();
+
+    free(blocks_dirty_bm);
+    free(blocks_queued_bm);
+    free(blocks_pinned_bm);
+    free(blocks_frozen_bm);
+    checksum_free();
+}
 
 /*
- * Initializes the blocks at the given path.
+ * Returns a pointer to the superblock.
+ */
+superblock_t* get_superblock()
+{
+    return (superblock_t*)blocks_base;
+}
+
+/*
+ * Returns a pointer to the start of the specified block.
+ */
+void* blocks_get_block(int bnum)  
+{
+    return blocks_base + ((size_t)bnum << BLOCK_SHIFT);
+}
+
+/*
+ * Returns the number of the block containing the given address.
+ */
+int blocks_get_bnum(void* addr)
+{
+    return ((uint8_t*)addr - (uint8_t*)blocks_base) >> BLOCK_SHIFT;
+}
+
+/*
+ * Reads one bit of an in-memory bitmap that other threads may be changing.
+ */
+static int blocks_bit(const uint8_t* bm, int ii)
+{
+    return __atomic_load_n(&bm[ii / 8], __ATOMIC_RELAXED) >> (7 - ii % 8) & 1;
+}
+
+/*
+ * Marks the specified block as modified since its last flush.
  *
- * This function creates a new file at the specified path, sets its size to NUFS_SIZE,
- * and maps it into memory for block storage. It also initializes the blocks' bitmap
- * and directory.
+ * A block already marked needs no lock: its mark is only cleared before
+ * the flush that writes it, which will see this change too.
  */
-void blocks_init(const char* path)  
+void blocks_dirty(int bnum)
 {
-    blocks_fd = open(path, O_CREAT | O_RDWR, 0644); 
-    assert(blocks_fd != -1);
+    if (blocks_bit(blocks_dirty_bm, bnum)) {
+        return;
+    }
+    pthread_mutex_lock(&sync_lock);
+    bitmap_put(blocks_dirty_bm, bnum, 1);
+    pthread_mutex_unlock(&sync_lock);
+}
 
-    int rv = ftruncate(blocks_fd, NUFS_SIZE);
-    assert(rv == 0);
+/*
+ * Writes back every queued block, one msync() per run of adjacent blocks.
+ *
+ * Takes ownership of the given snapshot of the queued bitmap.
+ */
+static int blocks_flush(uint8_t* queued)
+{
+    int rv = 0;
+    int runs = 0;
 
-    blocks_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-    assert(blocks_base != MAP_FAILED);
+    for (int ii = 0; ii < blocks_count; ++ii) {
+        if (!bitmap_get(queued, ii)) {
+            continue;
+        }
 
-    void* bbm = get_blocks_bitmap(); 
+        int start = ii;
+        while (ii + 1 < blocks_count && bitmap_get(queued, ii + 1)) {
+            ++ii;
+        }
 
-    if (bitmap_get(bbm, 0) == 0) {
-        bitmap_put(bbm, 0, 1);
-        directory_init();
+        if (msync(blocks_get_block(start), (size_t)BLOCK_SIZE * (ii - start + 1), MS_SYNC) != 0) {
+            rv = -errno;
+        }
+        ++runs;
     }
+
+    free(queued);
+    printf("+ blocks_flush() -> %d (%d runs)\n", rv, runs);
+    return rv;
 }
 
 /*
- * Frees the memory mapped blocks.
+ * Flushes the dirty blocks among the given ones.
  *
- * This function unmaps the memory region used for block storage.
+ * The caller queues its dirty blocks, then waits for the first group flush
+ * that starts after they were queued. Whoever finds no flush running leads
+ * the next one, taking along everything queued by the other waiters.
  */
-void blocks_free()
+int blocks_sync(const int* bnums, int count)
 {
-    int rv = munmap(blocks_base, NUFS_SIZE);
-    assert(rv == 0);
+    // An image kept in memory is only written by checkpoints
+    if (blocks_memory) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&sync_lock);
+
+    int queued = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        if (bitmap_get(blocks_dirty_bm, bnums[ii])) {
+            bitmap_put(blocks_dirty_bm, bnums[ii], 0);
+            bitmap_put(blocks_queued_bm, bnums[ii], 1);
+        }
+        if (bitmap_get(blocks_queued_bm, bnums[ii])) {
+            queued = 1;
+        }
+    }
+
+    // Queued blocks go out with the next flush to start. Blocks that are
+    // neither dirty nor queued may still be in the flush that is running.
+    long ticket = queued ? sync_started + 1 : sync_started;
+    int rv = 0;
+
+    while (sync_done < ticket) {
+        if (sync_busy) {
+            pthread_cond_wait(&sync_cond, &sync_lock);
+            rv = sync_rv;
+            continue;
+        }
+
+        uint8_t* snapshot = malloc(blocks_count / 8);
+        memcpy(snapshot, blocks_queued_bm, blocks_count / 8);
+        memset(blocks_queued_bm, 0, blocks_count / 8);
+        sync_busy = 1;
+        sync_started += 1;
+        pthread_mutex_unlock(&sync_lock);
+
+        rv = blocks_flush(snapshot);
+
+        pthread_mutex_lock(&sync_lock);
+        sync_rv = rv;
+        sync_done = sync_started;
+        sync_busy = 0;
+        pthread_cond_broadcast(&sync_cond);
+    }
+
+    pthread_mutex_unlock(&sync_lock);
+    return rv;
 }
 
 /*
- * Returns a pointer to the start of the specified block.
+ * Reads ahead the part of the run each stripe unit it spans holds. The
+ * reads go to the members' page caches, which back the mapping.
  */
-void* blocks_get_block(int bnum)  
+void blocks_prefetch(int bnum, int count)
+{
+    if (blocks_memory || blocks_members == 1 || blocks_contiguous(bnum, count) == count) {
+        return;
+    }
+    while (count > 0) {
+        off_t offset;
+        int fd = blocks_locate(bnum, &offset);
+        int run = blocks_contiguous(bnum, count);
+        readahead(fd, offset, (size_t)run << BLOCK_SHIFT);
+        bnum += run;
+        count -= run;
+    }
+}
+
+/*
+ * Pins the specified block by remapping it copy-on-write over the shared
+ * mapping. Its contents stay the same; later stores stay private until
+ * blocks_writeback() copies them to the image.
+ */
+void blocks_pin(int bnum)
+{
+    // Blocks are only unpinned at a checkpoint, while no transaction runs
+    if (!blocks_bit(blocks_pinned_bm, bnum)) {
+        blocks_pin_range(bnum, 1);
+    }
+}
+
+/*
+ * Pins a run of blocks, remapping each stretch of it that is not pinned
+ * yet, and within one stripe unit, with a single mmap().
+ */
+void blocks_pin_range(int first, int count)
+{
+    pthread_mutex_lock(&sync_lock);
+    int ii = first;
+    while (ii < first + count) {
+        if (bitmap_get(blocks_pinned_bm, ii)) {
+            ++ii;
+            continue;
+        }
+
+        int start = ii;
+        int end = start + blocks_contiguous(start, first + count - start);
+        while (ii < end && !bitmap_get(blocks_pinned_bm, ii)) {
+            bitmap_put(blocks_pinned_bm, ii, 1);
+            ++ii;
+        }
+
+        // Memory is private already; only the bits are kept
+        if (!blocks_memory) {
+            off_t offset;
+            int fd = blocks_locate(start, &offset);
+            void* addr = mmap(blocks_get_block(start), (size_t)BLOCK_SIZE * (ii - start), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_FIXED, fd, offset);
+            assert(addr != MAP_FAILED);
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Unpins the specified block by mapping the image's copy back in. A block
+ * of an image kept in memory stays as it is, and changed until the next
+ * checkpoint.
+ */
+void blocks_unpin(int bnum)
+{
+    pthread_mutex_lock(&sync_lock);
+    if (bitmap_get(blocks_pinned_bm, bnum) && !blocks_memory) {
+        off_t offset;
+        int fd = blocks_locate(bnum, &offset);
+        void* addr = mmap(blocks_get_block(bnum), BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_FIXED, fd, offset);
+        assert(addr != MAP_FAILED);
+        bitmap_put(blocks_dirty_bm, bnum, 0);
+    }
+    bitmap_put(blocks_pinned_bm, bnum, 0);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Returns whether the specified block is pinned.
+ */
+int blocks_pinned(int bnum)
+{
+    pthread_mutex_lock(&sync_lock);
+    int rv = bitmap_get(blocks_pinned_bm, bnum);
+    pthread_mutex_unlock(&sync_lock);
+    return rv;
+}
+
+/*
+ * Copies every dirty pinned block to its home location and syncs the image.
+ *
+ * The blocks stay pinned; their private copies now match the image.
+ */
+int blocks_writeback()
 {
-    return blocks_base + 4096 * bnum;
+    // An image kept in memory is written by checkpoints, which capture
+    // the blocks here when one is due
+    if (blocks_memory) {
+        if (__atomic_exchange_n(&ckpt_due, 0, __ATOMIC_ACQ_REL)) {
+            blocks_capture();
+        }
+        return 0;
+    }
+
+    int rv = 0;
+    int count = 0;
+
+    pthread_mutex_lock(&sync_lock);
+    for (int ii = 0; ii < blocks_count; ++ii) {
+        if (bitmap_get(blocks_pinned_bm, ii) && bitmap_get(blocks_dirty_bm, ii)) {
+            off_t offset;
+            int fd = blocks_locate(ii, &offset);
+            if (pwrite(fd, blocks_get_block(ii), BLOCK_SIZE, offset) != BLOCK_SIZE) {
+                rv = -errno;
+            }
+            bitmap_put(blocks_dirty_bm, ii, 0);
+            ++count;
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+
+    int synced = blocks_sync_files();
+    rv = rv < 0 ? rv : synced;
+
+    printf("+ blocks_writeback() -> %d (%d blocks)\n", rv, count);
+    return rv;
 }
 
 /*
@@ -73,7 +1255,7 @@ void* blocks_get_block(int bnum)
  */
 void* get_blocks_bitmap() 
 {
-    return blocks_get_block(0);
+    return blocks_get_block(get_superblock()->bbm_block);
 }
 
 /*
@@ -81,53 +1263,409 @@ void* get_blocks_bitmap()
  */
 void* get_inode_bitmap()
 {
-    uint8_t* block = blocks_get_block(0);  
-    return (void*)(block + 32);
+    return blocks_get_block(get_superblock()->ibm_block);
+}
+
+/*
+ * Records that the specified block became used or free in the block bitmap,
+ * in the superblock's free counts. The caller holds the lock of the
+ * block's group; the counts are read without it.
+ */
+static void blocks_account(int bnum, int used)
+{
+    superblock_t* sb = get_superblock();
+    int delta = used ? -1 : 1;
+    __atomic_add_fetch(&sb->free_blocks, delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sb->group_free[bnum / BLOCKS_GROUP], delta, __ATOMIC_RELAXED);
+    blocks_dirty(0);
+
+    if (blocks_bit(blocks_frozen_bm, bnum)) {
+        __atomic_add_fetch(&blocks_frozen_free, delta, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Counts the free blocks and inodes in the bitmaps.
+ */
+int blocks_recount(int fix)
+{
+    superblock_t* sb = get_superblock();
+    void* bbm = get_blocks_bitmap();
+    void* ibm = get_inode_bitmap();
+    int stale = 0;
+
+    uint32_t total = 0;
+    for (int gg = 0; gg < sb->group_count; ++gg) {
+        int end = (gg + 1) * BLOCKS_GROUP;
+        end = end < sb->block_count ? end : sb->block_count;
+
+        uint32_t free = 0;
+        for (int ii = gg * BLOCKS_GROUP; ii < end; ++ii) {
+            free += !bitmap_get(bbm, ii);
+        }
+        total += free;
+
+        if (sb->group_free[gg] != free) {
+            stale += 1;
+            if (fix) {
+                sb->group_free[gg] = free;
+            }
+        }
+    }
+
+    uint32_t inodes = 0;
+    for (int ii = 0; ii < sb->inode_count; ++ii) {
+        inodes += !bitmap_get(ibm, ii);
+    }
+
+    stale += (sb->free_blocks != total) + (sb->free_inodes != inodes);
+    if (fix && stale > 0) {
+        sb->free_blocks = total;
+        sb->free_inodes = inodes;
+        blocks_dirty(0);
+    }
+    return stale;
+}
+
+/*
+ * Returns the number of blocks that can still be allocated.
+ */
+int blocks_free_count()
+{
+    int frozen = __atomic_load_n(&blocks_frozen_free, __ATOMIC_RELAXED);
+    return __atomic_load_n(&get_superblock()->free_blocks, __ATOMIC_RELAXED) - frozen;
+}
+
+/*
+ * Returns whether the specified block can be allocated: free in the block
+ * bitmap and not frozen.
+ */
+static int blocks_available(const uint8_t* bbm, int bnum)
+{
+    return !bitmap_get((void*)bbm, bnum) && !blocks_bit(blocks_frozen_bm, bnum);
+}
+
+/*
+ * Allocates the run of up to count adjacent blocks that starts at the first
+ * available block of the specified group and ends within it. Returns its
+ * first block, with its length in got, or -1 if none is available.
+ *
+ * Only the group's lock is held, so threads allocating in other groups go
+ * on in parallel. The whole run is logged as one bitmap record.
+ */
+static int blocks_claim(int gg, int count, int* got)
+{
+    superblock_t* sb = get_superblock();
+    uint8_t* bbm = get_blocks_bitmap();
+    int first = gg * BLOCKS_GROUP;
+    int end = first + BLOCKS_GROUP;
+    first = first > sb->data_block ? first : sb->data_block;
+    end = end < sb->block_count ? end : sb->block_count;
+
+    pthread_mutex_lock(&blocks_groups[gg].lock);
+
+    while (first < end && !blocks_available(bbm, first)) {
+        // Whole bytes of used blocks are skipped at once
+        first = first % 8 == 0 && bbm[first / 8] == 0xff ? first + 8 : first + 1;
+    }
+    int len = 0;
+    while (len < count && first + len < end && blocks_available(bbm, first + len)) {
+        ++len;
+    }
+
+    if (len > 0) {
+        journal_log(JR_ALLOC, sb->bbm_block, first, len);
+        for (int ii = 0; ii < len; ++ii) {
+            bitmap_put(bbm, first + ii, 1);
+            blocks_account(first + ii, 1);
+            checksum_clear(first + ii);
+        }
+    }
+
+    pthread_mutex_unlock(&blocks_groups[gg].lock);
+
+    *got = len;
+    return len > 0 ? first : -1;
+}
+
+/*
+ * Allocates a run of blocks from the thread's home group, or else from the
+ * first group after it that has one, among groups lo to hi. That group
+ * becomes the new home, so the next allocation goes straight to it. Groups
+ * with no free blocks are skipped without taking their lock.
+ */
+static int blocks_alloc_run(int lo, int hi, int count, int* got)
+{
+    superblock_t* sb = get_superblock();
+    int groups = hi - lo;
+
+    int mount = __atomic_load_n(&blocks_mounts, __ATOMIC_RELAXED);
+    if (blocks_home_mount != mount) {
+        blocks_home = __atomic_fetch_add(&blocks_homes, 1, __ATOMIC_RELAXED);
+        blocks_home_mount = mount;
+    }
+
+    int start = blocks_home >= lo && blocks_home < hi ? blocks_home - lo : blocks_home % groups;
+    for (int ii = 0; ii < groups; ++ii) {
+        int gg = lo + (start + ii) % groups;
+        if (__atomic_load_n(&sb->group_free[gg], __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        int first = blocks_claim(gg, count, got);
+        if (first >= 0) {
+            blocks_home = gg;
+            return first;
+        }
+    }
+
+    *got = 0;
+    return -1;
+}
+
+/*
+ * Allocates a run of blocks from the given tier, 0 for the fast one and 1
+ * for the slow one, or from the fast tier and else the slow one if tier is
+ * -1. An image without tiers is all fast.
+ */
+static int blocks_alloc_tier(int tier, int count, int* got)
+{
+    superblock_t* sb = get_superblock();
+    int base = sb->data_block / BLOCKS_GROUP;
+    int split = blocks_tier ? blocks_tier / BLOCKS_GROUP : sb->group_count;
+
+    int first = -1;
+    if (tier <= 0 && base < split) {
+        first = blocks_alloc_run(base, split, count, got);
+    }
+    if (first < 0 && tier != 0 && split < sb->group_count) {
+        first = blocks_alloc_run(split, sb->group_count, count, got);
+    }
+    return first;
 }
 
 /*
  * Allocates a block.
  *
  * This function searches for a free block in the blocks' bitmap, marks it as used,
- * and returns its block number.
+ * and returns its block number. Blocks frozen by a snapshot are skipped.
  */
 int alloc_block()
 {
-    void* bbm = get_blocks_bitmap(); 
+    int got;
+    int ii = blocks_alloc_tier(-1, 1, &got);
+    if (ii < 0) {
+        return -1;
+    }
 
-    for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-        if (!bitmap_get(bbm, ii)) {
-            bitmap_put(bbm, ii, 1);
-            printf("+ alloc_block() -> %d\n", ii);
-            return ii;
-        }
+    printf("+ alloc_block() -> %d\n", ii);
+    return ii;
+}
+
+/*
+ * Allocates a run of adjacent free blocks.
+ */
+int alloc_extent(int count, int* got)
+{
+    int first = blocks_alloc_tier(-1, count, got);
+    if (first < 0) {
+        return -1;
     }
 
-    return -1;
+    printf("+ alloc_extent(%d) -> %d (%d blocks)\n", count, first, *got);
+    return first;
+}
+
+/*
+ * Allocates a run of adjacent free blocks in the specified tier.
+ */
+int alloc_extent_tier(int tier, int count, int* got)
+{
+    int first = blocks_alloc_tier(tier, count, got);
+    if (first < 0) {
+        return -1;
+    }
+
+    printf("+ alloc_extent_tier(%d, %d) -> %d (%d blocks)\n", tier, count, first, *got);
+    return first;
+}
+
+/*
+ * Returns the number of blocks in the fast tier.
+ */
+int blocks_tier_blocks()
+{
+    return blocks_tier;
+}
+
+/*
+ * Counts the free blocks of the specified tier.
+ */
+int blocks_tier_free(int tier)
+{
+    superblock_t* sb = get_superblock();
+    int split = blocks_tier ? blocks_tier / BLOCKS_GROUP : sb->group_count;
+    int free = 0;
+    for (int gg = tier ? split : 0; gg < (tier ? (int)sb->group_count : split); ++gg) {
+        free += __atomic_load_n(&sb->group_free[gg], __ATOMIC_RELAXED);
+    }
+    return free;
+}
+
+/*
+ * Returns the reference count table entry of the specified block.
+ *
+ * Entries count references beyond the first, so a block that is merely
+ * allocated has an entry of 0 and allocation never touches the table.
+ */
+static uint16_t* block_refcount(int bnum)
+{
+    int per_block = BLOCK_SIZE / sizeof(uint16_t);
+    uint16_t* table = blocks_get_block(get_superblock()->refc_block + bnum / per_block);
+    return table + bnum % per_block;
+}
+
+/*
+ * Records a change to the reference count of the specified block.
+ */
+static void block_refcount_log(int bnum)
+{
+    int per_block = BLOCK_SIZE / sizeof(uint16_t);
+    journal_log(JR_REF, get_superblock()->refc_block + bnum / per_block, bnum % per_block, 1);
 }
 
 /*
  * Frees a block.
  *
- * This function marks the specified block as free in the blocks' bitmap.
+ * This function drops one reference to the specified block and marks it
+ * as free in the blocks' bitmap once the last one is gone. A pinned
+ * (metadata) block is only released at the next journal checkpoint, so it
+ * cannot be reused for data while the image still refers to it.
  */
 void free_block(int bnum)
 {
     printf("+ free_block(%d)\n", bnum);
 
+    superblock_t* sb = get_superblock();
     void* bbm = get_blocks_bitmap();  
-    bitmap_put(bbm, bnum, 0);
+    uint16_t* extra = block_refcount(bnum);
+    pthread_mutex_t* lock = &blocks_groups[bnum / BLOCKS_GROUP].lock;
+
+    pthread_mutex_lock(lock);
+    if (*extra > 0) {
+        block_refcount_log(bnum);
+        *extra -= 1;
+    } else if (blocks_pinned(bnum)) {
+        journal_free_later(bnum);
+    } else {
+        journal_log(JR_ALLOC, sb->bbm_block, bnum, 1);
+        bitmap_put(bbm, bnum, 0);
+        blocks_account(bnum, 0);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+/*
+ * Freezes every block marked used in the given block bitmap, counting
+ * again the frozen blocks the live tree no longer uses.
+ */
+void blocks_freeze(const void* bbm)
+{
+    const uint8_t* live = get_blocks_bitmap();
+    int frozen_free = 0;
+
+    pthread_mutex_lock(&sync_lock);
+    for (int ii = 0; ii < blocks_count / 8; ++ii) {
+        uint8_t frozen = blocks_frozen_bm[ii] | ((const uint8_t*)bbm)[ii];
+        __atomic_store_n(&blocks_frozen_bm[ii], frozen, __ATOMIC_RELAXED);
+        frozen_free += __builtin_popcount(frozen & ~live[ii] & 0xff);
+    }
+    __atomic_store_n(&blocks_frozen_free, frozen_free, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Thaws every frozen block.
+ */
+void blocks_thaw()
+{
+    pthread_mutex_lock(&sync_lock);
+    for (int ii = 0; ii < blocks_count / 8; ++ii) {
+        __atomic_store_n(&blocks_frozen_bm[ii], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&blocks_frozen_free, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Returns whether the specified block is frozen.
+ */
+int block_frozen(int bnum)
+{
+    return blocks_bit(blocks_frozen_bm, bnum);
+}
+
+/*
+ * Adds a reference to an allocated block.
+ */
+int block_share(int bnum)
+{
+    superblock_t* sb = get_superblock();
+    void* bbm = get_blocks_bitmap();
+    uint16_t* extra = block_refcount(bnum);
+    pthread_mutex_t* lock = &blocks_groups[bnum / BLOCKS_GROUP].lock;
+    int rv = 0;
+
+    pthread_mutex_lock(lock);
+    if (!bitmap_get(bbm, bnum)) {
+        journal_log(JR_ALLOC, sb->bbm_block, bnum, 1);
+        bitmap_put(bbm, bnum, 1);
+        blocks_account(bnum, 1);
+    } else if (*extra == UINT16_MAX) {
+        rv = -EMLINK;
+    } else {
+        block_refcount_log(bnum);
+        *extra += 1;
+    }
+    pthread_mutex_unlock(lock);
+    return rv;
+}
+
+/*
+ * Returns the number of references to the specified block.
+ */
+int block_refs(int bnum)
+{
+    return 1 + *block_refcount(bnum);
+}
+
+/*
+ * Sets the number of references to the specified block.
+ */
+void block_set_refs(int bnum, int refs)
+{
+    superblock_t* sb = get_superblock();
+    void* bbm = get_blocks_bitmap();
+    uint16_t* extra = block_refcount(bnum);
+    int used = refs > 0;
+    int more = refs > 1 + UINT16_MAX ? UINT16_MAX : (refs > 1 ? refs - 1 : 0);
+    pthread_mutex_t* lock = &blocks_groups[bnum / BLOCKS_GROUP].lock;
+
+    pthread_mutex_lock(lock);
+    if (bitmap_get(bbm, bnum) != used) {
+        journal_log(JR_ALLOC, sb->bbm_block, bnum, 1);
+        bitmap_put(bbm, bnum, used);
+        blocks_account(bnum, used);
+    }
+    if (*extra != more) {
+        block_refcount_log(bnum);
+        *extra = more;
+    }
+    pthread_mutex_unlock(lock);
 }
 
 /*
  * Get the number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes) {
-  int quo = bytes / BLOCK_SIZE;
-  int rem = bytes % BLOCK_SIZE;
-  if (rem == 0) {
-    return quo;
-  } else {
-    return quo + 1;
-  }
+int bytes_to_blocks(int64_t bytes) {
+  return (bytes + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
 }
@@ -2,38 +2,244 @@
 #define BLOCKS_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 /*
  * Represents a block in the file system.
  */
 
-// Externally defined block size.
+// Bytes per block of the mounted image, and its base 2 logarithm. Both
+// come from the superblock; see blocks_init().
 extern int BLOCK_SIZE;
+extern int BLOCK_SHIFT;
+
+// Block sizes an image may have: 4, 16 or 64 KiB
+#define BLOCK_SIZE_MIN 4096
+#define BLOCK_SIZE_MAX 65536
+
+// Identifies a formatted nufs image ("NUFS").
+#define NUFS_MAGIC 0x5346554e
+#define NUFS_VERSION 12
+
+/*
+ * The superblock lives at the start of block 0 and records where each
+ * metadata region of the image starts. Every block before data_block is
+ * reserved and never handed out by alloc_block(). All of them but the
+ * journal and the checksum area are metadata, pinned while mounted.
+ *
+ * The blocks may be striped across several backing files in units of
+ * stripe_blocks: unit n is stored in file n % stripe_count, after the units
+ * before it there. The superblock is at the start of the first file. An
+ * image in a single file is one unit as long as the image.
+ *
+ * Instead, an image may be split in two tiers: its first tier_blocks blocks,
+ * which hold all the metadata, in a fast file, and the rest in a slow one.
+ * The fast tier is whole allocation groups; see tier.h for how file data
+ * moves between the two.
+ *
+ * It also counts the free blocks and inodes, in total and per allocation
+ * group, so statfs and the allocator never scan the bitmaps. While
+ * mounted, each group also has a lock of its own: allocating and freeing
+ * take only the lock of the group they touch, so threads working in
+ * different groups never wait for each other. The counts
+ * follow every bitmap change in memory and reach the image with the
+ * superblock at each checkpoint. They are not journaled: replaying a
+ * journal counts them again from the bitmaps.
+ */
+typedef struct superblock {
+    uint32_t magic;           // NUFS_MAGIC
+    uint32_t version;         // On-disk format version
+    uint32_t block_size;      // Bytes per block
+    uint32_t block_count;     // Total number of blocks in the image
+    uint32_t stripe_count;    // Backing files the blocks are striped across
+    uint32_t stripe_blocks;   // Blocks per stripe unit
+    uint32_t tier_blocks;     // Blocks in the fast tier, 0 if the image has no tiers
+    uint32_t inode_count;     // Number of slots in the inode table
+    uint32_t bbm_block;       // Block bitmap
+    uint32_t ibm_block;       // Inode bitmap
+    uint32_t itab_block;      // First block of the inode table
+    uint32_t itab_blocks;     // Length of the inode table in blocks
+    uint32_t refc_block;      // First block of the block reference counts
+    uint32_t refc_blocks;     // Length of the reference count table in blocks
+    uint32_t snap_block;      // Snapshot table
+    uint32_t dedup_block;     // First block of the dedup hash index
+    uint32_t dedup_blocks;    // Length of the dedup hash index in blocks
+    uint32_t csum_block;      // First block of the data block checksums
+    uint32_t csum_blocks;     // Length of the checksum area in blocks
+    uint32_t journal_block;   // First block of the metadata journal
+    uint32_t journal_blocks;  // Length of the journal in blocks
+    uint32_t data_block;      // First allocatable block
+    uint32_t free_blocks;     // Blocks free in the block bitmap
+    uint32_t free_inodes;     // Inodes free in the inode bitmap
+    uint32_t group_count;     // Allocation groups of BLOCKS_GROUP blocks
+    uint32_t group_free[];    // Blocks free in each allocation group
+} superblock_t;
+
+// Blocks per allocation group, and groups an image may have at most
+#define BLOCKS_GROUP 1024
+#define BLOCKS_GROUP_MAX (BLOCK_SIZE_MAX * 8 / BLOCKS_GROUP)
 
 /*
  * Get the number of blocks needed to store the given number of bytes.
  *
  * This function calculates the number of blocks required to store a given
- * number of bytes based on the predefined block size.
+ * number of bytes based on the block size of the mounted image.
+ */
+int bytes_to_blocks(int64_t bytes);
+
+/*
+ * Sizes of the regions of a new image.
+ */
+typedef struct blocks_geometry {
+    int block_count;         // Total blocks, a multiple of 8, at most 8 per byte of a block
+    int inode_count;         // Inode table slots, at most 8 per byte of a block
+    int journal_blocks;      // Length of the metadata journal, at least 2
+    int block_size;          // 4096, 16384 or 65536 bytes
+} blocks_geometry_t;
+
+/*
+ * Returns whether an image may have blocks of the given size.
+ */
+int blocks_size_valid(int size);
+
+// Mapping policies, see blocks_set_map()
+#define BLOCKS_MAP_HUGE       1  // Transparent huge pages for the data blocks
+#define BLOCKS_MAP_POPULATE   2  // Prefault the metadata every operation reads
+#define BLOCKS_MAP_RANDOM     4  // Data blocks are read at random: no readahead
+#define BLOCKS_MAP_SEQUENTIAL 8  // Data blocks are read in order: aggressive readahead
+#define BLOCKS_MAP_MEMORY    16  // Keep the image in anonymous memory, see blocks_set_checkpoint()
+
+/*
+ * Chooses how the next blocks_init() maps the image, as a mask of
+ * BLOCKS_MAP_* policies. The default, 0, maps it with plain pages and no
+ * advice.
+ *
+ * Huge pages only take for images the kernel can back with them, such as
+ * ones on tmpfs mounted with huge=advise, or kept in memory; pinned
+ * metadata blocks of a mapped image are always mapped with plain pages.
+ */
+void blocks_set_map(int policies);
+
+/*
+ * Sets the seconds between the checkpoints of an image kept in memory
+ * (BLOCKS_MAP_MEMORY). The default is 10.
+ *
+ * Such an image is read into anonymous memory when it is mounted, and its
+ * files are only written by checkpoints: nothing else waits for storage,
+ * not even fsync. Each checkpoint writes every block changed since the
+ * last one, as of a moment no transaction was open. It goes to a log past
+ * the end of the image first, is committed by one of two records written
+ * in turn, and is then copied in place; mounting finishes a copy a crash
+ * cut short. A crash loses at most the changes of one interval.
+ */
+void blocks_set_checkpoint(int seconds);
+
+/*
+ * Starts checkpointing an image kept in memory in the background. Does
+ * nothing for an image mapped from its files.
+ *
+ * Called once the file system is running, like journal_start().
+ */
+void blocks_start();
+
+// Backing files an image may be striped across, and the default stripe unit
+#define BLOCKS_STRIPE_MAX 16
+#define BLOCKS_STRIPE_UNIT 65536
+
+/*
+ * Chooses the backing files the next blocks_init() or blocks_mkfs() stripes
+ * the image across, besides the one at its path, and the bytes per stripe
+ * unit of a new image: a multiple of its block size, or 0 for
+ * BLOCKS_STRIPE_UNIT. The paths must stay valid until then. The default,
+ * no members, keeps the image in one file.
+ *
+ * An existing image takes its stripe unit from its superblock and must be
+ * given the members it was made with, in the same order. Each stripe unit
+ * is a mapping of its own, so small units on a large image may run into
+ * the kernel's limit on mappings (vm.max_map_count).
+ *
+ * Returns 0, or -EINVAL if there are more than BLOCKS_STRIPE_MAX files.
+ */
+int blocks_set_stripe(const char* const* members, int count, int unit);
+
+/*
+ * Chooses the slow file the next blocks_init() or blocks_mkfs() keeps the
+ * blocks past the fast tier in, and the bytes of the fast tier of a new
+ * image, rounded up to whole allocation groups: 0 for a quarter of it. The
+ * path must stay valid until then. The default, no slow file, keeps the
+ * image in one tier. An image is either tiered or striped.
+ *
+ * Returns 0, or -EINVAL if the size is negative.
+ */
+int blocks_set_tier(const char* slow, long long fast);
+
+/*
+ * Returns the number of blocks in the fast tier, which are the first ones
+ * of the image, or 0 if the image has no tiers.
+ */
+int blocks_tier_blocks();
+
+/*
+ * Counts the free blocks of the fast tier (0) or the slow tier (1). An
+ * image without tiers is all fast.
  */
-int bytes_to_blocks(int bytes);
+int blocks_tier_free(int tier);
 
 /*
  * Initializes the file system blocks.
  *
- * This function creates a new file at the specified path, sets its size to
- * NUFS_SIZE, and maps it into memory for block storage. It also initializes
- * the blocks' bitmap and directory.
+ * This function opens the image at the specified path and maps it into
+ * memory for block storage. A blank image is formatted with a default
+ * geometry of 256 blocks of 4 KiB; an existing one has its metadata
+ * journal replayed. BLOCK_SIZE and BLOCK_SHIFT are set from the image, and
+ * the data paths specialized for its block size are chosen.
  */
 void blocks_init(const char* path);
 
+/*
+ * Creates a blank image at the specified path with the given geometry,
+ * replacing any file there, and gives it a root directory.
+ *
+ * Regions that start out zero, such as the inode table, are left as holes
+ * in the file. Returns 0 on success, -EINVAL if the geometry does not fit
+ * the format, or another negative errno.
+ */
+int blocks_mkfs(const char* path, const blocks_geometry_t* geo);
+
+/*
+ * Counts the free blocks and inodes in the bitmaps and compares the counts
+ * with the superblock's. Stale counts are rewritten if fix is set.
+ *
+ * Returns the number of counts that were stale.
+ */
+int blocks_recount(int fix);
+
+/*
+ * Returns the number of blocks that can still be allocated: those free in
+ * the block bitmap, less those a snapshot holds.
+ */
+int blocks_free_count();
+
+/*
+ * Sets the number of references to the specified block outright,
+ * allocating it or freeing it as needed. Used by fsck to repair an image.
+ */
+void block_set_refs(int bnum, int refs);
+
 /*
  * Frees the memory mapped file system blocks.
  *
- * This function unmaps the memory region used for block storage.
+ * This function checkpoints the metadata journal and unmaps the memory
+ * region used for block storage. An image kept in memory gets a last
+ * checkpoint.
  */
 void blocks_free();
 
+/*
+ * Returns a pointer to the superblock.
+ */
+superblock_t* get_superblock();
+
 /*
  * Returns a pointer to the start of the specified block.
  *
@@ -41,6 +247,70 @@ void blocks_free();
  */
 void* blocks_get_block(int bnum);
 
+/*
+ * Returns the number of the block containing the given address.
+ *
+ * The address must point into the mapped image.
+ */
+int blocks_get_bnum(void* addr);
+
+/*
+ * Starts reading a run of blocks of a striped image into memory, in
+ * parallel from every backing file it spans, so that faulting the run in
+ * does not wait for one file after another. Does nothing for an image in
+ * a single file or a run within one stripe unit.
+ */
+void blocks_prefetch(int bnum, int count);
+
+/*
+ * Marks the specified block as modified.
+ *
+ * Dirty blocks are remembered in memory so that blocks_sync() only has to
+ * flush the pages that actually changed since they were last flushed.
+ */
+void blocks_dirty(int bnum);
+
+/*
+ * Flushes the given blocks to the backing image.
+ *
+ * Only blocks marked dirty are written, and adjacent blocks are merged into
+ * a single msync() range. Concurrent callers are grouped: one flush covers
+ * every request queued while the previous flush was running. Returns 0 on
+ * success or a negative errno.
+ */
+int blocks_sync(const int* bnums, int count);
+
+/*
+ * Pins the specified block in memory.
+ *
+ * A pinned block is remapped copy-on-write, so the kernel never writes its
+ * changes back to the image on its own. Metadata blocks are pinned so that
+ * they only reach the image through blocks_writeback(), after the journal
+ * records describing the change are durable.
+ */
+void blocks_pin(int bnum);
+
+/*
+ * Pins a run of blocks at once.
+ */
+void blocks_pin_range(int first, int count);
+
+/*
+ * Unpins the specified block, discarding any changes not yet written back.
+ */
+void blocks_unpin(int bnum);
+
+/*
+ * Returns whether the specified block is pinned.
+ */
+int blocks_pinned(int bnum);
+
+/*
+ * Writes every dirty pinned block to its home location in the image and
+ * waits for it to reach storage. Returns 0 on success or a negative errno.
+ */
+int blocks_writeback();
+
 /*
  * Returns a pointer to the blocks' bitmap.
  *
@@ -59,15 +329,69 @@ void* get_inode_bitmap();
  * Allocates a free block.
  *
  * This function searches for a free block in the blocks' bitmap, marks it as
- * used, and returns its block number.
+ * used, and returns its block number. Each thread has a home allocation
+ * group, handed out in turn as threads first allocate, and searches it
+ * first; once it runs dry the thread takes the next group with free blocks
+ * as its home. Blocks of the fast tier are used up before the slow one's.
  */
 int alloc_block();
 
+/*
+ * Allocates a run of adjacent free blocks.
+ *
+ * The run starts at the first free block of the thread's home group (see
+ * alloc_block()), ends within that group and is at most count blocks long;
+ * its length is stored in got. Returns its first block number, or -1 if no
+ * block is free.
+ */
+int alloc_extent(int count, int* got);
+
+/*
+ * Allocates a run of adjacent free blocks like alloc_extent(), from the
+ * fast tier (0) or the slow tier (1) only.
+ */
+int alloc_extent_tier(int tier, int count, int* got);
+
 /*
  * Frees the specified block.
  *
- * This function marks the specified block as free in the blocks' bitmap.
+ * This function drops one reference to the specified block, and marks it
+ * as free in the blocks' bitmap once the last reference is gone.
  */
 void free_block(int bnum);
 
+/*
+ * Freezes every block marked used in the given block bitmap.
+ *
+ * A frozen block belongs to a snapshot: it is copied before it is written
+ * and never handed out by alloc_block(), whether or not the live tree still
+ * uses it.
+ */
+void blocks_freeze(const void* bbm);
+
+/*
+ * Thaws every frozen block.
+ */
+void blocks_thaw();
+
+/*
+ * Returns whether the specified block is frozen.
+ */
+int block_frozen(int bnum);
+
+/*
+ * Adds a reference to an allocated block, so that it is shared.
+ *
+ * Shared blocks are copied before they are written, see inode_cow_pnum().
+ * A frozen block the live tree no longer uses is simply allocated again.
+ * Returns 0 on success, or -EMLINK if the block already has as many
+ * references as the reference count table can hold.
+ */
+int block_share(int bnum);
+
+/*
+ * Returns the number of references to the specified block.
+ */
+int block_refs(int bnum);
+
 #endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "checksum.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "crc32c.h"
+
+/*
+ * Represents functions for sealing and verifying data blocks.
+ */
+
+static int checksum_mode = CHECKSUM_FULL;
+// Blocks verified or sealed since mount, for CHECKSUM_LAZY
+static uint8_t* checksum_known = 0;
+static pthread_mutex_t checksum_lock = PTHREAD_MUTEX_INITIALIZER;
+static checksum_stats_t checksum_stats;
+
+static uint64_t checksum_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Returns the checksum area entry of the specified block.
+ */
+static uint32_t* checksum_entry(int bnum)
+{
+    int per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint32_t* table = blocks_get_block(get_superblock()->csum_block + bnum / per_block);
+    return table + bnum % per_block;
+}
+
+/*
+ * Forgets which blocks were verified since mount.
+ */
+void checksum_init()
+{
+    free(checksum_known);
+    checksum_known = calloc(get_superblock()->block_count / 8 + 1, 1);
+    memset(&checksum_stats, 0, sizeof(checksum_stats));
+}
+
+/*
+ * Frees the checksum state.
+ */
+void checksum_free()
+{
+    free(checksum_known);
+    checksum_known = 0;
+}
+
+/*
+ * Chooses when reads verify checksums.
+ */
+void checksum_set_mode(int mode)
+{
+    checksum_mode = mode;
+}
+
+/*
+ * Computes and stores the checksum of the specified block.
+ */
+void checksum_seal(int bnum)
+{
+    uint64_t start = checksum_now();
+    uint32_t crc = crc32c(0, blocks_get_block(bnum), BLOCK_SIZE);
+
+    pthread_mutex_lock(&checksum_lock);
+    *checksum_entry(bnum) = crc;
+    bitmap_put(checksum_known, bnum, 1);
+    checksum_stats.sealed += BLOCK_SIZE;
+    checksum_stats.seal_nanos += checksum_now() - start;
+    pthread_mutex_unlock(&checksum_lock);
+
+    blocks_dirty(blocks_get_bnum(checksum_entry(bnum)));
+}
+
+/*
+ * Marks the specified block as not sealed.
+ */
+void checksum_clear(int bnum)
+{
+    pthread_mutex_lock(&checksum_lock);
+    *checksum_entry(bnum) = 0;
+    bitmap_put(checksum_known, bnum, 0);
+    pthread_mutex_unlock(&checksum_lock);
+
+    blocks_dirty(blocks_get_bnum(checksum_entry(bnum)));
+}
+
+/*
+ * Checks the specified block against its checksum.
+ */
+int checksum_verify(int bnum)
+{
+    if (checksum_mode == CHECKSUM_OFF) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&checksum_lock);
+    uint32_t expected = *checksum_entry(bnum);
+    int known = bitmap_get(checksum_known, bnum);
+    pthread_mutex_unlock(&checksum_lock);
+
+    if (expected == 0 || (checksum_mode == CHECKSUM_LAZY && known)) {
+        return 0;
+    }
+
+    uint64_t start = checksum_now();
+    uint32_t crc = crc32c(0, blocks_get_block(bnum), BLOCK_SIZE);
+
+    pthread_mutex_lock(&checksum_lock);
+    checksum_stats.verified += BLOCK_SIZE;
+    checksum_stats.verify_nanos += checksum_now() - start;
+    if (crc == expected) {
+        bitmap_put(checksum_known, bnum, 1);
+    } else {
+        checksum_stats.failures += 1;
+    }
+    pthread_mutex_unlock(&checksum_lock);
+
+    if (crc != expected) {
+        fprintf(stderr, "nufs: block %d: checksum %08x, expected %08x\n", bnum, crc, expected);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Fills in the checksum statistics.
+ */
+void checksum_get_stats(checksum_stats_t* stats)
+{
+    pthread_mutex_lock(&checksum_lock);
+    *stats = checksum_stats;
+    pthread_mutex_unlock(&checksum_lock);
+
+    strncpy(stats->impl, crc32c_impl(), sizeof(stats->impl) - 1);
+}
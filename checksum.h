@@ -0,0 +1,75 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * Represents per-block checksums of file data.
+ *
+ * The checksum area of the image holds a CRC-32C for every block. Writes
+ * seal the blocks they change, reads verify the blocks they return, and a
+ * mismatch fails the read with -EIO. A stored 0 means the block has not
+ * been sealed since it was allocated, and is not checked.
+ *
+ * The checksum area is mapped like file data and flushed with it by fsync,
+ * so a block and its checksum reach the image together. Metadata blocks are
+ * covered by the journal's own checksums instead.
+ */
+
+// When reads verify checksums, chosen with -o verify=...
+#define CHECKSUM_FULL 0      // On every read (the default)
+#define CHECKSUM_LAZY 1      // On the first read of each block after mount
+#define CHECKSUM_OFF  2      // Never; writes still seal
+
+typedef struct checksum_stats {
+    uint64_t verified;       // Bytes verified since mount
+    uint64_t verify_nanos;   // Time spent verifying them
+    uint64_t sealed;         // Bytes sealed since mount
+    uint64_t seal_nanos;     // Time spent sealing them
+    uint64_t failures;       // Blocks that failed verification since mount
+    char impl[8];            // CRC-32C implementation, see crc32c_impl()
+} checksum_stats_t;
+
+// Reports checksum_stats_t for the whole file system; issued on any file
+#define NUFS_IOC_CHECKSUM_STATS _IOR('N', 3, checksum_stats_t)
+
+/*
+ * Forgets which blocks were verified since mount.
+ */
+void checksum_init();
+
+/*
+ * Frees the checksum state.
+ */
+void checksum_free();
+
+/*
+ * Chooses when reads verify checksums.
+ */
+void checksum_set_mode(int mode);
+
+/*
+ * Computes and stores the checksum of the specified block.
+ */
+void checksum_seal(int bnum);
+
+/*
+ * Marks the specified block as not sealed.
+ */
+void checksum_clear(int bnum);
+
+/*
+ * Checks the specified block against its checksum.
+ *
+ * Returns 0 if it matches, was not sealed or need not be checked, and -EIO
+ * otherwise.
+ */
+int checksum_verify(int bnum);
+
+/*
+ * Fills in the checksum statistics.
+ */
+void checksum_get_stats(checksum_stats_t* stats);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef CLONE_H
+#define CLONE_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * Represents the reflink ioctl understood by nufs.
+ *
+ * The kernel answers FICLONE and FICLONERANGE on a FUSE file itself, without
+ * asking the file system, so nufs takes its own request that names the
+ * source by path instead of by file descriptor. It is issued on the
+ * destination file.
+ */
+
+// Longest source path a clone request can carry
+#define CLONE_PATH 256
+
+typedef struct clone_args {
+    uint64_t src_offset;     // Block aligned offset in the source
+    uint64_t src_length;     // Bytes to clone, 0 meaning to the end of the source
+    uint64_t dest_offset;    // Block aligned offset in the destination
+    char src[CLONE_PATH];    // Source path inside the file system, e.g. /dir/file
+} clone_args_t;
+
+// Shares the source range's blocks with the destination file
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 1, clone_args_t)
+
+#endif
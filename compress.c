@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "compress.h"
+#include "blocks.h"
+#include "inode.h"
+#include "lz.h"
+#include "checksum.h"
+#include "tail.h"
+
+/*
+ * Represents functions for reading and writing compressed clusters.
+ */
+
+// Identifies the first block of a compressed cluster ("LZCL")
+#define CLUSTER_MAGIC 0x4c435a4c
+
+// Starts the compressed data of a cluster
+typedef struct cluster_hdr {
+    uint32_t magic;          // CLUSTER_MAGIC
+    uint32_t size;           // Bytes of compressed data after the header
+} cluster_hdr_t;
+
+// Decompressed clusters kept in memory
+#define CACHE_SLOTS 16
+
+/*
+ * A direct-mapped cache entry, keyed by the first block of the compressed
+ * data. Compressed blocks are never written in place, so an entry stays
+ * valid until its block is reused for another compressed cluster, which
+ * cluster_deflate() evicts.
+ */
+typedef struct cluster_cache {
+    int bnum;                      // First compressed block, 0 if empty
+    uint8_t data[CLUSTER_SIZE_MAX]; // Only CLUSTER_SIZE bytes are touched
+} cluster_cache_t;
+
+static cluster_cache_t cluster_cache[CACHE_SLOTS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static long cache_hits = 0;
+static long cache_misses = 0;
+
+/*
+ * Returns the block a block map slot refers to, or 0 if it refers to none.
+ */
+int slot_block(int slot)
+{
+    if (slot == CLUSTER_PAD) {
+        return 0;
+    }
+    if (tail_slot(slot)) {
+        return tail_block(slot);
+    }
+    return slot < 0 ? -slot : slot;
+}
+
+/*
+ * Returns whether the given file page lies in a compressed cluster.
+ */
+int cluster_compressed(inode_t* node, int fpn)
+{
+    return inode_get_pnum(node, fpn - fpn % CLUSTER_PAGES) < 0;
+}
+
+/*
+ * Decompresses the cluster starting at file page first into data.
+ */
+static int cluster_decode(inode_t* node, int first, uint8_t* data)
+{
+    uint8_t packed[CLUSTER_SIZE];
+    int count = 0;
+
+    for (int ii = 0; ii < CLUSTER_PAGES; ++ii) {
+        int bnum = slot_block(inode_get_pnum(node, first + ii));
+        if (bnum && checksum_verify(bnum) < 0) {
+            return -EIO;
+        }
+        if (bnum) {
+            memcpy(packed + BLOCK_SIZE * count++, blocks_get_block(bnum), BLOCK_SIZE);
+        }
+    }
+
+    cluster_hdr_t* hdr = (cluster_hdr_t*)packed;
+    if (hdr->magic != CLUSTER_MAGIC || hdr->size > BLOCK_SIZE * count - sizeof(cluster_hdr_t)) {
+        return -EIO;
+    }
+    int size = lz_decompress(packed + sizeof(cluster_hdr_t), hdr->size, data, CLUSTER_SIZE);
+    return size == CLUSTER_SIZE ? 0 : -EIO;
+}
+
+/*
+ * Copies a file page into page, going through the cluster cache for pages
+ * of compressed clusters.
+ */
+int cluster_read_page(inode_t* node, int fpn, char* page)
+{
+    int slot = inode_get_pnum(node, fpn);
+    if (slot > 0) {
+        memcpy(page, blocks_get_block(slot), BLOCK_SIZE);
+        return 0;
+    }
+    if (slot == 0) {
+        memset(page, 0, BLOCK_SIZE);
+        return 0;
+    }
+
+    int first = fpn - fpn % CLUSTER_PAGES;
+    int bnum = -inode_get_pnum(node, first);
+    int rv = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    cluster_cache_t* entry = &cluster_cache[bnum % CACHE_SLOTS];
+    if (entry->bnum == bnum) {
+        cache_hits += 1;
+    } else {
+        cache_misses += 1;
+        rv = cluster_decode(node, first, entry->data);
+        entry->bnum = rv == 0 ? bnum : 0;
+        printf("+ cluster_read_page(%d) -> %d (%ld hits, %ld misses)\n",
+               fpn, rv, cache_hits, cache_misses);
+    }
+    if (rv == 0) {
+        memcpy(page, entry->data + BLOCK_SIZE * (fpn - first), BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return rv;
+}
+
+/*
+ * Expands a compressed cluster into fresh plain blocks, then releases the
+ * compressed ones. Clones and snapshots sharing them keep reading them.
+ */
+int cluster_inflate(inode_t* node, int fpn)
+{
+    int first = fpn - fpn % CLUSTER_PAGES;
+    if (inode_get_pnum(node, first) >= 0) {
+        return 0;
+    }
+
+    uint8_t data[CLUSTER_SIZE];
+    int rv = cluster_decode(node, first, data);
+    if (rv < 0) {
+        return rv;
+    }
+
+    rv = inode_map_prepare(node, first, CLUSTER_PAGES);
+    if (rv < 0) {
+        return rv;
+    }
+
+    int fresh[CLUSTER_PAGES];
+    for (int ii = 0; ii < CLUSTER_PAGES; ++ii) {
+        fresh[ii] = alloc_block();
+        if (fresh[ii] < 0) {
+            while (ii-- > 0) {
+                free_block(fresh[ii]);
+            }
+            return -ENOSPC;
+        }
+    }
+
+    for (int ii = 0; ii < CLUSTER_PAGES; ++ii) {
+        int old = slot_block(inode_get_pnum(node, first + ii));
+
+        memcpy(blocks_get_block(fresh[ii]), data + BLOCK_SIZE * ii, BLOCK_SIZE);
+        blocks_dirty(fresh[ii]);
+        checksum_seal(fresh[ii]);
+        inode_set_slot(node, first + ii, fresh[ii]);
+
+        if (old) {
+            free_block(old);
+        }
+    }
+
+    printf("+ cluster_inflate(%d) -> %d blocks\n", first, CLUSTER_PAGES);
+    return 0;
+}
+
+/*
+ * Compresses a plain cluster into fresh blocks, then releases the plain
+ * ones.
+ *
+ * Bytes past the end of the file are compressed as zeros. Clusters holding
+ * a block that is shared or frozen by a snapshot are left alone, since
+ * compressing them would only add blocks.
+ */
+int cluster_deflate(inode_t* node, int fpn)
+{
+    int first = fpn - fpn % CLUSTER_PAGES;
+    if (first + CLUSTER_PAGES > INODE_MAX_PAGES) {
+        return 0;
+    }
+
+    uint8_t data[CLUSTER_SIZE];
+    int old[CLUSTER_PAGES];
+    int plain = 0;
+
+    for (int ii = 0; ii < CLUSTER_PAGES; ++ii) {
+        old[ii] = inode_get_pnum(node, first + ii);
+        if (old[ii] < 0 || tail_slot(old[ii])) {
+            return 0;
+        }
+        if (old[ii] == 0) {
+            memset(data + BLOCK_SIZE * ii, 0, BLOCK_SIZE);
+            continue;
+        }
+        if (block_refs(old[ii]) > 1 || block_frozen(old[ii])) {
+            return 0;
+        }
+        memcpy(data + BLOCK_SIZE * ii, blocks_get_block(old[ii]), BLOCK_SIZE);
+        plain += 1;
+    }
+
+    int64_t valid = node->size - (int64_t)BLOCK_SIZE * first;
+    if (valid < CLUSTER_SIZE) {
+        memset(data + (valid > 0 ? valid : 0), 0, CLUSTER_SIZE - (valid > 0 ? valid : 0));
+    }
+
+    // Worth it only if at least one block is saved, counting a new
+    // indirect block the compressed slots of holes may need
+    int budget = plain - 1;
+    if (first + CLUSTER_PAGES > 2 && plain < CLUSTER_PAGES) {
+        budget -= 1;
+    }
+    if (budget <= 0) {
+        return 0;
+    }
+
+    uint8_t packed[CLUSTER_SIZE];
+    int size = lz_compress(data, CLUSTER_SIZE, packed + sizeof(cluster_hdr_t),
+                           BLOCK_SIZE * budget - sizeof(cluster_hdr_t));
+    if (size == 0) {
+        return 0;
+    }
+
+    cluster_hdr_t* hdr = (cluster_hdr_t*)packed;
+    hdr->magic = CLUSTER_MAGIC;
+    hdr->size = size;
+    int count = bytes_to_blocks(sizeof(cluster_hdr_t) + size);
+    memset(packed + sizeof(cluster_hdr_t) + size, 0, BLOCK_SIZE * count - sizeof(cluster_hdr_t) - size);
+
+    if (inode_map_prepare(node, first, CLUSTER_PAGES) < 0) {
+        return 0;
+    }
+
+    int fresh[CLUSTER_PAGES];
+    for (int ii = 0; ii < count; ++ii) {
+        fresh[ii] = alloc_block();
+        if (fresh[ii] < 0) {
+            while (ii-- > 0) {
+                free_block(fresh[ii]);
+            }
+            return 0;
+        }
+        memcpy(blocks_get_block(fresh[ii]), packed + BLOCK_SIZE * ii, BLOCK_SIZE);
+        blocks_dirty(fresh[ii]);
+        checksum_seal(fresh[ii]);
+    }
+
+    // The first block may have held another compressed cluster before
+    pthread_mutex_lock(&cache_lock);
+    if (cluster_cache[fresh[0] % CACHE_SLOTS].bnum == fresh[0]) {
+        cluster_cache[fresh[0] % CACHE_SLOTS].bnum = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    for (int ii = 0; ii < CLUSTER_PAGES; ++ii) {
+        inode_set_slot(node, first + ii, ii < count ? -fresh[ii] : CLUSTER_PAD);
+        if (old[ii]) {
+            free_block(old[ii]);
+        }
+    }
+
+    printf("+ cluster_deflate(%d) -> %d blocks (%d bytes)\n", first, count, size);
+    return 1;
+}
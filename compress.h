@@ -0,0 +1,65 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "inode.h"
+
+/*
+ * Represents transparent compression of file data.
+ *
+ * Files flagged INODE_COMPRESS (set with chattr +c, inherited from the
+ * parent directory) are stored in clusters of CLUSTER_PAGES file pages,
+ * aligned on a multiple of CLUSTER_PAGES. Once a write completes a cluster
+ * and on flush, the cluster is compressed with the lz codec into as few
+ * blocks as it needs, if that saves at least one block.
+ *
+ * A compressed cluster is recorded in the block map itself: its first slots
+ * hold the negated numbers of the blocks holding the compressed data, and
+ * the remaining ones CLUSTER_PAD. Reads decompress through a small cache of
+ * clusters; writes to a compressed cluster first expand it back into plain
+ * blocks. Compressed blocks are never written in place.
+ */
+
+// File pages per compression cluster
+#define CLUSTER_PAGES 8
+// Bytes per compression cluster of the mounted image, and at most
+#define CLUSTER_SIZE (CLUSTER_PAGES * BLOCK_SIZE)
+#define CLUSTER_SIZE_MAX (CLUSTER_PAGES * BLOCK_SIZE_MAX)
+// Block map slot past the compressed data of a cluster
+#define CLUSTER_PAD (-1)
+
+/*
+ * Returns the block a block map slot refers to, or 0 if it refers to none.
+ */
+int slot_block(int slot);
+
+/*
+ * Returns whether the given file page lies in a compressed cluster.
+ */
+int cluster_compressed(inode_t* node, int fpn);
+
+/*
+ * Copies a file page into page, decompressing its cluster if needed.
+ *
+ * Holes read as zeros. Returns 0 on success or -EIO if the compressed data
+ * is damaged.
+ */
+int cluster_read_page(inode_t* node, int fpn, char* page);
+
+/*
+ * Expands the compressed cluster holding the given file page into plain
+ * blocks, so it can be written.
+ *
+ * Returns 0 on success (or if the cluster is not compressed), -ENOSPC or
+ * -EIO.
+ */
+int cluster_inflate(inode_t* node, int fpn);
+
+/*
+ * Compresses the cluster holding the given file page, if it is stored
+ * plain, owned by this file alone and compresses well enough.
+ *
+ * Returns 1 if the cluster was compressed, 0 otherwise.
+ */
+int cluster_deflate(inode_t* node, int fpn);
+
+#endif
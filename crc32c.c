@@ -0,0 +1,108 @@
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+// The Castagnoli polynomial, bit-reflected
+#define CRC32C_POLY 0x82f63b78
+
+// crc32c_table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_fn)(uint32_t, const uint8_t*, int);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Consumes 8 bytes per step, one table lookup per byte.
+ */
+static uint32_t crc32c_slice8(uint32_t crc, const uint8_t* pp, int len)
+{
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, pp, 4);
+        memcpy(&hi, pp + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        pp += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc32c_table[0][(crc ^ *pp++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * Consumes 8 bytes per crc32 instruction.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* pp, int len)
+{
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t vv;
+        memcpy(&vv, pp, 8);
+        crc64 = _mm_crc32_u64(crc64, vv);
+        pp += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *pp++);
+    }
+    return crc;
+}
+#endif
+
+/*
+ * Builds the tables and picks the fastest implementation available.
+ */
+static void crc32c_setup()
+{
+    for (int bb = 0; bb < 256; ++bb) {
+        uint32_t crc = bb;
+        for (int ii = 0; ii < 8; ++ii) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][bb] = crc;
+    }
+    for (int bb = 0; bb < 256; ++bb) {
+        for (int kk = 1; kk < 8; ++kk) {
+            uint32_t prev = crc32c_table[kk - 1][bb];
+            crc32c_table[kk][bb] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    crc32c_fn = crc32c_slice8;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_fn = crc32c_sse42;
+    }
+#endif
+}
+
+/*
+ * Extends crc with len bytes of data.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, int len)
+{
+    pthread_once(&crc32c_once, crc32c_setup);
+    return ~crc32c_fn(~crc, data, len);
+}
+
+/*
+ * Returns the name of the implementation in use.
+ */
+const char* crc32c_impl()
+{
+    pthread_once(&crc32c_once, crc32c_setup);
+    return crc32c_fn == crc32c_slice8 ? "slice8" : "sse4.2";
+}
@@ -0,0 +1,26 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+
+/*
+ * Represents the CRC-32C (Castagnoli) checksum, as used by iSCSI, ext4 and
+ * btrfs.
+ *
+ * On x86-64 processors with SSE4.2 it is computed with the crc32
+ * instruction, 8 bytes at a time; elsewhere with slicing-by-8 tables. The
+ * choice is made once, on first use.
+ */
+
+/*
+ * Extends crc, the checksum of the bytes before data (0 for none), with len
+ * bytes of data.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, int len);
+
+/*
+ * Returns the name of the implementation in use, "sse4.2" or "slice8".
+ */
+const char* crc32c_impl();
+
+#endif
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dedup.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "hash.h"
+#include "tail.h"
+
+/*
+ * Represents functions for deduplicating file pages.
+ *
+ * The index is an open-addressing table filling the dedup blocks of the
+ * image. A hash is looked for in DEDUP_PROBES slots from its home slot;
+ * entering one reuses its own slot, an empty or stale one, or, when all of
+ * them hold live entries, the home slot. Slots are never emptied, so a
+ * lookup can stop at the first empty one.
+ */
+
+// Slots looked at for one hash
+#define DEDUP_PROBES 8
+
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+// Held shared while file data is written, and exclusive while a page is
+// compared with a block and made to share it
+static pthread_rwlock_t dedup_share_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int dedup_enabled = 0;
+static uint64_t dedup_hashed = 0;
+static uint64_t dedup_merged = 0;
+static uint64_t dedup_nanos = 0;
+
+static uint64_t dedup_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Returns whether an index entry may still be followed: its block must be
+ * an allocated data block. Pinned blocks hold metadata, or are waiting to
+ * be freed at the next checkpoint.
+ */
+static int dedup_live(int bnum)
+{
+    superblock_t* sb = get_superblock();
+    return bnum >= sb->data_block && bnum < sb->block_count &&
+           bitmap_get(get_blocks_bitmap(), bnum) && !blocks_pinned(bnum);
+}
+
+/*
+ * Deduplicates the given plain file page against the index.
+ */
+int dedup_page(inode_t* node, int fpn)
+{
+    int pnum = inode_get_pnum(node, fpn);
+    if (pnum <= 0 || tail_slot(pnum)) {
+        return 0;
+    }
+
+    uint64_t start = dedup_now();
+    hash128_t hh = hash128(blocks_get_block(pnum), BLOCK_SIZE);
+    uint32_t key[3] = { hh.lo, hh.lo >> 32, hh.hi };
+
+    // The caller's own write is done; wait for the others
+    dedup_write_end();
+    pthread_mutex_lock(&dedup_lock);
+    if (dedup_enabled) {
+        pthread_rwlock_wrlock(&dedup_share_lock);
+    }
+
+    superblock_t* sb = get_superblock();
+    dedup_entry_t* table = blocks_get_block(sb->dedup_block);
+    int count = sb->dedup_blocks * BLOCK_SIZE / sizeof(dedup_entry_t);
+    int home = (hh.hi >> 32) % count;
+
+    dedup_entry_t* slot = 0;
+    int match = 0;
+
+    for (int ii = 0; ii < DEDUP_PROBES; ++ii) {
+        dedup_entry_t* entry = &table[(home + ii) % count];
+        if (entry->bnum == 0) {
+            slot = slot ? slot : entry;
+            break;
+        }
+        if (memcmp(entry->hash, key, sizeof(key)) == 0) {
+            if (entry->bnum != pnum && dedup_live(entry->bnum) &&
+                memcmp(blocks_get_block(entry->bnum), blocks_get_block(pnum), BLOCK_SIZE) == 0) {
+                match = entry->bnum;
+            }
+            slot = entry;
+            break;
+        }
+        if (!slot && !dedup_live(entry->bnum)) {
+            slot = entry;
+        }
+    }
+
+    int merged = 0;
+    if (match && block_share(match) == 0) {
+        inode_set_slot(node, fpn, match);
+        free_block(pnum);
+        merged = 1;
+    } else {
+        slot = slot ? slot : &table[home];
+        memcpy(slot->hash, key, sizeof(key));
+        slot->bnum = pnum;
+        blocks_dirty(blocks_get_bnum(slot));
+    }
+
+    dedup_hashed += 1;
+    dedup_merged += merged;
+    dedup_nanos += dedup_now() - start;
+    if (dedup_enabled) {
+        pthread_rwlock_unlock(&dedup_share_lock);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    dedup_write_begin();
+
+    if (merged) {
+        printf("+ dedup_page(%d) -> %d shared\n", fpn, match);
+    }
+    return merged;
+}
+
+void dedup_set_enabled(int enabled)
+{
+    dedup_enabled = enabled;
+}
+
+void dedup_write_begin()
+{
+    if (dedup_enabled) {
+        pthread_rwlock_rdlock(&dedup_share_lock);
+    }
+}
+
+void dedup_write_end()
+{
+    if (dedup_enabled) {
+        pthread_rwlock_unlock(&dedup_share_lock);
+    }
+}
+
+/*
+ * Fills in the dedup statistics, counting block references from the
+ * reference count table.
+ */
+void dedup_get_stats(dedup_stats_t* stats)
+{
+    superblock_t* sb = get_superblock();
+    void* bbm = get_blocks_bitmap();
+
+    memset(stats, 0, sizeof(dedup_stats_t));
+    for (int ii = sb->data_block; ii < sb->block_count; ++ii) {
+        if (bitmap_get(bbm, ii)) {
+            stats->blocks += 1;
+            stats->refs += block_refs(ii);
+        }
+    }
+
+    pthread_mutex_lock(&dedup_lock);
+    stats->hashed = dedup_hashed;
+    stats->merged = dedup_merged;
+    stats->nanos = dedup_nanos;
+    pthread_mutex_unlock(&dedup_lock);
+}
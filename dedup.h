@@ -0,0 +1,75 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "inode.h"
+
+/*
+ * Represents inline block deduplication.
+ *
+ * With the dedup mount option (-o dedup), every page a write covers whole
+ * is hashed with hash128() and looked up in a hash index kept in the image.
+ * If an allocated block already holds the same bytes, the page is pointed
+ * at that block, which gains a reference, and its own block is released.
+ * Otherwise the page's block is entered into the index.
+ *
+ * The index is a hint: entries are never journaled and go stale when their
+ * block is rewritten or freed, so a match is only taken after comparing the
+ * bytes. Shared blocks are copied before they are written, so a block keeps
+ * its contents for as long as it is shared. The comparison and the sharing
+ * wait for writes under way to end, so a block is not shared halfway
+ * through being written in place.
+ */
+
+// An index slot; the index holds two of them per block of the image
+typedef struct dedup_entry {
+    uint32_t hash[3];        // First 96 bits of the block's hash128()
+    int32_t bnum;            // Block holding those bytes, 0 if empty
+} dedup_entry_t;
+
+typedef struct dedup_stats {
+    uint64_t blocks;         // Allocated data blocks
+    uint64_t refs;           // References to them from files
+    uint64_t hashed;         // Pages hashed since mount
+    uint64_t merged;         // Pages pointed at an existing block since mount
+    uint64_t nanos;          // Time spent hashing and looking up since mount
+} dedup_stats_t;
+
+// Reports dedup_stats_t for the whole file system; issued on any file
+#define NUFS_IOC_DEDUP_STATS _IOR('N', 2, dedup_stats_t)
+
+/*
+ * Deduplicates the given plain file page against the index.
+ *
+ * Must be called inside a transaction, holding the inode's lock exclusive,
+ * right after the page was written. Returns 1 if the page now shares an
+ * existing block, 0 otherwise.
+ */
+int dedup_page(inode_t* node, int fpn);
+
+/*
+ * Turns deduplication on or off for the mount.
+ */
+void dedup_set_enabled(int enabled);
+
+/*
+ * Holds off sharing blocks while file data is written. A block a write
+ * fills, in place or freshly allocated, could be compared with a page
+ * before the write ends and be shared with stale bytes. Taken by
+ * inode_lock() for changes; does nothing with deduplication off.
+ */
+void dedup_write_begin();
+
+/*
+ * Lets blocks be shared again after a write.
+ */
+void dedup_write_end();
+
+/*
+ * Fills in the dedup statistics.
+ */
+void dedup_get_stats(dedup_stats_t* stats);
+
+#endif
@@ -9,6 +9,7 @@
 #include "inode.h"
 #include "func.h"
 #include "bitmap.h"
+#include "journal.h"
 
 /*
  * Represents functions for managing directories.
@@ -16,8 +17,8 @@
 
 // Current root inode
 int rooti = 0;
-// Maximum number of entries in a directory
-int MAX_ENTR = 4096 / sizeof(dirent_t); 
+// Maximum number of entries in a directory, which is one block
+#define MAX_ENTR (BLOCK_SIZE / (int)sizeof(dirent_t))
 
 
 /*
@@ -28,8 +29,6 @@ int MAX_ENTR = 4096 / sizeof(dirent_t);
  * root directory entries.
  */
 void directory_init() {
-    // Inode bitmap
-    void* ibm = get_inode_bitmap();	
     // Creates the root inode
     rooti = alloc_inode();
     
@@ -41,12 +40,14 @@ void directory_init() {
     root->mode = 040755;
     root->size = 0;
     root->ptrs[0] = alloc_block();  
-    root->ptrs[1] = alloc_block(); 
+    root->ptrs[1] = 0;
     root->iptr = 0;
     root->time = time(0);
+    inode_dirty(root);
 
-    // Sets the inode bitmap first spot to 1, because root was created
-    bitmap_put(ibm, 0, 1);
+    // Starts with an empty entry block
+    journal_log(JR_ZERO, root->ptrs[0], 0, 0);
+    memset(blocks_get_block(root->ptrs[0]), 0, BLOCK_SIZE);
 
     // Root points to itself
     directory_put(root, ".", rooti);
@@ -77,7 +78,6 @@ int directory_lookup(inode_t* dd, const char* name) {
 int tree_lookup(const char* path) {
 
     int result = 0;
-    inode_t* root = get_inode(rooti); 
 
     slist_t* list = s_split(path, '/');
     list = list->next;
@@ -100,53 +100,90 @@ int tree_lookup(const char* path) {
  * name to the given directory inode.
  */
 int directory_put(inode_t* dd, const char* name, int inum) {  
-    dirent_t* entries = (dirent_t*) blocks_get_block(dd->ptrs[0]); 
+    // A snapshot may still refer to the entry block
+    int bnum = inode_cow_pnum(dd, 0);
+    if (bnum < 0) {
+        return -ENOSPC;
+    }
+    dirent_t* entries = (dirent_t*) blocks_get_block(bnum); 
     for (int i = 0; i < MAX_ENTR; i++) {
-        if(entries[i].inum == 0) {
+        if(entries[i].name[0] == 0) {
+            journal_log(JR_DIRENT, bnum, i, 1);
             entries[i].inum = inum;
             strcpy(entries[i].name, name);
             dd->size += sizeof(dirent_t); 
             dd->time = time(0);
+            inode_dirty(dd);
             return 0;
         }
     }
-    return -1;
+    return -ENOSPC;
 }
 
 /*
  * Deletes the given directory with the given name.
+ *
+ * The entry's slot is cleared and reused by a later directory_put().
  */
 int directory_delete(inode_t* dd, const char* name) {  
-    int rv = 0;
     printf(" + directory_delete(%s)\n", name);
-    int rm = 0;
-    dirent_t* entries = (dirent_t*) blocks_get_block(dd->ptrs[0]);
+    if (directory_lookup(dd, name) < 0) {
+        return -ENOENT;
+    }
+    int bnum = inode_cow_pnum(dd, 0);
+    if (bnum < 0) {
+        return -ENOSPC;
+    }
+    dirent_t* entries = (dirent_t*) blocks_get_block(bnum);
     for (int i = 0; i < MAX_ENTR; i++) {
-        if(!(strcmp(entries[i].name, name))) {
-            rm = i;
-            goto delete_found;
+        if(entries[i].name[0] != 0 && streq(entries[i].name, name)) {
+            journal_log(JR_DIRENT, bnum, i, 1);
+            memset(&entries[i], 0, sizeof(dirent_t));
+            dd->size -= sizeof(dirent_t);
+            dd->time = time(0);
+            inode_dirty(dd);
+            return 0;
         }
     }
-    delete_found:
-    dd->time = time(0);
-    memcpy(&entries[rm], &entries[rm + 1], 4096 - ((rm + 1) * sizeof(dirent_t)));  
-    return rv;
+    return -ENOENT;
 }
 
 /*
  * Creates a list of all the directories in a particular path.
  */
 slist_t* directory_list(const char* path) {
-    int index = get_inode(tree_lookup(path))->ptrs[0];
-    dirent_t* entries = (dirent_t*) blocks_get_block(index);  
+    return directory_list_node(get_inode(tree_lookup(path)));
+}
+
+/*
+ * Creates a list of the entries of the given directory inode.
+ */
+slist_t* directory_list_node(inode_t* dd) {
+    dirent_t* entries = (dirent_t*) blocks_get_block(dd->ptrs[0]);  
 
     slist_t* result = 0;
-    for (int i = 0; i < MAX_ENTR && strcmp(entries[i].name, ""); i++) {
-        result = s_cons(entries[i].name, result);
+    for (int i = 0; i < MAX_ENTR; i++) {
+        if (entries[i].name[0] != 0) {
+            result = s_cons(entries[i].name, result);
+        }
     }
     return result;
 }
 
+/*
+ * Finds the first entry of the directory in the given slot or after it.
+ */
+int directory_next(inode_t* dd, int slot, dirent_t** ent) {
+    dirent_t* entries = (dirent_t*) blocks_get_block(dd->ptrs[0]);
+    for (int i = slot < 0 ? 0 : slot; i < MAX_ENTR; i++) {
+        if (entries[i].name[0] != 0) {
+            *ent = &entries[i];
+            return i;
+        }
+    }
+    return -ENOENT;
+}
+
 /*
  * Retrieves the inode number of the parent directory.
  *
@@ -68,6 +68,23 @@ int directory_delete(inode_t* dd, const char* name);
  */
 slist_t* directory_list(const char* path);
 
+/*
+ * Creates a list of the entries of the given directory inode.
+ *
+ * Unlike directory_list(), this also works for inodes that are not in the
+ * live inode table, such as those of a snapshot.
+ */
+slist_t* directory_list_node(inode_t* dd);
+
+/*
+ * Finds the first entry of the directory in the given slot or after it.
+ *
+ * Returns the slot of the entry and stores a pointer to it in ent, or
+ * returns -ENOENT if there are no more entries. Nothing is copied, so a
+ * directory can be walked a slot at a time without building a list.
+ */
+int directory_next(inode_t* dd, int slot, dirent_t** ent);
+
 
 void print_directory(inode_t* dd);
 
@@ -10,7 +10,7 @@
  * @param bb The second string.
  * @return Returns 0 if the strings are equal, a non-zero value otherwise.
  */
-static int streq(const char* aa, const char* bb)
+static inline int streq(const char* aa, const char* bb)
 {
   return strcmp(aa, bb) == 0;
 }
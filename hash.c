@@ -0,0 +1,73 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+// Lanes hashed side by side, and the bytes each stripe feeds them
+#define HASH_LANES 8
+#define HASH_STRIPE (4 * HASH_LANES)
+
+static const uint32_t PRIME1 = 2654435761u;
+static const uint32_t PRIME2 = 2246822519u;
+static const uint32_t PRIME3 = 3266489917u;
+static const uint32_t PRIME4 = 668265263u;
+
+static uint32_t hash_rotl(uint32_t vv, int bits)
+{
+    return (vv << bits) | (vv >> (32 - bits));
+}
+
+// Spreads every input bit over the whole word
+static uint32_t hash_avalanche(uint32_t hh)
+{
+    hh ^= hh >> 15;
+    hh *= PRIME2;
+    hh ^= hh >> 13;
+    hh *= PRIME3;
+    hh ^= hh >> 16;
+    return hh;
+}
+
+/*
+ * Hashes len bytes of data.
+ */
+hash128_t hash128(const void* data, int len)
+{
+    const uint8_t* pp = data;
+    uint32_t acc[HASH_LANES];
+
+    for (int ii = 0; ii < HASH_LANES; ++ii) {
+        acc[ii] = PRIME4 + ii * PRIME1;
+    }
+
+    // The lanes do not depend on each other, so this loop vectorizes
+    int stripes = len / HASH_STRIPE;
+    for (int ss = 0; ss < stripes; ++ss) {
+        uint32_t words[HASH_LANES];
+        memcpy(words, pp + ss * HASH_STRIPE, HASH_STRIPE);
+        for (int ii = 0; ii < HASH_LANES; ++ii) {
+            acc[ii] = hash_rotl(acc[ii] + words[ii] * PRIME2, 13) * PRIME1;
+        }
+    }
+
+    for (int ii = stripes * HASH_STRIPE; ii < len; ++ii) {
+        uint32_t* lane = &acc[ii % HASH_LANES];
+        *lane = hash_rotl(*lane + pp[ii] * PRIME3, 11) * PRIME1;
+    }
+
+    // Fold the lanes into four words, then let each depend on all of them
+    uint32_t hh[4];
+    for (int ii = 0; ii < 4; ++ii) {
+        hh[ii] = hash_avalanche(acc[ii] ^ hash_rotl(acc[ii + 4], 16) ^ (uint32_t)len);
+    }
+    hh[0] += hh[1] + hh[2] + hh[3];
+    for (int ii = 1; ii < 4; ++ii) {
+        hh[ii] = hash_avalanche(hh[ii] + hh[0] * PRIME4);
+    }
+    hh[0] = hash_avalanche(hh[0] ^ hh[3]);
+
+    hash128_t rv;
+    rv.lo = (uint64_t)hh[1] << 32 | hh[0];
+    rv.hi = (uint64_t)hh[3] << 32 | hh[2];
+    return rv;
+}
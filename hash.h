@@ -0,0 +1,25 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+/*
+ * Represents a fast 128-bit content hash.
+ *
+ * The input is consumed in 32-byte stripes by 8 independent 32-bit lanes
+ * (multiply, rotate, multiply, as in xxHash's rounds), which compilers turn
+ * into SIMD code. The lanes are then folded and mixed into 128 bits. It is
+ * not a cryptographic hash: callers that act on a match compare the bytes.
+ */
+
+typedef struct hash128 {
+    uint64_t lo;
+    uint64_t hi;
+} hash128_t;
+
+/*
+ * Hashes len bytes of data.
+ */
+hash128_t hash128(const void* data, int len);
+
+#endif
@@ -2,10 +2,18 @@
 #include "blocks.h"  
 #include "bitmap.h"
 #include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include "func.h"
-
-// Maximum number of nodes (inodes)
-int MAX_NODE = 4096 / sizeof(inode_t);  
+#include "xattr.h"
+#include "journal.h"
+#include "compress.h"
+#include "tail.h"
+#include "checksum.h"
+#include "dedup.h"
 
 /*
  * Retrieves the inode associated with the given inode number.
@@ -17,30 +25,205 @@ int MAX_NODE = 4096 / sizeof(inode_t);
  *   Pointer to the inode structure with the specified inode number
  */
 inode_t* get_inode(int inum) { 
-    return (inode_t*)(((uint8_t*)blocks_get_block(0)) + 64) + (inum * sizeof(inode_t));  
+    return (inode_t*)blocks_get_block(get_superblock()->itab_block) + inum;
+}
+
+int inode_max_pages() {
+    const int64_t slots = INODE_MAP_SLOTS;
+    int64_t pages = 2 + slots + slots * slots + slots * slots * slots;
+    return pages < INT_MAX ? pages : INT_MAX;
+}
+
+// Inodes per allocation group of the inode bitmap
+#define INODES_GROUP 256
+// Locks the groups share, group g taking lock g % INODE_LOCKS
+#define INODE_LOCKS 64
+
+// Serializes the inode bitmap of the groups that share it, on a cache line
+// of its own
+typedef struct inode_group {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) inode_group_t;
+
+static inode_group_t inode_groups[INODE_LOCKS] = {
+    [0 ... INODE_LOCKS - 1] = { PTHREAD_MUTEX_INITIALIZER }
+};
+
+// Home inode group of this thread, and the mount it was handed out for
+static __thread int inode_home = 0;
+static __thread int inode_home_mount = -1;
+// Home groups handed out since the image was mounted, and mounts so far
+static int inode_homes = 0;
+static int inode_mounts = 0;
+
+/*
+ * Hands out home inode groups from the first one again.
+ */
+void inode_reset_homes() {
+    __atomic_store_n(&inode_homes, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&inode_mounts, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the lock of the inode group holding the given inode.
+ */
+static pthread_mutex_t* inode_group_lock(int inum) {
+    return &inode_groups[inum / INODES_GROUP % INODE_LOCKS].lock;
 }
 
+// Locks on the data and block maps of the inodes, inode i taking lock
+// i % INODE_DATA_LOCKS
+#define INODE_DATA_LOCKS 256
+
+static pthread_rwlock_t inode_data_locks[INODE_DATA_LOCKS] = {
+    [0 ... INODE_DATA_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
 /*
- * Allocates an inode with the given inode number.
+ * Returns the lock on the data of the given inode, or null for an inode
+ * of a snapshot, which lives outside the inode table.
+ */
+static pthread_rwlock_t* inode_data_lock(inode_t* node) {
+    uintptr_t first = (uintptr_t)get_inode(0);
+    uintptr_t end = (uintptr_t)get_inode(get_superblock()->inode_count);
+    if ((uintptr_t)node < first || (uintptr_t)node >= end) {
+        return 0;
+    }
+    return &inode_data_locks[(node - get_inode(0)) % INODE_DATA_LOCKS];
+}
+
+void inode_lock(inode_t* node, int exclusive) {
+    pthread_rwlock_t* lock = inode_data_lock(node);
+    if (lock && exclusive) {
+        pthread_rwlock_wrlock(lock);
+    } else if (lock) {
+        pthread_rwlock_rdlock(lock);
+    }
+    // Every inode lock is taken before the dedup one
+    if (exclusive) {
+        dedup_write_begin();
+    }
+}
+
+void inode_lock_pair(inode_t* dst, inode_t* src) {
+    pthread_rwlock_t* dlock = inode_data_lock(dst);
+    pthread_rwlock_t* slock = inode_data_lock(src);
+    if (slock == dlock) {
+        pthread_rwlock_wrlock(dlock);
+    } else if (!slock || dlock < slock) {
+        pthread_rwlock_wrlock(dlock);
+        inode_lock(src, 0);
+    } else {
+        inode_lock(src, 0);
+        pthread_rwlock_wrlock(dlock);
+    }
+    dedup_write_begin();
+}
+
+void inode_unlock(inode_t* node, int exclusive) {
+    if (exclusive) {
+        dedup_write_end();
+    }
+    pthread_rwlock_t* lock = inode_data_lock(node);
+    if (lock) {
+        pthread_rwlock_unlock(lock);
+    }
+}
+
+void inode_unlock_pair(inode_t* dst, inode_t* src) {
+    inode_unlock(dst, 1);
+    if (inode_data_lock(src) != inode_data_lock(dst)) {
+        inode_unlock(src, 0);
+    }
+}
+
+/*
+ * Records that an inode became used or free in the inode bitmap, in the
+ * superblock's free count.
+ */
+static void inode_account(int used) {
+    __atomic_add_fetch(&get_superblock()->free_inodes, used ? -1 : 1, __ATOMIC_RELAXED);
+    blocks_dirty(0);
+}
+
+/*
+ * Allocates the first free inode of the specified group, holding only its
+ * lock. Returns its number, or -1 if the group has none free.
+ */
+static int inode_claim(int group) {
+    superblock_t* sb = get_superblock();
+    void* inbm = get_inode_bitmap();
+    int end = (group + 1) * INODES_GROUP;
+    end = end < sb->inode_count ? end : sb->inode_count;
+    int inum = -1;
+
+    pthread_mutex_lock(inode_group_lock(group * INODES_GROUP));
+    for (int i = group * INODES_GROUP; i < end; i++) {
+        if (!bitmap_get(inbm, i)) {
+            journal_log(JR_ALLOC, sb->ibm_block, i, 1);
+            bitmap_put(inbm, i, 1);
+            inode_account(1);
+            inum = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(inode_group_lock(group * INODES_GROUP));
+    return inum;
+}
+
+/*
+ * Allocates an inode.
  *
- * Parameters:
- *   inum: Inode number to allocate
+ * Each thread has a home group of the inode table, handed out in turn from
+ * the first one at each mount, and looks there first; once it runs dry the thread makes the next group with
+ * a free inode its home, like alloc_block() does for blocks.
  *
  * Returns:
  *   Inode number of the allocated inode upon success, -1 otherwise
  */
-int alloc_inode(int inum) {
-    void* inbm = get_inode_bitmap();
-  
-    for (int i = 0; i < MAX_NODE; i++) {
-        if (!bitmap_get(inbm, i)) {
-            bitmap_put(inbm, i, 1);
-            return i;
+int alloc_inode() {
+    superblock_t* sb = get_superblock();
+    int groups = (sb->inode_count + INODES_GROUP - 1) / INODES_GROUP;
+
+    if (__atomic_load_n(&sb->free_inodes, __ATOMIC_RELAXED) == 0) {
+        return -1;
+    }
+    int mount = __atomic_load_n(&inode_mounts, __ATOMIC_RELAXED);
+    if (inode_home_mount != mount) {
+        inode_home = __atomic_fetch_add(&inode_homes, 1, __ATOMIC_RELAXED);
+        inode_home_mount = mount;
+    }
+
+    for (int i = 0; i < groups; i++) {
+        int group = (inode_home + i) % groups;
+        int inum = inode_claim(group);
+        if (inum >= 0) {
+            inode_home = group;
+            return inum;
         }
     }
     return -1;
 }
 
+// Bumped whenever a block of any block map moves, which invalidates every
+// inode_map_cache_t. Maps change on request and writeback threads at once,
+// so it is only touched atomically.
+static uint32_t inode_map_gen = 1;
+
+/*
+ * Invalidates every inode_map_cache_t.
+ */
+static void inode_map_moved() {
+    __atomic_add_fetch(&inode_map_gen, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Frees a block of the map or the data of an inode being freed.
+ */
+static void inode_free_slot(int slot, int level, void* arg) {
+    slot_release(slot);
+}
+
 /*
  * Frees the inode associated with the given inode number.
  *
@@ -51,23 +234,218 @@ int alloc_inode(int inum) {
  *   None
  */
 void free_inode(int inum) {
+    superblock_t* sb = get_superblock();
     inode_t* node = get_inode(inum); 
     void* inbm = get_inode_bitmap();
 
+    inode_dirty(node);
+
     if (node->refs > 1) {
         node->refs = node->refs - 1;
         return;
     } else {
-        free_block(node->ptrs[0]);
-        free_block(node->ptrs[1]);
+        inode_map_walk(node, inode_free_slot, 0);
+        inode_map_moved();
+        xattr_release(node);
         memset(node, 0, sizeof(inode_t));  
+        pthread_mutex_lock(inode_group_lock(inum));
+        journal_log(JR_ALLOC, sb->ibm_block, inum, 1);
         bitmap_put(inbm, inum, 0);
+        inode_account(0);
+        pthread_mutex_unlock(inode_group_lock(inum));
+    }
+}
+
+/*
+ * Splits a file page number into the indexes of its slots at each level of
+ * the block map, top first. Returns the number of levels of indirect blocks
+ * above the page: 0 for a direct pointer, 1 to 3 under iptr, dptr or tptr,
+ * or -1 past INODE_MAX_PAGES.
+ */
+static int inode_map_split(int fpn, int idx[3]) {
+    const int64_t slots = INODE_MAP_SLOTS;
+    int64_t page = fpn;
+
+    if (page < 2) {
+        return 0;
+    }
+    page -= 2;
+    if (page < slots) {
+        idx[0] = page;
+        return 1;
+    }
+    page -= slots;
+    if (page < slots * slots) {
+        idx[0] = page / slots;
+        idx[1] = page % slots;
+        return 2;
+    }
+    page -= slots * slots;
+    if (page < slots * slots * slots) {
+        idx[0] = page / (slots * slots);
+        idx[1] = page / slots % slots;
+        idx[2] = page % slots;
+        return 3;
+    }
+    return -1;
+}
+
+/*
+ * Returns the inode's pointer to the tree of the given number of levels.
+ */
+static int* inode_map_root(inode_t* node, int level) {
+    switch (level) {
+    case 1:
+        return &node->iptr;
+    case 2:
+        return &node->dptr;
+    default:
+        return &node->tptr;
+    }
+}
+
+/*
+ * Finds the last level block of the map holding the given file page, and
+ * the page's index in it. Returns 0 if the page is a hole all the way up.
+ */
+static int inode_map_leaf(inode_t* node, int fpn, int levels, int idx[3]) {
+    int bnum = *inode_map_root(node, levels);
+    for (int i = 0; i < levels - 1 && bnum; i++) {
+        bnum = ((int*)blocks_get_block(bnum))[idx[i]];
+    }
+    return bnum;
+}
+
+/*
+ * Makes the block of the map at *ptr ready to be changed, allocating an
+ * empty one if there is none and copying one frozen by a snapshot. parent
+ * is the block holding ptr, 0 for the inode itself. Returns the block, or
+ * -1 if no block is free.
+ */
+static int inode_map_writable(inode_t* node, int* ptr, int parent) {
+    if (*ptr && !block_frozen(*ptr)) {
+        return *ptr;
+    }
+
+    int bnum = alloc_block();
+    if (bnum < 0) {
+        return -1;
+    }
+    if (*ptr) {
+        journal_log(JR_COPY, bnum, *ptr, 0);
+        memcpy(blocks_get_block(bnum), blocks_get_block(*ptr), BLOCK_SIZE);
+        free_block(*ptr);
+    } else {
+        journal_log(JR_ZERO, bnum, 0, 0);
+        memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+    }
+
+    *ptr = bnum;
+    if (parent) {
+        journal_log(JR_PTR, parent, ptr - (int*)blocks_get_block(parent), 1);
+    } else {
+        inode_dirty(node);
+    }
+    inode_map_moved();
+    return bnum;
+}
+
+/*
+ * Returns the slot of the given file page, with the blocks of the map
+ * above it made writable, and stores the block holding it in *bnum (0 for
+ * a direct pointer). Returns null if a block could not be allocated.
+ */
+static int* inode_map_slot(inode_t* node, int fpn, int* bnum) {
+    int idx[3];
+    int levels = inode_map_split(fpn, idx);
+
+    *bnum = 0;
+    if (levels == 0) {
+        return &node->ptrs[fpn];
+    }
+    if (levels < 0) {
+        return 0;
+    }
+
+    int* ptr = inode_map_root(node, levels);
+    for (int i = 0; i < levels; i++) {
+        int block = inode_map_writable(node, ptr, *bnum);
+        if (block < 0) {
+            return 0;
+        }
+        *bnum = block;
+        ptr = (int*)blocks_get_block(block) + idx[i];
+    }
+    return ptr;
+}
+
+/*
+ * Makes the block map of a range of file pages ready to be changed, one
+ * last level block at a time.
+ */
+int inode_map_prepare(inode_t* node, int fpn, int count) {
+    if (fpn < 0 || count > INODE_MAX_PAGES - fpn) {
+        return -EFBIG;
+    }
+
+    for (int i = fpn; i < fpn + count; ) {
+        int idx[3];
+        int levels = inode_map_split(i, idx);
+        int bnum;
+        if (!inode_map_slot(node, i, &bnum)) {
+            return -ENOSPC;
+        }
+        i += levels == 0 ? 1 : INODE_MAP_SLOTS - idx[levels - 1];
+    }
+    return 0;
+}
+
+/*
+ * Walks the tree of the map under one block, which holds slots of the
+ * given level minus one. Block numbers outside the data region, which only
+ * a damaged image holds, are not followed.
+ */
+static void inode_map_walk_block(int bnum, int level, inode_map_fn fn, void* arg) {
+    superblock_t* sb = get_superblock();
+
+    if (bnum >= sb->data_block && bnum < sb->block_count) {
+        int* slots = (int*)blocks_get_block(bnum);
+        for (int i = 0; i < INODE_MAP_SLOTS; i++) {
+            if (slots[i] == 0) {
+                continue;
+            }
+            if (level > 1) {
+                inode_map_walk_block(slots[i], level - 1, fn, arg);
+            } else {
+                fn(slots[i], 0, arg);
+            }
+        }
+    }
+    fn(bnum, level, arg);
+}
+
+/*
+ * Calls fn for every slot in use in the block map of the inode.
+ */
+void inode_map_walk(inode_t* node, inode_map_fn fn, void* arg) {
+    for (int i = 0; i < 2; i++) {
+        if (node->ptrs[i]) {
+            fn(node->ptrs[i], 0, arg);
+        }
+    }
+    for (int level = 1; level <= 3; level++) {
+        int root = *inode_map_root(node, level);
+        if (root) {
+            inode_map_walk_block(root, level, fn, arg);
+        }
     }
 }
 
 /*
  * Expands the size of the inode to accommodate the given size.
  *
+ * Pages past the old end are holes until they are written.
+ *
  * Parameters:
  *   node: Pointer to the inode structure
  *   size: New size to accommodate
@@ -75,23 +453,11 @@ void free_inode(int inum) {
  * Returns:
  *   New size of the inode upon success
  */
-int grow_inode(inode_t* node, int size) {  
-    int new_blocks = bytes_to_blocks(size); 
-
-    if (new_blocks > 2) {
-        new_blocks = new_blocks - 2;
-        if (node->iptr == 0) {
-            node->iptr = alloc_block();
-        }
-        int* indirect = (int*)blocks_get_block(node->iptr); 
-
-        for (int i = 0; i < new_blocks; i++) { 
-            if (!indirect[i]) {
-                indirect[i] = alloc_block();
-            }
-        }
+int64_t grow_inode(inode_t* node, int64_t size) {  
+    if (size > node->size) {
+        node->size = size;
     }
-    node->size = size;
+    inode_dirty(node);
     return node->size;
 }
 
@@ -106,20 +472,448 @@ int grow_inode(inode_t* node, int size) {
  *   Page number corresponding to the given file page number
  */
 int inode_get_pnum(inode_t* node, int fpn) {
-    return fpn < 2 ? node->ptrs[fpn] : ((int*)blocks_get_block(node->iptr))[fpn - 2];  
+    int idx[3];
+    int levels = inode_map_split(fpn, idx);
+    if (levels == 0) {
+        return node->ptrs[fpn];
+    }
+    if (levels < 0) {
+        return 0;
+    }
+
+    int bnum = inode_map_leaf(node, fpn, levels, idx);
+    return bnum ? ((int*)blocks_get_block(bnum))[idx[levels - 1]] : 0;
 }
 
 /*
- * TODO: Shrink the size of the inode.
+ * Retrieves the page number of the given file page, going through the
+ * cache when it holds the last level block of the map for the page.
+ */
+int inode_get_pnum_cached(inode_t* node, int fpn, inode_map_cache_t* cache) {
+    // Taken before the walk, so a map moved during it leaves the entry stale
+    uint32_t gen = __atomic_load_n(&inode_map_gen, __ATOMIC_ACQUIRE);
+    if (cache->first >= 0 && cache->gen == gen &&
+        fpn >= cache->first && fpn - cache->first < INODE_MAP_SLOTS) {
+        return ((int*)blocks_get_block(cache->bnum))[fpn - cache->first];
+    }
+
+    int idx[3];
+    int levels = inode_map_split(fpn, idx);
+    if (levels == 0) {
+        return node->ptrs[fpn];
+    }
+    if (levels < 0) {
+        return 0;
+    }
+
+    int bnum = inode_map_leaf(node, fpn, levels, idx);
+    if (bnum == 0) {
+        return 0;
+    }
+    cache->gen = gen;
+    cache->first = fpn - idx[levels - 1];
+    cache->bnum = bnum;
+    return ((int*)blocks_get_block(bnum))[idx[levels - 1]];
+}
+
+/*
+ * Finds the run of pages from fpn on mapped to adjacent blocks, or holes.
+ */
+int inode_get_run(inode_t* node, int fpn, int count, inode_map_cache_t* cache, int* slot) {
+    *slot = inode_get_pnum_cached(node, fpn, cache);
+    if (*slot < 0 || tail_slot(*slot)) {
+        return 1;
+    }
+
+    int run = 1;
+    while (run < count &&
+           inode_get_pnum_cached(node, fpn + run, cache) == (*slot ? *slot + run : 0)) {
+        run++;
+    }
+    return run;
+}
+
+/*
+ * Stores a block map slot for the given file page.
+ */
+void inode_set_slot(inode_t* node, int fpn, int slot) {
+    int bnum;
+    int* ptr = inode_map_slot(node, fpn, &bnum);
+    if (!ptr) {
+        return;
+    }
+
+    *ptr = slot;
+    if (bnum) {
+        journal_log(JR_PTR, bnum, ptr - (int*)blocks_get_block(bnum), 1);
+    } else {
+        inode_dirty(node);
+    }
+}
+
+/*
+ * Points the given file page of the inode at another block, dropping the
+ * reference to the block it pointed at before, if any. The page must not
+ * be in a compressed cluster.
+ */
+static void inode_set_pnum(inode_t* node, int fpn, int pnum) {
+    int old = inode_get_pnum(node, fpn);
+    inode_set_slot(node, fpn, pnum);
+    slot_release(old);
+}
+
+/*
+ * Retrieves the page number of the given file page for writing.
+ *
+ * A block shared with other files or frozen by a snapshot is copied first,
+ * and the inode is pointed at the private copy. A hole gets a zeroed block,
+ * a compressed cluster is expanded into plain blocks first, and a packed
+ * tail gets a block of its own.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   fpn: File page number
+ *
+ * Returns:
+ *   Page number that can be written, or -1 if no block is free for the copy
+ *   or the compressed cluster cannot be read
+ */
+int inode_cow_pnum(inode_t* node, int fpn) {
+    if (cluster_inflate(node, fpn) < 0) {
+        return -1;
+    }
+
+    int pnum = inode_get_pnum(node, fpn);
+    if (tail_slot(pnum)) {
+        int bnum = tail_promote(node, fpn);
+        return bnum < 0 ? -1 : bnum;
+    }
+    if (pnum && block_refs(pnum) == 1 && !block_frozen(pnum)) {
+        return pnum;
+    }
+
+    if (inode_map_prepare(node, fpn, 1) < 0) {
+        return -1;
+    }
+    int copy = alloc_block();
+    if (copy < 0) {
+        return -1;
+    }
+    if (pnum == 0) {
+        memset(blocks_get_block(copy), 0, BLOCK_SIZE);
+    } else {
+        // Directory blocks are pinned metadata, so their copy is journaled
+        if (blocks_pinned(pnum)) {
+            journal_log(JR_COPY, copy, pnum, 0);
+        }
+        memcpy(blocks_get_block(copy), blocks_get_block(pnum), BLOCK_SIZE);
+    }
+    inode_set_pnum(node, fpn, copy);
+    return copy;
+}
+
+/*
+ * Makes a range of one inode share the blocks of a range of another.
+ *
+ * Offsets must be block aligned, and the destination range may not start
+ * past the destination's last block. The length must be block aligned too,
+ * unless the range runs to the end of the source and at least to the end of
+ * the destination.
+ * Blocks previously mapped in the destination range are released.
+ * Compressed clusters are shared whole: if the source range holds one, the
+ * offsets must be aligned to clusters, and so must the length unless the
+ * range runs to the end of the source.
+ *
+ * Parameters:
+ *   dst: Inode to clone into
+ *   dst_off: Offset in the destination
+ *   src: Inode to clone from
+ *   src_off: Offset in the source
+ *   len: Bytes to clone, 0 meaning up to the end of the source
+ *
+ * Returns:
+ *   Number of bytes cloned upon success, a negative errno otherwise
+ */
+int64_t inode_clone(inode_t* dst, int64_t dst_off, inode_t* src, int64_t src_off, int64_t len) {
+    if (src_off % BLOCK_SIZE || dst_off % BLOCK_SIZE || src_off > src->size ||
+        dst_off > (int64_t)bytes_to_blocks(dst->size) * BLOCK_SIZE) {
+        return -EINVAL;
+    }
+    if (len == 0 || src_off + len > src->size) {
+        len = src->size - src_off;
+    }
+
+    int to_eof = src_off + len == src->size && dst_off + len >= dst->size;
+    if (len % BLOCK_SIZE && !to_eof) {
+        return -EINVAL;
+    }
+    if (dst == src && dst_off < src_off + len && src_off < dst_off + len) {
+        return -EINVAL;
+    }
+
+    if (dst_off + len > (int64_t)INODE_MAX_PAGES * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+    int src_fpn = src_off / BLOCK_SIZE;
+    int dst_fpn = dst_off / BLOCK_SIZE;
+    int pages = bytes_to_blocks(len);
+
+    // The destination range is overwritten, so its compressed clusters are
+    // expanded first
+    for (int i = 0; i < pages; i++) {
+        int rv = cluster_inflate(dst, dst_fpn + i);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+
+    // Compressed clusters of the source are shared whole, so they have to
+    // line up with the destination's
+    int packed = 0;
+    for (int i = 0; i < pages; i++) {
+        packed |= cluster_compressed(src, src_fpn + i);
+    }
+    if (packed) {
+        if (src_fpn % CLUSTER_PAGES || dst_fpn % CLUSTER_PAGES ||
+            (pages % CLUSTER_PAGES && !to_eof)) {
+            return -EINVAL;
+        }
+        pages = (pages + CLUSTER_PAGES - 1) / CLUSTER_PAGES * CLUSTER_PAGES;
+    }
+
+    int rv = inode_map_prepare(dst, dst_fpn, pages);
+    if (rv < 0) {
+        return rv;
+    }
+
+    for (int i = 0; i < pages; i++) {
+        // A packed tail gets units of its own, or a block past the
+        // direct pointers
+        int slot = inode_get_pnum(src, src_fpn + i);
+        if (tail_slot(slot)) {
+            slot = tail_copy(slot, dst_fpn + i >= 2);
+            if (slot < 0) {
+                return slot;
+            }
+        } else if (slot_block(slot)) {
+            int rv = block_share(slot_block(slot));
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        int old = inode_get_pnum(dst, dst_fpn + i);
+        inode_set_slot(dst, dst_fpn + i, slot);
+        slot_release(old);
+    }
+
+    if (dst_off + len > dst->size) {
+        dst->size = dst_off + len;
+    }
+    dst->time = time(0);
+    inode_dirty(dst);
+    return len;
+}
+
+/*
+ * Releases the file pages from keep on in the tree of the map under *ptr,
+ * which maps the pages from first on and has the given number of levels of
+ * blocks, 0 for a single data slot. parent is the block holding ptr, 0 for
+ * the inode itself. A tree wholly past keep is released like the map of a
+ * freed inode. Returns -1 if a block of the map could not be copied.
+ */
+static int inode_map_trim(inode_t* node, int* ptr, int parent, int level, int64_t first, int64_t keep) {
+    int64_t child = 1;
+    for (int i = 1; i < level; i++) {
+        child *= INODE_MAP_SLOTS;
+    }
+
+    if (first >= keep) {
+        if (level > 0) {
+            inode_map_walk_block(*ptr, level, inode_free_slot, 0);
+        } else {
+            slot_release(*ptr);
+        }
+        *ptr = 0;
+        if (parent) {
+            journal_log(JR_PTR, parent, ptr - (int*)blocks_get_block(parent), 1);
+        } else {
+            inode_dirty(node);
+        }
+        return 0;
+    }
+    if (level == 0 || first + child * INODE_MAP_SLOTS <= keep) {
+        return 0;
+    }
+
+    int bnum = inode_map_writable(node, ptr, parent);
+    if (bnum < 0) {
+        return -1;
+    }
+    for (int i = (keep - first) / child; i < INODE_MAP_SLOTS; i++) {
+        int* slot = (int*)blocks_get_block(bnum) + i;
+        if (*slot && inode_map_trim(node, slot, bnum, level - 1, first + i * child, keep) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Shrinks the size of the inode by the specified amount.
+ *
+ * The pages past the new end are released, dropping a reference to each
+ * block like free_inode(), and the blocks of the map left empty go with
+ * them. The rest of the new last page is zeroed, so the file reads as
+ * zeros there if it grows again. A compressed cluster the new end falls
+ * in is expanded first.
  *
  * Parameters:
  *   node: Pointer to the inode structure
  *   size: Size to shrink
  *
  * Returns:
- *   0 upon success
+ *   0 upon success, -ENOSPC if no block is free for a copy or -EIO
  */
-int shrink_inode(inode_t* node, int size) {  
-    node->size = node->size - size;
+int shrink_inode(inode_t* node, int64_t size) {
+    int64_t end = node->size - size;
+    int64_t keep = bytes_to_blocks(end);
+    int in_page = end % BLOCK_SIZE;
+
+    if (keep % CLUSTER_PAGES && cluster_compressed(node, keep)) {
+        int rv = cluster_inflate(node, keep);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    if (in_page && inode_get_pnum(node, keep - 1)) {
+        int bnum = inode_cow_pnum(node, keep - 1);
+        if (bnum < 0) {
+            return -ENOSPC;
+        }
+        blocks_dirty(bnum);
+        memset((char*)blocks_get_block(bnum) + in_page, 0, BLOCK_SIZE - in_page);
+        checksum_seal(bnum);
+    }
+
+    int rv = 0;
+    for (int i = keep; i < 2 && rv == 0; i++) {
+        if (node->ptrs[i]) {
+            rv = inode_map_trim(node, &node->ptrs[i], 0, 0, i, keep);
+        }
+    }
+    int64_t first = 2;
+    int64_t span = INODE_MAP_SLOTS;
+    for (int level = 1; level <= 3 && rv == 0; level++) {
+        int* root = inode_map_root(node, level);
+        if (*root) {
+            rv = inode_map_trim(node, root, 0, level, first, keep);
+        }
+        first += span;
+        span *= INODE_MAP_SLOTS;
+    }
+    inode_map_moved();
+    if (rv < 0) {
+        return -ENOSPC;
+    }
+
+    node->size = end;
+    inode_dirty(node);
     return 0;
 }
+
+/*
+ * Records the given inode as modified in the current transaction.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *
+ * Returns:
+ *   None
+ */
+void inode_dirty(inode_t* node) {
+    journal_log(JR_INODE, 0, node - get_inode(0), 1);
+}
+
+/*
+ * Counts a block of the map or the data of an inode.
+ */
+static void inode_count_slot(int slot, int level, void* arg) {
+    if (slot_block(slot)) {
+        *(int*)arg += 1;
+    }
+}
+
+/*
+ * Counts the blocks holding the inode's data and block map.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *
+ * Returns:
+ *   Number of blocks
+ */
+int inode_blocks(inode_t* node) {
+    int count = 0;
+    inode_map_walk(node, inode_count_slot, &count);
+    return count;
+}
+
+// Blocks for inode_sync() to write back
+typedef struct inode_sync_list {
+    int* bnums;
+    int count;
+    int cap;
+} inode_sync_list_t;
+
+/*
+ * Adds a data block of an inode to the list to write back. Blocks of the
+ * map are pinned metadata, which the checkpoint writes back instead.
+ */
+static void inode_sync_slot(int slot, int level, void* arg) {
+    inode_sync_list_t* list = arg;
+    if (level > 0 || !slot_block(slot)) {
+        return;
+    }
+    if (list->count == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 64;
+        list->bnums = realloc(list->bnums, list->cap * sizeof(int));
+    }
+    list->bnums[list->count++] = slot_block(slot);
+}
+
+/*
+ * Flushes the data and metadata of the given inode to the image.
+ *
+ * Data blocks are written back first, then the journal is committed, so a
+ * committed size never covers data that has not reached the image.
+ * blocks_sync() skips the data blocks that are still clean.
+ *
+ * Parameters:
+ *   inum: Inode number to flush
+ *
+ * Returns:
+ *   0 upon success, a negative errno otherwise
+ */
+int inode_sync(int inum) {
+    inode_t* node = get_inode(inum);
+    int rv = 0;
+
+    if (!S_ISDIR(node->mode)) {
+        superblock_t* sb = get_superblock();
+        inode_sync_list_t list = { 0, 0, 0 };
+        inode_map_walk(node, inode_sync_slot, &list);
+
+        // Their checksums go with them
+        for (int i = 0; i < sb->csum_blocks; i++) {
+            inode_sync_slot(sb->csum_block + i, 0, &list);
+        }
+
+        rv = blocks_sync(list.bnums, list.count);
+        free(list.bnums);
+    }
+
+    if (rv == 0) {
+        rv = journal_commit();
+    }
+    return rv;
+}
@@ -7,18 +7,70 @@
 
 #include "blocks.h"
 
+// File data is compressed (see compress.h); new entries of a directory
+// with this flag inherit it
+#define INODE_COMPRESS 0x1
+
+// Block map slots per indirect block
+#define INODE_MAP_SLOTS (BLOCK_SIZE / (int)sizeof(int))
+// File pages reachable through the direct, single, double and triple
+// indirect pointers: a little over 4 TiB of data with 4 KiB blocks. Page
+// numbers are ints, so larger blocks stop at INT_MAX pages.
+#define INODE_MAX_PAGES inode_max_pages()
+
 /*
  * Represents an Inode structure for a filesystem.
+ *
+ * Inodes are 128 bytes, so that none straddles two inode table blocks.
+ *
+ * The block map starts with two direct pointers. The pages after them are
+ * mapped by a tree of indirect blocks of INODE_MAP_SLOTS slots each: one
+ * level under iptr, two under dptr and three under tptr. Missing blocks
+ * of the tree, like missing data blocks, are holes.
  */
 typedef struct inode {
     int refs;            // Number of references to this inode
     int32_t mode;        // File mode (permissions and type)
-    int size;            // Size of the file in bytes
+    int64_t size;        // Size of the file in bytes
     int ptrs[2];         // Direct pointers to data blocks
     int iptr;            // Indirect pointer to additional data blocks
+    int dptr;            // Double indirect pointer
+    int tptr;            // Triple indirect pointer
+    uint32_t flags;      // INODE_* flags
     time_t time;         // Last modification time
+    int32_t xattr;       // Block of extended attributes, 0 if none
+    uint8_t xattr_inline[76]; // Extended attributes stored inline (see xattr.h)
 } inode_t;
 
+/*
+ * Remembers the last block of the block map a lookup went through, so
+ * that lookups of nearby pages skip the walk down the tree.
+ */
+typedef struct inode_map_cache {
+    uint32_t gen;        // Block map generation the entry is valid for
+    int first;           // First file page mapped by bnum, -1 if empty
+    int bnum;            // Last level block of the map holding first
+} inode_map_cache_t;
+
+/*
+ * Called by inode_map_walk() for each slot in use. Level 0 slots refer to
+ * data, the others to blocks of the map itself.
+ */
+typedef void (*inode_map_fn)(int slot, int level, void* arg);
+
+/*
+ * Hands out the home groups alloc_inode() starts from in turn again, from
+ * the first group, for a newly mounted image. The first thread to allocate
+ * an inode then starts from inode 0, so formatting makes it the root.
+ */
+void inode_reset_homes();
+
+/*
+ * Returns the number of file pages the block map can reach, see
+ * INODE_MAX_PAGES.
+ */
+int inode_max_pages();
+
 /*
  * Prints the attributes of the given inode.
  *
@@ -73,19 +125,21 @@ void free_inode(int inum);
  * Returns:
  *   New size of the inode upon success
  */
-int grow_inode(inode_t* node, int size);
+int64_t grow_inode(inode_t* node, int64_t size);
 
 /*
- * Shrinks the size of the inode by the specified amount.
+ * Shrinks the size of the inode by the specified amount, releasing the
+ * pages past its new end and zeroing the rest of its new last page. Must
+ * be called inside a transaction.
  *
  * Parameters:
  *   node: Pointer to the inode structure
  *   size: Size to shrink
  *
  * Returns:
- *   0 upon success
+ *   0 upon success, -ENOSPC if no block is free for a copy or -EIO
  */
-int shrink_inode(inode_t* node, int size);
+int shrink_inode(inode_t* node, int64_t size);
 
 /*
  * Retrieves the page number of the given inode based on the file page number.
@@ -95,9 +149,207 @@ int shrink_inode(inode_t* node, int size);
  *   fpn: File page number
  *
  * Returns:
- *   Page number corresponding to the given file page number
+ *   Block map slot of the page: a page number, 0 for a hole, a negative
+ *   value inside a compressed cluster (see compress.h), or a packed tail
+ *   from TAIL_SLOT on (see tail.h)
  */
 int inode_get_pnum(inode_t* node, int fpn);
 
+/*
+ * Retrieves the block map slot of the given file page like
+ * inode_get_pnum(), going through the given cache.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   fpn: File page number
+ *   cache: Cache entry, with first set to -1 before its first use
+ *
+ * Returns:
+ *   Block map slot of the page
+ */
+int inode_get_pnum_cached(inode_t* node, int fpn, inode_map_cache_t* cache);
+
+/*
+ * Finds the run of file pages starting at fpn that are mapped to adjacent
+ * blocks, or are all holes, going through the given cache.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   fpn: First file page
+ *   count: Most pages the run may have
+ *   cache: Cache entry, as for inode_get_pnum_cached()
+ *   slot: Where to store the block map slot of the first page
+ *
+ * Returns:
+ *   Number of pages in the run; a page of a compressed cluster or a packed
+ *   tail is a run of its own
+ */
+int inode_get_run(inode_t* node, int fpn, int count, inode_map_cache_t* cache, int* slot);
+
+/*
+ * Stores a block map slot for the given file page, without releasing the
+ * block it held before.
+ *
+ * The block map must already be writable there, see inode_map_prepare().
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   fpn: File page number
+ *   slot: Value to store
+ *
+ * Returns:
+ *   None
+ */
+void inode_set_slot(inode_t* node, int fpn, int slot);
+
+/*
+ * Makes the block map of a range of file pages ready to be changed.
+ *
+ * Missing indirect blocks on the way are allocated empty, and those frozen
+ * by a snapshot are copied first.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   fpn: First file page
+ *   count: Number of pages
+ *
+ * Returns:
+ *   0 upon success, -EFBIG past INODE_MAX_PAGES or -ENOSPC if no block is
+ *   free
+ */
+int inode_map_prepare(inode_t* node, int fpn, int count);
+
+/*
+ * Calls fn for every slot in use in the block map of the inode, blocks of
+ * the map after the slots they hold.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   fn: Function to call
+ *   arg: Passed on to fn
+ *
+ * Returns:
+ *   None
+ */
+void inode_map_walk(inode_t* node, inode_map_fn fn, void* arg);
+
+/*
+ * Counts the blocks holding the inode's data and block map.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *
+ * Returns:
+ *   Number of blocks
+ */
+int inode_blocks(inode_t* node);
+
+/*
+ * Retrieves the page number of the given file page for writing, copying a
+ * block shared with other files first.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   fpn: File page number
+ *
+ * Returns:
+ *   Page number that can be written, or -1 if no block is free for the copy
+ */
+int inode_cow_pnum(inode_t* node, int fpn);
+
+/*
+ * Makes a range of one inode share the blocks of a range of another.
+ *
+ * Parameters:
+ *   dst: Inode to clone into
+ *   dst_off: Block aligned offset in the destination
+ *   src: Inode to clone from
+ *   src_off: Block aligned offset in the source
+ *   len: Bytes to clone, 0 meaning up to the end of the source
+ *
+ * Returns:
+ *   Number of bytes cloned upon success, a negative errno otherwise
+ */
+int64_t inode_clone(inode_t* dst, int64_t dst_off, inode_t* src, int64_t src_off, int64_t len);
+
+/*
+ * Records the given inode as modified in the current transaction.
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *
+ * Returns:
+ *   None
+ */
+void inode_dirty(inode_t* node);
+
+/*
+ * Flushes the data and metadata blocks of the given inode to the image.
+ *
+ * Parameters:
+ *   inum: Inode number to flush
+ *
+ * Returns:
+ *   0 upon success, a negative errno otherwise
+ */
+int inode_sync(int inum);
+
+/*
+ * Takes the lock on the data and block map of the given inode, shared for
+ * reading them and exclusive for changing them. A write, a truncate, the
+ * compression of a cluster and the packing of a tail hold it exclusive, so
+ * a read never finds a block freed or moved under it. Inodes of a snapshot
+ * never change and take no lock. Holding one exclusive also holds off
+ * dedup_page() from sharing a block while it is written (see dedup.h).
+ *
+ * Inside a transaction, the lock is taken after journal_begin() and
+ * dropped before journal_end().
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   exclusive: Whether to take the lock exclusive
+ *
+ * Returns:
+ *   None
+ */
+void inode_lock(inode_t* node, int exclusive);
+
+/*
+ * Takes the locks of two inodes, the first exclusive and the second shared,
+ * in an order that cannot deadlock.
+ *
+ * Parameters:
+ *   dst: Inode that is changed
+ *   src: Inode that is read
+ *
+ * Returns:
+ *   None
+ */
+void inode_lock_pair(inode_t* dst, inode_t* src);
+
+/*
+ * Releases the lock taken by inode_lock().
+ *
+ * Parameters:
+ *   node: Pointer to the inode structure
+ *   exclusive: Whether the lock was taken exclusive
+ *
+ * Returns:
+ *   None
+ */
+void inode_unlock(inode_t* node, int exclusive);
+
+/*
+ * Releases the locks taken by inode_lock_pair().
+ *
+ * Parameters:
+ *   dst: Inode that was changed
+ *   src: Inode that was read
+ *
+ * Returns:
+ *   None
+ */
+void inode_unlock_pair(inode_t* dst, inode_t* src);
+
 #endif
 
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "io.h"
+#include "blocks.h"
+#include "inode.h"
+#include "compress.h"
+#include "checksum.h"
+#include "tier.h"
+#include "tail.h"
+
+/*
+ * Represents functions for copying file data between requests and the
+ * image, a run of pages at a time.
+ *
+ * The data paths are compiled once for each block size, with the block
+ * shift a constant, so page numbers and offsets within pages are shifts
+ * and masks. io_init() picks the variant for the mounted image.
+ */
+
+// Keeps the data paths specialized for each block size apart
+#define IO_INLINE static inline __attribute__((always_inline))
+
+/*
+ * Returns the number of bytes of a run of pages, starting at in_page in
+ * its first page, that a request with left bytes to go covers.
+ */
+IO_INLINE size_t io_run_bytes(int run, int in_page, size_t left, int shift)
+{
+    size_t bytes = ((size_t)run << shift) - in_page;
+    return bytes < left ? bytes : left;
+}
+
+/*
+ * Returns the number of pages bytes span from the start of a page.
+ */
+IO_INLINE int io_pages(size_t bytes, int shift)
+{
+    return (bytes + ((size_t)1 << shift) - 1) >> shift;
+}
+
+/*
+ * Reads up to size bytes at offset, stopping at the end of the file.
+ */
+IO_INLINE int io_read_sized(inode_t* node, char* buf, size_t size, off_t offset,
+                            inode_map_cache_t* map, int shift)
+{
+    const off_t mask = ((off_t)1 << shift) - 1;
+
+    if (offset >= node->size) {
+        return 0;
+    }
+    if (size > node->size - offset) {
+        size = node->size - offset;
+    }
+
+    size_t pos = 0;
+    while (pos < size) {
+        int fpn = (offset + pos) >> shift;
+        int in_page = (offset + pos) & mask;
+        int slot;
+        int run = inode_get_run(node, fpn, io_pages(in_page + size - pos, shift), map, &slot);
+        size_t len = io_run_bytes(run, in_page, size - pos, shift);
+
+        if (tail_slot(slot)) {
+            if (tail_read(slot, buf + pos, in_page, len) < 0) {
+                return -EIO;
+            }
+        } else if (slot > 0) {
+            // A run across stripe units reads from every member at once
+            blocks_prefetch(slot, run);
+            for (int ii = 0; ii < run; ++ii) {
+                if (checksum_verify(slot + ii) < 0) {
+                    return -EIO;
+                }
+            }
+            memcpy(buf + pos, (char*)blocks_get_block(slot) + in_page, len);
+            tier_touch(slot, run);
+        } else if (slot == 0) {
+            memset(buf + pos, 0, len);
+        } else {
+            char page[(size_t)1 << shift];
+            if (cluster_read_page(node, fpn, page) < 0) {
+                return -EIO;
+            }
+            memcpy(buf + pos, page + in_page, len);
+        }
+        pos += len;
+    }
+    return pos;
+}
+
+/*
+ * Returns how many of the run of adjacent blocks from bnum on may be
+ * written in place, counting from the first, or, if the first may not, how
+ * many may not.
+ */
+IO_INLINE int io_in_place(int bnum, int run, int* in_place)
+{
+    *in_place = block_refs(bnum) == 1 && !block_frozen(bnum);
+
+    int count = 1;
+    while (count < run &&
+           (block_refs(bnum + count) == 1 && !block_frozen(bnum + count)) == *in_place) {
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Fills a fresh block with the old one's bytes, or zeros if there is none.
+ */
+IO_INLINE void io_keep(int bnum, int old, int shift)
+{
+    if (old) {
+        memcpy(blocks_get_block(bnum), blocks_get_block(old), (size_t)1 << shift);
+    } else {
+        memset(blocks_get_block(bnum), 0, (size_t)1 << shift);
+    }
+}
+
+/*
+ * Points a run of pages at fresh adjacent blocks, keeping the bytes of the
+ * first and last pages the write leaves alone. old is the first slot of
+ * the run, 0 for holes. Returns the first fresh block, storing the number
+ * of pages it starts in *run, or -ENOSPC.
+ */
+IO_INLINE int io_replace(inode_t* node, int fpn, int* run, int old, int in_page, size_t len,
+                         int shift)
+{
+    if (inode_map_prepare(node, fpn, *run) < 0) {
+        return -ENOSPC;
+    }
+    int got;
+    int first = alloc_extent(*run, &got);
+    if (first < 0) {
+        return -ENOSPC;
+    }
+    if (got < *run) {
+        *run = got;
+        len = io_run_bytes(got, in_page, len, shift);
+    }
+
+    // The write covers every page whole but maybe the first and the last
+    int last = got - 1;
+    int ragged = ((in_page + len) & (((size_t)1 << shift) - 1)) != 0;
+    if (in_page > 0 || (last == 0 && ragged)) {
+        io_keep(first, old, shift);
+    }
+    if (last > 0 && ragged) {
+        io_keep(first + last, old ? old + last : 0, shift);
+    }
+
+    for (int ii = 0; ii < got; ++ii) {
+        inode_set_slot(node, fpn + ii, first + ii);
+        if (old) {
+            free_block(old + ii);
+        }
+    }
+    return first;
+}
+
+/*
+ * Writes size bytes at offset, growing the file if needed.
+ */
+IO_INLINE int io_write_sized(inode_t* node, const char* buf, size_t size, off_t offset,
+                             inode_map_cache_t* map, int shift)
+{
+    const off_t mask = ((off_t)1 << shift) - 1;
+
+    size_t pos = 0;
+    while (pos < size) {
+        int fpn = (offset + pos) >> shift;
+        int in_page = (offset + pos) & mask;
+        int slot;
+        int run = inode_get_run(node, fpn, io_pages(in_page + size - pos, shift), map, &slot);
+        int bnum;
+
+        if (tail_slot(slot)) {
+            // A packed tail is written in place while the write fits in its
+            // units, and gets a block of its own again once it outgrows them
+            size_t len = io_run_bytes(1, in_page, size - pos, shift);
+            if (tail_write(slot, buf + pos, in_page, len) == 0) {
+                pos += len;
+                continue;
+            }
+            bnum = tail_promote(node, fpn);
+        } else if (slot < 0) {
+            // A compressed cluster is expanded first
+            bnum = inode_cow_pnum(node, fpn);
+        } else {
+            int in_place = 0;
+            if (slot > 0) {
+                run = io_in_place(slot, run, &in_place);
+            }
+            bnum = in_place ? slot : io_replace(node, fpn, &run, slot, in_page,
+                                                io_run_bytes(run, in_page, size - pos, shift),
+                                                shift);
+        }
+        if (bnum < 0) {
+            break;
+        }
+
+        size_t len = io_run_bytes(run, in_page, size - pos, shift);
+        for (int ii = 0; ii < run; ++ii) {
+            blocks_dirty(bnum + ii);
+        }
+        memcpy((char*)blocks_get_block(bnum) + in_page, buf + pos, len);
+        for (int ii = 0; ii < run; ++ii) {
+            checksum_seal(bnum + ii);
+        }
+        tier_touch(bnum, run);
+        pos += len;
+    }
+
+    if (pos == 0 && size > 0) {
+        return -ENOSPC;
+    }
+    if (offset + (off_t)pos > node->size) {
+        node->size = offset + pos;
+        inode_dirty(node);
+    }
+    return pos;
+}
+
+// The variants for 4, 16 and 64 KiB blocks
+#define IO_SIZED(shift)                                                          \
+    static int io_read_##shift(inode_t* node, char* buf, size_t size, off_t offset, \
+                               inode_map_cache_t* map)                           \
+    {                                                                            \
+        return io_read_sized(node, buf, size, offset, map, shift);               \
+    }                                                                            \
+    static int io_write_##shift(inode_t* node, const char* buf, size_t size,     \
+                                off_t offset, inode_map_cache_t* map)            \
+    {                                                                            \
+        return io_write_sized(node, buf, size, offset, map, shift);              \
+    }
+
+IO_SIZED(12)
+IO_SIZED(14)
+IO_SIZED(16)
+
+static int (*io_read_fn)(inode_t*, char*, size_t, off_t, inode_map_cache_t*) = io_read_12;
+static int (*io_write_fn)(inode_t*, const char*, size_t, off_t, inode_map_cache_t*) = io_write_12;
+
+/*
+ * Picks the data paths for blocks of 1 << shift bytes.
+ */
+void io_init(int shift)
+{
+    switch (shift) {
+    case 14:
+        io_read_fn = io_read_14;
+        io_write_fn = io_write_14;
+        break;
+    case 16:
+        io_read_fn = io_read_16;
+        io_write_fn = io_write_16;
+        break;
+    default:
+        io_read_fn = io_read_12;
+        io_write_fn = io_write_12;
+    }
+}
+
+int io_read(inode_t* node, char* buf, size_t size, off_t offset, inode_map_cache_t* map)
+{
+    // Pages may not be written, freed or moved to the other tier under
+    // the read
+    inode_lock(node, 0);
+    tier_read_begin();
+    int rv = io_read_fn(node, buf, size, offset, map);
+    tier_read_end();
+    inode_unlock(node, 0);
+    return rv;
+}
+
+int io_write(inode_t* node, const char* buf, size_t size, off_t offset, inode_map_cache_t* map)
+{
+    return io_write_fn(node, buf, size, offset, map);
+}
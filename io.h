@@ -0,0 +1,46 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "inode.h"
+
+/*
+ * Represents the data paths of reads and writes.
+ *
+ * A request is cut into runs of pages (see inode_get_run()): pages mapped
+ * to adjacent blocks, runs of holes, or single pages of compressed
+ * clusters. Each run is copied with one memcpy() from or to the mapped
+ * image, the first and last pages cut to the bytes the request covers.
+ *
+ * Writes go in place to the blocks only this file holds. Holes, and blocks
+ * shared with other files or frozen by a snapshot, are replaced by runs of
+ * fresh adjacent blocks; the bytes of their first and last pages that the
+ * request does not cover are taken from the old block, or zeros.
+ */
+
+/*
+ * Picks the data paths specialized for blocks of 1 << shift bytes: 12, 14
+ * or 16. Called by blocks_init() once the block size is known.
+ */
+void io_init(int shift);
+
+/*
+ * Reads up to size bytes at offset into buf, stopping at the end of the
+ * file. The cache is the one of inode_get_pnum_cached().
+ *
+ * Returns the number of bytes read or -EIO.
+ */
+int io_read(inode_t* node, char* buf, size_t size, off_t offset, inode_map_cache_t* map);
+
+/*
+ * Writes size bytes from buf at offset, growing the file if it ends
+ * before them. Must be called inside a transaction.
+ *
+ * Returns the number of bytes written, short if blocks ran out part way,
+ * or -ENOSPC if none could be.
+ */
+int io_write(inode_t* node, const char* buf, size_t size, off_t offset, inode_map_cache_t* map);
+
+#endif
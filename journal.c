@@ -0,0 +1,759 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "directory.h"
+#include "snapshot.h"
+
+// Identifies the journal header ("JRNL") and each transaction ("TXN1")
+#define JOURNAL_MAGIC 0x4c4e524a
+#define TXN_MAGIC     0x314e5854
+
+// Commit as soon as this many bytes of transactions are buffered
+static const int COMMIT_BYTES = 8192;
+// Seconds between background commits
+static const int COMMIT_INTERVAL = 5;
+
+/*
+ * The first journal block holds the header; transactions are appended
+ * back to back in the blocks after it. Replay starts at the first one and
+ * stops at the first transaction that is torn, stale or out of sequence.
+ */
+typedef struct journal_header {
+    uint32_t magic;       // JOURNAL_MAGIC
+    uint32_t reserved;
+    uint64_t start_txid;  // Id of the first transaction in the journal
+} journal_header_t;
+
+typedef struct journal_txn {
+    uint32_t magic;       // TXN_MAGIC
+    uint32_t size;        // Bytes including this header
+    uint64_t txid;        // Sequence number
+    uint32_t checksum;    // Of the whole transaction with this field zeroed
+    uint32_t count;       // Number of records that follow
+} journal_txn_t;
+
+// Each record is followed by its payload, see rec_payload_size()
+typedef struct journal_rec {
+    uint32_t type;        // JR_*
+    uint32_t bnum;        // Target block
+    uint32_t index;       // First item
+    uint32_t count;       // Number of items
+} journal_rec_t;
+
+// Held shared by open transactions and exclusively by checkpoints
+static pthread_rwlock_t txn_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// The calling thread's open transaction
+static __thread int txn_depth = 0;
+static __thread journal_rec_t* txn_recs = 0;
+static __thread int txn_count = 0;
+static __thread int txn_cap = 0;
+
+// Protects everything below
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  journal_cond = PTHREAD_COND_INITIALIZER;
+
+// Ended transactions waiting for the next commit
+static uint8_t* pending = 0;
+static int pending_len = 0;
+static int pending_cap = 0;
+
+static uint64_t next_txid = 0;   // Id of the next transaction to end
+static int journal_head = 0;     // Bytes of the journal area in use
+
+static int  commit_busy    = 0;  // a group commit is being written
+static long commit_started = 0;  // number of group commits started
+static long commit_done    = 0;  // number of group commits finished
+static int  commit_rv      = 0;  // result of the last finished commit
+
+// Pinned blocks to release at the next checkpoint
+static int* deferred = 0;
+static int deferred_count = 0;
+static int deferred_cap = 0;
+
+// Whether the blocks of the inodes are pinned, see journal_pin_lazy()
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+static int inodes_pinned = 0;
+
+static pthread_t journal_thread;
+static pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
+static int thread_running = 0;
+static int thread_stop = 0;
+
+/*
+ * Returns the journal header.
+ */
+static journal_header_t* journal_header()
+{
+    return blocks_get_block(get_superblock()->journal_block);
+}
+
+/*
+ * Returns the start of the area transactions are written to.
+ */
+static uint8_t* journal_data()
+{
+    return blocks_get_block(get_superblock()->journal_block + 1);
+}
+
+/*
+ * Returns the size of the area transactions are written to.
+ */
+static int journal_capacity()
+{
+    return (get_superblock()->journal_blocks - 1) * BLOCK_SIZE;
+}
+
+/*
+ * FNV-1a over the given bytes.
+ */
+static uint32_t journal_checksum(const uint8_t* data, int len)
+{
+    uint32_t hash = 2166136261u;
+    for (int ii = 0; ii < len; ++ii) {
+        hash = (hash ^ data[ii]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Returns the number of payload bytes following the given record.
+ */
+static int rec_payload_size(const journal_rec_t* rec)
+{
+    switch (rec->type) {
+    case JR_ALLOC:
+        return (rec->count + 7) / 8;
+    case JR_INODE:
+        return rec->count * sizeof(inode_t);
+    case JR_DIRENT:
+        return rec->count * sizeof(dirent_t);
+    case JR_PTR:
+        return rec->count * sizeof(int);
+    case JR_REF:
+        return rec->count * sizeof(uint16_t);
+    case JR_SNAP:
+        return rec->count * sizeof(snapshot_t);
+    case JR_XATTR:
+        return rec->count;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Copies the current contents described by the record into its payload.
+ */
+static void rec_capture(const journal_rec_t* rec, uint8_t* payload)
+{
+    switch (rec->type) {
+    case JR_ALLOC: {
+        void* bm = blocks_get_block(rec->bnum);
+        memset(payload, 0, rec_payload_size(rec));
+        for (int ii = 0; ii < rec->count; ++ii) {
+            bitmap_put(payload, ii, bitmap_get(bm, rec->index + ii));
+        }
+        break;
+    }
+    case JR_INODE:
+        memcpy(payload, get_inode(rec->index), rec_payload_size(rec));
+        break;
+    case JR_DIRENT:
+        memcpy(payload, (dirent_t*)blocks_get_block(rec->bnum) + rec->index, rec_payload_size(rec));
+        break;
+    case JR_PTR:
+        memcpy(payload, (int*)blocks_get_block(rec->bnum) + rec->index, rec_payload_size(rec));
+        break;
+    case JR_REF:
+        memcpy(payload, (uint16_t*)blocks_get_block(rec->bnum) + rec->index, rec_payload_size(rec));
+        break;
+    case JR_SNAP:
+        memcpy(payload, (snapshot_t*)blocks_get_block(rec->bnum) + rec->index, rec_payload_size(rec));
+        break;
+    case JR_XATTR:
+        memcpy(payload, (uint8_t*)blocks_get_block(rec->bnum) + rec->index, rec->count);
+        break;
+    }
+}
+
+/*
+ * Redoes the record from its payload. Records hold after-images, so
+ * applying one twice is harmless.
+ */
+static void rec_apply(const journal_rec_t* rec, const uint8_t* payload)
+{
+    if (rec->type == JR_FREE) {
+        // Released by the checkpoint that ends the replay
+        journal_free_later(rec->bnum);
+        return;
+    }
+
+    if (rec->type != JR_INODE) {
+        blocks_pin(rec->bnum);
+        blocks_dirty(rec->bnum);
+    }
+
+    switch (rec->type) {
+    case JR_ALLOC: {
+        void* bm = blocks_get_block(rec->bnum);
+        for (int ii = 0; ii < rec->count; ++ii) {
+            bitmap_put(bm, rec->index + ii, bitmap_get((void*)payload, ii));
+        }
+        break;
+    }
+    case JR_INODE:
+        memcpy(get_inode(rec->index), payload, rec_payload_size(rec));
+        for (int ii = 0; ii < rec->count; ++ii) {
+            blocks_dirty(blocks_get_bnum(get_inode(rec->index + ii)));
+        }
+        break;
+    case JR_DIRENT:
+        memcpy((dirent_t*)blocks_get_block(rec->bnum) + rec->index, payload, rec_payload_size(rec));
+        break;
+    case JR_PTR:
+        memcpy((int*)blocks_get_block(rec->bnum) + rec->index, payload, rec_payload_size(rec));
+        break;
+    case JR_REF:
+        memcpy((uint16_t*)blocks_get_block(rec->bnum) + rec->index, payload, rec_payload_size(rec));
+        break;
+    case JR_SNAP:
+        memcpy((snapshot_t*)blocks_get_block(rec->bnum) + rec->index, payload, rec_payload_size(rec));
+        break;
+    case JR_XATTR:
+        memcpy((uint8_t*)blocks_get_block(rec->bnum) + rec->index, payload, rec->count);
+        break;
+    case JR_ZERO:
+        memset(blocks_get_block(rec->bnum), 0, BLOCK_SIZE);
+        break;
+    case JR_COPY:
+        memcpy(blocks_get_block(rec->bnum), blocks_get_block(rec->index), BLOCK_SIZE);
+        break;
+    }
+}
+
+/*
+ * Lays out an empty journal in a freshly formatted image.
+ */
+void journal_format()
+{
+    journal_header_t* hdr = journal_header();
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->start_txid = 1;
+}
+
+/*
+ * Encodes the calling thread's transaction into the pending buffer.
+ */
+static void journal_encode()
+{
+    if (txn_count == 0) {
+        return;
+    }
+
+    int size = sizeof(journal_txn_t);
+    for (int ii = 0; ii < txn_count; ++ii) {
+        size += sizeof(journal_rec_t) + rec_payload_size(&txn_recs[ii]);
+    }
+    // Keep every transaction header 8-byte aligned
+    size = (size + 7) / 8 * 8;
+    assert(size <= journal_capacity() / 2);
+
+    pthread_mutex_lock(&journal_lock);
+
+    if (pending_len + size > pending_cap) {
+        pending_cap = 2 * (pending_len + size);
+        pending = realloc(pending, pending_cap);
+    }
+
+    uint8_t* start = pending + pending_len;
+    journal_txn_t* txn = (journal_txn_t*)start;
+    txn->magic = TXN_MAGIC;
+    txn->size = size;
+    txn->txid = next_txid++;
+    txn->checksum = 0;
+    txn->count = txn_count;
+
+    uint8_t* pos = start + sizeof(journal_txn_t);
+    for (int ii = 0; ii < txn_count; ++ii) {
+        memcpy(pos, &txn_recs[ii], sizeof(journal_rec_t));
+        pos += sizeof(journal_rec_t);
+        rec_capture(&txn_recs[ii], pos);
+        pos += rec_payload_size(&txn_recs[ii]);
+    }
+
+    memset(pos, 0, start + size - pos);
+    txn->checksum = journal_checksum(start, size);
+    pending_len += size;
+
+    pthread_mutex_unlock(&journal_lock);
+
+    txn_count = 0;
+}
+
+/*
+ * Adds a record to the calling thread's transaction.
+ */
+static void txn_append(int type, int bnum, int index, int count)
+{
+    if (txn_count == txn_cap) {
+        txn_cap = txn_cap ? 2 * txn_cap : 16;
+        txn_recs = realloc(txn_recs, txn_cap * sizeof(journal_rec_t));
+    }
+
+    journal_rec_t* rec = &txn_recs[txn_count++];
+    rec->type = type;
+    rec->bnum = bnum;
+    rec->index = index;
+    rec->count = count;
+}
+
+/*
+ * Pins a block of an inode's block map.
+ */
+static void journal_pin_map(int slot, int level, void* arg)
+{
+    if (level > 0) {
+        blocks_pin(slot);
+    }
+}
+
+/*
+ * Pins the directory, indirect and xattr blocks of every allocated inode.
+ */
+static void journal_pin_inodes()
+{
+    superblock_t* sb = get_superblock();
+    void* ibm = get_inode_bitmap();
+
+    for (int ii = 0; ii < sb->inode_count; ++ii) {
+        if (!bitmap_get(ibm, ii)) {
+            continue;
+        }
+
+        inode_t* node = get_inode(ii);
+        if (S_ISDIR(node->mode)) {
+            blocks_pin(node->ptrs[0]);
+        }
+        inode_map_walk(node, journal_pin_map, 0);
+        if (node->xattr) {
+            blocks_pin(node->xattr);
+        }
+    }
+}
+
+/*
+ * Pins the blocks of the inodes unless that is done already.
+ *
+ * Nothing but a transaction changes or frees metadata, and none of them
+ * may take a metadata block for data, so pinning can wait for the first.
+ */
+static void journal_pin_lazy()
+{
+    pthread_mutex_lock(&pin_lock);
+    if (!inodes_pinned) {
+        journal_pin_inodes();
+        inodes_pinned = 1;
+    }
+    pthread_mutex_unlock(&pin_lock);
+}
+
+/*
+ * Returns whether the journal, with what is buffered for it, is half full.
+ */
+static int journal_crowded()
+{
+    pthread_mutex_lock(&journal_lock);
+    int crowded = journal_head + pending_len >= journal_capacity() / 2;
+    pthread_mutex_unlock(&journal_lock);
+    return crowded;
+}
+
+/*
+ * Begins a metadata transaction. A half full journal is checkpointed
+ * first, so the transaction, at most half the journal, fits behind what
+ * is in it.
+ */
+void journal_begin()
+{
+    if (txn_depth == 0) {
+        journal_pin_lazy();
+        if (journal_crowded()) {
+            journal_checkpoint();
+        }
+    }
+    if (txn_depth++ == 0) {
+        pthread_rwlock_rdlock(&txn_lock);
+    }
+}
+
+/*
+ * Begins a transaction that runs alone.
+ */
+void journal_begin_exclusive()
+{
+    assert(txn_depth == 0);
+    journal_pin_lazy();
+    txn_depth = 1;
+    pthread_rwlock_wrlock(&txn_lock);
+}
+
+/*
+ * Records that count items starting at index in block bnum are about to
+ * change. Blocks that are not pinned yet must be logged before they are
+ * modified.
+ */
+void journal_log(int type, int bnum, int index, int count)
+{
+    assert(txn_depth > 0);
+
+    if (type == JR_INODE) {
+        bnum = blocks_get_bnum(get_inode(index));
+        for (int ii = 1; ii < count; ++ii) {
+            blocks_dirty(blocks_get_bnum(get_inode(index + ii)));
+        }
+    } else {
+        blocks_pin(bnum);
+    }
+    blocks_dirty(bnum);
+
+    for (int ii = 0; ii < txn_count; ++ii) {
+        journal_rec_t* rec = &txn_recs[ii];
+        if (rec->type != type || rec->bnum != bnum || type == JR_ZERO || type == JR_COPY) {
+            continue;
+        }
+        if (index >= rec->index && index + count <= rec->index + rec->count) {
+            return;
+        }
+        if (index == rec->index + rec->count) {
+            rec->count += count;
+            return;
+        }
+        if (index + count == rec->index) {
+            rec->index = index;
+            rec->count += count;
+            return;
+        }
+    }
+
+    txn_append(type, bnum, index, count);
+}
+
+/*
+ * Ends a metadata transaction. Commits once enough is buffered, and
+ * checkpoints instead once the journal would be half full.
+ */
+void journal_end()
+{
+    assert(txn_depth > 0);
+    if (--txn_depth > 0) {
+        return;
+    }
+
+    journal_encode();
+    pthread_rwlock_unlock(&txn_lock);
+
+    pthread_mutex_lock(&journal_lock);
+    int full = pending_len >= COMMIT_BYTES;
+    pthread_mutex_unlock(&journal_lock);
+
+    if (journal_crowded()) {
+        journal_checkpoint();
+    } else if (full) {
+        journal_commit();
+    }
+}
+
+/*
+ * Appends a batch of transactions to the journal area at the given offset
+ * and waits for it to reach storage.
+ */
+static int journal_write(const uint8_t* batch, int head, int len)
+{
+    uint8_t* data = journal_data();
+    memcpy(data + head, batch, len);
+
+    int start = head / 4096 * 4096;
+    int rv = 0;
+    if (msync(data + start, head + len - start, MS_SYNC) != 0) {
+        rv = -errno;
+    }
+
+    printf("+ journal_write(%d bytes @+%d) -> %d\n", len, head, rv);
+    return rv;
+}
+
+/*
+ * Makes every ended transaction durable in the journal.
+ *
+ * The caller waits for the first commit that starts after its transactions
+ * were buffered. Whoever finds no commit running writes the next one,
+ * taking along everything buffered by the other waiters.
+ */
+int journal_commit()
+{
+    pthread_mutex_lock(&journal_lock);
+
+    long ticket = pending_len > 0 ? commit_started + 1 : commit_started;
+    int rv = 0;
+
+    while (commit_done < ticket) {
+        if (commit_busy) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+            rv = commit_rv;
+            continue;
+        }
+
+        uint8_t* batch = pending;
+        int len = pending_len;
+        int head = journal_head;
+        pending = 0;
+        pending_len = 0;
+        pending_cap = 0;
+
+        assert(head + len <= journal_capacity());
+        journal_head += len;
+        commit_busy = 1;
+        commit_started += 1;
+        pthread_mutex_unlock(&journal_lock);
+
+        rv = len > 0 ? journal_write(batch, head, len) : 0;
+        free(batch);
+
+        pthread_mutex_lock(&journal_lock);
+        commit_rv = rv;
+        commit_done = commit_started;
+        commit_busy = 0;
+        pthread_cond_broadcast(&journal_cond);
+    }
+
+    pthread_mutex_unlock(&journal_lock);
+    return rv;
+}
+
+/*
+ * Commits buffered transactions, writes every dirty metadata block to its
+ * home location and empties the journal.
+ *
+ * No transaction may be open meanwhile, so the pinned blocks hold exactly
+ * the effect of the committed ones. Pinned blocks freed since the last
+ * checkpoint are written back like the others, then unpinned and released
+ * in a transaction of their own that opens the emptied journal. Written
+ * back first, a freed directory block still reads the same to a snapshot
+ * that refers to it.
+ */
+int journal_checkpoint()
+{
+    pthread_rwlock_wrlock(&txn_lock);
+
+    int rv = journal_commit();
+    if (rv == 0) {
+        rv = blocks_writeback();
+    }
+
+    if (rv == 0) {
+        journal_header_t* hdr = journal_header();
+        pthread_mutex_lock(&journal_lock);
+        int moved = hdr->start_txid != next_txid;
+        hdr->start_txid = next_txid;
+        journal_head = 0;
+        pthread_mutex_unlock(&journal_lock);
+
+        // For the checkpoint of an image kept in memory
+        if (moved) {
+            blocks_dirty(get_superblock()->journal_block);
+        }
+
+        if (msync(hdr, 4096, MS_SYNC) != 0) {
+            rv = -errno;
+        }
+    }
+
+    if (rv == 0) {
+        pthread_mutex_lock(&journal_lock);
+        int* frees = deferred;
+        int count = deferred_count;
+        deferred = 0;
+        deferred_count = 0;
+        deferred_cap = 0;
+        pthread_mutex_unlock(&journal_lock);
+
+        txn_depth++;
+        for (int ii = 0; ii < count; ++ii) {
+            blocks_unpin(frees[ii]);
+            free_block(frees[ii]);
+        }
+        txn_depth--;
+        journal_encode();
+        free(frees);
+        if (count > 0) {
+            rv = journal_commit();
+        }
+    }
+
+    pthread_rwlock_unlock(&txn_lock);
+
+    printf("+ journal_checkpoint() -> %d\n", rv);
+    return rv;
+}
+
+/*
+ * Queues a pinned block to be released at the next checkpoint. Inside a
+ * transaction the release is logged too, so a replay after a crash
+ * releases the block instead of leaking it.
+ */
+void journal_free_later(int bnum)
+{
+    if (txn_depth > 0) {
+        txn_append(JR_FREE, bnum, 0, 0);
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    if (deferred_count == deferred_cap) {
+        deferred_cap = deferred_cap ? 2 * deferred_cap : 16;
+        deferred = realloc(deferred, deferred_cap * sizeof(int));
+    }
+    deferred[deferred_count++] = bnum;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/*
+ * Pins the metadata blocks and replays every committed transaction.
+ *
+ * After a replay the free counts are taken again from the bitmaps, the
+ * result is checkpointed straight away, and only blocks that are still
+ * metadata stay pinned. Otherwise the blocks of the inodes are only pinned
+ * by the first transaction, so mounting reads no more than the reserved
+ * regions and the journal.
+ */
+void journal_init()
+{
+    superblock_t* sb = get_superblock();
+
+    // Every reserved region but the checksums and the journal, which end it
+    blocks_pin_range(0, sb->csum_block);
+
+    journal_header_t* hdr = journal_header();
+    assert(hdr->magic == JOURNAL_MAGIC);
+
+    uint8_t* data = journal_data();
+    int capacity = journal_capacity();
+    uint64_t txid = hdr->start_txid;
+    int head = 0;
+    int replayed = 0;
+
+    while (head + (int)sizeof(journal_txn_t) <= capacity) {
+        journal_txn_t* txn = (journal_txn_t*)(data + head);
+        if (txn->magic != TXN_MAGIC || txn->txid != txid ||
+            txn->size < sizeof(journal_txn_t) || head + txn->size > capacity) {
+            break;
+        }
+
+        uint32_t checksum = txn->checksum;
+        txn->checksum = 0;
+        int valid = journal_checksum((uint8_t*)txn, txn->size) == checksum;
+        txn->checksum = checksum;
+        if (!valid) {
+            break;
+        }
+
+        uint8_t* pos = (uint8_t*)txn + sizeof(journal_txn_t);
+        for (int ii = 0; ii < txn->count; ++ii) {
+            journal_rec_t* rec = (journal_rec_t*)pos;
+            pos += sizeof(journal_rec_t);
+            rec_apply(rec, pos);
+            pos += rec_payload_size(rec);
+        }
+
+        head += txn->size;
+        txid += 1;
+        replayed += 1;
+    }
+
+    next_txid = txid;
+    journal_head = head;
+
+    pthread_mutex_lock(&pin_lock);
+    inodes_pinned = 0;
+    pthread_mutex_unlock(&pin_lock);
+
+    if (replayed > 0) {
+        // The free counts are not journaled
+        blocks_recount(1);
+        journal_checkpoint();
+        for (int ii = sb->data_block; ii < sb->block_count; ++ii) {
+            blocks_unpin(ii);
+        }
+        journal_pin_lazy();
+    }
+
+    printf("+ journal_init() -> replayed %d transactions\n", replayed);
+}
+
+/*
+ * Commits on a timer, and checkpoints once the journal is half full.
+ */
+static void* journal_main(void* arg)
+{
+    pthread_mutex_lock(&journal_lock);
+    while (!thread_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += COMMIT_INTERVAL;
+        pthread_cond_timedwait(&thread_cond, &journal_lock, &deadline);
+        if (thread_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&journal_lock);
+
+        journal_commit();
+        if (journal_crowded()) {
+            journal_checkpoint();
+        }
+
+        pthread_mutex_lock(&journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+}
+
+/*
+ * Starts the background commit thread.
+ */
+void journal_start()
+{
+    thread_stop = 0;
+    int rv = pthread_create(&journal_thread, 0, journal_main, 0);
+    assert(rv == 0);
+    thread_running = 1;
+}
+
+/*
+ * Stops the background thread and checkpoints the journal.
+ */
+void journal_free()
+{
+    if (thread_running) {
+        pthread_mutex_lock(&journal_lock);
+        thread_stop = 1;
+        pthread_cond_signal(&thread_cond);
+        pthread_mutex_unlock(&journal_lock);
+        pthread_join(journal_thread, 0);
+        thread_running = 0;
+    }
+
+    // The blocks the first checkpoint releases reach the image with the second
+    journal_checkpoint();
+    journal_checkpoint();
+}
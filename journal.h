@@ -0,0 +1,115 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * Represents the write-ahead metadata journal.
+ *
+ * Metadata blocks (superblock, bitmaps, inode table, reference counts,
+ * directory, indirect and xattr blocks) are pinned in memory and changed in place
+ * inside a transaction. Each change is described by a compact logical
+ * record; when a transaction ends, the records are encoded with the current
+ * contents of what they describe and buffered. Buffered transactions are
+ * written to the journal area together (group commit), and the pinned
+ * blocks only reach their home location at a checkpoint, once every change
+ * they hold is durable in the journal. Mounting replays the committed
+ * transactions.
+ */
+
+// Bits of an allocation bitmap: bnum is the bitmap block, index the first
+// bit, count the number of bits
+#define JR_ALLOC  1
+// Inode table slots: index is the first inode number
+#define JR_INODE  2
+// Directory entries: bnum is the directory block, index the first slot
+#define JR_DIRENT 3
+// Block pointers in an indirect block: index is the first slot
+#define JR_PTR    4
+// A whole block cleared to zeros
+#define JR_ZERO   5
+// Block reference counts: bnum is the table block, index the first slot
+#define JR_REF    6
+// A whole block copied from block index into block bnum; the source must
+// not change again in the same transaction
+#define JR_COPY   7
+// Snapshot table slots: bnum is the table block, index the first slot
+#define JR_SNAP   8
+// Bytes of a new xattr block: index is the first byte
+#define JR_XATTR  9
+// A pinned block released at the next checkpoint: bnum is the block
+#define JR_FREE   10
+
+/*
+ * Lays out an empty journal in a freshly formatted image.
+ */
+void journal_format();
+
+/*
+ * Pins the metadata blocks and replays every committed transaction.
+ *
+ * Called by blocks_init() when the image is mounted.
+ */
+void journal_init();
+
+/*
+ * Starts the background commit thread.
+ *
+ * Called once the file system is running, so the thread survives FUSE
+ * daemonizing the process.
+ */
+void journal_start();
+
+/*
+ * Stops the background thread and checkpoints the journal.
+ */
+void journal_free();
+
+/*
+ * Begins a metadata transaction.
+ *
+ * Transactions nest; only the outermost journal_end() closes one.
+ */
+void journal_begin();
+
+/*
+ * Begins a transaction that runs alone: it waits for the open ones to end,
+ * and no other begins until it ends with journal_end(). Nothing changes
+ * behind its back meanwhile, apart from file data read or written outside
+ * a transaction. Must not be nested in another transaction.
+ */
+void journal_begin_exclusive();
+
+/*
+ * Records that count items starting at index are about to change.
+ *
+ * Must be called inside a transaction, before the bytes are modified. The
+ * target block is pinned and marked dirty. Records that extend one already
+ * in the transaction are merged into it.
+ */
+void journal_log(int type, int bnum, int index, int count);
+
+/*
+ * Ends a metadata transaction and buffers it for the next group commit.
+ */
+void journal_end();
+
+/*
+ * Makes every ended transaction durable in the journal.
+ *
+ * Concurrent callers share one write. Returns 0 on success or a negative
+ * errno.
+ */
+int journal_commit();
+
+/*
+ * Commits buffered transactions, writes every dirty metadata block to its
+ * home location and empties the journal.
+ */
+int journal_checkpoint();
+
+/*
+ * Queues a pinned block to be released at the next checkpoint, or by the
+ * replay that follows a crash.
+ */
+void journal_free_later(int bnum);
+
+#endif
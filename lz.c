@@ -0,0 +1,214 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+// Shortest match worth encoding
+#define LZ_MINMATCH 4
+// The last bytes of the input are always literals
+#define LZ_LASTLITERALS 5
+// No match may start within this many bytes of the end
+#define LZ_MFLIMIT 12
+// Farthest a match may reach back
+#define LZ_MAXOFFSET 65535
+// Size of the match finder's hash table, as a power of two
+#define LZ_HASHBITS 12
+
+static uint32_t lz_read32(const uint8_t* pp)
+{
+    uint32_t vv;
+    memcpy(&vv, pp, sizeof(vv));
+    return vv;
+}
+
+static uint32_t lz_hash(uint32_t vv)
+{
+    return (vv * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+/*
+ * Writes the part of a length beyond its 15 nibble as a run of 255 bytes
+ * and a final byte below 255.
+ */
+static uint8_t* lz_put_length(uint8_t* op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/*
+ * Emits one sequence. A null match means the final, literal-only one.
+ *
+ * Returns the new output position, or null if dst is too small.
+ */
+static uint8_t* lz_put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* lits,
+                                int litlen, int offset, int mlen)
+{
+    int worst = 1 + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1;
+    if (worst > oend - op) {
+        return 0;
+    }
+
+    uint8_t* token = op++;
+    *token = (litlen < 15 ? litlen : 15) << 4;
+    if (litlen >= 15) {
+        op = lz_put_length(op, litlen - 15);
+    }
+    memcpy(op, lits, litlen);
+    op += litlen;
+
+    if (offset) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        *token |= mlen < 15 ? mlen : 15;
+        if (mlen >= 15) {
+            op = lz_put_length(op, mlen - 15);
+        }
+    }
+    return op;
+}
+
+/*
+ * Compresses len bytes from src into dst, greedily taking the match the
+ * hash table remembers for the next 4 bytes.
+ */
+int lz_compress(const uint8_t* src, int len, uint8_t* dst, int cap)
+{
+    // Positions plus one, so that 0 means empty
+    int table[1 << LZ_HASHBITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    if (len > LZ_MFLIMIT) {
+        const uint8_t* mflimit = end - LZ_MFLIMIT;
+        const uint8_t* matchlimit = end - LZ_LASTLITERALS;
+
+        while (ip < mflimit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t hh = lz_hash(seq);
+            const uint8_t* ref = table[hh] ? src + table[hh] - 1 : 0;
+            table[hh] = ip - src + 1;
+
+            if (!ref || ip - ref > LZ_MAXOFFSET || lz_read32(ref) != seq) {
+                ++ip;
+                continue;
+            }
+
+            const uint8_t* mp = ip + LZ_MINMATCH;
+            const uint8_t* rp = ref + LZ_MINMATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                ++mp;
+                ++rp;
+            }
+
+            op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                                 mp - ip - LZ_MINMATCH);
+            if (!op) {
+                return 0;
+            }
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    op = lz_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - dst : 0;
+}
+
+/*
+ * Reads the part of a length beyond its 15 nibble. Returns -1 if the input
+ * ends first.
+ */
+static int lz_get_length(const uint8_t** ip, const uint8_t* iend)
+{
+    int len = 0;
+    int bb;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        bb = *(*ip)++;
+        len += bb;
+    } while (bb == 255);
+    return len;
+}
+
+/*
+ * Decompresses len bytes from src into dst, checking every length and
+ * offset against both buffers.
+ */
+int lz_decompress(const uint8_t* src, int len, uint8_t* dst, int cap)
+{
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+
+        int litlen = token >> 4;
+        if (litlen == 15) {
+            int more = lz_get_length(&ip, iend);
+            if (more < 0) {
+                return -1;
+            }
+            litlen += more;
+        }
+        if (litlen > iend - ip || litlen > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+
+        // The last sequence has no match
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - dst) {
+            return -1;
+        }
+
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int more = lz_get_length(&ip, iend);
+            if (more < 0) {
+                return -1;
+            }
+            mlen += more;
+        }
+        mlen += LZ_MINMATCH;
+        if (mlen > oend - op) {
+            return -1;
+        }
+
+        // Matches may overlap their own output
+        const uint8_t* match = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, match, mlen);
+        } else {
+            for (int ii = 0; ii < mlen; ++ii) {
+                op[ii] = match[ii];
+            }
+        }
+        op += mlen;
+    }
+
+    return op - dst;
+}
@@ -0,0 +1,31 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+/*
+ * Represents a small LZ77 codec using the LZ4 block format.
+ *
+ * Each sequence is a token byte (literal length in the high nibble, match
+ * length minus 4 in the low one, 15 meaning more length bytes follow), the
+ * literals, and a 2-byte little-endian match offset. The last sequence
+ * carries literals only. It trades ratio for speed: one hash probe per
+ * position, no lazy matching.
+ */
+
+/*
+ * Compresses len bytes from src into dst.
+ *
+ * Returns the compressed size, or 0 if it would not fit in cap bytes.
+ */
+int lz_compress(const uint8_t* src, int len, uint8_t* dst, int cap);
+
+/*
+ * Decompresses len bytes from src into dst.
+ *
+ * Returns the decompressed size, or -1 if the input is malformed or would
+ * not fit in cap bytes.
+ */
+int lz_decompress(const uint8_t* src, int len, uint8_t* dst, int cap);
+
+#endif
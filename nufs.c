@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -6,19 +7,377 @@
 #include <sys/stat.h>
 #include <bsd/string.h>
 #include <assert.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
 
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include "nufs.h"
 #include "inode.h"
 #include "func.h"
 #include "bitmap.h"
 #include "blocks.h"  
 #include "slist.h"
 #include "directory.h"
+#include "journal.h"
+#include "clone.h"
+#include "snapshot.h"
+#include "compress.h"
+#include "dedup.h"
+#include "checksum.h"
+#include "xattr.h"
+#include "io.h"
+#include "writeback.h"
+#include "tier.h"
+#include "tail.h"
+#include "trace.h"
+
+// The inode flags ioctls, as in <linux/fs.h>, whose BLOCK_SIZE macro
+// clashes with ours
+#ifndef FS_IOC_GETFLAGS
+#define FS_IOC_GETFLAGS _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS _IOW('f', 2, long)
+#define FS_COMPR_FL     0x00000004
+#endif
 
 
 //int BLOCK_SIZE = 4096;  
 
+// Mount options of our own, taken out of -o before FUSE sees it
+static struct nufs_opts {
+    int dedup;               // -o dedup: deduplicate fully written pages
+    int verify;              // -o verify=full|lazy|off: when reads check checksums
+    char* trace;             // -o trace=PATH: record every operation (see trace.h)
+    int hugepages;           // -o hugepages: map data blocks with huge pages
+    int populate;            // -o populate: prefault the hot metadata at mount
+    int access;              // -o access=random|sequential: data block read pattern
+    char* stripe;            // -o stripe=PATH[:PATH...]: more files to stripe the image across
+    char* stripe_unit;       // -o stripe_unit=SIZE: stripe unit of a blank image, e.g. 64K
+    int memory;              // -o memory: keep the image in memory, checkpointing it
+    int checkpoint;          // -o checkpoint=SECS: seconds between those checkpoints
+    int writeback;           // -o writeback=N: threads writing buffered writes out
+    char* tier;              // -o tier=PATH: slow file to keep cold data in
+    char* tier_size;         // -o tier_size=SIZE: fast tier of a blank image, e.g. 64M
+    int migrate;             // -o migrate=N: blocks moved between tiers per second
+} nufs_opts = { .writeback = WRITEBACK_THREADS, .migrate = TIER_RATE };
+
+#ifndef NUFS_NO_MAIN
+static const struct fuse_opt nufs_opt_spec[] = {
+    { "dedup", offsetof(struct nufs_opts, dedup), 1 },
+    { "verify=full", offsetof(struct nufs_opts, verify), CHECKSUM_FULL },
+    { "verify=lazy", offsetof(struct nufs_opts, verify), CHECKSUM_LAZY },
+    { "verify=off", offsetof(struct nufs_opts, verify), CHECKSUM_OFF },
+    { "trace=%s", offsetof(struct nufs_opts, trace), 0 },
+    { "hugepages", offsetof(struct nufs_opts, hugepages), BLOCKS_MAP_HUGE },
+    { "populate", offsetof(struct nufs_opts, populate), BLOCKS_MAP_POPULATE },
+    { "access=random", offsetof(struct nufs_opts, access), BLOCKS_MAP_RANDOM },
+    { "access=sequential", offsetof(struct nufs_opts, access), BLOCKS_MAP_SEQUENTIAL },
+    { "stripe=%s", offsetof(struct nufs_opts, stripe), 0 },
+    { "stripe_unit=%s", offsetof(struct nufs_opts, stripe_unit), 0 },
+    { "memory", offsetof(struct nufs_opts, memory), BLOCKS_MAP_MEMORY },
+    { "checkpoint=%d", offsetof(struct nufs_opts, checkpoint), 0 },
+    { "writeback=%d", offsetof(struct nufs_opts, writeback), 0 },
+    { "tier=%s", offsetof(struct nufs_opts, tier), 0 },
+    { "tier_size=%s", offsetof(struct nufs_opts, tier_size), 0 },
+    { "migrate=%d", offsetof(struct nufs_opts, migrate), 0 },
+    FUSE_OPT_END
+};
+#endif
+
+// Kernel cache timeouts in seconds, put before the command line's own -o
+// options so those win. Every change to names goes through the kernel,
+// which updates its dentries itself, so entries can be kept for long.
+// Attributes are kept for less: a hard link or a clone changes those of
+// another path behind the kernel's back.
+#define NUFS_TIMEOUTS "-oentry_timeout=30,negative_timeout=30,attr_timeout=1"
+
+// Request sizes, put before the command line's own -o options like the
+// timeouts. Without big_writes the kernel sends writes a page at a time;
+// 128 KiB is the most libfuse's request buffer takes. A 1 MiB readahead
+// window keeps streaming reads several requests ahead.
+#define NUFS_IO_OPTS "-obig_writes,max_write=131072,max_readahead=1048576"
+
+// The inode mtime and size each file had when its last handle was
+// released, to tell whether the kernel's page cache of it is still good.
+// A time of -1 means it must not be trusted.
+typedef struct cached_file {
+    time_t time;
+    int64_t size;
+} cached_file_t;
+
+static cached_file_t* nufs_cached;
+
+// Where the last read on this thread found the block map of its file.
+// Reads of one handle run on several threads at once, while its writes
+// take turns, so only writes keep theirs in the handle.
+static __thread inode_t* nufs_read_node = 0;
+static __thread inode_map_cache_t nufs_read_map;
+
+// State kept in fi->fh for each open file of the live tree: its inode,
+// so reads and writes skip the path lookup, where the last write found its
+// block map, and the small writes made through it that are still buffered.
+// Files in snapshots get none.
+typedef struct nufs_handle {
+    inode_t* node;
+    inode_map_cache_t map;
+    char* buf;                  // Buffered writes, or null if there are none
+    off_t buf_offset;           // Where in the file they start
+    int buf_len;                // Bytes buffered
+    int buf_cap;                // Bytes the buffer holds, up to a block boundary
+    time_t buf_since;           // When the first of them was made
+    time_t buf_time;            // When the last of them was made: the file's mtime
+    struct nufs_handle* next;   // Next handle with buffered writes
+} nufs_handle_t;
+
+// Writes smaller than a block are gathered in the handle they are made
+// through while each continues the last, and written to the file together
+// in runs of up to NUFS_WBUF_BLOCKS blocks, ending on a block boundary.
+// A buffer is handed to the writeback workers (see writeback.h) once full
+// or NUFS_WBUF_AGE seconds old, and written out and waited for by fsync,
+// close and release, and before anything else reads or changes its file.
+// A file has at most one buffer at a time, and all of them hold at most
+// NUFS_WBUF_LIMIT bytes; writes past that go straight to their file.
+#define NUFS_WBUF_BLOCKS 16
+#define NUFS_WBUF_LIMIT (16 << 20)
+#define NUFS_WBUF_AGE 1
+
+static pthread_mutex_t wbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+static nufs_handle_t* wbuf_list = 0;     // Handles with buffered writes
+static long wbuf_bytes = 0;              // Bytes of buffer they hold
+
+static pthread_cond_t wbuf_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t wbuf_thread;
+static int wbuf_running = 0;
+static int wbuf_stop = 0;
+
+// Returns the handle of an open file, or null if it has none.
+static nufs_handle_t* nufs_handle(struct fuse_file_info* fi)
+{
+    return fi ? (nufs_handle_t*)(uintptr_t)fi->fh : 0;
+}
+
+// Held shared while a path of the live tree is looked up or a directory
+// listed, and exclusively, inside the transaction, while entries are added
+// or removed, so two changes to one directory never take the same entry
+static pthread_rwlock_t nufs_tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Looks up a path of the live tree. Returns its inode number or -ENOENT.
+static int nufs_tree_lookup(const char* path)
+{
+    pthread_rwlock_rdlock(&nufs_tree_lock);
+    int inum = tree_lookup(path);
+    pthread_rwlock_unlock(&nufs_tree_lock);
+    return inum;
+}
+
+// Finds the inode at the given path, in the live tree or in a snapshot.
+// Returns null if there is none.
+static inode_t* nufs_lookup(const char* path)
+{
+    if (snapshot_path(path)) {
+        return snapshot_lookup(path);
+    }
+    int inum = nufs_tree_lookup(path);
+    return inum < 0 ? 0 : get_inode(inum);
+}
+
+// Writes size bytes at offset into a file of the live tree, in one
+// transaction with the block map and size changes it makes; the data is not
+// journaled. The file's mtime becomes the given one. Returns the bytes
+// written or a negative errno.
+static int nufs_write_node(inode_t* node, const char* buf, size_t size, off_t offset,
+                           inode_map_cache_t* map, time_t mtime)
+{
+    journal_begin();
+    inode_lock(node, 1);
+
+    // First and last pages the write touches
+    int initialPage = offset >> BLOCK_SHIFT;
+    int lastPage = (offset + size - 1) >> BLOCK_SHIFT;
+
+    // Compressed clusters this write expands are compressed again after it
+    int firstCluster = initialPage / CLUSTER_PAGES;
+    int clusters = lastPage / CLUSTER_PAGES - firstCluster + 1;
+    int recompress[clusters];
+    for (int c = 0; c < clusters; c++) {
+        recompress[c] = cluster_compressed(node, (firstCluster + c) * CLUSTER_PAGES);
+    }
+
+    // Runs of adjacent blocks are copied whole; shared blocks and holes get
+    // fresh ones. The size grows to cover what was written.
+    int rv = io_write(node, buf, size, offset, map);
+    if (rv < 0) {
+        inode_unlock(node, 1);
+        journal_end();
+        return rv;
+    }
+    node->time = mtime;
+    inode_dirty(node);
+
+    // Compress the clusters this write completed
+    if (node->flags & INODE_COMPRESS) {
+        for (int c = 0; c < clusters; c++) {
+            int first = (firstCluster + c) * CLUSTER_PAGES;
+            if (recompress[c] || first + CLUSTER_PAGES - 1 <= lastPage) {
+                cluster_deflate(node, first);
+            }
+        }
+    }
+
+    // Pages this write covered whole may duplicate existing blocks
+    if (nufs_opts.dedup) {
+        for (int i = initialPage; i <= lastPage; i++) {
+            if ((off_t)i << BLOCK_SHIFT >= offset && (off_t)(i + 1) << BLOCK_SHIFT <= offset + rv) {
+                dedup_page(node, i);
+            }
+        }
+    }
+
+    inode_unlock(node, 1);
+    journal_end();
+    return rv;
+}
+
+// Writes buffered data to a file for the writeback workers. Another thread
+// may be reading through the map cache of the handle it came from.
+static int wbuf_write_out(inode_t* node, const char* data, size_t size, off_t offset,
+                          time_t mtime)
+{
+    inode_map_cache_t map = { 0, -1, 0 };
+    return nufs_write_node(node, data, size, offset, &map, mtime);
+}
+
+// Hands a handle's buffered writes to the writeback workers, which free
+// the buffer once they are made. Called with wbuf_lock held.
+static void wbuf_flush(nufs_handle_t* fh)
+{
+    if (!fh->buf) {
+        return;
+    }
+    writeback_queue(fh->node, fh->buf, fh->buf_len, fh->buf_offset, fh->buf_time);
+
+    nufs_handle_t** link = &wbuf_list;
+    while (*link != fh) {
+        link = &(*link)->next;
+    }
+    *link = fh->next;
+    wbuf_bytes -= fh->buf_cap;
+    fh->buf = 0;
+}
+
+// Writes out the buffered writes to a file, or to every file if node is
+// null, and waits for them, so that its size, mtime and data are current.
+static void wbuf_flush_node(inode_t* node)
+{
+    if (__atomic_load_n(&wbuf_list, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&wbuf_lock);
+        nufs_handle_t* fh = wbuf_list;
+        while (fh) {
+            nufs_handle_t* next = fh->next;
+            if (!node || fh->node == node) {
+                wbuf_flush(fh);
+            }
+            fh = next;
+        }
+        pthread_mutex_unlock(&wbuf_lock);
+    }
+    writeback_wait(node);
+}
+
+// Buffers a small write made through a handle, writing out what the
+// handle buffered before if the write does not continue it. Returns
+// whether the write was buffered; if not, nothing is buffered for its file.
+static int wbuf_write(nufs_handle_t* fh, const char* buf, size_t size, off_t offset)
+{
+    pthread_mutex_lock(&wbuf_lock);
+    if (fh->buf && offset != fh->buf_offset + fh->buf_len) {
+        wbuf_flush(fh);
+    }
+
+    while (size > 0) {
+        if (!fh->buf) {
+            // Only one handle buffers writes to a file at a time
+            nufs_handle_t* other = wbuf_list;
+            while (other) {
+                nufs_handle_t* next = other->next;
+                if (other->node == fh->node) {
+                    wbuf_flush(other);
+                }
+                other = next;
+            }
+
+            // The buffer ends on a block boundary, so later ones cover whole blocks
+            off_t end = (off_t)((offset >> BLOCK_SHIFT) + NUFS_WBUF_BLOCKS) << BLOCK_SHIFT;
+            int cap = end - offset;
+            if (wbuf_bytes + cap > NUFS_WBUF_LIMIT) {
+                pthread_mutex_unlock(&wbuf_lock);
+                return 0;
+            }
+            fh->buf = malloc(cap);
+            fh->buf_offset = offset;
+            fh->buf_len = 0;
+            fh->buf_cap = cap;
+            fh->buf_since = time(0);
+            wbuf_bytes += cap;
+            fh->next = wbuf_list;
+            __atomic_store_n(&wbuf_list, fh, __ATOMIC_RELEASE);
+        }
+
+        int len = size < (size_t)(fh->buf_cap - fh->buf_len) ? size : fh->buf_cap - fh->buf_len;
+        memcpy(fh->buf + fh->buf_len, buf, len);
+        fh->buf_len += len;
+        fh->buf_time = time(0);
+        if (fh->buf_len == fh->buf_cap) {
+            wbuf_flush(fh);
+        }
+        buf += len;
+        offset += len;
+        size -= len;
+    }
+    pthread_mutex_unlock(&wbuf_lock);
+    return 1;
+}
+
+// Writes out what a handle buffered, if it has one, and returns the first
+// error writing buffers out to its file since this was last called, or 0.
+static int wbuf_sync(nufs_handle_t* fh)
+{
+    if (!fh) {
+        return 0;
+    }
+    pthread_mutex_lock(&wbuf_lock);
+    wbuf_flush(fh);
+    pthread_mutex_unlock(&wbuf_lock);
+    writeback_wait(fh->node);
+    return writeback_error(fh->node);
+}
+
+// Hands buffers to the writeback workers once they are NUFS_WBUF_AGE
+// seconds old, checking every second.
+static void* wbuf_main(void* arg)
+{
+    pthread_mutex_lock(&wbuf_lock);
+    while (!wbuf_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&wbuf_cond, &wbuf_lock, &deadline);
+
+        time_t old = time(0) - NUFS_WBUF_AGE;
+        nufs_handle_t* fh = wbuf_list;
+        while (fh) {
+            nufs_handle_t* next = fh->next;
+            if (fh->buf_since <= old) {
+                wbuf_flush(fh);
+            }
+            fh = next;
+        }
+    }
+    pthread_mutex_unlock(&wbuf_lock);
+    return 0;
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 // Checks if a file exists.
@@ -28,7 +387,7 @@ int nufs_access(const char *path, int mask)
     int rv = 0;
 
     // Check if the file exists in the filesystem
-    if (tree_lookup(path) < 0) {
+    if (!nufs_lookup(path)) {
         rv = -ENOENT;
     }
 
@@ -43,19 +402,25 @@ int nufs_getattr(const char *path, struct stat *st)
     // Placeholder for return value
     int rv = 0;
 
-    // Retrieve the inode number associated with the file path
-    int inum = tree_lookup(path);
+    // Retrieve the inode associated with the file path
+    inode_t* node = nufs_lookup(path);
 
     // Check if the file does not exist
-    if (inum == -ENOENT) {
+    if (!node) {
         return rv = -ENOENT;
     } else {
-        // Retrieve the inode and populate the stat structure
-        inode_t* node = get_inode(inum);
+        // Size and mtime include the writes still buffered
+        wbuf_flush_node(node);
+
+        // Populate the stat structure; snapshots are read-only
         st->st_mode = node->mode;
         st->st_size = node->size;
         st->st_nlink = node->refs;
         st->st_mtime = node->time;
+        st->st_blocks = inode_blocks(node) * (BLOCK_SIZE / 512);
+        if (snapshot_path(path)) {
+            st->st_mode &= ~0222;
+        }
     }
 
     // Print debugging information
@@ -63,19 +428,79 @@ int nufs_getattr(const char *path, struct stat *st)
     return rv;
 }
 
+// Reports the size and free space of the file system, from the counts
+// kept in the superblock rather than a scan of the bitmaps.
+int nufs_statfs(const char *path, struct statvfs *st)
+{
+    superblock_t* sb = get_superblock();
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = sb->block_count;
+    st->f_bfree = blocks_free_count();
+    st->f_bavail = st->f_bfree;
+    st->f_files = sb->inode_count;
+    st->f_ffree = sb->free_inodes;
+    st->f_favail = st->f_ffree;
+    st->f_namemax = DIR_NAME - 1;
+
+    // Print debugging information
+    printf("statfs(%s) -> 0 {free: %ld blocks, %ld inodes}\n", path,
+           (long)st->f_bfree, (long)st->f_ffree);
+    return 0;
+}
+
 // Lists the contents of a directory.
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
              off_t offset, struct fuse_file_info *fi)
 {
     struct stat st;
+    memset(&st, 0, sizeof(st));
+    int count = 0;
+
+    // Each entry is passed with the offset to resume after it, so a listing
+    // that does not fit the kernel's buffer continues where it stopped
+    // instead of starting over.
+    if (streq(path, SNAPSHOT_DIR)) {
+        // /.snapshots lists the snapshots
+        slist_t* names = snapshot_list();
+        int ii = 0;
+        for (slist_t* list = names; list; list = list->next, ++ii) {
+            if (ii < offset) {
+                continue;
+            }
+            st.st_mode = S_IFDIR | 0555;
+            if (filler(buf, list->data, &st, ii + 1)) {
+                break;
+            }
+            ++count;
+        }
+        s_free(names);
+    } else {
+        inode_t* node = nufs_lookup(path);
+        if (!node) {
+            return -ENOENT;
+        }
 
-    // Iterate through the directory entries and fill the buffer
-    for (slist_t* list = directory_list(path); list; list = list->next) {
-        filler(buf, list->data, &st, 0);
+        // Entries in a snapshot refer to its own inode table, so their type
+        // is left for getattr to find
+        int live = !snapshot_path(path);
+        dirent_t* ent;
+        pthread_rwlock_rdlock(&nufs_tree_lock);
+        for (int slot = directory_next(node, offset, &ent); slot >= 0;
+             slot = directory_next(node, slot + 1, &ent)) {
+            st.st_ino = ent->inum;
+            st.st_mode = live ? get_inode(ent->inum)->mode : 0;
+            if (filler(buf, ent->name, &st, slot + 1)) {
+                break;
+            }
+            ++count;
+        }
+        pthread_rwlock_unlock(&nufs_tree_lock);
     }
 
     // Print debugging information
-    printf("readdir(%s) -> %d\n", path, 0);
+    printf("readdir(%s, %ld) -> %d entries\n", path, (long)offset, count);
     return 0;
 }
 
@@ -85,22 +510,68 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
     // Placeholder for return value
     int rv = -1;
 
+    // Snapshots are read-only
+    if (snapshot_path(path)) {
+        return -EROFS;
+    }
+
+    journal_begin();
+    pthread_rwlock_wrlock(&nufs_tree_lock);
+
     // Allocate a new inode and initialize its attributes
     int inum = alloc_inode();
+    if (inum < 0) {
+        pthread_rwlock_unlock(&nufs_tree_lock);
+        journal_end();
+        printf("mknod(%s, %04o) -> %d\n", path, mode, -ENOSPC);
+        return -ENOSPC;
+    }
     inode_t* newnode = get_inode(inum);
     int dirNum = directory_get_super(path);
     inode_t* node = get_inode(dirNum);
 
-    newnode->ptrs[0] = alloc_block();
-    newnode->ptrs[1] = alloc_block();
+    // Only a directory starts with a block, for its entries; a file gets
+    // blocks, or units of a fragment block (see tail.h), as it is written
+    newnode->ptrs[0] = 0;
+    newnode->ptrs[1] = 0;
     newnode->refs = 1;
     newnode->mode = mode;
     newnode->iptr = 0;
+    newnode->dptr = 0;
+    newnode->tptr = 0;
     newnode->size = 0;
     newnode->time = time(0);
+    newnode->flags = node->flags & INODE_COMPRESS;
+    inode_dirty(newnode);
+    nufs_cached[inum].time = -1;
+
+    // A new directory starts with an empty entry block
+    if (S_ISDIR(mode)) {
+        int bnum = alloc_block();
+        if (bnum < 0) {
+            rv = -ENOSPC;
+        } else {
+            newnode->ptrs[0] = bnum;
+            journal_log(JR_ZERO, bnum, 0, 0);
+            memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+            rv = 0;
+        }
+    } else {
+        rv = 0;
+    }
 
     // Update the directory entry with the new inode number
-    rv = directory_put(get_inode(directory_get_super(path)), directory_get_name(path), inum);
+    if (rv == 0) {
+        rv = directory_put(node, directory_get_name(path), inum);
+    }
+
+    // A full directory takes the inode and its block back in the same
+    // transaction, so nothing is left orphaned
+    if (rv < 0) {
+        free_inode(inum);
+    }
+    pthread_rwlock_unlock(&nufs_tree_lock);
+    journal_end();
 
     // Print debugging information
     printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
@@ -111,8 +582,18 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 // Creates a directory.
 int nufs_mkdir(const char *path, mode_t mode)
 {
-    // Use mknod to create a directory
-    int rv = nufs_mknod(path, mode | 040000, 0);
+    int rv;
+
+    // A directory made in /.snapshots takes a snapshot of that name
+    const char* snap = snapshot_name(path);
+    if (snap) {
+        // The snapshot includes every write made so far
+        wbuf_flush_node(0);
+        rv = snapshot_create(snap);
+    } else {
+        // Use mknod to create a directory
+        rv = nufs_mknod(path, mode | 040000, 0);
+    }
     printf("mkdir(%s) -> %d\n", path, rv);
     return rv;
 }
@@ -122,18 +603,36 @@ int remove(const char* path) {
     // Placeholder for return value
     int rv = -1;
 
+    // Snapshots are read-only
+    if (snapshot_path(path)) {
+        return -EROFS;
+    }
+
+    journal_begin();
+    pthread_rwlock_wrlock(&nufs_tree_lock);
+
     // Retrieve the inode number and free the corresponding inode
     int inum = tree_lookup(path);
+    inode_lock(get_inode(inum), 1);
     free_inode(inum);
+    inode_unlock(get_inode(inum), 1);
 
     // Delete the directory entry
     rv =  directory_delete(get_inode(directory_get_super(path)), directory_get_name(path));
+    pthread_rwlock_unlock(&nufs_tree_lock);
+    journal_end();
     return rv;
 }
 
 // Removes a file.
 int nufs_unlink(const char *path)
 {
+    // Writes still buffered must not reach the inode once it is freed
+    int inum = snapshot_path(path) ? -1 : nufs_tree_lookup(path);
+    if (inum >= 0) {
+        wbuf_flush_node(get_inode(inum));
+    }
+
     // Remove the file
     int rv = remove(path);
     printf("unlink(%s) -> %d\n", path, rv);
@@ -146,14 +645,36 @@ int nufs_link(const char *from, const char *to)
     // Placeholder for return value
     int rv = -1;
 
+    // Snapshots are read-only
+    if (snapshot_path(from) || snapshot_path(to)) {
+        return -EROFS;
+    }
+
+    // Writes still buffered go to the file first, as for every other
+    // change to its inode
+    int inum = nufs_tree_lookup(from);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    wbuf_flush_node(get_inode(inum));
+
+    journal_begin();
+    pthread_rwlock_wrlock(&nufs_tree_lock);
+
     // Retrieve inode numbers
     int fromNum = tree_lookup(from);
     inode_t* parentNode = get_inode(directory_get_super(to));
     inode_t* fromNode = get_inode(fromNum);
     fromNode->refs += 1;
+    inode_dirty(fromNode);
+
+    // Writes through one name now leave the other's pages behind
+    nufs_cached[fromNum].time = -1;
 
     // Update the directory entry
     rv = directory_put(parentNode, directory_get_name(to), fromNum);
+    pthread_rwlock_unlock(&nufs_tree_lock);
+    journal_end();
 
     // Print debugging information
     printf("link(%s => %s) -> %d\n", from, to, rv);
@@ -163,8 +684,16 @@ int nufs_link(const char *from, const char *to)
 // Removes a directory.
 int nufs_rmdir(const char *path)
 {
-    // Remove the directory
-    int rv = remove(path);
+    int rv;
+
+    // Removing /.snapshots/<name> deletes that snapshot
+    const char* snap = snapshot_name(path);
+    if (snap) {
+        rv = snapshot_delete(snap);
+    } else {
+        // Remove the directory
+        rv = remove(path);
+    }
     printf("rmdir(%s) -> %d\n", path, rv);
     return rv;
 }
@@ -175,15 +704,24 @@ int nufs_rename(const char *from, const char *to)
     // Placeholder for return value
     int rv = 0;
 
+    // Snapshots are read-only
+    if (snapshot_path(from) || snapshot_path(to)) {
+        return -EROFS;
+    }
+
+    // Update directory entries, both in one transaction
+    journal_begin();
+    pthread_rwlock_wrlock(&nufs_tree_lock);
+
     // Retrieve inode numbers
     int from_node_num = tree_lookup(from);
-    inode_t* from_node = get_inode(from_node_num);
     inode_t* from_parent_node = get_inode(directory_get_super(from));
     inode_t* to_parent_node = get_inode(directory_get_super(to));
 
-    // Update directory entries
     directory_put(to_parent_node, directory_get_name(to), from_node_num);
     directory_delete(from_parent_node, directory_get_name(from));
+    pthread_rwlock_unlock(&nufs_tree_lock);
+    journal_end();
 
     // Print debugging information
     printf("rename(%s => %s) -> %d\n", from, to, rv);
@@ -197,12 +735,18 @@ int nufs_chmod(const char *path, mode_t mode)
     int rv = 0;
 
     // Check if the file exists
-    if (tree_lookup(path) < 0) {
+    if (snapshot_path(path)) {
+        rv = -EROFS;
+    } else if (nufs_tree_lookup(path) < 0) {
         rv = -1;
     } else {
-        // Update the mode of the file
-        inode_t* node  = get_inode(tree_lookup(path));
+        // Update the mode of the file, after the writes still buffered
+        inode_t* node  = get_inode(nufs_tree_lookup(path));
+        wbuf_flush_node(node);
+        journal_begin();
         node->mode = mode;
+        inode_dirty(node);
+        journal_end();
     }
     // Print debugging information
     printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
@@ -215,8 +759,33 @@ int nufs_truncate(const char *path, off_t size)
     // Placeholder for return value
     int rv = 0;
 
-    // Update the file size
-    get_inode(tree_lookup(path))->size = size;
+    // Snapshots are read-only
+    if (snapshot_path(path)) {
+        return -EROFS;
+    }
+    if (size > (off_t)INODE_MAX_PAGES * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+
+    // Update the file size, after the writes still buffered. Shrinking
+    // releases the pages past the new end.
+    int inum = nufs_tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    inode_t* node = get_inode(inum);
+    wbuf_flush_node(node);
+    journal_begin();
+    inode_lock(node, 1);
+    if (size < node->size) {
+        rv = shrink_inode(node, node->size - size);
+    } else {
+        node->size = size;
+        inode_dirty(node);
+    }
+    tail_pack(node);
+    inode_unlock(node, 1);
+    journal_end();
 
     // Print debugging information
     printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
@@ -228,87 +797,210 @@ int nufs_open(const char *path, struct fuse_file_info *fi)
 {
     // Placeholder for return value
     int rv = 0;
+
+    // Files in a snapshot can only be opened for reading
+    if (snapshot_path(path) && (fi->flags & O_ACCMODE) != O_RDONLY) {
+        rv = -EROFS;
+    }
+
+    // The kernel may keep the pages it has of a file in a snapshot, which
+    // never changes, or of a file with a single name, whose data only
+    // changes through that name, if it is as it was when last released
+    if (rv == 0 && snapshot_path(path)) {
+        fi->keep_cache = 1;
+    } else if (rv == 0) {
+        int inum = nufs_tree_lookup(path);
+        inode_t* node = inum < 0 ? 0 : get_inode(inum);
+        fi->keep_cache = node && node->refs == 1 &&
+                         nufs_cached[inum].time == node->time &&
+                         nufs_cached[inum].size == node->size;
+
+        if (node) {
+            nufs_handle_t* fh = malloc(sizeof(nufs_handle_t));
+            fh->node = node;
+            fh->map.first = -1;
+            fh->buf = 0;
+            fi->fh = (uintptr_t)fh;
+        }
+    }
+
     // Print debugging information
-    printf("open(%s) -> %d\n", path, rv);
+    printf("open(%s) -> %d%s\n", path, rv, fi->keep_cache ? " (keep cache)" : "");
     return rv;
 }
 
-int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Remembers what the kernel's pages of a file hold once it is closed.
+int nufs_release(const char *path, struct fuse_file_info *fi)
 {
-    // Placeholder value for return
-    int rv = 6;
-
-    // Retrieve the inode associated with the file path
-    inode_t* node = get_inode(tree_lookup(path));
+    nufs_handle_t* fh = nufs_handle(fi);
+    wbuf_sync(fh);
 
-    // Calculate initial block and remainder for efficient block access
-    int remainder = offset % BLOCK_SIZE;
-    int initialBlock = offset / BLOCK_SIZE;
-
-    // Track the current pointer for buffer manipulation
-    int currentPtr = 0;
+    int inum = snapshot_path(path) ? -1 : nufs_tree_lookup(path);
+    if (inum >= 0) {
+        inode_t* node = get_inode(inum);
+        nufs_cached[inum].time = node->refs == 1 ? node->time : -1;
+        nufs_cached[inum].size = node->size;
+    }
+    free(fh);
 
-    // Loop through the necessary blocks to read data
-    for (int i = initialBlock; i < bytes_to_blocks(size) + initialBlock; i++) {
-        char* data = blocks_get_block(inode_get_pnum(node, i));
+    printf("release(%s) -> 0\n", path);
+    return 0;
+}
 
-        // Handle the first page's data read
-        if (i == initialBlock) {
-            int length = BLOCK_SIZE - remainder;
-            memcpy(buf, data + remainder, length);
-            currentPtr += length;
-        } else {
-            // Copy the entire block to the buffer
-            memcpy(buf + currentPtr, data, BLOCK_SIZE);
-            currentPtr += BLOCK_SIZE;
-        }
+int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    // Retrieve the inode associated with the file path, and where this
+    // thread last found its block map
+    nufs_handle_t* fh = nufs_handle(fi);
+    inode_t* node = fh ? fh->node : nufs_lookup(path);
+    if (!node) {
+        return -ENOENT;
     }
+    if (nufs_read_node != node) {
+        nufs_read_node = node;
+        nufs_read_map.first = -1;
+    }
+    wbuf_flush_node(node);
+
+    // Runs of adjacent blocks are copied whole, up to the end of the file
+    int rv = io_read(node, buf, size, offset, &nufs_read_map);
 
     // Print debugging information
     printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
-    return currentPtr;
+    return rv;
 }
 
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    // Retrieve the inode associated with the file path
-    inode_t* node = get_inode(tree_lookup(path));
+    // Snapshots are read-only
+    if (snapshot_path(path)) {
+        return -EROFS;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    // Files end at the last page the block map can reach
+    if (offset + size > (off_t)INODE_MAX_PAGES * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+
+    // Retrieve the inode associated with the file path, and where its
+    // block map was last found
+    nufs_handle_t* fh = nufs_handle(fi);
+    inode_map_cache_t local = { 0, -1, 0 };
+    inode_map_cache_t* map = fh ? &fh->map : &local;
+    int inum = fh ? 0 : nufs_tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    inode_t* node = fh ? fh->node : get_inode(inum);
+
+    // Small writes are buffered in the handle; others go straight to the
+    // file, after anything buffered for it
+    int rv = size;
+    if (!fh || size >= (size_t)BLOCK_SIZE || !wbuf_write(fh, buf, size, offset)) {
+        wbuf_flush_node(node);
+        rv = nufs_write_node(node, buf, size, offset, map, time(0));
+    }
+
+    // Print debugging information
+    printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    return rv;
+}
 
-    // Resize the inode if necessary
-    grow_inode(node, size + offset);
+// Packs the last page of a small file into a fragment block (see tail.h),
+// in a transaction of its own unless it is packed already. Returns 0, or
+// -EIO if the page fails its checksum.
+static int nufs_pack_tail(inode_t* node)
+{
+    if (!node || S_ISDIR(node->mode) || node->size <= 0 || node->size > 2 * (off_t)BLOCK_SIZE ||
+        tail_slot(node->ptrs[(node->size - 1) >> BLOCK_SHIFT])) {
+        return 0;
+    }
+    journal_begin();
+    inode_lock(node, 1);
+    int rv = tail_pack(node);
+    inode_unlock(node, 1);
+    journal_end();
+    return rv < 0 ? rv : 0;
+}
 
-    // Track the current pointer for buffer manipulation
-    int currentPtr = 0;
+// Called on each close(); writes out what the handle buffered and reports
+// any error doing so, but durability is left to fsync. The last cluster of
+// a compressed file, which no write completed, is compressed here, and the
+// last page of a small file packed.
+int nufs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int rv = wbuf_sync(nufs_handle(fi));
+
+    int inum = snapshot_path(path) ? -1 : nufs_tree_lookup(path);
+    inode_t* node = inum < 0 ? 0 : get_inode(inum);
+    if (node && S_ISREG(node->mode) && (node->flags & INODE_COMPRESS) && node->size > 0) {
+        journal_begin();
+        inode_lock(node, 1);
+        cluster_deflate(node, (node->size - 1) >> BLOCK_SHIFT);
+        inode_unlock(node, 1);
+        journal_end();
+    } else if (node && S_ISREG(node->mode)) {
+        int packed = nufs_pack_tail(node);
+        rv = rv < 0 ? rv : packed;
+    }
 
-    // Calculate initial page and remainder for efficient block access
-    int initialPage = offset / BLOCK_SIZE;
-    int remainder = offset % BLOCK_SIZE;
+    printf("flush(%s) -> %d\n", path, rv);
+    return rv;
+}
 
-    // Loop through the necessary pages to write data
-    for (int i = initialPage; i < bytes_to_blocks(size) + initialPage; i++) {
-        char* data = blocks_get_block(inode_get_pnum(node, i));
+// Flushes a file's data and metadata blocks to the image.
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    // Placeholder value for return
+    int rv = 0;
 
-        // Handle the first page's data write
-        if (i == initialPage) {
-            int length = BLOCK_SIZE - remainder;
-            memcpy(data + remainder, buf + currentPtr, length);
-            currentPtr += length;
-        } else {
-            // Copy the entire block from the buffer
-            memcpy(data, buf + currentPtr, BLOCK_SIZE);
-            currentPtr += BLOCK_SIZE;
+    // Only the blocks this inode maps are written back; a snapshot has
+    // nothing left to write
+    int inum = nufs_tree_lookup(path);
+    if (snapshot_path(path)) {
+        rv = 0;
+    } else if (inum < 0) {
+        rv = -ENOENT;
+    } else {
+        // Writes still buffered go to the file first, and a small file is
+        // packed before its blocks are written back
+        wbuf_flush_node(get_inode(inum));
+        rv = wbuf_sync(nufs_handle(fi));
+        int packed = nufs_pack_tail(get_inode(inum));
+        rv = rv < 0 ? rv : packed;
+        if (rv >= 0) {
+            inode_lock(get_inode(inum), 0);
+            rv = inode_sync(inum);
+            inode_unlock(get_inode(inum), 0);
         }
     }
 
-    // Update inode size and modification time
-    node->size = size + offset;
-    node->time = time(0);
+    // Print debugging information
+    printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+    return rv;
+}
+
+// Flushes a directory's entries and metadata blocks to the image.
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
     // Placeholder value for return
-    int rv = size;
+    int rv = 0;
+
+    // A directory's entries live in its data blocks, so this is the same walk
+    int inum = nufs_tree_lookup(path);
+    if (snapshot_path(path)) {
+        rv = 0;
+    } else if (inum < 0) {
+        rv = -ENOENT;
+    } else {
+        rv = inode_sync(inum);
+    }
 
     // Print debugging information
-    printf("node size: %d\n", node->size);
-    printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    printf("fsyncdir(%s, %d) -> %d\n", path, datasync, rv);
     return rv;
 }
 
@@ -317,11 +1009,25 @@ int nufs_utimens(const char* path, const struct timespec ts[2])
     // Placeholder value for return
     int rv = 0;
 
-    // Retrieve the inode associated with the file path
-    inode_t* node = get_inode(tree_lookup(path));
-    
+    // Snapshots are read-only
+    if (snapshot_path(path)) {
+        return -EROFS;
+    }
+
+    // Retrieve the inode associated with the file path; writes still
+    // buffered must not set the time again later
+    int inum = nufs_tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    inode_t* node = get_inode(inum);
+    wbuf_flush_node(node);
+    journal_begin();
+
     // Update inode modification time
     node->time = ts[1].tv_sec;
+    inode_dirty(node);
+    journal_end();
 
     // Print debugging information
     printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
@@ -329,11 +1035,95 @@ int nufs_utimens(const char* path, const struct timespec ts[2])
     return rv;
 }
 
+// Handles nufs' own ioctls. NUFS_IOC_CLONE_RANGE shares the blocks of a
+// range of another file with this one (see clone.h). The source may be in
+// a snapshot, which restores it without copying data. FS_IOC_GETFLAGS and
+// FS_IOC_SETFLAGS expose the compression flag to lsattr and chattr +c.
+// NUFS_IOC_DEDUP_STATS reports on deduplication (see dedup.h),
+// NUFS_IOC_CHECKSUM_STATS on checksums (see checksum.h), and
+// NUFS_IOC_WRITEBACK_STATS on the writeback of buffered writes (see
+// writeback.h).
 int nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
            unsigned int flags, void* data)
 {
     // Placeholder value for return
-    int rv = -1;
+    int rv = -ENOTTY;
+
+    if ((unsigned int)cmd == NUFS_IOC_CLONE_RANGE) {
+        clone_args_t* args = data;
+        args->src[CLONE_PATH - 1] = 0;
+
+        inode_t* src = nufs_lookup(args->src);
+        int dst = nufs_tree_lookup(path);
+        if (snapshot_path(path)) {
+            rv = -EROFS;
+        } else if (!src || dst < 0) {
+            rv = -ENOENT;
+        } else if (args->src_offset > INT64_MAX || args->src_length > INT64_MAX ||
+                   args->dest_offset > INT64_MAX) {
+            rv = -EFBIG;
+        } else {
+            wbuf_flush_node(src);
+            wbuf_flush_node(get_inode(dst));
+            journal_begin();
+            inode_lock_pair(get_inode(dst), src);
+            rv = inode_clone(get_inode(dst), args->dest_offset,
+                             src, args->src_offset, args->src_length);
+            inode_unlock_pair(get_inode(dst), src);
+            journal_end();
+            nufs_cached[dst].time = -1;
+            rv = rv < 0 ? rv : 0;
+        }
+    }
+
+    if ((unsigned int)cmd == FS_IOC_GETFLAGS) {
+        inode_t* node = nufs_lookup(path);
+        if (!node) {
+            rv = -ENOENT;
+        } else {
+            *(unsigned int*)data = node->flags & INODE_COMPRESS ? FS_COMPR_FL : 0;
+            rv = 0;
+        }
+    }
+
+    if ((unsigned int)cmd == FS_IOC_SETFLAGS) {
+        int inum = nufs_tree_lookup(path);
+        unsigned int flags = *(unsigned int*)data;
+        if (snapshot_path(path)) {
+            rv = -EROFS;
+        } else if (inum < 0) {
+            rv = -ENOENT;
+        } else if (flags & ~FS_COMPR_FL) {
+            rv = -EOPNOTSUPP;
+        } else {
+            // Takes effect for data written from now on, not for the
+            // writes still buffered
+            inode_t* node = get_inode(inum);
+            wbuf_flush_node(node);
+            journal_begin();
+            inode_lock(node, 1);
+            node->flags = (node->flags & ~INODE_COMPRESS) | (flags ? INODE_COMPRESS : 0);
+            inode_dirty(node);
+            inode_unlock(node, 1);
+            journal_end();
+            rv = 0;
+        }
+    }
+
+    if ((unsigned int)cmd == NUFS_IOC_DEDUP_STATS) {
+        dedup_get_stats((dedup_stats_t*)data);
+        rv = 0;
+    }
+
+    if ((unsigned int)cmd == NUFS_IOC_CHECKSUM_STATS) {
+        checksum_get_stats((checksum_stats_t*)data);
+        rv = 0;
+    }
+
+    if ((unsigned int)cmd == NUFS_IOC_WRITEBACK_STATS) {
+        writeback_get_stats((writeback_stats_t*)data);
+        rv = 0;
+    }
 
     // Print debugging information
     printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
@@ -345,11 +1135,16 @@ int nufs_symlink(const char* to, const char* from) {
     int rv = 0;
 
     // Create a symbolic link by creating a new inode and writing the target path
+    journal_begin();
     rv = nufs_mknod(from, 0120000, 0);
+    if (rv >= 0) {
+        rv = nufs_write(from, to , strlen(to), 0, 0);
+        nufs_pack_tail(nufs_lookup(from));
+    }
+    journal_end();
     if (rv < 0) {
         return rv;
     }
-    rv = nufs_write(from, to , strlen(to), 0, 0);
 
     // Print debugging information
     printf("symlink(%s, %s) -> (%d)\n", from, to, rv);
@@ -368,12 +1163,408 @@ int nufs_readlink(const char* path, char* buf, size_t size) {
     return rv;
 }
 
+// Sets an extended attribute (see xattr.h).
+int nufs_setxattr(const char* path, const char* name, const char* value,
+              size_t size, int flags)
+{
+    int rv = 0;
+
+    // Snapshots are read-only
+    int inum = nufs_tree_lookup(path);
+    if (snapshot_path(path)) {
+        rv = -EROFS;
+    } else if (inum < 0) {
+        rv = -ENOENT;
+    } else {
+        wbuf_flush_node(get_inode(inum));
+        journal_begin();
+        rv = xattr_set(get_inode(inum), name, value, size, flags);
+        journal_end();
+    }
+
+    printf("setxattr(%s, %s, %zu) -> %d\n", path, name, size, rv);
+    return rv;
+}
+
+// Reads an extended attribute.
+int nufs_getxattr(const char* path, const char* name, char* value, size_t size)
+{
+    inode_t* node = nufs_lookup(path);
+    int rv = node ? xattr_get(node, name, value, size) : -ENOENT;
+
+    printf("getxattr(%s, %s, %zu) -> %d\n", path, name, size, rv);
+    return rv;
+}
+
+// Lists the names of the extended attributes.
+int nufs_listxattr(const char* path, char* list, size_t size)
+{
+    inode_t* node = nufs_lookup(path);
+    int rv = node ? xattr_list(node, list, size) : -ENOENT;
+
+    printf("listxattr(%s, %zu) -> %d\n", path, size, rv);
+    return rv;
+}
+
+// Removes an extended attribute.
+int nufs_removexattr(const char* path, const char* name)
+{
+    int rv = 0;
+
+    // Snapshots are read-only
+    int inum = nufs_tree_lookup(path);
+    if (snapshot_path(path)) {
+        rv = -EROFS;
+    } else if (inum < 0) {
+        rv = -ENOENT;
+    } else {
+        wbuf_flush_node(get_inode(inum));
+        journal_begin();
+        rv = xattr_remove(get_inode(inum), name);
+        journal_end();
+    }
+
+    printf("removexattr(%s, %s) -> %d\n", path, name, rv);
+    return rv;
+}
+
+// Sets up per-mount state and starts background work once FUSE has
+// daemonized the process.
+void* nufs_init(struct fuse_conn_info *conn)
+{
+    // No page cache is trusted until its file has been released once
+    int inodes = get_superblock()->inode_count;
+    nufs_cached = malloc(inodes * sizeof(cached_file_t));
+    for (int ii = 0; ii < inodes; ++ii) {
+        nufs_cached[ii].time = -1;
+    }
+
+    dedup_set_enabled(nufs_opts.dedup);
+    journal_start();
+    blocks_start();
+    tier_start();
+
+    // Buffered writes are written out by workers, on a timer
+    writeback_start(nufs_opts.writeback, wbuf_write_out);
+    wbuf_stop = 0;
+    int rv = pthread_create(&wbuf_thread, 0, wbuf_main, 0);
+    assert(rv == 0);
+    wbuf_running = 1;
+
+    printf("init()\n");
+    return NULL;
+}
+
+// Writes out what is buffered, checkpoints the journal, closes the trace
+// and unmaps the image on unmount.
+void nufs_destroy(void *private_data)
+{
+    if (wbuf_running) {
+        pthread_mutex_lock(&wbuf_lock);
+        wbuf_stop = 1;
+        pthread_cond_signal(&wbuf_cond);
+        pthread_mutex_unlock(&wbuf_lock);
+        pthread_join(wbuf_thread, 0);
+        wbuf_running = 0;
+    }
+    wbuf_flush_node(0);
+    writeback_stop();
+
+    trace_close();
+    blocks_free();
+    free(nufs_cached);
+    printf("destroy()\n");
+}
+
+// Traced callbacks, installed by nufs_trace_ops(). Each calls the plain
+// callback and records it once it returns (see trace.h).
+
+static uint64_t trace_fh(struct fuse_file_info* fi)
+{
+    return fi ? fi->fh : 0;
+}
+
+static int traced_access(const char* path, int mask)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_access(path, mask);
+    trace_log(&(trace_rec_t){ .op = TRACE_ACCESS, .result = rv, .mode = mask }, path, 0, start);
+    return rv;
+}
+
+static int traced_getattr(const char* path, struct stat* st)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_getattr(path, st);
+    trace_log(&(trace_rec_t){ .op = TRACE_GETATTR, .result = rv }, path, 0, start);
+    return rv;
+}
+
+static int traced_statfs(const char* path, struct statvfs* st)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_statfs(path, st);
+    trace_log(&(trace_rec_t){ .op = TRACE_STATFS, .result = rv }, path, 0, start);
+    return rv;
+}
+
+static int traced_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info* fi)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_readdir(path, buf, filler, offset, fi);
+    trace_log(&(trace_rec_t){ .op = TRACE_READDIR, .result = rv, .offset = offset }, path, 0, start);
+    return rv;
+}
+
+static int traced_mknod(const char* path, mode_t mode, dev_t rdev)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_mknod(path, mode, rdev);
+    trace_log(&(trace_rec_t){ .op = TRACE_MKNOD, .result = rv, .mode = mode }, path, 0, start);
+    return rv;
+}
+
+static int traced_mkdir(const char* path, mode_t mode)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_mkdir(path, mode);
+    trace_log(&(trace_rec_t){ .op = TRACE_MKDIR, .result = rv, .mode = mode }, path, 0, start);
+    return rv;
+}
+
+static int traced_link(const char* from, const char* to)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_link(from, to);
+    trace_log(&(trace_rec_t){ .op = TRACE_LINK, .result = rv }, from, to, start);
+    return rv;
+}
+
+static int traced_unlink(const char* path)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_unlink(path);
+    trace_log(&(trace_rec_t){ .op = TRACE_UNLINK, .result = rv }, path, 0, start);
+    return rv;
+}
+
+static int traced_rmdir(const char* path)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_rmdir(path);
+    trace_log(&(trace_rec_t){ .op = TRACE_RMDIR, .result = rv }, path, 0, start);
+    return rv;
+}
+
+static int traced_rename(const char* from, const char* to)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_rename(from, to);
+    trace_log(&(trace_rec_t){ .op = TRACE_RENAME, .result = rv }, from, to, start);
+    return rv;
+}
+
+static int traced_chmod(const char* path, mode_t mode)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_chmod(path, mode);
+    trace_log(&(trace_rec_t){ .op = TRACE_CHMOD, .result = rv, .mode = mode }, path, 0, start);
+    return rv;
+}
+
+static int traced_truncate(const char* path, off_t size)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_truncate(path, size);
+    trace_log(&(trace_rec_t){ .op = TRACE_TRUNCATE, .result = rv, .size = size }, path, 0, start);
+    return rv;
+}
+
+static int traced_open(const char* path, struct fuse_file_info* fi)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_open(path, fi);
+    trace_log(&(trace_rec_t){ .op = TRACE_OPEN, .result = rv, .mode = fi->flags,
+                              .handle = trace_fh(fi) }, path, 0, start);
+    return rv;
+}
+
+static int traced_read(const char* path, char* buf, size_t size, off_t offset,
+                       struct fuse_file_info* fi)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_read(path, buf, size, offset, fi);
+    trace_log(&(trace_rec_t){ .op = TRACE_READ, .result = rv, .handle = trace_fh(fi),
+                              .offset = offset, .size = size }, path, 0, start);
+    return rv;
+}
+
+static int traced_write(const char* path, const char* buf, size_t size, off_t offset,
+                        struct fuse_file_info* fi)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_write(path, buf, size, offset, fi);
+    trace_log(&(trace_rec_t){ .op = TRACE_WRITE, .result = rv, .handle = trace_fh(fi),
+                              .offset = offset, .size = size }, path, 0, start);
+    return rv;
+}
+
+static int traced_flush(const char* path, struct fuse_file_info* fi)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_flush(path, fi);
+    trace_log(&(trace_rec_t){ .op = TRACE_FLUSH, .result = rv, .handle = trace_fh(fi) }, path, 0, start);
+    return rv;
+}
+
+static int traced_release(const char* path, struct fuse_file_info* fi)
+{
+    // The handle is freed by the release, so it is taken first
+    uint64_t handle = trace_fh(fi);
+    uint64_t start = trace_now();
+    int rv = nufs_release(path, fi);
+    trace_log(&(trace_rec_t){ .op = TRACE_RELEASE, .result = rv, .handle = handle }, path, 0, start);
+    return rv;
+}
+
+static int traced_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_fsync(path, datasync, fi);
+    trace_log(&(trace_rec_t){ .op = TRACE_FSYNC, .result = rv, .mode = datasync,
+                              .handle = trace_fh(fi) }, path, 0, start);
+    return rv;
+}
+
+static int traced_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_fsyncdir(path, datasync, fi);
+    trace_log(&(trace_rec_t){ .op = TRACE_FSYNCDIR, .result = rv, .mode = datasync }, path, 0, start);
+    return rv;
+}
+
+static int traced_utimens(const char* path, const struct timespec ts[2])
+{
+    uint64_t start = trace_now();
+    int rv = nufs_utimens(path, ts);
+    trace_log(&(trace_rec_t){ .op = TRACE_UTIMENS, .result = rv, .arg = ts[1].tv_sec }, path, 0, start);
+    return rv;
+}
+
+static int traced_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
+                        unsigned int flags, void* data)
+{
+    trace_rec_t rec = { .op = TRACE_IOCTL, .mode = cmd, .handle = trace_fh(fi) };
+    const char* src = 0;
+    if ((unsigned int)cmd == NUFS_IOC_CLONE_RANGE) {
+        clone_args_t* args = data;
+        args->src[CLONE_PATH - 1] = 0;
+        src = args->src;
+        rec.offset = args->dest_offset;
+        rec.size = args->src_length;
+        rec.arg = args->src_offset;
+    } else if ((unsigned int)cmd == FS_IOC_SETFLAGS) {
+        rec.arg = *(unsigned int*)data;
+    }
+
+    uint64_t start = trace_now();
+    rec.result = nufs_ioctl(path, cmd, arg, fi, flags, data);
+    trace_log(&rec, path, src, start);
+    return rec.result;
+}
+
+static int traced_readlink(const char* path, char* buf, size_t size)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_readlink(path, buf, size);
+    trace_log(&(trace_rec_t){ .op = TRACE_READLINK, .result = rv, .size = size }, path, 0, start);
+    return rv;
+}
+
+static int traced_symlink(const char* to, const char* from)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_symlink(to, from);
+    trace_log(&(trace_rec_t){ .op = TRACE_SYMLINK, .result = rv }, from, to, start);
+    return rv;
+}
+
+static int traced_setxattr(const char* path, const char* name, const char* value,
+                           size_t size, int flags)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_setxattr(path, name, value, size, flags);
+    trace_log(&(trace_rec_t){ .op = TRACE_SETXATTR, .result = rv, .mode = flags,
+                              .size = size }, path, name, start);
+    return rv;
+}
+
+static int traced_getxattr(const char* path, const char* name, char* value, size_t size)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_getxattr(path, name, value, size);
+    trace_log(&(trace_rec_t){ .op = TRACE_GETXATTR, .result = rv, .size = size }, path, name, start);
+    return rv;
+}
+
+static int traced_listxattr(const char* path, char* list, size_t size)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_listxattr(path, list, size);
+    trace_log(&(trace_rec_t){ .op = TRACE_LISTXATTR, .result = rv, .size = size }, path, 0, start);
+    return rv;
+}
+
+static int traced_removexattr(const char* path, const char* name)
+{
+    uint64_t start = trace_now();
+    int rv = nufs_removexattr(path, name);
+    trace_log(&(trace_rec_t){ .op = TRACE_REMOVEXATTR, .result = rv }, path, name, start);
+    return rv;
+}
+
+// Swaps the callbacks of ops for the traced ones. The trace itself is
+// opened with trace_open().
+void nufs_trace_ops(struct fuse_operations* ops)
+{
+    ops->access   = traced_access;
+    ops->getattr  = traced_getattr;
+    ops->statfs   = traced_statfs;
+    ops->readdir  = traced_readdir;
+    ops->mknod    = traced_mknod;
+    ops->mkdir    = traced_mkdir;
+    ops->link     = traced_link;
+    ops->unlink   = traced_unlink;
+    ops->rmdir    = traced_rmdir;
+    ops->rename   = traced_rename;
+    ops->chmod    = traced_chmod;
+    ops->truncate = traced_truncate;
+    ops->open     = traced_open;
+    ops->read     = traced_read;
+    ops->write    = traced_write;
+    ops->flush    = traced_flush;
+    ops->release  = traced_release;
+    ops->fsync    = traced_fsync;
+    ops->fsyncdir = traced_fsyncdir;
+    ops->utimens  = traced_utimens;
+    ops->ioctl    = traced_ioctl;
+    ops->readlink = traced_readlink;
+    ops->symlink  = traced_symlink;
+    ops->setxattr = traced_setxattr;
+    ops->getxattr = traced_getxattr;
+    ops->listxattr = traced_listxattr;
+    ops->removexattr = traced_removexattr;
+}
+
 void nufs_init_ops(struct fuse_operations* ops)
 {
     // Initialize the FUSE operations structure with implemented callbacks
     memset(ops, 0, sizeof(struct fuse_operations));
     ops->access   = nufs_access;
     ops->getattr  = nufs_getattr;
+    ops->statfs   = nufs_statfs;
     ops->readdir  = nufs_readdir;
     ops->mknod    = nufs_mknod;
     ops->mkdir    = nufs_mkdir;
@@ -386,26 +1577,130 @@ void nufs_init_ops(struct fuse_operations* ops)
     ops->open     = nufs_open;
     ops->read     = nufs_read;
     ops->write    = nufs_write;
+    ops->flush    = nufs_flush;
+    ops->release  = nufs_release;
+    ops->fsync    = nufs_fsync;
+    ops->fsyncdir = nufs_fsyncdir;
     ops->utimens  = nufs_utimens;
     ops->ioctl    = nufs_ioctl;
     ops->readlink = nufs_readlink;
     ops->symlink  = nufs_symlink;
+    ops->setxattr = nufs_setxattr;
+    ops->getxattr = nufs_getxattr;
+    ops->listxattr = nufs_listxattr;
+    ops->removexattr = nufs_removexattr;
+    ops->init     = nufs_init;
+    ops->destroy  = nufs_destroy;
 }
 
+// Tools that call the callbacks themselves build without main()
+#ifndef NUFS_NO_MAIN
 struct fuse_operations nufs_ops;
 
+// Parses a size in bytes with an optional K, M or G suffix. Returns -1 if
+// it is malformed.
+static long long nufs_size(const char* text)
+{
+    char* end;
+    long long size = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size *= 1024;  // fall through
+    case 'M': case 'm': size *= 1024;  // fall through
+    case 'K': case 'k': size *= 1024; ++end;
+    }
+    return *end == 0 && end != text ? size : -1;
+}
+
+// Hands the stripe options to the block layer. Returns 0, or -EINVAL if
+// they are malformed.
+static int nufs_set_stripe()
+{
+    static const char* members[BLOCKS_STRIPE_MAX];
+    int count = 0;
+    for (char* path = strtok(nufs_opts.stripe, ":"); path; path = strtok(0, ":")) {
+        if (count == BLOCKS_STRIPE_MAX) {
+            return -EINVAL;
+        }
+        members[count++] = path;
+    }
+
+    long long unit = 0;
+    if (nufs_opts.stripe_unit) {
+        unit = nufs_size(nufs_opts.stripe_unit);
+        if (unit <= 0 || unit > INT_MAX) {
+            return -EINVAL;
+        }
+    }
+    return blocks_set_stripe(members, count, unit);
+}
+
+// Hands the tier options to the block layer. Returns 0, or -EINVAL if
+// they are malformed.
+static int nufs_set_tier()
+{
+    long long fast = 0;
+    if (nufs_opts.tier_size) {
+        fast = nufs_size(nufs_opts.tier_size);
+        if (fast <= 0) {
+            return -EINVAL;
+        }
+    }
+    tier_set_rate(nufs_opts.migrate);
+    return blocks_set_tier(nufs_opts.tier, fast);
+}
+
 int main(int argc, char *argv[])
 {
     // Ensure valid command line arguments
-    assert(argc > 2 && argc < 6);
+    assert(argc > 2);
 
     // Print information about mounting data file
     printf("TODO: mount %s as data file\n", argv[argc-1]);
 
+    // Take out our own mount options, leaving the rest to FUSE
+    const char* image = argv[--argc];
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &nufs_opts, nufs_opt_spec, NULL) != 0) {
+        return 1;
+    }
+
     // Initialize block system and FUSE operations
-    blocks_init(argv[--argc]);
+    blocks_set_map(nufs_opts.hugepages | nufs_opts.populate | nufs_opts.access | nufs_opts.memory);
+    if (nufs_opts.checkpoint > 0) {
+        blocks_set_checkpoint(nufs_opts.checkpoint);
+    }
+    if (nufs_opts.writeback < 0) {
+        fprintf(stderr, "%s: writeback takes a number of threads\n", image);
+        return 1;
+    }
+    if (nufs_opts.stripe && nufs_set_stripe() < 0) {
+        fprintf(stderr, "%s: at most %d stripe members and a positive stripe unit\n", image,
+                BLOCKS_STRIPE_MAX - 1);
+        return 1;
+    }
+    if (nufs_opts.migrate < 0) {
+        fprintf(stderr, "%s: migrate takes a number of blocks per second\n", image);
+        return 1;
+    }
+    if (nufs_opts.tier && nufs_set_tier() < 0) {
+        fprintf(stderr, "%s: tier_size takes a positive size\n", image);
+        return 1;
+    }
+    blocks_init(image);
     nufs_init_ops(&nufs_ops);
+    checksum_set_mode(nufs_opts.verify);
+    if (nufs_opts.trace) {
+        int rv = trace_open(nufs_opts.trace);
+        if (rv < 0) {
+            fprintf(stderr, "%s: %s\n", nufs_opts.trace, strerror(-rv));
+            return 1;
+        }
+        nufs_trace_ops(&nufs_ops);
+    }
+    fuse_opt_insert_arg(&args, 1, NUFS_TIMEOUTS);
+    fuse_opt_insert_arg(&args, 1, NUFS_IO_OPTS);
 
     // Run FUSE with the specified operations
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
 }
+#endif
@@ -0,0 +1,23 @@
+#ifndef NUFS_H
+#define NUFS_H
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+
+/*
+ * Represents the FUSE callbacks of nufs, for the mount and for tools that
+ * drive them directly on an image.
+ */
+
+/*
+ * Fills in ops with the nufs callbacks.
+ */
+void nufs_init_ops(struct fuse_operations* ops);
+
+/*
+ * Swaps the callbacks of ops for ones that record each call to the trace
+ * opened with trace_open() (see trace.h).
+ */
+void nufs_trace_ops(struct fuse_operations* ops);
+
+#endif
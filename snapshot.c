@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "snapshot.h"
+#include "blocks.h"
+#include "inode.h"
+#include "directory.h"
+#include "journal.h"
+#include "func.h"
+
+/*
+ * Represents functions for managing snapshots.
+ *
+ * A snapshot's header block lists the copies of the metadata blocks it
+ * took, in this order: block bitmap, inode bitmap, inode table blocks.
+ */
+
+// Position of each copy in a snapshot's header block
+#define SNAP_BBM  0
+#define SNAP_IBM  1
+#define SNAP_ITAB 2
+
+// Number of snapshot slots in the table, which takes the first 4 KiB of its
+// block whatever the block size
+static const int SNAP_COUNT = 4096 / sizeof(snapshot_t);
+
+// Stands in for /.snapshots, which has no inode of its own
+static inode_t snapshot_root = { 2, 040555, 0, {0, 0}, 0, 0 };
+
+/*
+ * Returns the snapshot table.
+ */
+static snapshot_t* snapshot_table()
+{
+    return (snapshot_t*)blocks_get_block(get_superblock()->snap_block);
+}
+
+/*
+ * Returns the number of metadata blocks a snapshot copies.
+ */
+static int snapshot_copies()
+{
+    return SNAP_ITAB + get_superblock()->itab_blocks;
+}
+
+/*
+ * Returns the snapshot with the given name, or null if there is none.
+ */
+static snapshot_t* snapshot_find(const char* name)
+{
+    snapshot_t* table = snapshot_table();
+    for (int ii = 0; ii < SNAP_COUNT; ++ii) {
+        if (table[ii].name[0] != 0 && streq(table[ii].name, name)) {
+            return &table[ii];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the given inode as it was when the snapshot was taken.
+ */
+static inode_t* snapshot_inode(snapshot_t* snap, int inum)
+{
+    int* copies = blocks_get_block(snap->hdr);
+    int per_block = BLOCK_SIZE / sizeof(inode_t);
+    inode_t* itab = blocks_get_block(copies[SNAP_ITAB + inum / per_block]);
+    return itab + inum % per_block;
+}
+
+/*
+ * Recomputes the frozen blocks from the block bitmaps of every snapshot.
+ */
+static void snapshot_freeze_all()
+{
+    snapshot_t* table = snapshot_table();
+
+    blocks_thaw();
+    for (int ii = 0; ii < SNAP_COUNT; ++ii) {
+        if (table[ii].name[0] != 0) {
+            int* copies = blocks_get_block(table[ii].hdr);
+            blocks_freeze(blocks_get_block(copies[SNAP_BBM]));
+        }
+    }
+}
+
+/*
+ * Freezes the blocks of every existing snapshot.
+ */
+void snapshot_init()
+{
+    snapshot_freeze_all();
+}
+
+/*
+ * Returns whether the path is /.snapshots or lies below it.
+ */
+int snapshot_path(const char* path)
+{
+    int len = strlen(SNAPSHOT_DIR);
+    return strncmp(path, SNAPSHOT_DIR, len) == 0 && (path[len] == 0 || path[len] == '/');
+}
+
+/*
+ * Returns the snapshot name if the path is exactly /.snapshots/<name>.
+ */
+const char* snapshot_name(const char* path)
+{
+    if (!snapshot_path(path) || path[strlen(SNAPSHOT_DIR)] == 0) {
+        return 0;
+    }
+
+    const char* name = path + strlen(SNAPSHOT_DIR) + 1;
+    return *name != 0 && strchr(name, '/') == 0 ? name : 0;
+}
+
+/*
+ * Takes a snapshot of the live tree.
+ *
+ * The header and copy blocks are allocated first, so the copied block
+ * bitmap already marks them used.
+ */
+int snapshot_create(const char* name)
+{
+    if (strlen(name) >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    if (snapshot_find(name)) {
+        return -EEXIST;
+    }
+
+    snapshot_t* table = snapshot_table();
+    int slot = 0;
+    while (slot < SNAP_COUNT && table[slot].name[0] != 0) {
+        ++slot;
+    }
+    if (slot == SNAP_COUNT) {
+        return -ENOSPC;
+    }
+
+    superblock_t* sb = get_superblock();
+    int count = snapshot_copies();
+    int sources[count];
+    sources[SNAP_BBM] = sb->bbm_block;
+    sources[SNAP_IBM] = sb->ibm_block;
+    for (int ii = 0; ii < sb->itab_blocks; ++ii) {
+        sources[SNAP_ITAB + ii] = sb->itab_block + ii;
+    }
+
+    journal_begin();
+
+    int hdr = alloc_block();
+    if (hdr < 0) {
+        journal_end();
+        return -ENOSPC;
+    }
+    journal_log(JR_ZERO, hdr, 0, 0);
+    memset(blocks_get_block(hdr), 0, BLOCK_SIZE);
+
+    int* copies = blocks_get_block(hdr);
+    for (int ii = 0; ii < count; ++ii) {
+        journal_log(JR_PTR, hdr, ii, 1);
+        copies[ii] = alloc_block();
+        if (copies[ii] < 0) {
+            copies[ii] = 0;
+            for (int jj = 0; jj < ii; ++jj) {
+                free_block(copies[jj]);
+            }
+            free_block(hdr);
+            journal_end();
+            return -ENOSPC;
+        }
+    }
+
+    for (int ii = 0; ii < count; ++ii) {
+        journal_log(JR_COPY, copies[ii], sources[ii], 0);
+        memcpy(blocks_get_block(copies[ii]), blocks_get_block(sources[ii]), BLOCK_SIZE);
+    }
+
+    journal_log(JR_SNAP, sb->snap_block, slot, 1);
+    strcpy(table[slot].name, name);
+    table[slot].hdr = hdr;
+    table[slot].time = time(0);
+
+    snapshot_freeze_all();
+    journal_end();
+
+    printf("+ snapshot_create(%s) -> %d\n", name, hdr);
+    return 0;
+}
+
+/*
+ * Deletes the named snapshot.
+ *
+ * Blocks only the snapshot still referred to become allocatable once the
+ * frozen set is recomputed without it.
+ */
+int snapshot_delete(const char* name)
+{
+    snapshot_t* snap = snapshot_find(name);
+    if (!snap) {
+        return -ENOENT;
+    }
+
+    journal_begin();
+
+    int* copies = blocks_get_block(snap->hdr);
+    for (int ii = 0; ii < snapshot_copies(); ++ii) {
+        free_block(copies[ii]);
+    }
+    free_block(snap->hdr);
+
+    journal_log(JR_SNAP, get_superblock()->snap_block, snap - snapshot_table(), 1);
+    memset(snap, 0, sizeof(snapshot_t));
+
+    snapshot_freeze_all();
+    journal_end();
+
+    printf("+ snapshot_delete(%s)\n", name);
+    return 0;
+}
+
+/*
+ * Looks up a path below /.snapshots by walking the snapshot's own copy of
+ * the inode table.
+ */
+inode_t* snapshot_lookup(const char* path)
+{
+    if (streq(path, SNAPSHOT_DIR) || streq(path, SNAPSHOT_DIR "/")) {
+        return &snapshot_root;
+    }
+    if (!snapshot_path(path)) {
+        return 0;
+    }
+
+    slist_t* parts = s_split(path + strlen(SNAPSHOT_DIR) + 1, '/');
+    snapshot_t* snap = parts ? snapshot_find(parts->data) : 0;
+    inode_t* node = snap ? snapshot_inode(snap, tree_lookup("/")) : 0;
+
+    for (slist_t* it = parts ? parts->next : 0; node && it; it = it->next) {
+        int inum = S_ISDIR(node->mode) ? directory_lookup(node, it->data) : -ENOENT;
+        node = inum < 0 ? 0 : snapshot_inode(snap, inum);
+    }
+
+    s_free(parts);
+    return node;
+}
+
+/*
+ * Lists the names of the existing snapshots.
+ */
+slist_t* snapshot_list()
+{
+    snapshot_t* table = snapshot_table();
+    slist_t* result = 0;
+    for (int ii = 0; ii < SNAP_COUNT; ++ii) {
+        if (table[ii].name[0] != 0) {
+            result = s_cons(table[ii].name, result);
+        }
+    }
+    return result;
+}
+
+/*
+ * Stores the blocks the snapshots hold themselves into bnums.
+ */
+int snapshot_blocks(int* bnums)
+{
+    snapshot_t* table = snapshot_table();
+    int count = 0;
+    for (int ii = 0; ii < SNAP_COUNT; ++ii) {
+        if (table[ii].name[0] == 0) {
+            continue;
+        }
+        int* copies = blocks_get_block(table[ii].hdr);
+        if (bnums) {
+            bnums[count] = table[ii].hdr;
+            memcpy(bnums + count + 1, copies, snapshot_copies() * sizeof(int));
+        }
+        count += 1 + snapshot_copies();
+    }
+    return count;
+}
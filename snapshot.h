@@ -0,0 +1,90 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <time.h>
+
+#include "inode.h"
+#include "slist.h"
+#include "directory.h"
+
+/*
+ * Represents read-only point-in-time snapshots of the file system.
+ *
+ * Taking a snapshot copies the block bitmap, the inode bitmap and the inode
+ * table; no data or directory block is copied. Every block the snapshot's
+ * block bitmap marks as used stays frozen while it exists: the live tree
+ * copies a frozen block before changing it (see inode_cow_pnum()), and
+ * alloc_block() never hands one out, even once the live tree has let go of
+ * it. Deleting a snapshot thaws its blocks, which returns the ones no
+ * longer used anywhere to the free pool.
+ *
+ * Snapshots appear as /.snapshots/<name>. mkdir and rmdir there create and
+ * delete them; everything below is read-only.
+ */
+
+// Directory holding the snapshots, not listed in the root directory
+#define SNAPSHOT_DIR "/.snapshots"
+
+typedef struct snapshot {
+    char name[DIR_NAME];     // Name under /.snapshots, empty for a free slot
+    int hdr;                 // Block listing the copied metadata blocks
+    int _reserved;
+    time_t time;             // When the snapshot was taken
+} snapshot_t;
+
+/*
+ * Freezes the blocks of every existing snapshot.
+ *
+ * Called by blocks_init() once the journal has been replayed.
+ */
+void snapshot_init();
+
+/*
+ * Returns whether the path is /.snapshots or lies below it.
+ */
+int snapshot_path(const char* path);
+
+/*
+ * Returns the snapshot name if the path is exactly /.snapshots/<name>, or
+ * null otherwise.
+ */
+const char* snapshot_name(const char* path);
+
+/*
+ * Takes a snapshot of the live tree under the given name.
+ *
+ * Returns 0 on success, -EEXIST if the name is taken, -ENAMETOOLONG, or
+ * -ENOSPC if the table or the image is full.
+ */
+int snapshot_create(const char* name);
+
+/*
+ * Deletes the named snapshot and thaws its blocks.
+ *
+ * Returns 0 on success or -ENOENT.
+ */
+int snapshot_delete(const char* name);
+
+/*
+ * Looks up a path below /.snapshots.
+ *
+ * Returns the inode as it was when the snapshot was taken, a synthetic
+ * directory inode for /.snapshots itself, or null if there is none. The
+ * inode must not be modified.
+ */
+inode_t* snapshot_lookup(const char* path);
+
+/*
+ * Lists the names of the existing snapshots.
+ */
+slist_t* snapshot_list();
+
+/*
+ * Stores the blocks the snapshots hold themselves, their header blocks and
+ * metadata copies, into bnums, which must have room for all of them.
+ *
+ * Returns how many there are; passing null only counts them.
+ */
+int snapshot_blocks(int* bnums);
+
+#endif
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "tail.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "compress.h"
+#include "checksum.h"
+
+/*
+ * Represents functions for packing the tails of small files into shared
+ * fragment blocks.
+ */
+
+// Fragment blocks remembered as having units free
+#define TAIL_ROOM 16
+
+// Units taken in each block, 0 for a block that is no fragment block;
+// null until the first tail is packed or released after mounting
+static uint32_t* tail_used = 0;
+
+// Fragment blocks units were last freed in or handed out from
+static int tail_room[TAIL_ROOM];
+static int tail_room_next = 0;
+
+// Held shared by reads of packed tails, and exclusively by anything that
+// changes fragment blocks, so no read sees a block and its checksum differ
+static pthread_rwlock_t tail_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Returns whether a block map slot holds a packed tail.
+ */
+int tail_slot(int slot)
+{
+    return slot >= TAIL_SLOT;
+}
+
+/*
+ * Returns the fragment block a packed tail is in.
+ */
+int tail_block(int slot)
+{
+    return (slot - TAIL_SLOT) >> 10;
+}
+
+// First unit and number of units of a packed tail, and its units as a mask
+static int tail_first(int slot)
+{
+    return (slot >> 5) & 31;
+}
+
+static int tail_count(int slot)
+{
+    return (slot & 31) + 1;
+}
+
+static uint32_t tail_mask(int first, int count)
+{
+    return (uint32_t)(((uint64_t)1 << count) - 1) << first;
+}
+
+static char* tail_data(int slot)
+{
+    return (char*)blocks_get_block(tail_block(slot)) + tail_first(slot) * TAIL_UNIT;
+}
+
+/*
+ * Remembers a fragment block as having units free, unless it already is.
+ */
+static void tail_remember(int bnum)
+{
+    for (int ii = 0; ii < TAIL_ROOM; ++ii) {
+        if (tail_room[ii] == bnum) {
+            return;
+        }
+    }
+    tail_room[tail_room_next] = bnum;
+    tail_room_next = (tail_room_next + 1) % TAIL_ROOM;
+}
+
+/*
+ * Forgets the units taken, to be found again when they are first needed.
+ */
+void tail_init()
+{
+    free(tail_used);
+    tail_used = 0;
+    memset(tail_room, 0, sizeof(tail_room));
+    tail_room_next = 0;
+}
+
+/*
+ * Finds the units taken in the fragment blocks of the live tree, unless
+ * that is done already. Called with tail_lock held exclusively.
+ */
+static void tail_scan()
+{
+    if (tail_used) {
+        return;
+    }
+    superblock_t* sb = get_superblock();
+    void* ibm = get_inode_bitmap();
+
+    tail_used = calloc(sb->block_count, sizeof(uint32_t));
+    assert(tail_used);
+
+    for (int inum = 0; inum < sb->inode_count; ++inum) {
+        inode_t* node = get_inode(inum);
+        if (!bitmap_get(ibm, inum) || S_ISDIR(node->mode)) {
+            continue;
+        }
+        for (int fpn = 0; fpn < 2; ++fpn) {
+            int slot = node->ptrs[fpn];
+            if (tail_slot(slot)) {
+                tail_used[tail_block(slot)] |= tail_mask(tail_first(slot), tail_count(slot));
+            }
+        }
+    }
+    for (int bnum = sb->data_block; bnum < sb->block_count; ++bnum) {
+        if (tail_used[bnum] && tail_used[bnum] != UINT32_MAX) {
+            tail_remember(bnum);
+        }
+    }
+}
+
+/*
+ * Forgets the units taken.
+ */
+void tail_free()
+{
+    free(tail_used);
+    tail_used = 0;
+}
+
+/*
+ * Takes a run of count adjacent units in a fragment block with room, or in
+ * a fresh one. Returns the slot of the run, or -1 if no block is free.
+ * Called with tail_lock held exclusively.
+ */
+static int tail_alloc(int count)
+{
+    tail_scan();
+    for (int ii = 0; ii < TAIL_ROOM; ++ii) {
+        int bnum = tail_room[ii];
+        if (!bnum || !tail_used[bnum] || block_frozen(bnum)) {
+            continue;
+        }
+        for (int first = 0; first + count <= TAIL_UNITS; ++first) {
+            uint32_t mask = tail_mask(first, count);
+            if ((tail_used[bnum] & mask) == 0 && block_share(bnum) == 0) {
+                tail_used[bnum] |= mask;
+                return TAIL_SLOT + (bnum << 10) + (first << 5) + count - 1;
+            }
+        }
+    }
+
+    // A fresh block starts zeroed, so bytes past each tail read as zeros
+    int bnum = alloc_block();
+    if (bnum < 0) {
+        return -1;
+    }
+    memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+    tail_used[bnum] = tail_mask(0, count);
+    tail_remember(bnum);
+    return TAIL_SLOT + (bnum << 10) + count - 1;
+}
+
+/*
+ * Hands back the units of a packed tail, freeing its fragment block with
+ * the last of them.
+ */
+static void tail_release(int slot)
+{
+    int bnum = tail_block(slot);
+
+    pthread_rwlock_wrlock(&tail_lock);
+    tail_scan();
+    tail_used[bnum] &= ~tail_mask(tail_first(slot), tail_count(slot));
+    if (tail_used[bnum]) {
+        tail_remember(bnum);
+    }
+    pthread_rwlock_unlock(&tail_lock);
+
+    free_block(bnum);
+}
+
+/*
+ * Releases what a block map slot refers to.
+ */
+void slot_release(int slot)
+{
+    if (tail_slot(slot)) {
+        tail_release(slot);
+    } else if (slot_block(slot)) {
+        free_block(slot_block(slot));
+    }
+}
+
+/*
+ * Copies part of the page of a packed tail.
+ */
+int tail_read(int slot, char* buf, int offset, int len)
+{
+    int have = tail_count(slot) * TAIL_UNIT - offset;
+    have = have < 0 ? 0 : have < len ? have : len;
+
+    pthread_rwlock_rdlock(&tail_lock);
+    int rv = checksum_verify(tail_block(slot));
+    if (rv == 0) {
+        memcpy(buf, tail_data(slot) + offset, have);
+    }
+    pthread_rwlock_unlock(&tail_lock);
+
+    memset(buf + have, 0, len - have);
+    return rv;
+}
+
+/*
+ * Writes part of the page of a packed tail in place.
+ */
+int tail_write(int slot, const char* buf, int offset, int len)
+{
+    int bnum = tail_block(slot);
+    if (offset + len > tail_count(slot) * TAIL_UNIT || block_frozen(bnum)) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&tail_lock);
+    blocks_dirty(bnum);
+    memcpy(tail_data(slot) + offset, buf, len);
+    checksum_seal(bnum);
+    pthread_rwlock_unlock(&tail_lock);
+    return 0;
+}
+
+/*
+ * Packs the last page of a file.
+ */
+int tail_pack(inode_t* node)
+{
+    if (S_ISDIR(node->mode) || (node->flags & INODE_COMPRESS) || node->size <= 0) {
+        return 0;
+    }
+
+    // Only a last page reached through a direct pointer is packed, so
+    // mounting finds every tail in the inode table
+    int fpn = (node->size - 1) >> BLOCK_SHIFT;
+    if (fpn >= 2) {
+        return 0;
+    }
+    int len = node->size - ((int64_t)fpn << BLOCK_SHIFT);
+    int count = (len + TAIL_UNIT - 1) / TAIL_UNIT;
+    int old = node->ptrs[fpn];
+    if (old <= 0 || tail_slot(old) || count > TAIL_MAX || block_refs(old) != 1 ||
+        block_frozen(old)) {
+        return 0;
+    }
+    if (checksum_verify(old) < 0) {
+        return -EIO;
+    }
+
+    pthread_rwlock_wrlock(&tail_lock);
+    int slot = tail_alloc(count);
+    if (slot < 0) {
+        pthread_rwlock_unlock(&tail_lock);
+        return 0;
+    }
+    int bnum = tail_block(slot);
+    blocks_dirty(bnum);
+    memcpy(tail_data(slot), blocks_get_block(old), len);
+    memset(tail_data(slot) + len, 0, count * TAIL_UNIT - len);
+    checksum_seal(bnum);
+    pthread_rwlock_unlock(&tail_lock);
+
+    inode_set_slot(node, fpn, slot);
+    free_block(old);
+
+    printf("+ tail_pack(%d bytes) -> %d units @%d in %d\n", len, count, tail_first(slot), bnum);
+    return 1;
+}
+
+/*
+ * Makes a packed tail a whole block again.
+ */
+int tail_promote(inode_t* node, int fpn)
+{
+    int slot = inode_get_pnum(node, fpn);
+    if (inode_map_prepare(node, fpn, 1) < 0) {
+        return -ENOSPC;
+    }
+    int bnum = alloc_block();
+    if (bnum < 0) {
+        return -ENOSPC;
+    }
+
+    blocks_dirty(bnum);
+    int rv = tail_read(slot, blocks_get_block(bnum), 0, BLOCK_SIZE);
+    if (rv < 0) {
+        free_block(bnum);
+        return rv;
+    }
+    checksum_seal(bnum);
+    inode_set_slot(node, fpn, bnum);
+    slot_release(slot);
+
+    printf("+ tail_promote(%d) -> %d\n", fpn, bnum);
+    return bnum;
+}
+
+/*
+ * Copies a packed tail.
+ */
+int tail_copy(int slot, int whole)
+{
+    if (whole) {
+        int bnum = alloc_block();
+        if (bnum < 0) {
+            return -ENOSPC;
+        }
+        blocks_dirty(bnum);
+        int rv = tail_read(slot, blocks_get_block(bnum), 0, BLOCK_SIZE);
+        if (rv < 0) {
+            free_block(bnum);
+            return rv;
+        }
+        checksum_seal(bnum);
+        return bnum;
+    }
+
+    pthread_rwlock_wrlock(&tail_lock);
+    if (checksum_verify(tail_block(slot)) < 0) {
+        pthread_rwlock_unlock(&tail_lock);
+        return -EIO;
+    }
+    int copy = tail_alloc(tail_count(slot));
+    if (copy < 0) {
+        pthread_rwlock_unlock(&tail_lock);
+        return -ENOSPC;
+    }
+    blocks_dirty(tail_block(copy));
+    memcpy(tail_data(copy), tail_data(slot), tail_count(slot) * TAIL_UNIT);
+    checksum_seal(tail_block(copy));
+    pthread_rwlock_unlock(&tail_lock);
+    return copy;
+}
@@ -0,0 +1,115 @@
+#ifndef TAIL_H
+#define TAIL_H
+
+#include "inode.h"
+
+/*
+ * Represents tail packing of small files.
+ *
+ * The last page of a file that fits in its direct pointers, if it holds at
+ * most half a block, is packed into a shared fragment block instead of a
+ * block of its own. Fragment blocks are split into TAIL_UNITS units, and a
+ * tail takes a run of adjacent units. Its block map slot records the
+ * fragment block and the run (see TAIL_SLOT), so a packed tail is read with
+ * one block touch, and bytes past its units read as zeros.
+ *
+ * A fragment block has one reference per tail packed in it, and is freed
+ * with the last. Which units are taken is only kept in memory: the first
+ * tail packed or released after mounting rebuilds it from the direct
+ * pointers of the inodes, so mounting itself scans nothing. Units are only
+ * handed out from blocks no snapshot has frozen.
+ *
+ * Files are packed when closed, synced or truncated, unless compressed,
+ * shared with a clone or frozen by a snapshot, so a file growing by appends
+ * is not packed and unpacked on every write. A write that fits in a tail's
+ * units is made in place; one that outgrows them, or to a frozen fragment
+ * block, first makes the tail a whole block again.
+ */
+
+// Units per fragment block, and the most units a tail is packed in
+#define TAIL_UNITS 32
+#define TAIL_MAX (TAIL_UNITS / 2)
+
+// Bytes per unit of the mounted image
+#define TAIL_UNIT (BLOCK_SIZE / TAIL_UNITS)
+
+// Block map slots from TAIL_SLOT on hold a packed tail: the fragment block
+// above bit 10, the first unit in bits 5-9 and the number of units less
+// one in bits 0-4. Block numbers stay below 2^19.
+#define TAIL_SLOT (1 << 30)
+
+/*
+ * Returns whether a block map slot holds a packed tail.
+ */
+int tail_slot(int slot);
+
+/*
+ * Returns the fragment block a packed tail is in.
+ */
+int tail_block(int slot);
+
+/*
+ * Forgets the units taken in the fragment blocks, so they are found again
+ * from the live tree when first needed.
+ *
+ * Called by blocks_init() when the image is mounted.
+ */
+void tail_init();
+
+/*
+ * Forgets the units taken.
+ *
+ * Called by blocks_free().
+ */
+void tail_free();
+
+/*
+ * Copies len bytes at offset in the page of a packed tail into buf, zeros
+ * past its units.
+ *
+ * Returns 0, or -EIO if the fragment block fails its checksum.
+ */
+int tail_read(int slot, char* buf, int offset, int len);
+
+/*
+ * Writes len bytes from buf at offset in the page of a packed tail, in
+ * place.
+ *
+ * Returns 0, or -1 if they do not fit in its units or its fragment block is
+ * frozen; nothing is written then.
+ */
+int tail_write(int slot, const char* buf, int offset, int len);
+
+/*
+ * Packs the last page of a file, if it is small enough and owned by the
+ * file alone. Its block is verified first, so a bad page is not sealed
+ * again as good. Must be called inside a transaction.
+ *
+ * Returns whether it was packed, or -EIO if the block fails its checksum
+ * and stays where it is.
+ */
+int tail_pack(inode_t* node);
+
+/*
+ * Makes the packed tail at the given file page a whole block again. Must be
+ * called inside a transaction.
+ *
+ * Returns the block, -ENOSPC if none is free or -EIO.
+ */
+int tail_promote(inode_t* node, int fpn);
+
+/*
+ * Copies a packed tail to fresh units, or to a fresh block of its own if
+ * whole is set. Must be called inside a transaction.
+ *
+ * Returns the slot of the copy, -ENOSPC or -EIO.
+ */
+int tail_copy(int slot, int whole);
+
+/*
+ * Releases what a block map slot refers to: the units of a packed tail, or
+ * the block of any other slot.
+ */
+void slot_release(int slot);
+
+#endif
@@ -2,11 +2,13 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 58;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts) = @_;
+    $opts //= "";
+    system("(make mount NUFS_OPTS='$opts' 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -54,6 +56,10 @@ my $msg1 = read_text("one.txt");
 say "# '$msg0' eq '$msg1'?";
 ok($msg0 eq $msg1, "Read back data1 correctly.");
 
+open my $sfh, ">>", "mnt/one.txt";
+ok(($sfh and $sfh->sync), "fsync a file");
+close $sfh if $sfh;
+
 my $msg2 = "hello, two";
 write_text("two.txt", $msg2);
 ok(-e "mnt/two.txt", "File2 exists.");
@@ -171,5 +177,231 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+system("./nufs-clone mnt/larger.txt mnt/clone.txt");
+$back = read_text("clone.txt");
+ok($content eq $back, "Clone a file by sharing its blocks");
+
+mkdir("mnt/.snapshots/before");
+write_text("larger.txt", "overwritten");
+$back = read_text(".snapshots/before/larger.txt");
+ok($content eq $back, "Snapshot keeps the old contents");
+
+mkdir("mnt/packed");
+system("chattr +c mnt/packed >> test.log 2>&1");
+write_text("packed/larger.txt", $content);
+$back = read_text("packed/larger.txt");
+ok($content eq $back, "Read back a compressed file");
+
+write_text("cached.txt", "one");
+$back = read_text("cached.txt");
+link("mnt/cached.txt", "mnt/alias.txt");
+write_text("alias.txt", "two");
+$back = read_text("cached.txt");
+ok($back eq "two", "A write through a hard link is seen through the other name");
+
+system(q{python3 -c 'import os; os.setxattr("mnt/cached.txt", "user.tag", b"x" * 300)'});
+my $xattr = `python3 -c 'import os; print(len(os.getxattr("mnt/cached.txt", "user.tag")))'`;
+ok($xattr == 300, "Set and read back an extended attribute");
+
+mkdir("mnt/many");
+write_text("many/$_", $_) for (1..60);
+my @listed = sort { $a <=> $b } grep { /^\d+$/ } split /\n/, `ls -f mnt/many`;
+my $types = `find mnt/many -mindepth 1 -type f | wc -l`;
+ok("@listed" eq join(" ", 1..60) && $types == 60, "List a directory with many entries");
+
+open my $sparse, ">", "mnt/sparse.bin" or die "sparse.bin: $!";
+seek $sparse, 5 * 2**30, 0;
+print $sparse "far";
+close $sparse;
+my $far = read_text_slice("sparse.bin", 3, 5 * 2**30);
+ok($far eq "far" && -s "mnt/sparse.bin" == 5 * 2**30 + 3, "Write past 4 GiB into a sparse file");
+unlink("mnt/sparse.bin");
+
+my $stream = join(" ", map { sprintf("%07d", $_) } 1..20000);
+write_text("stream.txt", $stream);
+my $tail = read_text_slice("stream.txt", 4096, length($stream) - 100);
+$back = read_text("stream.txt");
+ok($back eq $stream && $tail eq substr($stream, -100) . "\n", "Stream a large file and read its tail");
+
+my ($total, $before) = split " ", `stat -f -c '%b %f' mnt`;
+unlink("mnt/stream.txt");
+my (undef, $after) = split " ", `stat -f -c '%b %f' mnt`;
+ok($total > 0 && $after - $before >= 30, "statfs reports blocks freed by an unlink");
+
+unmount();
+
+mount("-o dedup");
+write_text("twin.txt", $content);
+my $report = `./nufs-dedup mnt`;
+$back = read_text("twin.txt");
+ok($content eq $back && $report =~ /pages merged:\s+[1-9]/,
+   "Identical pages share their blocks");
+
+write_text("sealed.txt", "checksummed " x 1000);
+unmount();
+
+# Flip one byte of the file's data in the image
+open my $img, "+<", "data.nufs" or die "data.nufs: $!";
+binmode $img;
+my $image = do { local $/ = undef; <$img> };
+my $at = index($image, "checksummed " x 300);
+if ($at >= 0) {
+    seek $img, $at + 100, 0;
+    print $img "X";
+}
+close $img;
+
+mount();
+open my $fh, "<", "mnt/sealed.txt";
+my $sealed = $fh ? <$fh> : undef;
+ok($at >= 0 && !defined($sealed), "Reading a corrupted block fails");
+
+unmount();
+
+system("./fsck.nufs data.nufs >> test.log 2>&1");
+ok(system("./fsck.nufs -n data.nufs >> test.log 2>&1") == 0, "fsck.nufs leaves a consistent image");
+
+system("rm -rf unpacked repacked packed.nufs");
+system("./nufs-unpack data.nufs unpacked >> test.log 2>&1");
+system("./nufs-pack unpacked packed.nufs >> test.log 2>&1");
+system("./nufs-unpack packed.nufs repacked >> test.log 2>&1");
+my $same = system("diff -r unpacked repacked >> test.log 2>&1") == 0;
+$back = `cat unpacked/packed/larger.txt`;
+system("rm -rf repacked packed.nufs");
+ok($same && $back eq $content, "nufs-pack and nufs-unpack round trip a tree");
+
+system("./nufs-pack -b 64K unpacked packed.nufs >> test.log 2>&1");
+system("./nufs-unpack packed.nufs repacked >> test.log 2>&1");
+$same = system("diff -r unpacked repacked >> test.log 2>&1") == 0;
+my $wide = system("./fsck.nufs -n packed.nufs >> test.log 2>&1") == 0;
+ok($same && $wide, "Pack a tree into an image of 64 KiB blocks");
+system("rm -rf unpacked repacked packed.nufs");
+
+system("rm -f traced.nufs test.trace");
+system("cp data.nufs traced.nufs");
+mount("-o trace=test.trace");
+write_text("traced.txt", $content);
+$back = read_text("traced.txt");
+unmount();
+my $replay = `./nufs-replay test.trace traced.nufs 2>&1`;
+ok($back eq $content && $replay =~ /^write\s+[1-9]/m && $replay =~ /operations replayed/,
+   "nufs-replay plays back a recorded trace");
+system("rm -f traced.nufs test.trace");
+
+mount("-o hugepages,populate,access=random");
+$back = read_text("traced.txt");
+unmount();
+my $bench = `./nufs-bench -n 200 -r 1 data.nufs 2>&1`;
+ok($back eq $content && $bench =~ /^populate\s+\d/m, "Mount with each mapping policy and benchmark them");
+
+my $scale = `./nufs-scale -t 4 -n 10 -s 16K scale.nufs 2>&1`;
+ok($? == 0 && $scale =~ /^\s+4\s+\d+/m, "Create and append to files from several threads at once");
+
+system("rm -f data.nufs stripe1.nufs stripe2.nufs");
+system("./mkfs.nufs -s 4M -u 64K data.nufs stripe1.nufs stripe2.nufs >> test.log 2>&1");
+mount("-o stripe=stripe1.nufs:stripe2.nufs");
+write_text("striped.txt", $stream);
+$back = read_text("striped.txt");
+unmount();
+my $striped = system("./fsck.nufs -n data.nufs stripe1.nufs stripe2.nufs >> test.log 2>&1") == 0;
+ok($back eq $stream && $striped, "Stripe an image across three files");
+system("rm -f stripe1.nufs stripe2.nufs");
+
+system("rm -f data.nufs");
+mount("-o memory,checkpoint=1");
+write_text("kept.txt", $content);
+unmount();
+mount();
+$back = read_text("kept.txt");
+unmount();
+ok($back eq $content, "Keep the image in memory and checkpoint it to the file");
 
+mount();
+my $line = "=This string is fourty characters long.=";
+open my $log, ">", "mnt/appended.txt";
+syswrite($log, $line) for 1..2000;
+my $seen = -s "mnt/appended.txt";
+close $log;
+unmount();
+mount();
+$back = read_text("appended.txt");
+unmount();
+ok($seen == 80000 && $back eq $line x 2000, "Buffer small appends to an open file");
+
+mount("-o writeback=1");
+open $log, ">>", "mnt/appended.txt";
+syswrite($log, $line) for 1..2000;
+close $log;
+my $writeback = `./nufs-writeback mnt 2>&1`;
+$back = read_text("appended.txt");
+unmount();
+ok($back eq $line x 4000 && $writeback =~ /^written:\s+[1-9]\d* writes/m,
+   "Write buffered appends out on a worker thread");
+
+system("rm -f data.nufs slow.nufs");
+system("./mkfs.nufs -s 8M -t slow.nufs -T 4M data.nufs >> test.log 2>&1");
+mount("-o tier=slow.nufs,migrate=64");
+write_text("tiered.txt", $stream);
+$back = read_text("tiered.txt");
+unmount();
+my $tiered = system("./fsck.nufs -n -t slow.nufs data.nufs >> test.log 2>&1") == 0;
+ok($back eq $stream && $tiered && -s "slow.nufs" == 4 << 20,
+   "Keep an image in a fast and a slow tier");
+system("rm -f data.nufs slow.nufs");
+
+mount();
+mkdir("mnt/small");
+my (undef, $free) = split " ", `stat -f -c '%b %f' mnt`;
+write_text("small/$_", sprintf("%0300d", $_)) for (1..60);
+my (undef, $left) = split " ", `stat -f -c '%b %f' mnt`;
+write_text("small/7", "7" x 2000);
+my $intact = !grep { read_text("small/$_") ne sprintf("%0300d", $_) } grep { $_ != 7 } 1..60;
+$back = read_text("small/7");
+unmount();
+ok($free - $left <= 10 && $intact && $back eq "7" x 2000,
+   "Pack the tails of small files into shared blocks");
+
+system("rm -f data.nufs");
+mount();
+my (undef, $uncut) = split " ", `stat -f -c '%b %f' mnt`;
+write_text("cut.txt", "A" x 400000);
+truncate("mnt/cut.txt", 10);
+truncate("mnt/cut.txt", 9000);
+my $head = read_text_slice("cut.txt", 10, 0);
+my $gap = read_text_slice("cut.txt", 20, 5000);
+unmount();
+mount();
+my (undef, $cut) = split " ", `stat -f -c '%b %f' mnt`;
+unmount();
+ok($head eq "A" x 10 && $gap eq "\0" x 20 && $uncut - $cut <= 2,
+   "Release the blocks of a file cut short");
+
+system("rm -f data.nufs");
+mount();
+mkdir("mnt/gone");
+write_text("gone/$_", "x" x 5000) for (1..8);
+unlink("mnt/gone/$_") for (1..8);
+rmdir("mnt/gone");
+write_text("kept.txt", $msg0);
+open my $kfh, ">>", "mnt/kept.txt";
+$kfh->sync if $kfh;
+close $kfh if $kfh;
+# Killed after the commit and before any checkpoint
+system("pkill -9 -x nufs");
+sleep 1;
+unmount();
+mount();
+$back = read_text("kept.txt");
+my $removed = !-e "mnt/gone";
+unmount();
+ok($back eq $msg0 && $removed && system("./fsck.nufs -n data.nufs >> test.log 2>&1") == 0,
+   "Replay the journal after a crash without leaking blocks");
+
+system("rm -f data.nufs");
+mount();
+mkdir("mnt/full");
+my $made = grep { open(my $fh, ">", "mnt/full/$_") } 1..100;
+my $nospace = !open(my $nfh, ">", "mnt/full/more") && $!{ENOSPC};
+unmount();
+ok($made < 100 && $nospace && system("./fsck.nufs -n data.nufs >> test.log 2>&1") == 0,
+   "Fail to create in a full directory without orphaning inodes");
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "tier.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "journal.h"
+#include "checksum.h"
+#include "tail.h"
+
+/*
+ * Represents functions for tracking how hot each block of file data is and
+ * moving pages between the tiers of an image.
+ */
+
+// Heat of each block, null for an image with no tiers
+static uint8_t* tier_heat = 0;
+
+// Held shared by reads of file data, and exclusively by a batch of moves
+static pthread_rwlock_t tier_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int tier_rate = TIER_RATE;
+static int tier_decay_secs = TIER_DECAY;
+
+// Where the next batch goes on looking for pages to move
+static int tier_inum = 0;
+static int tier_fpn = 0;
+
+static pthread_mutex_t tier_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t tier_thread;
+static int tier_running = 0;
+static int tier_stop = 0;
+
+/*
+ * Sets the most blocks migration moves per second.
+ */
+void tier_set_rate(int blocks)
+{
+    tier_rate = blocks;
+}
+
+/*
+ * Sets the seconds in which heat halves.
+ */
+void tier_set_decay(int seconds)
+{
+    tier_decay_secs = seconds;
+}
+
+/*
+ * Starts every block of a tiered image out cold.
+ */
+void tier_init()
+{
+    free(tier_heat);
+    tier_heat = 0;
+    tier_inum = 0;
+    tier_fpn = 0;
+    if (blocks_tier_blocks()) {
+        tier_heat = calloc(get_superblock()->block_count, 1);
+        assert(tier_heat);
+    }
+}
+
+/*
+ * Stops the migration thread and frees the heat.
+ */
+void tier_free()
+{
+    if (tier_running) {
+        pthread_mutex_lock(&tier_mutex);
+        tier_stop = 1;
+        pthread_cond_signal(&tier_cond);
+        pthread_mutex_unlock(&tier_mutex);
+        pthread_join(tier_thread, 0);
+        tier_running = 0;
+    }
+    free(tier_heat);
+    tier_heat = 0;
+}
+
+/*
+ * Warms a run of blocks. Racing updates may lose a step, which is fine
+ * for a heuristic.
+ */
+void tier_touch(int bnum, int count)
+{
+    if (!tier_heat) {
+        return;
+    }
+    for (int ii = 0; ii < count; ++ii) {
+        if (tier_heat[bnum + ii] < UINT8_MAX) {
+            tier_heat[bnum + ii] += 1;
+        }
+    }
+}
+
+/*
+ * Holds off migration during a read.
+ */
+void tier_read_begin()
+{
+    if (tier_heat) {
+        pthread_rwlock_rdlock(&tier_lock);
+    }
+}
+
+/*
+ * Lets migration go on after a read.
+ */
+void tier_read_end()
+{
+    if (tier_heat) {
+        pthread_rwlock_unlock(&tier_lock);
+    }
+}
+
+/*
+ * Halves the heat of every block.
+ */
+void tier_decay()
+{
+    if (!tier_heat) {
+        return;
+    }
+    int count = get_superblock()->block_count;
+    for (int ii = 0; ii < count; ++ii) {
+        tier_heat[ii] >>= 1;
+    }
+}
+
+/*
+ * Returns the tier a page in the given block should move to, or -1 if it
+ * stays. up tells whether the fast tier has room for it.
+ */
+static int tier_target(int bnum, int up)
+{
+    if (block_refs(bnum) != 1 || block_frozen(bnum)) {
+        return -1;
+    }
+    if (bnum < blocks_tier_blocks()) {
+        return tier_heat[bnum] == 0 ? 1 : -1;
+    }
+    return up && tier_heat[bnum] >= TIER_HOT ? 0 : -1;
+}
+
+/*
+ * Moves a run of pages of a file to fresh adjacent blocks of the given
+ * tier. The blocks were verified against their checksums when the run was
+ * found, and the copies reach the image before the block map points at
+ * them. Returns the number of pages moved, 0 if the tier has no block free.
+ */
+static int tier_move(inode_t* node, int fpn, int run, int to)
+{
+    if (inode_map_prepare(node, fpn, run) < 0) {
+        return 0;
+    }
+    int got;
+    int first = alloc_extent_tier(to, run, &got);
+    if (first < 0) {
+        return 0;
+    }
+
+    int olds[got];
+    int news[got];
+    for (int ii = 0; ii < got; ++ii) {
+        olds[ii] = inode_get_pnum(node, fpn + ii);
+        news[ii] = first + ii;
+        blocks_dirty(news[ii]);
+        memcpy(blocks_get_block(news[ii]), blocks_get_block(olds[ii]), BLOCK_SIZE);
+        checksum_seal(news[ii]);
+    }
+    if (blocks_sync(news, got) < 0) {
+        // Left as they were; the copies are dropped
+        for (int ii = 0; ii < got; ++ii) {
+            free_block(news[ii]);
+        }
+        return 0;
+    }
+
+    for (int ii = 0; ii < got; ++ii) {
+        tier_heat[news[ii]] = tier_heat[olds[ii]];
+        tier_heat[olds[ii]] = 0;
+        inode_set_slot(node, fpn + ii, news[ii]);
+        free_block(olds[ii]);
+    }
+    return got;
+}
+
+/*
+ * Moves one batch of pages. The whole batch, looking for pages included,
+ * runs alone, so no block map changes under it.
+ */
+int tier_migrate()
+{
+    if (!tier_heat || tier_rate <= 0) {
+        return 0;
+    }
+    superblock_t* sb = get_superblock();
+    void* ibm = get_inode_bitmap();
+    int batch = tier_rate < TIER_BATCH ? tier_rate : TIER_BATCH;
+    int up = 0;
+    int down = 0;
+    int looked = 0;
+
+    pthread_rwlock_wrlock(&tier_lock);
+    journal_begin_exclusive();
+
+    int room = blocks_tier_free(0) - blocks_tier_blocks() / TIER_RESERVE;
+    while (up + down < batch && looked < TIER_SCAN) {
+        inode_t* node = get_inode(tier_inum);
+        int pages = bitmap_get(ibm, tier_inum) && S_ISREG(node->mode) ?
+                    bytes_to_blocks(node->size) : 0;
+        looked += 1;
+        if (tier_fpn >= pages) {
+            tier_inum = (tier_inum + 1) % sb->inode_count;
+            tier_fpn = 0;
+            continue;
+        }
+
+        // Pages going the same way are moved together, to adjacent blocks
+        int slot = inode_get_pnum(node, tier_fpn);
+        int to = slot > 0 && !tail_slot(slot) ? tier_target(slot, room - up > 0) : -1;
+
+        // A block that fails its checksum stays where it is, rather than
+        // being sealed again as good in the other tier
+        if (to >= 0 && checksum_verify(slot) < 0) {
+            fprintf(stderr, "nufs: block %d: left in its tier\n", slot);
+            to = -1;
+        }
+        int run = to < 0 ? 0 : 1;
+        while (run > 0 && up + down + run < batch && tier_fpn + run < pages &&
+               looked < TIER_SCAN) {
+            int next = inode_get_pnum(node, tier_fpn + run);
+            looked += 1;
+            if (next <= 0 || tail_slot(next) || tier_target(next, room - up - run > 0) != to ||
+                checksum_verify(next) < 0) {
+                break;
+            }
+            run += 1;
+        }
+        if (run == 0) {
+            tier_fpn += 1;
+            continue;
+        }
+
+        int moved = tier_move(node, tier_fpn, run, to);
+        if (moved == 0) {
+            // The tier is full; the pages are tried again next time round
+            tier_fpn += run;
+            continue;
+        }
+        tier_fpn += moved;
+        if (to == 0) {
+            up += moved;
+        } else {
+            down += moved;
+        }
+    }
+
+    journal_end();
+    pthread_rwlock_unlock(&tier_lock);
+
+    if (up + down > 0) {
+        printf("+ tier_migrate() -> %d (%d up, %d down)\n", up + down, up, down);
+    }
+    return up + down;
+}
+
+/*
+ * Moves batches of pages spread over each second, and cools every block
+ * down on time. Waits a whole second after a batch that found nothing.
+ */
+static void* tier_main(void* arg)
+{
+    time_t decayed = time(0);
+    int moved = 1;
+
+    pthread_mutex_lock(&tier_mutex);
+    while (!tier_stop) {
+        int batches = (tier_rate + TIER_BATCH - 1) / TIER_BATCH;
+        long nanos = moved ? 1000000000L / batches : 1000000000L;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += nanos;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&tier_cond, &tier_mutex, &deadline);
+        if (tier_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&tier_mutex);
+
+        if (time(0) - decayed >= tier_decay_secs) {
+            tier_decay();
+            decayed = time(0);
+        }
+        moved = tier_migrate();
+
+        pthread_mutex_lock(&tier_mutex);
+    }
+    pthread_mutex_unlock(&tier_mutex);
+    return 0;
+}
+
+/*
+ * Starts the migration thread of a tiered image.
+ */
+void tier_start()
+{
+    if (!tier_heat || tier_rate <= 0) {
+        return;
+    }
+    tier_stop = 0;
+    int rv = pthread_create(&tier_thread, 0, tier_main, 0);
+    assert(rv == 0);
+    tier_running = 1;
+}
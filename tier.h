@@ -0,0 +1,101 @@
+#ifndef TIER_H
+#define TIER_H
+
+/*
+ * Represents the migration of file data between the fast and the slow tier
+ * of an image (see blocks_set_tier()).
+ *
+ * Reads and writes of file data warm the blocks they touch, one step per
+ * request, and the heat of every block halves every TIER_DECAY seconds.
+ * In the background, pages of regular files whose blocks have gone cold
+ * move to the slow tier, and pages whose blocks in the slow tier are hot
+ * move back to the fast one while more than 1/TIER_RESERVE of it is free.
+ * New blocks come from the fast tier, so what is written lands there and
+ * stays while it is used. Blocks shared with other files or a snapshot,
+ * compressed clusters and packed tails stay where they are, and so do
+ * blocks that fail their checksum, which are reported.
+ *
+ * Moving a page copies its block to a fresh one in the other tier and
+ * points the block map at the copy, so block maps may point into either
+ * tier. Migration is rate limited: it moves batches of up to TIER_BATCH
+ * pages, spread over each second, each in a transaction that runs alone
+ * and holds off reads of file data while it lasts.
+ */
+
+// Blocks moved per second by default, and seconds in which heat halves
+#define TIER_RATE 1024
+#define TIER_DECAY 30
+
+// Heat from which a block in the slow tier moves up
+#define TIER_HOT 4
+
+// Part of the fast tier kept free from blocks moving up: 1/TIER_RESERVE
+#define TIER_RESERVE 8
+
+// Pages moved, and pages looked at, at most per batch
+#define TIER_BATCH 64
+#define TIER_SCAN 4096
+
+/*
+ * Sets the blocks migration moves per second at most; 0 stops it. The
+ * default is TIER_RATE.
+ */
+void tier_set_rate(int blocks);
+
+/*
+ * Sets the seconds in which the heat of a block halves. The default is
+ * TIER_DECAY.
+ */
+void tier_set_decay(int seconds);
+
+/*
+ * Sets up heat tracking for a tiered image. Does nothing for an image with
+ * no tiers.
+ *
+ * Called by blocks_init() when the image is mounted.
+ */
+void tier_init();
+
+/*
+ * Stops migration and frees the heat of the blocks.
+ *
+ * Called by blocks_free().
+ */
+void tier_free();
+
+/*
+ * Starts migrating file data in the background. Does nothing for an image
+ * with no tiers, or if migration is off.
+ *
+ * Called once the file system is running, like journal_start().
+ */
+void tier_start();
+
+/*
+ * Warms a run of blocks of file data that is being read or written.
+ */
+void tier_touch(int bnum, int count);
+
+/*
+ * Holds off migration while file data is read outside a transaction,
+ * until tier_read_end().
+ */
+void tier_read_begin();
+
+/*
+ * Lets migration go on after tier_read_begin().
+ */
+void tier_read_end();
+
+/*
+ * Halves the heat of every block.
+ */
+void tier_decay();
+
+/*
+ * Moves one batch of pages between the tiers, going on through the files
+ * where the last batch stopped. Returns the number of pages moved.
+ */
+int tier_migrate();
+
+#endif
@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../blocks.h"
+#include "../bitmap.h"
+#include "../inode.h"
+#include "../directory.h"
+#include "../journal.h"
+#include "../snapshot.h"
+#include "../compress.h"
+
+/*
+ * Checks a nufs image and repairs what it can.
+ *
+ *   fsck.nufs [-n] [-j THREADS] [-t SLOW] IMAGE [MEMBER...]
+ *
+ *   -n          report problems without repairing them
+ *   -j THREADS  threads to check with (default one per CPU)
+ *   -t SLOW     the slow tier of a tiered image
+ *
+ * A striped image is given its members in the order mkfs.nufs was given
+ * them. Opening the image replays its journal. The check then runs in
+ * three parallel passes:
+ *
+ *   1. the directory tree is walked from the root, counting the links to
+ *      every inode;
+ *   2. the block maps of the inodes reached are walked, counting the
+ *      references to every block;
+ *   3. the inode bitmap, block bitmap and reference counts are compared
+ *      with those counts.
+ *
+ * The superblock's free counts are then checked against the bitmaps.
+ *
+ * Repairs free leaked inodes and blocks, drop directory entries naming
+ * free inodes and rewrite wrong counts, all through the journal; the free
+ * counts are rewritten last.
+ *
+ * Exits with 0 if the image is clean, 1 if problems were repaired, 4 if
+ * problems were left and 8 if the image could not be checked.
+ */
+
+// Repairs done per transaction, well below what the journal can hold
+#define FIX_BATCH 64
+
+// A directory entry naming a free inode
+typedef struct dangling {
+    int dir;
+    char name[DIR_NAME];
+} dangling_t;
+
+// A block whose allocation or reference count is wrong
+typedef struct block_fix {
+    int bnum;
+    int refs;                // References found
+} block_fix_t;
+
+static superblock_t* sb;
+static int threads;
+
+// Pass 1: directories waiting to be walked, and how many are being walked
+static int* dir_stack;
+static int dir_top = 0;
+static int dir_busy = 0;
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dir_cond = PTHREAD_COND_INITIALIZER;
+
+static uint8_t* reached;     // Inodes the tree walk reached
+static uint32_t* links;      // Directory entries naming each inode
+static uint32_t* refs;       // References to each block
+
+static dangling_t* danglings;
+static int dangling_count = 0;
+static long bad_pointers = 0;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Pass 3: blocks to fix, per thread
+static block_fix_t** fixes;
+static int* fix_counts;
+
+static FILE* out;
+
+static int valid_block(int bnum)
+{
+    return bnum >= (int)sb->data_block && bnum < (int)sb->block_count;
+}
+
+static void push_dir(int inum)
+{
+    pthread_mutex_lock(&dir_lock);
+    dir_stack[dir_top++] = inum;
+    pthread_cond_signal(&dir_cond);
+    pthread_mutex_unlock(&dir_lock);
+}
+
+/*
+ * Pass 1: takes directories off the stack until none are left and none
+ * are being walked, counting links and pushing the subdirectories found.
+ */
+static void* walk_dirs(void* arg)
+{
+    void* ibm = get_inode_bitmap();
+    int per_block = BLOCK_SIZE / sizeof(dirent_t);
+
+    for (;;) {
+        pthread_mutex_lock(&dir_lock);
+        while (dir_top == 0 && dir_busy > 0) {
+            pthread_cond_wait(&dir_cond, &dir_lock);
+        }
+        if (dir_top == 0) {
+            pthread_cond_broadcast(&dir_cond);
+            pthread_mutex_unlock(&dir_lock);
+            return 0;
+        }
+        int dir = dir_stack[--dir_top];
+        dir_busy += 1;
+        pthread_mutex_unlock(&dir_lock);
+
+        inode_t* dd = get_inode(dir);
+        dirent_t* entries = valid_block(dd->ptrs[0]) ? blocks_get_block(dd->ptrs[0]) : 0;
+        if (!entries) {
+            __atomic_add_fetch(&bad_pointers, 1, __ATOMIC_RELAXED);
+        }
+
+        for (int ii = 0; entries && ii < per_block; ++ii) {
+            dirent_t* ent = &entries[ii];
+            if (ent->name[0] == 0 || streq(ent->name, ".")) {
+                continue;
+            }
+
+            int inum = ent->inum;
+            if (inum < 0 || inum >= (int)sb->inode_count || !bitmap_get(ibm, inum)) {
+                pthread_mutex_lock(&report_lock);
+                danglings[dangling_count].dir = dir;
+                strncpy(danglings[dangling_count].name, ent->name, DIR_NAME - 1);
+                dangling_count += 1;
+                pthread_mutex_unlock(&report_lock);
+                continue;
+            }
+
+            __atomic_add_fetch(&links[inum], 1, __ATOMIC_RELAXED);
+            if (!__atomic_exchange_n(&reached[inum], 1, __ATOMIC_RELAXED) &&
+                S_ISDIR(get_inode(inum)->mode)) {
+                push_dir(inum);
+            }
+        }
+
+        pthread_mutex_lock(&dir_lock);
+        dir_busy -= 1;
+        if (dir_top == 0 && dir_busy == 0) {
+            pthread_cond_broadcast(&dir_cond);
+        }
+        pthread_mutex_unlock(&dir_lock);
+    }
+}
+
+static void count_ref(int slot)
+{
+    int bnum = slot_block(slot);
+    if (bnum == 0) {
+        return;
+    }
+    if (!valid_block(bnum)) {
+        __atomic_add_fetch(&bad_pointers, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&refs[bnum], 1, __ATOMIC_RELAXED);
+}
+
+static void count_slot(int slot, int level, void* arg)
+{
+    count_ref(slot);
+}
+
+/*
+ * Pass 2: counts the block references of one slice of the inode table.
+ */
+static void* count_blocks(void* arg)
+{
+    long tt = (long)arg;
+    int first = sb->inode_count * tt / threads;
+    int last = sb->inode_count * (tt + 1) / threads;
+
+    for (int inum = first; inum < last; ++inum) {
+        if (!reached[inum]) {
+            continue;
+        }
+
+        inode_t* node = get_inode(inum);
+        inode_map_walk(node, count_slot, 0);
+        count_ref(node->xattr);
+    }
+    return 0;
+}
+
+/*
+ * Pass 3: compares one slice of the block bitmap and reference counts with
+ * the references found.
+ */
+static void* check_blocks(void* arg)
+{
+    long tt = (long)arg;
+    int first = sb->block_count * tt / threads;
+    int last = sb->block_count * (tt + 1) / threads;
+    void* bbm = get_blocks_bitmap();
+
+    fixes[tt] = malloc((last - first) * sizeof(block_fix_t));
+    fix_counts[tt] = 0;
+
+    for (int bnum = first; bnum < last; ++bnum) {
+        int expected = bnum < (int)sb->data_block ? 1 : refs[bnum];
+        int stored = bitmap_get(bbm, bnum) ? block_refs(bnum) : 0;
+        if (expected != stored) {
+            block_fix_t* fix = &fixes[tt][fix_counts[tt]++];
+            fix->bnum = bnum;
+            fix->refs = expected;
+        }
+    }
+    return 0;
+}
+
+// Runs fn on every thread, passing each its index.
+static void run_threads(void* (*fn)(void*))
+{
+    pthread_t tids[threads];
+    for (long tt = 0; tt < threads; ++tt) {
+        pthread_create(&tids[tt], 0, fn, (void*)tt);
+    }
+    for (int tt = 0; tt < threads; ++tt) {
+        pthread_join(tids[tt], 0);
+    }
+}
+
+// Ends the repair transaction every FIX_BATCH repairs.
+static void fix_done(int* done)
+{
+    if (++*done % FIX_BATCH == 0) {
+        journal_end();
+        journal_begin();
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int repair = 1;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "nj:t:")) != -1) {
+        switch (opt) {
+        case 'n': repair = 0; break;
+        case 'j': threads = atoi(optarg); break;
+        case 't': blocks_set_tier(optarg, 0); break;
+        default: threads = 0;
+        }
+    }
+    if (optind >= argc || threads < 1 ||
+        blocks_set_stripe((const char* const*)argv + optind + 1, argc - optind - 1, 0) < 0) {
+        fprintf(stderr, "usage: %s [-n] [-j THREADS] [-t SLOW] IMAGE [MEMBER...]\n", argv[0]);
+        return 8;
+    }
+
+    const char* path = argv[optind];
+    uint32_t magic = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) || magic != NUFS_MAGIC) {
+        fprintf(stderr, "%s: not a nufs image\n", path);
+        return 8;
+    }
+    close(fd);
+
+    // The core logs every operation to stdout
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    blocks_init(path);
+    sb = get_superblock();
+
+    dir_stack = malloc(sb->inode_count * sizeof(int));
+    reached = calloc(sb->inode_count, 1);
+    links = calloc(sb->inode_count, sizeof(uint32_t));
+    refs = calloc(sb->block_count, sizeof(uint32_t));
+    danglings = malloc(sb->inode_count * (BLOCK_SIZE / sizeof(dirent_t)) * sizeof(dangling_t));
+    fixes = calloc(threads, sizeof(block_fix_t*));
+    fix_counts = calloc(threads, sizeof(int));
+
+    int root = tree_lookup("/");
+    reached[root] = 1;
+    push_dir(root);
+    run_threads(walk_dirs);
+    run_threads(count_blocks);
+
+    int held = snapshot_blocks(0);
+    int snap[held];
+    snapshot_blocks(snap);
+    for (int ii = 0; ii < held; ++ii) {
+        count_ref(snap[ii]);
+    }
+
+    run_threads(check_blocks);
+
+    // Inodes are few; their bitmap and link counts are checked in place
+    void* ibm = get_inode_bitmap();
+    int orphans = 0;
+    int bad_links = 0;
+    for (int inum = 0; inum < (int)sb->inode_count; ++inum) {
+        if (!bitmap_get(ibm, inum)) {
+            continue;
+        }
+        if (!reached[inum]) {
+            fprintf(out, "inode %d: allocated but not in any directory\n", inum);
+            orphans += 1;
+        } else if (get_inode(inum)->refs != (inum == root ? 1 : (int)links[inum])) {
+            fprintf(out, "inode %d: %d links, counted %d\n",
+                    inum, get_inode(inum)->refs, links[inum]);
+            bad_links += 1;
+        }
+    }
+
+    void* bbm = get_blocks_bitmap();
+    int leaked = 0;
+    int block_problems = 0;
+    for (int tt = 0; tt < threads; ++tt) {
+        for (int ii = 0; ii < fix_counts[tt]; ++ii) {
+            block_fix_t* fix = &fixes[tt][ii];
+            int stored = bitmap_get(bbm, fix->bnum) ? block_refs(fix->bnum) : 0;
+            if (fix->refs == 0) {
+                leaked += 1;
+            } else {
+                fprintf(out, "block %d: %d references, counted %d\n", fix->bnum, stored, fix->refs);
+            }
+            block_problems += 1;
+        }
+    }
+    if (leaked > 0) {
+        fprintf(out, "%d blocks allocated but not referenced\n", leaked);
+    }
+    for (int ii = 0; ii < dangling_count; ++ii) {
+        fprintf(out, "inode %d: entry %s names a free inode\n", danglings[ii].dir, danglings[ii].name);
+    }
+    if (bad_pointers > 0) {
+        fprintf(out, "%ld block pointers out of range, not repaired\n", bad_pointers);
+    }
+
+    int stale = blocks_recount(0);
+    if (stale > 0) {
+        fprintf(out, "%d free space counts in the superblock are stale\n", stale);
+    }
+
+    int problems = orphans + bad_links + block_problems + dangling_count + (stale > 0);
+
+    if (repair && problems > 0) {
+        int done = 0;
+        journal_begin();
+
+        for (int ii = 0; ii < dangling_count; ++ii) {
+            directory_delete(get_inode(danglings[ii].dir), danglings[ii].name);
+            fix_done(&done);
+        }
+
+        for (int inum = 0; inum < (int)sb->inode_count; ++inum) {
+            if (!bitmap_get(ibm, inum)) {
+                continue;
+            }
+            inode_t* node = get_inode(inum);
+            int expected = inum == root ? 1 : (int)links[inum];
+            if (!reached[inum]) {
+                // Its blocks were not counted, so pass 3 frees them
+                inode_dirty(node);
+                memset(node, 0, sizeof(inode_t));
+                journal_log(JR_ALLOC, sb->ibm_block, inum, 1);
+                bitmap_put(ibm, inum, 0);
+                fix_done(&done);
+            } else if (node->refs != expected) {
+                inode_dirty(node);
+                node->refs = expected;
+                fix_done(&done);
+            }
+        }
+
+        for (int tt = 0; tt < threads; ++tt) {
+            for (int ii = 0; ii < fix_counts[tt]; ++ii) {
+                block_set_refs(fixes[tt][ii].bnum, fixes[tt][ii].refs);
+                fix_done(&done);
+            }
+        }
+
+        journal_end();
+
+        // Inodes freed above bypass the counts
+        blocks_recount(1);
+    }
+
+    int inode_count = sb->inode_count;
+    int block_count = sb->block_count;
+    blocks_free();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(out, "%s: %d inodes, %d blocks checked with %d threads in %.3f s (%.0f MiB/s); "
+            "%d problems%s\n", path, inode_count, block_count, threads, secs,
+            block_count / 256.0 / secs, problems,
+            problems == 0 ? "" : repair ? ", repaired" : ", not repaired");
+    fclose(out);
+
+    if (problems == 0) {
+        return bad_pointers ? 4 : 0;
+    }
+    return repair && !bad_pointers ? 1 : 4;
+}
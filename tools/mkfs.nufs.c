@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "../blocks.h"
+
+/*
+ * Creates a nufs image.
+ *
+ *   mkfs.nufs [-f] [-b BLOCKSIZE] [-s SIZE] [-i INODES] [-j BLOCKS] [-u UNIT]
+ *             [-t SLOW [-T FAST]] IMAGE [MEMBER...]
+ *
+ *   -b BLOCKSIZE  bytes per block: 4K (default), 16K or 64K
+ *   -s SIZE    image size in bytes, with an optional K, M or G suffix
+ *              (default 1M, at most 8 blocks per byte of a block: 128M
+ *              with 4 KiB blocks, 2G with 16 KiB, 32G with 64 KiB)
+ *   -i INODES  inode table slots (default one per two blocks, at most 8
+ *              per byte of a block)
+ *   -j BLOCKS  journal length in blocks (default 16)
+ *   -u UNIT    stripe unit in bytes, a multiple of the block size, with an
+ *              optional K or M suffix (default 64K)
+ *   -t SLOW    keep the image in two tiers, the slow one in SLOW
+ *   -T FAST    bytes of the fast tier, with an optional K, M or G suffix,
+ *              rounded up to whole allocation groups (default a quarter)
+ *   -f         replace an existing nufs image
+ *
+ * Given MEMBERs, the image is striped across IMAGE and them in turn, one
+ * stripe unit at a time, and SIZE is their total. It is mounted with
+ * -o stripe=MEMBER:MEMBER..., listing them in the same order.
+ *
+ * Given SLOW, IMAGE holds the fast tier, with the metadata, and SLOW the
+ * rest of the blocks, and SIZE is their total. It is mounted with
+ * -o tier=SLOW. An image is either striped or tiered.
+ *
+ * Only the superblock, the bitmaps, the journal header and the root
+ * directory are written; everything else is left as holes in the file.
+ */
+
+// Parses a size with an optional K, M or G suffix. Returns -1 if invalid.
+static long long parse_size(const char* text)
+{
+    char* end;
+    long long size = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size *= 1024;  // fall through
+    case 'M': case 'm': size *= 1024;  // fall through
+    case 'K': case 'k': size *= 1024; ++end;
+    }
+    return *end == 0 && size > 0 ? size : -1;
+}
+
+// Returns whether the file already holds a nufs image.
+static int is_image(const char* path)
+{
+    uint32_t magic = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    int got = pread(fd, &magic, sizeof(magic), 0);
+    close(fd);
+    return got == sizeof(magic) && magic == NUFS_MAGIC;
+}
+
+int main(int argc, char* argv[])
+{
+    long long size = 1 << 20;
+    long long block_size = 4096;
+    int inodes = -1;
+    int journal = 16;
+    long long unit = 0;
+    const char* slow = 0;
+    long long fast = 0;
+    int force = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "fb:s:i:j:u:t:T:")) != -1) {
+        switch (opt) {
+        case 'f': force = 1; break;
+        case 'b': block_size = parse_size(optarg); break;
+        case 's': size = parse_size(optarg); break;
+        case 'i': inodes = atoi(optarg); break;
+        case 'j': journal = atoi(optarg); break;
+        case 'u': unit = parse_size(optarg); break;
+        case 't': slow = optarg; break;
+        case 'T': fast = parse_size(optarg); break;
+        default: size = -1;
+        }
+    }
+    int members = argc - optind - 1;
+    if (members < 0 || size < 0 || unit < 0 || fast < 0) {
+        fprintf(stderr, "usage: %s [-f] [-b BLOCKSIZE] [-s SIZE] [-i INODES] [-j BLOCKS] "
+                "[-u UNIT] [-t SLOW [-T FAST]] IMAGE [MEMBER...]\n", argv[0]);
+        return 2;
+    }
+    if (block_size > BLOCK_SIZE_MAX || !blocks_size_valid(block_size)) {
+        fprintf(stderr, "%s: blocks are 4K, 16K or 64K\n", argv[0]);
+        return 2;
+    }
+    if (unit % block_size != 0 || unit > INT_MAX ||
+        blocks_set_stripe((const char* const*)argv + optind + 1, members, unit) < 0) {
+        fprintf(stderr, "%s: at most %d members and a stripe unit of whole blocks\n", argv[0],
+                BLOCKS_STRIPE_MAX - 1);
+        return 2;
+    }
+    if (slow && members > 0) {
+        fprintf(stderr, "%s: an image is either striped or tiered\n", argv[0]);
+        return 2;
+    }
+    blocks_set_tier(slow, fast);
+
+    const char* path = argv[optind];
+    if (is_image(path) && !force) {
+        fprintf(stderr, "%s: already a nufs image, use -f to replace it\n", path);
+        return 1;
+    }
+
+    blocks_geometry_t geo;
+    geo.block_count = size / block_size / 8 * 8;
+    geo.inode_count = inodes > 0 ? inodes : geo.block_count / 2;
+    geo.journal_blocks = journal;
+    geo.block_size = block_size;
+    if (geo.inode_count > block_size * 8) {
+        geo.inode_count = block_size * 8;
+    }
+
+    // The core logs every operation to stdout
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+
+    int rv = blocks_mkfs(path, &geo);
+    if (rv == -EINVAL) {
+        fprintf(stderr, "%s: %d blocks, %d inodes and a %d block journal do not fit\n",
+                path, geo.block_count, geo.inode_count, geo.journal_blocks);
+        return 1;
+    }
+    if (rv < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(-rv));
+        return 1;
+    }
+
+    blocks_init(path);
+    superblock_t* sb = get_superblock();
+    fprintf(out, "%s: %u blocks of %u bytes, %u inodes, %u journal blocks, "
+            "%u blocks reserved\n", path, sb->block_count, sb->block_size, sb->inode_count,
+            sb->journal_blocks, sb->data_block);
+    if (sb->stripe_count > 1) {
+        fprintf(out, "%s: striped across %u files in units of %u bytes\n", path,
+                sb->stripe_count, sb->stripe_blocks * sb->block_size);
+    }
+    if (sb->tier_blocks) {
+        fprintf(out, "%s: tiered, %u blocks fast and %u in %s\n", path, sb->tier_blocks,
+                sb->block_count - sb->tier_blocks, slow);
+    }
+    blocks_free();
+
+    fclose(out);
+    return 0;
+}
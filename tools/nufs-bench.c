@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../blocks.h"
+#include "../bitmap.h"
+#include "../inode.h"
+#include "../io.h"
+
+/*
+ * Measures how long mounting an image takes and how fast random reads of
+ * its files are, under each mapping policy (see blocks_set_map()).
+ *
+ *   nufs-bench [-n READS] [-r ROUNDS] IMAGE
+ *
+ *   -n READS   one block reads per round (default 10000)
+ *   -r ROUNDS  mounts per policy (default 5)
+ *
+ * Every round starts cold: the image is dropped from the page cache, then
+ * mounted, read at random pages of its regular files and unmounted. All
+ * policies read the same pages in the same order. The image is not
+ * changed.
+ */
+
+typedef struct policy {
+    const char* name;        // As a mount option
+    int map;                 // BLOCKS_MAP_* policies
+} policy_t;
+
+static const policy_t policies[] = {
+    { "plain", 0 },
+    { "hugepages", BLOCKS_MAP_HUGE },
+    { "populate", BLOCKS_MAP_POPULATE },
+    { "access=random", BLOCKS_MAP_RANDOM },
+    { "access=sequential", BLOCKS_MAP_SEQUENTIAL },
+    { "populate,access=random", BLOCKS_MAP_POPULATE | BLOCKS_MAP_RANDOM },
+};
+
+// Regular files to read, with their number of pages
+static int* files = 0;
+static int* file_pages = 0;
+static int file_count = 0;
+
+static FILE* out;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_nanos(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Drops the image from the page cache, so the next mount starts cold.
+ */
+static void evict(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/*
+ * Lists the regular files of the mounted image that hold data.
+ */
+static void find_files()
+{
+    superblock_t* sb = get_superblock();
+    void* ibm = get_inode_bitmap();
+
+    files = malloc(sb->inode_count * sizeof(int));
+    file_pages = malloc(sb->inode_count * sizeof(int));
+    for (int ii = 0; ii < sb->inode_count; ++ii) {
+        inode_t* node = get_inode(ii);
+        if (bitmap_get(ibm, ii) && S_ISREG(node->mode) && node->size > 0) {
+            files[file_count] = ii;
+            file_pages[file_count] = bytes_to_blocks(node->size);
+            file_count += 1;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int reads = 10000;
+    int rounds = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n': reads = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        default: argc = 0;
+        }
+    }
+    if (argc == 0 || optind != argc - 1 || reads < 1 || rounds < 1) {
+        fprintf(stderr, "usage: %s [-n READS] [-r ROUNDS] IMAGE\n", argv[0]);
+        return 2;
+    }
+    const char* path = argv[optind];
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // The core logs every operation to stdout
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+
+    blocks_init(path);
+    find_files();
+    blocks_free();
+    if (file_count == 0) {
+        fprintf(out, "%s: no files to read\n", path);
+        return 1;
+    }
+
+    int policy_count = sizeof(policies) / sizeof(policies[0]);
+    uint64_t* mounts = malloc(rounds * sizeof(uint64_t));
+    uint64_t* nanos = malloc((size_t)rounds * reads * sizeof(uint64_t));
+    char buf[BLOCK_SIZE];
+
+    fprintf(out, "%s: %d files, %d reads x %d rounds\n", path, file_count, reads, rounds);
+    fprintf(out, "%-24s %10s %10s %10s %10s %10s\n", "policy", "mount ms", "mean us",
+            "p50 us", "p99 us", "max us");
+
+    for (int pp = 0; pp < policy_count; ++pp) {
+        for (int rr = 0; rr < rounds; ++rr) {
+            evict(path);
+            unsigned int seed = rr + 1;
+
+            uint64_t start = now();
+            blocks_set_map(policies[pp].map);
+            blocks_init(path);
+            mounts[rr] = now() - start;
+
+            for (int ii = 0; ii < reads; ++ii) {
+                int ff = rand_r(&seed) % file_count;
+                int page = rand_r(&seed) % file_pages[ff];
+                inode_map_cache_t map = { 0, -1, 0 };
+
+                start = now();
+                io_read(get_inode(files[ff]), buf, sizeof(buf), (off_t)BLOCK_SIZE * page, &map);
+                nanos[(size_t)rr * reads + ii] = now() - start;
+            }
+
+            blocks_free();
+        }
+
+        size_t total = (size_t)rounds * reads;
+        qsort(mounts, rounds, sizeof(uint64_t), compare_nanos);
+        qsort(nanos, total, sizeof(uint64_t), compare_nanos);
+        uint64_t sum = 0;
+        for (size_t ii = 0; ii < total; ++ii) {
+            sum += nanos[ii];
+        }
+        fprintf(out, "%-24s %10.2f %10.2f %10.2f %10.2f %10.2f\n", policies[pp].name,
+                mounts[rounds / 2] / 1e6, sum / 1e3 / total, nanos[total / 2] / 1e3,
+                nanos[total * 99 / 100] / 1e3, nanos[total - 1] / 1e3);
+    }
+
+    blocks_set_map(0);
+    fclose(out);
+    return 0;
+}
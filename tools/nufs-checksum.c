@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../checksum.h"
+
+/*
+ * Reports what block checksums cost on a nufs mount.
+ *
+ *   nufs-checksum PATH
+ *
+ * PATH may be any file or directory on the mount.
+ */
+
+// Prints bytes handled in the given time, and the rate in GB/s
+static void report(const char* what, uint64_t bytes, uint64_t nanos)
+{
+    printf("%-10s %8llu KiB in %8.3f ms", what,
+           (unsigned long long)bytes / 1024, nanos / 1e6);
+    if (nanos) {
+        printf(" (%.2f GB/s)", (double)bytes / nanos);
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s PATH\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    checksum_stats_t stats;
+    if (ioctl(fd, NUFS_IOC_CHECKSUM_STATS, &stats) != 0) {
+        perror("checksum stats");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    printf("crc32c:    %s\n", stats.impl);
+    report("verified:", stats.verified, stats.verify_nanos);
+    report("sealed:", stats.sealed, stats.seal_nanos);
+    printf("failures:  %llu\n", (unsigned long long)stats.failures);
+    return 0;
+}
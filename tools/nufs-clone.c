@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "../clone.h"
+
+/*
+ * Copies a file on a nufs mount by sharing its blocks, the way
+ * cp --reflink=always would on a file system with FICLONE support.
+ *
+ *   nufs-clone SRC DEST
+ */
+
+// Returns the mount point above the given absolute path, by walking up
+// until the device changes.
+static void mount_root(const char* path, char* root)
+{
+    struct stat st, up;
+    strcpy(root, path);
+    stat(root, &st);
+
+    while (strcmp(root, "/") != 0) {
+        char parent[PATH_MAX];
+        strcpy(parent, root);
+        strcpy(parent, dirname(parent));
+        if (stat(parent, &up) != 0 || up.st_dev != st.st_dev) {
+            break;
+        }
+        strcpy(root, parent);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s SRC DEST\n", argv[0]);
+        return 2;
+    }
+
+    char src[PATH_MAX];
+    char root[PATH_MAX];
+    if (!realpath(argv[1], src)) {
+        perror(argv[1]);
+        return 1;
+    }
+    mount_root(src, root);
+
+    clone_args_t args;
+    memset(&args, 0, sizeof(args));
+    const char* inside = src + (strcmp(root, "/") ? strlen(root) : 0);
+    if (strlen(inside) >= CLONE_PATH) {
+        fprintf(stderr, "%s: path too long\n", argv[1]);
+        return 1;
+    }
+    strcpy(args.src, inside);
+
+    int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    if (ioctl(fd, NUFS_IOC_CLONE_RANGE, &args) != 0) {
+        perror("clone");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
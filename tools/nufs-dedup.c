@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../dedup.h"
+
+/*
+ * Reports how well deduplication is doing on a nufs mount.
+ *
+ *   nufs-dedup PATH
+ *
+ * PATH may be any file or directory on the mount.
+ */
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s PATH\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    dedup_stats_t stats;
+    if (ioctl(fd, NUFS_IOC_DEDUP_STATS, &stats) != 0) {
+        perror("dedup stats");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    printf("data blocks:   %llu\n", (unsigned long long)stats.blocks);
+    printf("references:    %llu\n", (unsigned long long)stats.refs);
+    printf("dedup ratio:   %.2f\n", stats.blocks ? (double)stats.refs / stats.blocks : 1.0);
+    printf("pages hashed:  %llu\n", (unsigned long long)stats.hashed);
+    printf("pages merged:  %llu\n", (unsigned long long)stats.merged);
+    printf("ns per page:   %llu\n",
+           (unsigned long long)(stats.hashed ? stats.nanos / stats.hashed : 0));
+    return 0;
+}
@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+// directory.h has its own struct dirent
+#define dirent host_dirent
+#include <dirent.h>
+#undef dirent
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../blocks.h"
+#include "../inode.h"
+#include "../directory.h"
+#include "../journal.h"
+#include "../checksum.h"
+#include "../func.h"
+
+/*
+ * Packs a host directory tree into a nufs image, without going through
+ * FUSE.
+ *
+ *   nufs-pack [-j THREADS] [-b BLOCKSIZE] [-s SIZE] SRCDIR IMAGE
+ *
+ *   -j THREADS  threads to walk and copy with (default one per CPU)
+ *   -b BLOCKSIZE  bytes per block of a new image: 4K (default), 16K or 64K
+ *   -s SIZE     size of a new image in bytes, with an optional K, M or G
+ *               suffix (default just large enough for the tree)
+ *
+ * A missing IMAGE is created; an existing one gets the tree merged into its
+ * root. The tree is walked in parallel first. Then every inode, directory
+ * entry and block map is created in journaled transactions, each file's
+ * pages getting adjacent blocks where possible. Last, file data is read
+ * straight into the mapped image in parallel, one read per run of blocks,
+ * sealed with its checksums and flushed.
+ *
+ * Hard links are packed as separate files; special files are skipped.
+ */
+
+typedef struct entry {
+    char* host;              // Path on the host
+    int parent;              // Index of the parent directory, -1 for the top
+    struct stat st;
+    int inum;                // Inode in the image, -1 if skipped
+} entry_t;
+
+static entry_t* entries = 0;
+static int entry_count = 0;
+static int entry_cap = 0;
+static int threads;
+
+// Next entry to walk if it is a directory, and how many are being walked
+static int dir_head = 0;
+static int dir_busy = 0;
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+
+// Next file for the copy threads
+static int next_file = 0;
+static long long copied = 0;
+static int failures = 0;
+
+static FILE* out;
+
+// Parses a size with an optional K, M or G suffix. Returns -1 if invalid.
+static long long parse_size(const char* text)
+{
+    char* end;
+    long long size = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size *= 1024;  // fall through
+    case 'M': case 'm': size *= 1024;  // fall through
+    case 'K': case 'k': size *= 1024; ++end;
+    }
+    return *end == 0 && size > 0 ? size : -1;
+}
+
+// Appends an entry; walk_lock must be held. Returns its index.
+static int add_entry(char* host, int parent, struct stat* st)
+{
+    if (entry_count == entry_cap) {
+        entry_cap = entry_cap ? 2 * entry_cap : 256;
+        entries = realloc(entries, entry_cap * sizeof(entry_t));
+    }
+    entry_t* ent = &entries[entry_count];
+    ent->host = host;
+    ent->parent = parent;
+    ent->st = *st;
+    ent->inum = -1;
+    return entry_count++;
+}
+
+/*
+ * Walks directories off the queue until none are left and none are being
+ * walked. A directory is always added before its entries, so parents come
+ * first in the entry list.
+ */
+static void* walk_dirs(void* arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&walk_lock);
+        while (dir_head == entry_count && dir_busy > 0) {
+            pthread_cond_wait(&walk_cond, &walk_lock);
+        }
+        // Entries that are not directories are skipped over here
+        while (dir_head < entry_count && !S_ISDIR(entries[dir_head].st.st_mode)) {
+            ++dir_head;
+        }
+        if (dir_head == entry_count) {
+            pthread_cond_broadcast(&walk_cond);
+            pthread_mutex_unlock(&walk_lock);
+            return 0;
+        }
+        int dir = dir_head++;
+        char* path = strdup(entries[dir].host);
+        dir_busy += 1;
+        pthread_mutex_unlock(&walk_lock);
+
+        DIR* dh = opendir(path);
+        struct host_dirent* de;
+        while (dh && (de = readdir(dh)) != 0) {
+            if (streq(de->d_name, ".") || streq(de->d_name, "..")) {
+                continue;
+            }
+            char* child;
+            struct stat st;
+            if (asprintf(&child, "%s/%s", path, de->d_name) < 0 || lstat(child, &st) != 0) {
+                continue;
+            }
+
+            pthread_mutex_lock(&walk_lock);
+            add_entry(child, dir, &st);
+            pthread_cond_signal(&walk_cond);
+            pthread_mutex_unlock(&walk_lock);
+        }
+        if (dh) {
+            closedir(dh);
+        } else {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        }
+        free(path);
+
+        pthread_mutex_lock(&walk_lock);
+        dir_busy -= 1;
+        pthread_cond_broadcast(&walk_cond);
+        pthread_mutex_unlock(&walk_lock);
+    }
+}
+
+// Returns the number of data pages the entry needs in an image with blocks
+// of the given size.
+static int entry_pages(entry_t* ent, int block_size)
+{
+    if (S_ISDIR(ent->st.st_mode)) {
+        return 2;
+    }
+    return (ent->st.st_size + block_size - 1) / block_size;
+}
+
+// Returns the number of blocks the entry needs in an image with blocks of
+// the given size, counting the indirect blocks of its block map.
+static long entry_blocks(entry_t* ent, int block_size)
+{
+    long pages = entry_pages(ent, block_size);
+    long blocks = pages;
+    long slots = block_size / sizeof(int);
+
+    pages -= 2;
+    for (long span = 1; pages > 0 && span <= slots * slots; span *= slots) {
+        // One tree of blocks, each level mapping span times fewer pages
+        long tree = span * slots;
+        long here = pages < tree ? pages : tree;
+        for (long level = span; level >= 1; level /= slots) {
+            blocks += (here + level * slots - 1) / (level * slots);
+        }
+        pages -= here;
+    }
+    return blocks;
+}
+
+/*
+ * Creates the inode and directory entry of one host entry, with adjacent
+ * blocks for its pages. Returns 0 or a negative errno.
+ */
+static int create_entry(entry_t* ent)
+{
+    entry_t* parent = &entries[ent->parent];
+    if (parent->inum < 0) {
+        return -ENOENT;
+    }
+
+    const char* name = strrchr(ent->host, '/') + 1;
+    if (strlen(name) >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+
+    int is_dir = S_ISDIR(ent->st.st_mode);
+    if (!is_dir && !S_ISREG(ent->st.st_mode) && !S_ISLNK(ent->st.st_mode)) {
+        return -EOPNOTSUPP;
+    }
+    int pages = entry_pages(ent, BLOCK_SIZE);
+    if (ent->st.st_size > (off_t)INODE_MAX_PAGES * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+
+    inode_t* dd = get_inode(parent->inum);
+    int existing = directory_lookup(dd, name);
+    if (existing >= 0) {
+        if (is_dir && S_ISDIR(get_inode(existing)->mode)) {
+            ent->inum = existing;
+            return 0;
+        }
+        return -EEXIST;
+    }
+
+    journal_begin();
+
+    int inum = alloc_inode();
+    if (inum < 0) {
+        journal_end();
+        return -ENOSPC;
+    }
+    inode_t* node = get_inode(inum);
+    inode_dirty(node);
+    memset(node, 0, sizeof(inode_t));
+    node->refs = 1;
+    node->mode = ent->st.st_mode;
+    node->time = ent->st.st_mtime;
+
+    // The block map comes first, so the pages that follow are adjacent
+    int rv = inode_map_prepare(node, 0, pages);
+    for (int fpn = 0; rv == 0 && fpn < pages; ) {
+        int got;
+        int first = alloc_extent(pages - fpn, &got);
+        if (first < 0) {
+            rv = -ENOSPC;
+            break;
+        }
+        for (int ii = 0; ii < got; ++ii) {
+            inode_set_slot(node, fpn++, first + ii);
+        }
+    }
+
+    if (rv == 0 && is_dir) {
+        journal_log(JR_ZERO, node->ptrs[0], 0, 0);
+        memset(blocks_get_block(node->ptrs[0]), 0, BLOCK_SIZE);
+    } else if (rv == 0) {
+        node->size = ent->st.st_size;
+    }
+
+    if (rv == 0 && directory_put(dd, name, inum) < 0) {
+        rv = -ENOSPC;
+    }
+    if (rv < 0) {
+        // Frees whatever was allocated, then the inode itself
+        free_inode(inum);
+    } else {
+        ent->inum = inum;
+    }
+
+    journal_end();
+    return rv;
+}
+
+/*
+ * Copies one file's data into its blocks, one read per run of adjacent
+ * blocks. Returns 0 or a negative errno.
+ */
+static int copy_file(entry_t* ent)
+{
+    inode_t* node = get_inode(ent->inum);
+    int pages = bytes_to_blocks(node->size);
+
+    // A symlink stores its target as data, like nufs_symlink() does
+    if (S_ISLNK(node->mode)) {
+        char* data = blocks_get_block(node->ptrs[0]);
+        memset(data, 0, BLOCK_SIZE);
+        if (readlink(ent->host, data, BLOCK_SIZE - 1) < 0) {
+            return -errno;
+        }
+        checksum_seal(node->ptrs[0]);
+        blocks_dirty(node->ptrs[0]);
+        return 0;
+    }
+
+    int fd = open(ent->host, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int rv = 0;
+    for (int fpn = 0; fpn < pages; ) {
+        int first = inode_get_pnum(node, fpn);
+        int run = 1;
+        while (fpn + run < pages && inode_get_pnum(node, fpn + run) == first + run) {
+            ++run;
+        }
+
+        char* data = blocks_get_block(first);
+        ssize_t got = pread(fd, data, (size_t)BLOCK_SIZE * run, (off_t)BLOCK_SIZE * fpn);
+        if (got < 0) {
+            rv = -errno;
+            break;
+        }
+        memset(data + got, 0, (size_t)BLOCK_SIZE * run - got);
+
+        for (int ii = 0; ii < run; ++ii) {
+            checksum_seal(first + ii);
+            blocks_dirty(first + ii);
+        }
+        __atomic_add_fetch(&copied, got, __ATOMIC_RELAXED);
+        fpn += run;
+    }
+
+    close(fd);
+    return rv;
+}
+
+static void* copy_files(void* arg)
+{
+    for (;;) {
+        int ii = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED);
+        if (ii >= entry_count) {
+            return 0;
+        }
+        entry_t* ent = &entries[ii];
+        if (ent->inum < 0 || S_ISDIR(ent->st.st_mode)) {
+            continue;
+        }
+        int rv = copy_file(ent);
+        if (rv < 0) {
+            fprintf(stderr, "%s: %s\n", ent->host, strerror(-rv));
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void run_threads(void* (*fn)(void*))
+{
+    pthread_t tids[threads];
+    for (int tt = 0; tt < threads; ++tt) {
+        pthread_create(&tids[tt], 0, fn, 0);
+    }
+    for (int tt = 0; tt < threads; ++tt) {
+        pthread_join(tids[tt], 0);
+    }
+}
+
+/*
+ * Creates an image with blocks of the given size and room for the given
+ * number of data blocks and inodes, or of the given size. Returns 0 or a
+ * negative errno.
+ */
+static int create_image(const char* path, int block_size, long blocks, int inodes,
+                        long long size)
+{
+    blocks_geometry_t geo;
+    geo.inode_count = inodes + 16;
+    geo.journal_blocks = 16;
+    geo.block_size = block_size;
+
+    // The reserved regions grow with the image, so grow until it fits
+    long count = size > 0 ? size / block_size : blocks + blocks / 32 + 256;
+    for (;;) {
+        geo.block_count = (count + 7) / 8 * 8;
+        int rv = blocks_mkfs(path, &geo);
+        if (rv < 0) {
+            return rv;
+        }
+        if (size > 0) {
+            return 0;
+        }
+
+        blocks_init(path);
+        superblock_t* sb = get_superblock();
+        long room = sb->block_count - sb->data_block - 2;
+        blocks_free();
+        if (room >= blocks) {
+            return 0;
+        }
+        count += blocks - room;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    long long size = 0;
+    long long block_size = 4096;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:b:s:")) != -1) {
+        switch (opt) {
+        case 'j': threads = atoi(optarg); break;
+        case 'b': block_size = parse_size(optarg); break;
+        case 's': size = parse_size(optarg); break;
+        default: threads = 0;
+        }
+    }
+    if (optind != argc - 2 || threads < 1 || size < 0) {
+        fprintf(stderr, "usage: %s [-j THREADS] [-b BLOCKSIZE] [-s SIZE] SRCDIR IMAGE\n",
+                argv[0]);
+        return 2;
+    }
+    if (block_size > BLOCK_SIZE_MAX || !blocks_size_valid(block_size)) {
+        fprintf(stderr, "%s: blocks are 4K, 16K or 64K\n", argv[0]);
+        return 2;
+    }
+    const char* src = argv[optind];
+    const char* path = argv[optind + 1];
+
+    struct stat st;
+    if (stat(src, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: not a directory\n", src);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    add_entry(strdup(src), -1, &st);
+    run_threads(walk_dirs);
+
+    long blocks = 0;
+    for (int ii = 1; ii < entry_count; ++ii) {
+        blocks += entry_blocks(&entries[ii], block_size);
+    }
+
+    // The core logs every operation to stdout
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+
+    if (access(path, F_OK) != 0 || size > 0) {
+        int rv = create_image(path, block_size, blocks, entry_count, size);
+        if (rv < 0) {
+            fprintf(stderr, "%s: cannot create an image for %ld blocks and %d inodes: %s\n",
+                    path, blocks, entry_count, strerror(-rv));
+            return 1;
+        }
+    }
+
+    blocks_init(path);
+
+    entries[0].inum = tree_lookup("/");
+    for (int ii = 1; ii < entry_count; ++ii) {
+        int rv = create_entry(&entries[ii]);
+        if (rv < 0) {
+            fprintf(stderr, "%s: %s\n", entries[ii].host, strerror(-rv));
+            failures += 1;
+        }
+    }
+
+    run_threads(copy_files);
+
+    // Flush the data before the checkpoint makes the metadata final. Pinned
+    // blocks are left dirty for the checkpoint to write back.
+    superblock_t* sb = get_superblock();
+    int* bnums = malloc(sb->block_count * sizeof(int));
+    int count = 0;
+    for (int ii = 0; ii < (int)sb->block_count; ++ii) {
+        if (!blocks_pinned(ii)) {
+            bnums[count++] = ii;
+        }
+    }
+    int rv = blocks_sync(bnums, count);
+    free(bnums);
+    blocks_free();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(out, "%s: %d entries, %.1f MiB packed in %.3f s (%.0f MiB/s), %d failed\n",
+            path, entry_count - 1, copied / 1048576.0, secs, copied / 1048576.0 / secs, failures);
+    fclose(out);
+
+    return rv < 0 || failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+
+#include "../nufs.h"
+#include "../blocks.h"
+#include "../clone.h"
+#include "../dedup.h"
+#include "../checksum.h"
+#include "../trace.h"
+
+/*
+ * Replays a trace recorded with -o trace=PATH and reports the latency of
+ * each kind of operation.
+ *
+ *   nufs-replay [-r] TRACE IMAGE
+ *   nufs-replay [-r] -m MOUNTPOINT TRACE
+ *
+ *   -r             keep the recorded pace (default as fast as possible)
+ *   -m MOUNTPOINT  replay through a mount instead of on an image
+ *
+ * On an image, the operations go straight to the nufs callbacks, as the
+ * mount would make them; the image should be a copy of the one the trace
+ * was recorded on, taken before that mount. Through a mount, each
+ * operation becomes the system call that leads to it; a readdir past the
+ * first batch and a flush have none and are skipped.
+ *
+ * Writes and xattr values carry a fixed pattern, since traces hold no
+ * data. An operation whose success differs from the recorded one is
+ * counted as differing.
+ */
+
+typedef struct op_stats {
+    long count;
+    long differ;
+    uint64_t traced;         // Recorded time of all of them
+    uint64_t* nanos;         // Time of each in the replay
+} op_stats_t;
+
+// An open file of the trace, by its recorded handle
+typedef struct handle {
+    uint64_t traced;         // Recorded handle, 0 if the slot is free
+    struct fuse_file_info fi;
+    int fd;
+} handle_t;
+
+// A replayed operation that has nothing to do
+#define SKIPPED 1
+
+static op_stats_t stats[TRACE_OPS];
+static handle_t* handles = 0;
+static int handle_count = 0;
+
+static struct fuse_operations ops;
+static const char* mount = 0;
+
+static char* data = 0;
+static size_t data_size = 0;
+
+static FILE* out;
+
+/*
+ * Returns the handle recorded as traced, adding it if asked to.
+ */
+static handle_t* find_handle(uint64_t traced, int add)
+{
+    handle_t* free_slot = 0;
+    for (int ii = 0; ii < handle_count; ++ii) {
+        if (handles[ii].traced == traced) {
+            return &handles[ii];
+        }
+        if (handles[ii].traced == 0 && !free_slot) {
+            free_slot = &handles[ii];
+        }
+    }
+    if (!add) {
+        return 0;
+    }
+    if (!free_slot) {
+        handles = realloc(handles, (handle_count + 1) * sizeof(handle_t));
+        free_slot = &handles[handle_count++];
+    }
+    memset(free_slot, 0, sizeof(handle_t));
+    free_slot->traced = traced;
+    free_slot->fd = -1;
+    return free_slot;
+}
+
+/*
+ * Returns a buffer of at least size bytes, holding the write pattern.
+ */
+static char* buffer(size_t size)
+{
+    if (size > data_size) {
+        data = realloc(data, size);
+        for (size_t ii = data_size; ii < size; ++ii) {
+            data[ii] = "nufs-replay pattern\n"[ii % 20];
+        }
+        data_size = size;
+    }
+    return data;
+}
+
+static int count_entry(void* buf, const char* name, const struct stat* st, off_t off)
+{
+    return 0;
+}
+
+/*
+ * Replays one operation on the image, through the nufs callbacks.
+ */
+static int play_image(trace_rec_t* rec, const char* path, const char* path2)
+{
+    handle_t* h = rec->handle ? find_handle(rec->handle, rec->op == TRACE_OPEN) : 0;
+    struct fuse_file_info scratch = { 0 };
+    struct fuse_file_info* fi = h ? &h->fi : &scratch;
+    struct stat st;
+    struct timespec ts[2] = { { rec->arg, 0 }, { rec->arg, 0 } };
+    int rv;
+
+    switch (rec->op) {
+    case TRACE_ACCESS:   return ops.access(path, rec->mode);
+    case TRACE_GETATTR:  return ops.getattr(path, &st);
+    case TRACE_READDIR:  return ops.readdir(path, 0, count_entry, rec->offset, 0);
+    case TRACE_MKNOD:    return ops.mknod(path, rec->mode, 0);
+    case TRACE_MKDIR:    return ops.mkdir(path, rec->mode);
+    case TRACE_LINK:     return ops.link(path, path2);
+    case TRACE_UNLINK:   return ops.unlink(path);
+    case TRACE_RMDIR:    return ops.rmdir(path);
+    case TRACE_RENAME:   return ops.rename(path, path2);
+    case TRACE_CHMOD:    return ops.chmod(path, rec->mode);
+    case TRACE_TRUNCATE: return ops.truncate(path, rec->size);
+    case TRACE_OPEN:
+        fi->flags = rec->mode;
+        return ops.open(path, fi);
+    case TRACE_READ:     return ops.read(path, buffer(rec->size), rec->size, rec->offset, fi);
+    case TRACE_WRITE:    return ops.write(path, buffer(rec->size), rec->size, rec->offset, fi);
+    case TRACE_FLUSH:    return ops.flush(path, fi);
+    case TRACE_RELEASE:
+        rv = ops.release(path, fi);
+        if (h) {
+            h->traced = 0;
+        }
+        return rv;
+    case TRACE_FSYNC:    return ops.fsync(path, rec->mode, fi);
+    case TRACE_FSYNCDIR: return ops.fsyncdir(path, rec->mode, 0);
+    case TRACE_UTIMENS:  return ops.utimens(path, ts);
+    case TRACE_IOCTL: {
+        union {
+            clone_args_t clone;
+            unsigned int flags;
+            dedup_stats_t dedup;
+            checksum_stats_t checksum;
+        } arg;
+        memset(&arg, 0, sizeof(arg));
+        if (rec->mode == NUFS_IOC_CLONE_RANGE) {
+            if (snprintf(arg.clone.src, CLONE_PATH, "%s", path2) >= CLONE_PATH) {
+                return -ENAMETOOLONG;
+            }
+            arg.clone.src_offset = rec->arg;
+            arg.clone.src_length = rec->size;
+            arg.clone.dest_offset = rec->offset;
+        } else {
+            arg.flags = rec->arg;
+        }
+        return ops.ioctl(path, rec->mode, 0, fi, 0, &arg);
+    }
+    case TRACE_READLINK: return ops.readlink(path, buffer(rec->size), rec->size);
+    case TRACE_SYMLINK:  return ops.symlink(path2, path);
+    case TRACE_SETXATTR: return ops.setxattr(path, path2, buffer(rec->size), rec->size, rec->mode);
+    case TRACE_GETXATTR: return ops.getxattr(path, path2, buffer(rec->size), rec->size);
+    case TRACE_LISTXATTR: return ops.listxattr(path, buffer(rec->size), rec->size);
+    case TRACE_REMOVEXATTR: return ops.removexattr(path, path2);
+    case TRACE_STATFS: {
+        struct statvfs vfs;
+        return ops.statfs(path, &vfs);
+    }
+    }
+    return SKIPPED;
+}
+
+/*
+ * Returns the result of a system call the way the callbacks return it.
+ */
+static int sys(long rv)
+{
+    return rv < 0 ? -errno : rv;
+}
+
+/*
+ * Opens the file at full for one operation, unless its handle has it open.
+ */
+static int file_fd(handle_t* h, const char* full, int flags)
+{
+    return h && h->fd >= 0 ? h->fd : open(full, flags);
+}
+
+static void file_done(handle_t* h, int fd)
+{
+    if (!(h && h->fd == fd) && fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+ * Replays one operation through the mount, as the system call that leads
+ * to it.
+ */
+static int play_mount(trace_rec_t* rec, const char* path, const char* path2)
+{
+    handle_t* h = rec->handle ? find_handle(rec->handle, rec->op == TRACE_OPEN) : 0;
+    char full[8192];
+    char full2[8192];
+    if (snprintf(full, sizeof(full), "%s%s", mount, path) >= (int)sizeof(full) ||
+        snprintf(full2, sizeof(full2), "%s%s", mount, path2) >= (int)sizeof(full2)) {
+        return -ENAMETOOLONG;
+    }
+
+    struct stat st;
+    struct timespec ts[2] = { { rec->arg, 0 }, { rec->arg, 0 } };
+    int fd;
+    int rv;
+
+    switch (rec->op) {
+    case TRACE_ACCESS:   return sys(access(full, rec->mode));
+    case TRACE_GETATTR:  return sys(lstat(full, &st));
+    case TRACE_READDIR: {
+        if (rec->offset != 0) {
+            return SKIPPED;
+        }
+        DIR* dir = opendir(full);
+        if (!dir) {
+            return -errno;
+        }
+        while (readdir(dir)) {
+        }
+        closedir(dir);
+        return 0;
+    }
+    case TRACE_MKNOD:    return sys(mknod(full, rec->mode, 0));
+    case TRACE_MKDIR:    return sys(mkdir(full, rec->mode));
+    case TRACE_LINK:     return sys(link(full, full2));
+    case TRACE_UNLINK:   return sys(unlink(full));
+    case TRACE_RMDIR:    return sys(rmdir(full));
+    case TRACE_RENAME:   return sys(rename(full, full2));
+    case TRACE_CHMOD:    return sys(chmod(full, rec->mode));
+    case TRACE_TRUNCATE: return sys(truncate(full, rec->size));
+    case TRACE_OPEN:
+        fd = open(full, rec->mode & ~(O_CREAT | O_EXCL | O_TRUNC));
+        if (h) {
+            h->fd = fd;
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        return fd < 0 ? -errno : 0;
+    case TRACE_READ:
+        fd = file_fd(h, full, O_RDONLY);
+        rv = sys(pread(fd, buffer(rec->size), rec->size, rec->offset));
+        file_done(h, fd);
+        return rv;
+    case TRACE_WRITE:
+        fd = file_fd(h, full, O_WRONLY);
+        rv = sys(pwrite(fd, buffer(rec->size), rec->size, rec->offset));
+        file_done(h, fd);
+        return rv;
+    case TRACE_RELEASE:
+        if (h) {
+            rv = h->fd >= 0 ? sys(close(h->fd)) : 0;
+            h->traced = 0;
+            return rv;
+        }
+        return 0;
+    case TRACE_FSYNC:
+    case TRACE_FSYNCDIR:
+        fd = file_fd(h, full, O_RDONLY);
+        rv = sys(rec->mode ? fdatasync(fd) : fsync(fd));
+        file_done(h, fd);
+        return rv;
+    case TRACE_UTIMENS:  return sys(utimensat(AT_FDCWD, full, ts, AT_SYMLINK_NOFOLLOW));
+    case TRACE_IOCTL: {
+        union {
+            clone_args_t clone;
+            unsigned int flags;
+            dedup_stats_t dedup;
+            checksum_stats_t checksum;
+        } arg;
+        memset(&arg, 0, sizeof(arg));
+        if (rec->mode == NUFS_IOC_CLONE_RANGE) {
+            if (snprintf(arg.clone.src, CLONE_PATH, "%s", path2) >= CLONE_PATH) {
+                return -ENAMETOOLONG;
+            }
+            arg.clone.src_offset = rec->arg;
+            arg.clone.src_length = rec->size;
+            arg.clone.dest_offset = rec->offset;
+        } else {
+            arg.flags = rec->arg;
+        }
+        fd = file_fd(h, full, O_RDONLY);
+        rv = sys(ioctl(fd, rec->mode, &arg));
+        file_done(h, fd);
+        return rv;
+    }
+    case TRACE_READLINK: return sys(readlink(full, buffer(rec->size), rec->size));
+    case TRACE_SYMLINK:  return sys(symlink(path2, full));
+    case TRACE_SETXATTR: return sys(lsetxattr(full, path2, buffer(rec->size), rec->size, rec->mode));
+    case TRACE_GETXATTR: return sys(lgetxattr(full, path2, buffer(rec->size), rec->size));
+    case TRACE_LISTXATTR: return sys(llistxattr(full, buffer(rec->size), rec->size));
+    case TRACE_REMOVEXATTR: return sys(lremovexattr(full, path2));
+    case TRACE_STATFS: {
+        struct statvfs vfs;
+        return sys(statvfs(full, &vfs));
+    }
+    }
+    return SKIPPED;
+}
+
+static int compare_nanos(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(long total, double secs)
+{
+    fprintf(out, "%-12s %8s %10s %10s %10s %10s %10s %7s\n", "op", "count", "mean us",
+            "p50 us", "p99 us", "max us", "traced us", "differ");
+    for (int op = 1; op < TRACE_OPS; ++op) {
+        op_stats_t* s = &stats[op];
+        if (s->count == 0) {
+            continue;
+        }
+        qsort(s->nanos, s->count, sizeof(uint64_t), compare_nanos);
+        uint64_t sum = 0;
+        for (long ii = 0; ii < s->count; ++ii) {
+            sum += s->nanos[ii];
+        }
+        fprintf(out, "%-12s %8ld %10.1f %10.1f %10.1f %10.1f %10.1f %7ld\n", trace_op_name(op),
+                s->count, sum / 1e3 / s->count, s->nanos[s->count / 2] / 1e3,
+                s->nanos[s->count * 99 / 100] / 1e3, s->nanos[s->count - 1] / 1e3,
+                s->traced / 1e3 / s->count, s->differ);
+    }
+    fprintf(out, "%ld operations replayed in %.3f s (%.0f ops/s)\n", total, secs, total / secs);
+}
+
+int main(int argc, char* argv[])
+{
+    int paced = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "rm:")) != -1) {
+        switch (opt) {
+        case 'r': paced = 1; break;
+        case 'm': mount = optarg; break;
+        default: argc = 0;
+        }
+    }
+    if (argc == 0 || optind != argc - (mount ? 1 : 2)) {
+        fprintf(stderr, "usage: %s [-r] TRACE IMAGE\n"
+                        "       %s [-r] -m MOUNTPOINT TRACE\n", argv[0], argv[0]);
+        return 2;
+    }
+    const char* trace_path = argv[optind];
+    const char* image = mount ? 0 : argv[optind + 1];
+
+    FILE* file = fopen(trace_path, "r");
+    trace_header_t hdr;
+    if (!file || fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+        hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a nufs trace\n", trace_path);
+        return 1;
+    }
+    if (image && access(image, R_OK | W_OK) != 0) {
+        fprintf(stderr, "%s: %s\n", image, strerror(errno));
+        return 1;
+    }
+
+    // The core logs every operation to stdout
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+
+    if (image) {
+        blocks_init(image);
+        nufs_init_ops(&ops);
+        ops.init(0);
+    }
+
+    uint64_t begin = trace_now();
+    long total = 0;
+    trace_rec_t rec;
+    char path[UINT16_MAX + 1];
+    char path2[UINT16_MAX + 1];
+
+    while (fread(&rec, sizeof(rec), 1, file) == 1) {
+        if (fread(path, 1, rec.path_len, file) != rec.path_len ||
+            fread(path2, 1, rec.path2_len, file) != rec.path2_len) {
+            break;
+        }
+        path[rec.path_len] = 0;
+        path2[rec.path2_len] = 0;
+        if (!trace_op_name(rec.op)) {
+            continue;
+        }
+
+        if (paced) {
+            uint64_t now = trace_now() - begin;
+            if (rec.start > now) {
+                uint64_t wait = rec.start - now;
+                struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+                nanosleep(&ts, 0);
+            }
+        }
+
+        uint64_t start = trace_now();
+        int rv = image ? play_image(&rec, path, path2) : play_mount(&rec, path, path2);
+        uint64_t nanos = trace_now() - start;
+        if (rv == SKIPPED) {
+            continue;
+        }
+
+        op_stats_t* s = &stats[rec.op];
+        s->nanos = realloc(s->nanos, (s->count + 1) * sizeof(uint64_t));
+        s->nanos[s->count++] = nanos;
+        s->traced += rec.nanos;
+        s->differ += (rv < 0) != (rec.result < 0);
+        total += 1;
+    }
+    double secs = (trace_now() - begin) / 1e9;
+    fclose(file);
+
+    if (image) {
+        ops.destroy(0);
+    }
+
+    report(total, secs);
+    fclose(out);
+    return 0;
+}
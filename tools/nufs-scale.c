@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../nufs.h"
+#include "../blocks.h"
+#include "../directory.h"
+
+/*
+ * Measures how file creation and appends scale with the number of threads
+ * allocating at once.
+ *
+ *   nufs-scale [-t THREADS] [-n FILES] [-s SIZE] IMAGE
+ *
+ *   -t THREADS  most threads to run, doubling from 1 (default two per CPU)
+ *   -n FILES    files each thread creates (default 40)
+ *   -s SIZE     bytes appended to each file one block at a time, with an
+ *               optional K or M suffix (default 64K)
+ *
+ * IMAGE is formatted afresh for every thread count, replacing any file
+ * there, and removed at the end. Each thread creates its files in a
+ * directory of its own and fills each one before creating the next,
+ * straight through the nufs callbacks, so only the allocators and the
+ * journal are shared between threads.
+ *
+ * After the timed run, the threads create, check and remove as many files
+ * again in one shared directory, at the same time, which fails if two of
+ * them ever take the same entry. As many of them share it as it has
+ * entries for.
+ */
+
+static struct fuse_operations ops;
+static int files = 40;
+static long long size = 65536;
+static char* chunk;
+
+static FILE* out;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Parses a size with an optional K or M suffix. Returns -1 if invalid.
+static long long parse_size(const char* text)
+{
+    char* end;
+    long long size = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'M': case 'm': size *= 1024;  // fall through
+    case 'K': case 'k': size *= 1024; ++end;
+    }
+    return *end == 0 && size > 0 ? size : -1;
+}
+
+/*
+ * Creates and fills the files of one thread. Returns the number of
+ * operations that failed.
+ */
+static void* fill_files(void* arg)
+{
+    long thread = (long)arg;
+    long failed = 0;
+    char path[64];
+
+    for (int ff = 0; ff < files; ++ff) {
+        snprintf(path, sizeof(path), "/t%ld/f%d", thread, ff);
+        if (ops.mknod(path, 0100644, 0) != 0) {
+            failed += 1;
+            continue;
+        }
+        for (long long off = 0; off < size; off += BLOCK_SIZE) {
+            int len = size - off < BLOCK_SIZE ? size - off : BLOCK_SIZE;
+            if (ops.write(path, chunk, len, off, 0) != len) {
+                failed += 1;
+            }
+        }
+    }
+    return (void*)failed;
+}
+
+/*
+ * Creates, writes, checks and removes the files of one thread, one at a
+ * time, in the shared directory. Returns the number of operations that
+ * failed.
+ */
+static void* share_files(void* arg)
+{
+    long thread = (long)arg;
+    long failed = 0;
+    char path[64];
+    struct stat st;
+
+    for (int ff = 0; ff < files; ++ff) {
+        snprintf(path, sizeof(path), "/shared/t%ld-f%d", thread, ff);
+        if (ops.mknod(path, 0100644, 0) != 0) {
+            failed += 1;
+            continue;
+        }
+        if (ops.write(path, (char*)&thread, sizeof(thread), 0, 0) != sizeof(thread) ||
+            ops.getattr(path, &st) != 0 || st.st_size != sizeof(thread) ||
+            ops.unlink(path) != 0) {
+            failed += 1;
+        }
+    }
+    return (void*)failed;
+}
+
+// Counts the entries of a directory listing.
+static int count_entry(void* buf, const char* name, const struct stat* st, off_t off)
+{
+    *(int*)buf += 1;
+    return 0;
+}
+
+/*
+ * Runs the given number of threads on the shared directory. Returns the
+ * number of operations that failed, counting each entry left over.
+ */
+static long share(int threads)
+{
+    int most = BLOCK_SIZE / sizeof(dirent_t);
+    threads = threads < most ? threads : most;
+    ops.mkdir("/shared", 0755);
+
+    pthread_t tids[threads];
+    for (long tt = 0; tt < threads; ++tt) {
+        pthread_create(&tids[tt], 0, share_files, (void*)tt);
+    }
+    long failed = 0;
+    for (int tt = 0; tt < threads; ++tt) {
+        void* rv;
+        pthread_join(tids[tt], &rv);
+        failed += (long)rv;
+    }
+
+    int left = 0;
+    ops.readdir("/shared", &left, count_entry, 0, 0);
+    return failed + left;
+}
+
+/*
+ * Formats the image and runs the given number of threads on it. Returns
+ * the nanoseconds they took, or 0 if anything failed.
+ */
+static uint64_t run(const char* image, int threads)
+{
+    blocks_geometry_t geo;
+    geo.block_size = 4096;
+    geo.block_count = geo.block_size * 8;
+    geo.inode_count = 8192;
+    geo.journal_blocks = 256;
+    unlink(image);
+    if (blocks_mkfs(image, &geo) < 0) {
+        return 0;
+    }
+
+    blocks_init(image);
+    ops.init(0);
+
+    char dir[32];
+    for (int tt = 0; tt < threads; ++tt) {
+        snprintf(dir, sizeof(dir), "/t%d", tt);
+        ops.mkdir(dir, 0755);
+    }
+
+    pthread_t tids[threads];
+    uint64_t start = now();
+    for (long tt = 0; tt < threads; ++tt) {
+        pthread_create(&tids[tt], 0, fill_files, (void*)tt);
+    }
+    long failed = 0;
+    for (int tt = 0; tt < threads; ++tt) {
+        void* rv;
+        pthread_join(tids[tt], &rv);
+        failed += (long)rv;
+    }
+    uint64_t nanos = now() - start;
+    failed += share(threads);
+
+    ops.destroy(0);
+    if (failed > 0) {
+        fprintf(out, "%d threads: %ld operations failed\n", threads, failed);
+        return 0;
+    }
+    return nanos;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:s:")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'n': files = atoi(optarg); break;
+        case 's': size = parse_size(optarg); break;
+        default: max_threads = 0;
+        }
+    }
+    if (optind != argc - 1 || max_threads < 1 || files < 1 || size < 0) {
+        fprintf(stderr, "usage: %s [-t THREADS] [-n FILES] [-s SIZE] IMAGE\n", argv[0]);
+        return 2;
+    }
+    const char* image = argv[optind];
+
+    // The core logs every operation to stdout
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+
+    chunk = malloc(BLOCK_SIZE_MAX);
+    memset(chunk, 'x', BLOCK_SIZE_MAX);
+    nufs_init_ops(&ops);
+
+    fprintf(out, "%s: %d files of %lld bytes per thread\n", image, files, size);
+    fprintf(out, "%8s %12s %12s %10s %8s\n", "threads", "creates/s", "appends/s", "MiB/s",
+            "speedup");
+
+    double base = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        uint64_t nanos = run(image, threads);
+        if (nanos == 0) {
+            return 1;
+        }
+
+        double secs = nanos / 1e9;
+        long creates = (long)threads * files;
+        long appends = creates * ((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        double rate = (creates + appends) / secs;
+        base = base > 0 ? base : rate;
+        fprintf(out, "%8d %12.0f %12.0f %10.1f %7.2fx\n", threads, creates / secs,
+                appends / secs, creates * size / 1048576.0 / secs, rate / base);
+    }
+
+    unlink(image);
+    fclose(out);
+    return 0;
+}
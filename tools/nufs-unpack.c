@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../blocks.h"
+#include "../inode.h"
+#include "../directory.h"
+#include "../checksum.h"
+#include "../compress.h"
+#include "../tail.h"
+#include "../func.h"
+
+/*
+ * Copies the tree in a nufs image out to a host directory, without going
+ * through FUSE.
+ *
+ *   nufs-unpack [-j THREADS] IMAGE DESTDIR
+ *
+ *   -j THREADS  threads to copy with (default one per CPU)
+ *
+ * Directories are created first, then files and symlinks are written in
+ * parallel: plain blocks straight from the mapped image, one write per run
+ * of adjacent blocks, and compressed clusters and packed tails a page at a
+ * time. Holes stay holes. Blocks are checked against their checksums.
+ * Snapshots are not copied.
+ */
+
+typedef struct entry {
+    char* host;              // Path on the host
+    int inum;
+} entry_t;
+
+static entry_t* entries = 0;
+static int entry_count = 0;
+static int entry_cap = 0;
+
+// Next entry for the copy threads
+static int next_entry = 0;
+static long long copied = 0;
+static int failures = 0;
+
+static FILE* out;
+
+static void add_entry(char* host, int inum)
+{
+    if (entry_count == entry_cap) {
+        entry_cap = entry_cap ? 2 * entry_cap : 256;
+        entries = realloc(entries, entry_cap * sizeof(entry_t));
+    }
+    entries[entry_count].host = host;
+    entries[entry_count].inum = inum;
+    entry_count += 1;
+}
+
+/*
+ * Collects every entry below the root, creating the host directories as
+ * it goes. Directories are added before their entries.
+ */
+static void walk_image(void)
+{
+    for (int ii = 0; ii < entry_count; ++ii) {
+        inode_t* dd = get_inode(entries[ii].inum);
+        if (!S_ISDIR(dd->mode)) {
+            continue;
+        }
+        if (mkdir(entries[ii].host, dd->mode & 07777) != 0 && errno != EEXIST) {
+            fprintf(stderr, "%s: %s\n", entries[ii].host, strerror(errno));
+            failures += 1;
+            continue;
+        }
+
+        dirent_t* ents = blocks_get_block(dd->ptrs[0]);
+        for (int jj = 0; jj < BLOCK_SIZE / sizeof(dirent_t); ++jj) {
+            if (ents[jj].name[0] == 0 || streq(ents[jj].name, ".")) {
+                continue;
+            }
+            char* host;
+            if (asprintf(&host, "%s/%s", entries[ii].host, ents[jj].name) >= 0) {
+                add_entry(host, ents[jj].inum);
+            }
+        }
+    }
+}
+
+/*
+ * Writes one file's pages out. Returns 0 or a negative errno.
+ */
+static int copy_file(entry_t* ent, inode_t* node)
+{
+    int fd = open(ent->host, O_WRONLY | O_CREAT | O_TRUNC, node->mode & 07777);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int rv = 0;
+    int pages = bytes_to_blocks(node->size);
+    char page[BLOCK_SIZE];
+    for (int fpn = 0; rv == 0 && fpn < pages; ) {
+        int first = inode_get_pnum(node, fpn);
+        int run = 1;
+        const char* data = page;
+
+        if (first == 0) {
+            // Left as a hole by the ftruncate below
+            fpn += 1;
+            continue;
+        } else if (cluster_compressed(node, fpn)) {
+            rv = cluster_read_page(node, fpn, page);
+        } else if (tail_slot(first)) {
+            rv = tail_read(first, page, 0, BLOCK_SIZE);
+        } else {
+            while (fpn + run < pages && inode_get_pnum(node, fpn + run) == first + run) {
+                ++run;
+            }
+            for (int ii = 0; rv == 0 && ii < run; ++ii) {
+                rv = checksum_verify(first + ii);
+            }
+            data = blocks_get_block(first);
+        }
+
+        // The last page only holds the rest of the file
+        long long off = (long long)BLOCK_SIZE * fpn;
+        long long len = (long long)BLOCK_SIZE * run;
+        if (off + len > node->size) {
+            len = node->size - off;
+        }
+        if (rv == 0 && pwrite(fd, data, len, off) != len) {
+            rv = -errno;
+        }
+        __atomic_add_fetch(&copied, len, __ATOMIC_RELAXED);
+        fpn += run;
+    }
+
+    if (rv == 0 && ftruncate(fd, node->size) != 0) {
+        rv = -errno;
+    }
+    struct timespec times[2] = { { node->time, 0 }, { node->time, 0 } };
+    futimens(fd, times);
+    close(fd);
+    return rv;
+}
+
+/*
+ * Writes one symlink out. Returns 0 or a negative errno.
+ */
+static int copy_symlink(entry_t* ent, inode_t* node)
+{
+    char target[BLOCK_SIZE];
+    int rv = cluster_read_page(node, 0, target);
+    if (rv < 0) {
+        return rv;
+    }
+    target[node->size < BLOCK_SIZE ? node->size : BLOCK_SIZE - 1] = 0;
+
+    unlink(ent->host);
+    return symlink(target, ent->host) == 0 ? 0 : -errno;
+}
+
+static void* copy_entries(void* arg)
+{
+    for (;;) {
+        int ii = __atomic_fetch_add(&next_entry, 1, __ATOMIC_RELAXED);
+        if (ii >= entry_count) {
+            return 0;
+        }
+        entry_t* ent = &entries[ii];
+        inode_t* node = get_inode(ent->inum);
+
+        int rv = 0;
+        if (S_ISREG(node->mode)) {
+            rv = copy_file(ent, node);
+        } else if (S_ISLNK(node->mode)) {
+            rv = copy_symlink(ent, node);
+        }
+        if (rv < 0) {
+            fprintf(stderr, "%s: %s\n", ent->host, strerror(-rv));
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+        case 'j': threads = atoi(optarg); break;
+        default: threads = 0;
+        }
+    }
+    if (optind != argc - 2 || threads < 1) {
+        fprintf(stderr, "usage: %s [-j THREADS] IMAGE DESTDIR\n", argv[0]);
+        return 2;
+    }
+    const char* path = argv[optind];
+    const char* dest = argv[optind + 1];
+
+    if (access(path, R_OK | W_OK) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // The core logs every operation to stdout
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+
+    blocks_init(path);
+
+    add_entry(strdup(dest), tree_lookup("/"));
+    walk_image();
+
+    pthread_t tids[threads];
+    for (int tt = 0; tt < threads; ++tt) {
+        pthread_create(&tids[tt], 0, copy_entries, 0);
+    }
+    for (int tt = 0; tt < threads; ++tt) {
+        pthread_join(tids[tt], 0);
+    }
+
+    blocks_free();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(out, "%s: %d entries, %.1f MiB unpacked in %.3f s (%.0f MiB/s), %d failed\n",
+            dest, entry_count - 1, copied / 1048576.0, secs, copied / 1048576.0 / secs, failures);
+    fclose(out);
+
+    return failures > 0 ? 1 : 0;
+}
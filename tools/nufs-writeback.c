@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../writeback.h"
+
+/*
+ * Reports on the writeback of buffered writes on a nufs mount: how many
+ * are waiting, how long they waited, and how often writers were held back
+ * because too many were.
+ *
+ *   nufs-writeback PATH
+ *
+ * PATH may be any file or directory on the mount.
+ */
+
+// Returns the microseconds within which the given share of the writes in
+// the latency histogram were made
+static double percentile(const writeback_stats_t* stats, double share)
+{
+    uint64_t want = stats->flushed * share;
+    uint64_t seen = 0;
+    for (int ii = 0; ii < WRITEBACK_HIST; ++ii) {
+        seen += stats->latency_hist[ii];
+        if (seen > want) {
+            return (double)(1 << ii);
+        }
+    }
+    return (double)(1 << (WRITEBACK_HIST - 1));
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s PATH\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    writeback_stats_t stats;
+    if (ioctl(fd, NUFS_IOC_WRITEBACK_STATS, &stats) != 0) {
+        perror("writeback stats");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    printf("threads:   %u\n", stats.threads);
+    printf("queued:    %u writes, %llu KiB (at most %llu KiB)\n", stats.queued,
+           (unsigned long long)stats.queued_bytes / 1024,
+           (unsigned long long)stats.max_bytes / 1024);
+    printf("written:   %llu writes, %llu KiB, %llu failed\n",
+           (unsigned long long)stats.flushed, (unsigned long long)stats.flushed_bytes / 1024,
+           (unsigned long long)stats.errors);
+    if (stats.flushed) {
+        printf("latency:   mean %.0f us, p50 < %.0f us, p99 < %.0f us, max %.0f us\n",
+               stats.latency_nanos / 1e3 / stats.flushed, percentile(&stats, 0.5),
+               percentile(&stats, 0.99), stats.latency_max / 1e3);
+    }
+    printf("stalls:    %llu, %.3f ms waiting\n", (unsigned long long)stats.stalls,
+           stats.stall_nanos / 1e6);
+    return 0;
+}
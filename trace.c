@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+/*
+ * Represents functions for recording traces.
+ *
+ * Records go through a stdio buffer of TRACE_BUFFER bytes, so a write to
+ * the trace file only happens once it fills.
+ */
+
+#define TRACE_BUFFER (1 << 20)
+
+static FILE* trace_file = 0;
+static uint64_t trace_base = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* trace_names[TRACE_OPS] = {
+    [TRACE_ACCESS] = "access",
+    [TRACE_GETATTR] = "getattr",
+    [TRACE_READDIR] = "readdir",
+    [TRACE_MKNOD] = "mknod",
+    [TRACE_MKDIR] = "mkdir",
+    [TRACE_LINK] = "link",
+    [TRACE_UNLINK] = "unlink",
+    [TRACE_RMDIR] = "rmdir",
+    [TRACE_RENAME] = "rename",
+    [TRACE_CHMOD] = "chmod",
+    [TRACE_TRUNCATE] = "truncate",
+    [TRACE_OPEN] = "open",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_FLUSH] = "flush",
+    [TRACE_RELEASE] = "release",
+    [TRACE_FSYNC] = "fsync",
+    [TRACE_FSYNCDIR] = "fsyncdir",
+    [TRACE_UTIMENS] = "utimens",
+    [TRACE_IOCTL] = "ioctl",
+    [TRACE_READLINK] = "readlink",
+    [TRACE_SYMLINK] = "symlink",
+    [TRACE_SETXATTR] = "setxattr",
+    [TRACE_GETXATTR] = "getxattr",
+    [TRACE_LISTXATTR] = "listxattr",
+    [TRACE_REMOVEXATTR] = "removexattr",
+    [TRACE_STATFS] = "statfs",
+};
+
+uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Starts recording to the file at path.
+ */
+int trace_open(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        return -errno;
+    }
+    setvbuf(file, 0, _IOFBF, TRACE_BUFFER);
+
+    trace_header_t hdr = { TRACE_MAGIC, TRACE_VERSION, time(0) };
+
+    // Out before the mount forks into the background
+    fwrite(&hdr, sizeof(hdr), 1, file);
+    fflush(file);
+
+    pthread_mutex_lock(&trace_lock);
+    trace_file = file;
+    trace_base = trace_now();
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+int trace_enabled()
+{
+    return trace_file != 0;
+}
+
+/*
+ * Records an operation that started at start.
+ */
+void trace_log(trace_rec_t* rec, const char* path, const char* path2, uint64_t start)
+{
+    uint64_t end = trace_now();
+    size_t len = path ? strlen(path) : 0;
+    size_t len2 = path2 ? strlen(path2) : 0;
+
+    rec->path_len = len < UINT16_MAX ? len : UINT16_MAX;
+    rec->path2_len = len2 < UINT16_MAX ? len2 : UINT16_MAX;
+    rec->nanos = end - start;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        rec->start = start - trace_base;
+        fwrite(rec, sizeof(*rec), 1, trace_file);
+        fwrite(path, 1, rec->path_len, trace_file);
+        fwrite(path2, 1, rec->path2_len, trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * Writes out what is buffered and stops recording.
+ */
+void trace_close()
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+const char* trace_op_name(int op)
+{
+    return op > 0 && op < TRACE_OPS ? trace_names[op] : 0;
+}
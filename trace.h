@@ -0,0 +1,139 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Represents traces of the operations a mount serves.
+ *
+ * With -o trace=PATH, every FUSE callback is recorded to PATH as it
+ * returns: the operation, its paths, numeric arguments, result, when it
+ * started and how long it took. nufs-replay plays a trace back against a
+ * copy of the image taken before the mount, or against a mount, and
+ * reports the latency of each kind of operation.
+ *
+ * A trace is a trace_header_t followed by records. Each trace_rec_t is
+ * followed by its path and then its second path, without null bytes.
+ * Data is not recorded: a replay writes a fixed pattern instead.
+ */
+
+// Identifies a trace file ("NUFT")
+#define TRACE_MAGIC 0x5446554e
+#define TRACE_VERSION 1
+
+// Operations, one per FUSE callback
+enum {
+    TRACE_ACCESS = 1,
+    TRACE_GETATTR,
+    TRACE_READDIR,
+    TRACE_MKNOD,
+    TRACE_MKDIR,
+    TRACE_LINK,
+    TRACE_UNLINK,
+    TRACE_RMDIR,
+    TRACE_RENAME,
+    TRACE_CHMOD,
+    TRACE_TRUNCATE,
+    TRACE_OPEN,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_FLUSH,
+    TRACE_RELEASE,
+    TRACE_FSYNC,
+    TRACE_FSYNCDIR,
+    TRACE_UTIMENS,
+    TRACE_IOCTL,
+    TRACE_READLINK,
+    TRACE_SYMLINK,
+    TRACE_SETXATTR,
+    TRACE_GETXATTR,
+    TRACE_LISTXATTR,
+    TRACE_REMOVEXATTR,
+    TRACE_STATFS,
+    TRACE_OPS
+};
+
+typedef struct trace_header {
+    uint32_t magic;          // TRACE_MAGIC
+    uint32_t version;        // TRACE_VERSION
+    int64_t time;            // Wall clock time the trace started, in seconds
+} trace_header_t;
+
+/*
+ * One operation. What mode, offset, size and arg hold depends on it:
+ *
+ *   access            mode: the mask
+ *   readdir           offset
+ *   mknod, mkdir      mode
+ *   link, rename      path2: the new name
+ *   chmod             mode
+ *   truncate          size
+ *   open              mode: the open flags
+ *   read, write       offset and size
+ *   fsync, fsyncdir   mode: datasync
+ *   utimens           arg: the modification time
+ *   ioctl             mode: the command; for clones, path2 is the source,
+ *                     offset the destination offset, size the length and
+ *                     arg the source offset; for FS_IOC_SETFLAGS, arg is
+ *                     the flags
+ *   readlink          size
+ *   symlink           path2: the target
+ *   setxattr          path2: the name, size and mode: the flags
+ *   getxattr          path2: the name, size
+ *   listxattr         size
+ *   removexattr       path2: the name
+ *
+ * handle is the open file's handle, 0 for none; a replay ties the reads,
+ * writes and release of an open file to it.
+ */
+typedef struct trace_rec {
+    uint8_t op;              // TRACE_* operation
+    uint8_t pad;
+    uint16_t path_len;       // Bytes of the path after the record
+    uint16_t path2_len;      // Bytes of the second path after that
+    uint16_t pad2;
+    int32_t result;          // Return value of the callback
+    uint32_t mode;
+    uint64_t handle;
+    int64_t offset;
+    uint64_t size;
+    int64_t arg;
+    uint64_t start;          // Nanoseconds since the trace started
+    uint64_t nanos;          // Time the callback took
+} trace_rec_t;
+
+/*
+ * Starts recording to the file at path, replacing it.
+ *
+ * Returns 0 on success or a negative errno.
+ */
+int trace_open(const char* path);
+
+/*
+ * Returns whether operations are being recorded.
+ */
+int trace_enabled();
+
+/*
+ * Returns the time in nanoseconds, to pass to trace_log() as the start of
+ * an operation.
+ */
+uint64_t trace_now();
+
+/*
+ * Records an operation that started at start, filling in the record's
+ * times and path lengths.
+ */
+void trace_log(trace_rec_t* rec, const char* path, const char* path2, uint64_t start);
+
+/*
+ * Writes out what is buffered and stops recording.
+ */
+void trace_close();
+
+/*
+ * Returns the name of an operation, or null.
+ */
+const char* trace_op_name(int op);
+
+#endif
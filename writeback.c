@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "writeback.h"
+
+/*
+ * Represents functions for queueing buffered writes and the workers that
+ * make them.
+ */
+
+// A write waiting in the queue
+typedef struct writeback_job {
+    inode_t* node;
+    char* data;
+    int size;
+    off_t offset;
+    time_t mtime;
+    uint64_t queued;                // When it was queued
+    struct writeback_job* next;
+} writeback_job_t;
+
+// A write that failed, until writeback_error() reports it
+typedef struct writeback_err {
+    inode_t* node;
+    int error;
+    struct writeback_err* next;
+} writeback_err_t;
+
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_work = PTHREAD_COND_INITIALIZER;    // A write was queued
+static pthread_cond_t wb_done = PTHREAD_COND_INITIALIZER;    // A write was made
+
+static writeback_job_t* wb_head = 0;
+static writeback_job_t* wb_tail = 0;
+static int wb_pending = 0;                // Writes queued or being made
+static writeback_err_t* wb_errors = 0;
+
+static writeback_fn wb_write = 0;
+static pthread_t* wb_threads = 0;
+static inode_t** wb_running = 0;          // File each worker is writing, or null
+static int wb_count = 0;
+static int wb_stop = 0;
+
+static writeback_stats_t wb_stats;
+
+static uint64_t writeback_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Makes a write, keeps its error and accounts for it, then frees it.
+ */
+static void writeback_make(writeback_job_t* job)
+{
+    int rv = wb_write(job->node, job->data, job->size, job->offset, job->mtime);
+    if (rv >= 0 && rv < job->size) {
+        rv = -ENOSPC;
+    }
+    uint64_t nanos = writeback_now() - job->queued;
+
+    pthread_mutex_lock(&wb_lock);
+    if (rv < 0) {
+        // Only the first error of a file is kept
+        writeback_err_t* err = wb_errors;
+        while (err && err->node != job->node) {
+            err = err->next;
+        }
+        if (!err) {
+            err = malloc(sizeof(writeback_err_t));
+            err->node = job->node;
+            err->error = rv;
+            err->next = wb_errors;
+            wb_errors = err;
+        }
+        wb_stats.errors += 1;
+    }
+
+    int bucket = 0;
+    while (bucket < WRITEBACK_HIST - 1 && nanos >= (uint64_t)1000 << bucket) {
+        bucket += 1;
+    }
+    wb_stats.latency_hist[bucket] += 1;
+    wb_stats.latency_nanos += nanos;
+    wb_stats.latency_max = nanos > wb_stats.latency_max ? nanos : wb_stats.latency_max;
+    wb_stats.flushed += 1;
+    wb_stats.flushed_bytes += job->size;
+    wb_stats.queued_bytes -= job->size;
+    wb_stats.queued -= 1;
+    __atomic_sub_fetch(&wb_pending, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&wb_done);
+    pthread_mutex_unlock(&wb_lock);
+
+    printf("+ writeback_make(%d bytes, @+%ld) -> %d\n", job->size, job->offset, rv);
+    free(job->data);
+    free(job);
+}
+
+/*
+ * Takes the first queued write to a file no other worker is writing.
+ * Returns null if there is none. Called with wb_lock held.
+ */
+static writeback_job_t* writeback_take()
+{
+    writeback_job_t** link = &wb_head;
+    writeback_job_t* prev = 0;
+    while (*link) {
+        writeback_job_t* job = *link;
+        int busy = 0;
+        for (int ii = 0; ii < wb_count; ++ii) {
+            busy |= wb_running[ii] == job->node;
+        }
+        if (!busy) {
+            *link = job->next;
+            if (wb_tail == job) {
+                wb_tail = prev;
+            }
+            return job;
+        }
+        prev = job;
+        link = &job->next;
+    }
+    return 0;
+}
+
+/*
+ * Makes queued writes until told to stop with the queue empty.
+ */
+static void* writeback_main(void* arg)
+{
+    int self = (int)(intptr_t)arg;
+
+    pthread_mutex_lock(&wb_lock);
+    for (;;) {
+        writeback_job_t* job = writeback_take();
+        if (!job) {
+            if (wb_stop && !wb_head) {
+                break;
+            }
+            pthread_cond_wait(&wb_work, &wb_lock);
+            continue;
+        }
+        wb_running[self] = job->node;
+        pthread_mutex_unlock(&wb_lock);
+
+        writeback_make(job);
+
+        // Writes to the same file may have waited for this one, and so
+        // may writeback_wait()
+        pthread_mutex_lock(&wb_lock);
+        wb_running[self] = 0;
+        if (wb_head) {
+            pthread_cond_broadcast(&wb_work);
+        }
+        pthread_cond_broadcast(&wb_done);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return 0;
+}
+
+/*
+ * Starts the writeback workers.
+ */
+void writeback_start(int threads, writeback_fn write)
+{
+    memset(&wb_stats, 0, sizeof(wb_stats));
+    wb_write = write;
+    wb_stop = 0;
+    wb_count = threads;
+    wb_stats.threads = threads;
+    wb_threads = malloc(threads * sizeof(pthread_t));
+    wb_running = calloc(threads, sizeof(inode_t*));
+    for (int ii = 0; ii < threads; ++ii) {
+        int rv = pthread_create(&wb_threads[ii], 0, writeback_main, (void*)(intptr_t)ii);
+        assert(rv == 0);
+    }
+}
+
+/*
+ * Drains the queue and stops the workers.
+ */
+void writeback_stop()
+{
+    pthread_mutex_lock(&wb_lock);
+    wb_stop = 1;
+    pthread_cond_broadcast(&wb_work);
+    pthread_mutex_unlock(&wb_lock);
+    for (int ii = 0; ii < wb_count; ++ii) {
+        pthread_join(wb_threads[ii], 0);
+    }
+
+    free(wb_threads);
+    free(wb_running);
+    wb_threads = 0;
+    wb_running = 0;
+    wb_count = 0;
+
+    while (wb_errors) {
+        writeback_err_t* next = wb_errors->next;
+        free(wb_errors);
+        wb_errors = next;
+    }
+}
+
+/*
+ * Queues a write, waiting while the queue is full.
+ */
+void writeback_queue(inode_t* node, char* data, int size, off_t offset, time_t mtime)
+{
+    writeback_job_t* job = malloc(sizeof(writeback_job_t));
+    job->node = node;
+    job->data = data;
+    job->size = size;
+    job->offset = offset;
+    job->mtime = mtime;
+    job->next = 0;
+
+    pthread_mutex_lock(&wb_lock);
+    if (wb_stats.queued_bytes > 0 && wb_stats.queued_bytes + size > WRITEBACK_LIMIT) {
+        uint64_t start = writeback_now();
+        while (wb_stats.queued_bytes > 0 && wb_stats.queued_bytes + size > WRITEBACK_LIMIT) {
+            pthread_cond_wait(&wb_done, &wb_lock);
+        }
+        wb_stats.stalls += 1;
+        wb_stats.stall_nanos += writeback_now() - start;
+    }
+
+    job->queued = writeback_now();
+    wb_stats.queued += 1;
+    wb_stats.queued_bytes += size;
+    if (wb_stats.queued_bytes > wb_stats.max_bytes) {
+        wb_stats.max_bytes = wb_stats.queued_bytes;
+    }
+    __atomic_add_fetch(&wb_pending, 1, __ATOMIC_RELEASE);
+
+    // Without workers the write is made right away
+    if (wb_count == 0) {
+        pthread_mutex_unlock(&wb_lock);
+        writeback_make(job);
+        return;
+    }
+
+    if (wb_tail) {
+        wb_tail->next = job;
+    } else {
+        wb_head = job;
+    }
+    wb_tail = job;
+    pthread_cond_signal(&wb_work);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/*
+ * Returns whether a write to the given file, or to any file if node is
+ * null, is queued or being made. Called with wb_lock held.
+ */
+static int writeback_busy(inode_t* node)
+{
+    if (!node) {
+        return wb_pending > 0;
+    }
+    for (writeback_job_t* job = wb_head; job; job = job->next) {
+        if (job->node == node) {
+            return 1;
+        }
+    }
+    for (int ii = 0; ii < wb_count; ++ii) {
+        if (wb_running[ii] == node) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Waits for the writes queued for a file.
+ */
+void writeback_wait(inode_t* node)
+{
+    if (!__atomic_load_n(&wb_pending, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&wb_lock);
+    while (writeback_busy(node)) {
+        pthread_cond_wait(&wb_done, &wb_lock);
+    }
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/*
+ * Reports and forgets the first failed write to a file.
+ */
+int writeback_error(inode_t* node)
+{
+    int rv = 0;
+    pthread_mutex_lock(&wb_lock);
+    writeback_err_t** link = &wb_errors;
+    while (*link && (*link)->node != node) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        writeback_err_t* err = *link;
+        rv = err->error;
+        *link = err->next;
+        free(err);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return rv;
+}
+
+/*
+ * Fills in the writeback statistics.
+ */
+void writeback_get_stats(writeback_stats_t* stats)
+{
+    pthread_mutex_lock(&wb_lock);
+    *stats = wb_stats;
+    pthread_mutex_unlock(&wb_lock);
+}
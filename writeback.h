@@ -0,0 +1,97 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include "inode.h"
+
+/*
+ * Represents the writeback of buffered file writes.
+ *
+ * Writes gathered in memory are queued here and written to their files by
+ * a pool of worker threads, off the threads serving requests: placing the
+ * data, sealing its checksums, compressing and deduplicating it all happen
+ * in the workers. The writes queued for one file are made in the order they
+ * were queued, one at a time; writes to different files run in parallel.
+ *
+ * At most WRITEBACK_LIMIT bytes wait in the queue. A thread queueing more
+ * waits for the workers to catch up, so a burst of writes is slowed down
+ * rather than growing the queue without bound.
+ */
+
+// Workers started by default, and bytes the queue holds at most
+#define WRITEBACK_THREADS 2
+#define WRITEBACK_LIMIT (32 << 20)
+
+// Buckets of the flush latency histogram: bucket i counts writes that took
+// less than 2^i microseconds from being queued to being made, the last one
+// all that took longer
+#define WRITEBACK_HIST 24
+
+typedef struct writeback_stats {
+    uint32_t threads;        // Worker threads
+    uint32_t queued;         // Writes waiting or being made now
+    uint64_t queued_bytes;   // Bytes of them
+    uint64_t max_bytes;      // Most bytes queued at once since mount
+    uint64_t flushed;        // Writes made since mount
+    uint64_t flushed_bytes;  // Bytes of them
+    uint64_t errors;         // Writes that failed since mount
+    uint64_t stalls;         // Times a thread waited for the queue to drain
+    uint64_t stall_nanos;    // Time spent waiting
+    uint64_t latency_nanos;  // Total time from queueing to done
+    uint64_t latency_max;    // Longest of them
+    uint64_t latency_hist[WRITEBACK_HIST];
+} writeback_stats_t;
+
+// Reports writeback_stats_t for the whole file system; issued on any file
+#define NUFS_IOC_WRITEBACK_STATS _IOR('N', 4, writeback_stats_t)
+
+/*
+ * Writes size bytes of data at offset into a file, giving it the specified
+ * mtime. Returns the bytes written or a negative errno.
+ */
+typedef int (*writeback_fn)(inode_t* node, const char* data, size_t size, off_t offset,
+                            time_t mtime);
+
+/*
+ * Starts the given number of worker threads, which make the writes queued
+ * from now on with the given function. With no threads, writes are made
+ * right away by the thread queueing them.
+ *
+ * Called once the file system is running, like journal_start().
+ */
+void writeback_start(int threads, writeback_fn write);
+
+/*
+ * Makes every queued write and stops the workers.
+ */
+void writeback_stop();
+
+/*
+ * Queues a write of size bytes of data, allocated with malloc(), at offset
+ * into a file; the data is freed once written. Waits first while the queue
+ * is full.
+ */
+void writeback_queue(inode_t* node, char* data, int size, off_t offset, time_t mtime);
+
+/*
+ * Waits until every write queued for a file, or for any file if node is
+ * null, has been made.
+ */
+void writeback_wait(inode_t* node);
+
+/*
+ * Returns the first error making a queued write to a file since this was
+ * last called for it, and forgets it. Returns 0 if there was none.
+ */
+int writeback_error(inode_t* node);
+
+/*
+ * Fills in the writeback statistics.
+ */
+void writeback_get_stats(writeback_stats_t* stats);
+
+#endif
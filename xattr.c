@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "xattr.h"
+#include "blocks.h"
+#include "inode.h"
+#include "journal.h"
+#include "hash.h"
+
+/*
+ * Represents functions for extended attributes.
+ */
+
+// Identifies an xattr block ("XATR")
+#define XATTR_MAGIC 0x52544158
+
+// Longest attribute name, as in <linux/limits.h>
+#ifndef XATTR_NAME_MAX
+#define XATTR_NAME_MAX 255
+#endif
+
+// Starts an xattr block
+typedef struct xattr_hdr {
+    uint32_t magic;          // XATTR_MAGIC
+    uint16_t count;          // Attributes in the block
+    uint16_t used;           // Bytes of attributes after the header
+} xattr_hdr_t;
+
+// Precedes the name and value of an attribute in an xattr block. Inline
+// attributes have a one byte value length instead.
+typedef struct xattr_rec {
+    uint8_t name_len;
+    uint8_t _pad;
+    uint16_t value_len;
+} xattr_rec_t;
+
+// Bytes of attributes an xattr block holds: those of its first 4 KiB, so
+// the limits are the same whatever the block size
+#define XATTR_BLOCK_BYTES (4096 - (int)sizeof(xattr_hdr_t))
+
+// One attribute, pointing into the inode, a block or the caller's arguments
+typedef struct xattr_ent {
+    const char* name;
+    int name_len;
+    const char* value;
+    int value_len;
+} xattr_ent_t;
+
+// Attributes an inode can have at most: every one takes at least 3 bytes
+#define XATTR_MAX_ENTS ((XATTR_INLINE + XATTR_BLOCK_BYTES) / 3)
+
+// Slots of the value location cache and of the shared block table
+#define CACHE_SLOTS 256
+#define SHARED_SLOTS 1024
+
+/*
+ * A direct-mapped cache entry, keyed by xattr block and name. Xattr blocks
+ * are never written in place, so an entry stays valid until its block is
+ * reused for another xattr block, which xattr_write_block() evicts.
+ */
+typedef struct xattr_cache {
+    int bnum;                      // Xattr block, 0 if empty
+    uint8_t name_len;
+    char name[XATTR_NAME_MAX];
+    uint16_t value_off;            // Offset of the value in the block
+    uint16_t value_len;
+} xattr_cache_t;
+
+// An xattr block known since mount, by the hash of its contents
+typedef struct xattr_shared {
+    hash128_t hash;
+    int bnum;                      // 0 if empty
+} xattr_shared_t;
+
+static xattr_cache_t xattr_cache[CACHE_SLOTS];
+static xattr_shared_t xattr_shared[SHARED_SLOTS];
+static pthread_mutex_t xattr_lock = PTHREAD_MUTEX_INITIALIZER;
+static long cache_hits = 0;
+static long cache_misses = 0;
+
+/*
+ * FNV-1a over a name, to pick its cache slot.
+ */
+static uint32_t xattr_name_hash(int bnum, const char* name, int len)
+{
+    uint32_t hash = 2166136261u ^ bnum;
+    for (int ii = 0; ii < len; ++ii) {
+        hash = (hash ^ (uint8_t)name[ii]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Orders attributes by name.
+ */
+static int xattr_compare(const void* aa, const void* bb)
+{
+    const xattr_ent_t* ea = aa;
+    const xattr_ent_t* eb = bb;
+    int len = ea->name_len < eb->name_len ? ea->name_len : eb->name_len;
+    int rv = memcmp(ea->name, eb->name, len);
+    return rv ? rv : ea->name_len - eb->name_len;
+}
+
+/*
+ * Collects the inline attributes of the inode into ents. Returns how many
+ * there are.
+ */
+static int xattr_collect_inline(inode_t* node, xattr_ent_t* ents)
+{
+    int count = 0;
+    const uint8_t* inl = node->xattr_inline;
+    for (int off = 0; off + 2 <= XATTR_INLINE && inl[off] != 0; ++count) {
+        ents[count].name_len = inl[off];
+        ents[count].value_len = inl[off + 1];
+        ents[count].name = (const char*)inl + off + 2;
+        ents[count].value = ents[count].name + ents[count].name_len;
+        off += 2 + ents[count].name_len + ents[count].value_len;
+    }
+    return count;
+}
+
+/*
+ * Collects the attributes of the inode, inline ones first, into ents.
+ * Returns how many there are.
+ */
+static int xattr_collect(inode_t* node, xattr_ent_t* ents)
+{
+    int count = xattr_collect_inline(node, ents);
+
+    if (node->xattr) {
+        const xattr_hdr_t* hdr = blocks_get_block(node->xattr);
+        const uint8_t* data = (const uint8_t*)(hdr + 1);
+        for (int ii = 0, off = 0; ii < hdr->count; ++ii) {
+            const xattr_rec_t* rec = (const xattr_rec_t*)(data + off);
+            ents[count].name_len = rec->name_len;
+            ents[count].value_len = rec->value_len;
+            ents[count].name = (const char*)(rec + 1);
+            ents[count].value = ents[count].name + rec->name_len;
+            off += sizeof(xattr_rec_t) + rec->name_len + rec->value_len;
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Finds the named attribute among ents. Returns its index or -1.
+ */
+static int xattr_find(xattr_ent_t* ents, int count, const char* name, int len)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        if (ents[ii].name_len == len && memcmp(ents[ii].name, name, len) == 0) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Looks the named attribute up in the inode's xattr block through the
+ * cache. Returns 0 and fills in ent if it is there, or -ENODATA.
+ */
+static int xattr_block_lookup(inode_t* node, const char* name, int len, xattr_ent_t* ent)
+{
+    if (!node->xattr) {
+        return -ENODATA;
+    }
+
+    const char* block = blocks_get_block(node->xattr);
+    uint32_t slot = xattr_name_hash(node->xattr, name, len) % CACHE_SLOTS;
+
+    pthread_mutex_lock(&xattr_lock);
+    xattr_cache_t* entry = &xattr_cache[slot];
+    if (entry->bnum == node->xattr && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+        cache_hits += 1;
+        ent->value = block + entry->value_off;
+        ent->value_len = entry->value_len;
+        pthread_mutex_unlock(&xattr_lock);
+        return 0;
+    }
+    cache_misses += 1;
+    pthread_mutex_unlock(&xattr_lock);
+
+    const xattr_hdr_t* hdr = (const xattr_hdr_t*)block;
+    const uint8_t* data = (const uint8_t*)(hdr + 1);
+    for (int ii = 0, off = 0; ii < hdr->count; ++ii) {
+        const xattr_rec_t* rec = (const xattr_rec_t*)(data + off);
+        const char* rec_name = (const char*)(rec + 1);
+        if (rec->name_len == len && memcmp(rec_name, name, len) == 0) {
+            ent->value = rec_name + len;
+            ent->value_len = rec->value_len;
+
+            pthread_mutex_lock(&xattr_lock);
+            entry->bnum = node->xattr;
+            entry->name_len = len;
+            memcpy(entry->name, name, len);
+            entry->value_off = ent->value - block;
+            entry->value_len = ent->value_len;
+            pthread_mutex_unlock(&xattr_lock);
+
+            printf("+ xattr_block_lookup(%.*s) -> %d (%ld hits, %ld misses)\n",
+                   len, name, node->xattr, cache_hits, cache_misses);
+            return 0;
+        }
+        off += sizeof(xattr_rec_t) + rec->name_len + rec->value_len;
+    }
+    return -ENODATA;
+}
+
+/*
+ * Finds a known xattr block holding the given bytes and takes a reference
+ * to it. Returns its number, or 0 if there is none.
+ */
+static int xattr_share_block(const uint8_t* data, int len, hash128_t hash)
+{
+    pthread_mutex_lock(&xattr_lock);
+    xattr_shared_t* entry = &xattr_shared[hash.lo % SHARED_SLOTS];
+    int bnum = entry->bnum;
+    int same = bnum && entry->hash.lo == hash.lo && entry->hash.hi == hash.hi &&
+               memcmp(blocks_get_block(bnum), data, len) == 0;
+    pthread_mutex_unlock(&xattr_lock);
+
+    if (!same || block_share(bnum) < 0) {
+        return 0;
+    }
+    return bnum;
+}
+
+/*
+ * Writes the given bytes into a new xattr block, or finds a block that
+ * holds them already. Returns its number, or -ENOSPC.
+ */
+static int xattr_write_block(const uint8_t* data, int len)
+{
+    hash128_t hash = hash128(data, len);
+    int bnum = xattr_share_block(data, len, hash);
+    if (bnum) {
+        return bnum;
+    }
+
+    bnum = alloc_block();
+    if (bnum < 0) {
+        return -ENOSPC;
+    }
+    journal_log(JR_XATTR, bnum, 0, len);
+    memcpy(blocks_get_block(bnum), data, len);
+
+    // The block may have been an xattr block before
+    pthread_mutex_lock(&xattr_lock);
+    for (int ii = 0; ii < CACHE_SLOTS; ++ii) {
+        if (xattr_cache[ii].bnum == bnum) {
+            xattr_cache[ii].bnum = 0;
+        }
+    }
+    xattr_shared_t* entry = &xattr_shared[hash.lo % SHARED_SLOTS];
+    entry->hash = hash;
+    entry->bnum = bnum;
+    pthread_mutex_unlock(&xattr_lock);
+
+    return bnum;
+}
+
+/*
+ * Drops a reference to an xattr block, forgetting it for sharing once no
+ * inode refers to it any more.
+ */
+static void xattr_drop_block(int bnum)
+{
+    if (block_refs(bnum) == 1) {
+        pthread_mutex_lock(&xattr_lock);
+        for (int ii = 0; ii < SHARED_SLOTS; ++ii) {
+            if (xattr_shared[ii].bnum == bnum) {
+                xattr_shared[ii].bnum = 0;
+            }
+        }
+        pthread_mutex_unlock(&xattr_lock);
+    }
+    free_block(bnum);
+}
+
+/*
+ * Stores the given attributes into the inode: as many as fit inline in
+ * name order, the rest in an xattr block. Returns 0 or -ENOSPC.
+ */
+static int xattr_store(inode_t* node, xattr_ent_t* ents, int count)
+{
+    qsort(ents, count, sizeof(xattr_ent_t), xattr_compare);
+
+    uint8_t inl[XATTR_INLINE];
+    uint8_t block[4096];
+    memset(inl, 0, sizeof(inl));
+    xattr_hdr_t* hdr = (xattr_hdr_t*)block;
+    hdr->magic = XATTR_MAGIC;
+    hdr->count = 0;
+    hdr->used = 0;
+
+    int inl_used = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        xattr_ent_t* ent = &ents[ii];
+        int inl_size = 2 + ent->name_len + ent->value_len;
+        if (ent->value_len <= UINT8_MAX && inl_used + inl_size <= XATTR_INLINE) {
+            inl[inl_used] = ent->name_len;
+            inl[inl_used + 1] = ent->value_len;
+            memcpy(inl + inl_used + 2, ent->name, ent->name_len);
+            memcpy(inl + inl_used + 2 + ent->name_len, ent->value, ent->value_len);
+            inl_used += inl_size;
+            continue;
+        }
+
+        int size = sizeof(xattr_rec_t) + ent->name_len + ent->value_len;
+        if (hdr->used + size > XATTR_BLOCK_BYTES) {
+            return -ENOSPC;
+        }
+        xattr_rec_t* rec = (xattr_rec_t*)(block + sizeof(xattr_hdr_t) + hdr->used);
+        rec->name_len = ent->name_len;
+        rec->_pad = 0;
+        rec->value_len = ent->value_len;
+        memcpy(rec + 1, ent->name, ent->name_len);
+        memcpy((char*)(rec + 1) + ent->name_len, ent->value, ent->value_len);
+        hdr->used += size;
+        hdr->count += 1;
+    }
+
+    int len = sizeof(xattr_hdr_t) + hdr->used;
+    int old = node->xattr;
+    int bnum = 0;
+    if (hdr->count > 0 && old && memcmp(blocks_get_block(old), block, len) == 0) {
+        bnum = old;
+    } else if (hdr->count > 0) {
+        bnum = xattr_write_block(block, len);
+        if (bnum < 0) {
+            return bnum;
+        }
+    }
+
+    inode_dirty(node);
+    memcpy(node->xattr_inline, inl, XATTR_INLINE);
+    node->xattr = bnum;
+    if (old && old != bnum) {
+        xattr_drop_block(old);
+    }
+
+    printf("+ xattr_store(%d attributes) -> %d inline bytes, block %d\n", count, inl_used, bnum);
+    return 0;
+}
+
+/*
+ * Copies the value of the named attribute into value.
+ */
+int xattr_get(inode_t* node, const char* name, char* value, size_t size)
+{
+    int len = strlen(name);
+    xattr_ent_t ent;
+
+    // Inline attributes are in the inode already
+    xattr_ent_t ents[XATTR_INLINE / 3];
+    int count = xattr_collect_inline(node, ents);
+    int idx = xattr_find(ents, count, name, len);
+    if (idx >= 0) {
+        ent = ents[idx];
+    } else if (xattr_block_lookup(node, name, len, &ent) < 0) {
+        return -ENODATA;
+    }
+
+    if (size == 0) {
+        return ent.value_len;
+    }
+    if (size < ent.value_len) {
+        return -ERANGE;
+    }
+    memcpy(value, ent.value, ent.value_len);
+    return ent.value_len;
+}
+
+/*
+ * Sets the named attribute.
+ */
+int xattr_set(inode_t* node, const char* name, const char* value, size_t size, int flags)
+{
+    int len = strlen(name);
+    if (len == 0 || len > XATTR_NAME_MAX) {
+        return -ERANGE;
+    }
+    if (size > XATTR_BLOCK_BYTES - sizeof(xattr_rec_t) - len) {
+        return -ENOSPC;
+    }
+
+    xattr_ent_t* ents = malloc((XATTR_MAX_ENTS + 1) * sizeof(xattr_ent_t));
+    int count = xattr_collect(node, ents);
+    int idx = xattr_find(ents, count, name, len);
+
+    int rv = 0;
+    if (idx >= 0 && (flags & NUFS_XATTR_CREATE)) {
+        rv = -EEXIST;
+    } else if (idx < 0 && (flags & NUFS_XATTR_REPLACE)) {
+        rv = -ENODATA;
+    } else {
+        if (idx < 0) {
+            idx = count++;
+        }
+        ents[idx].name = name;
+        ents[idx].name_len = len;
+        ents[idx].value = value;
+        ents[idx].value_len = size;
+        rv = xattr_store(node, ents, count);
+    }
+
+    free(ents);
+    return rv;
+}
+
+/*
+ * Stores the names of the attributes in list.
+ */
+int xattr_list(inode_t* node, char* list, size_t size)
+{
+    xattr_ent_t* ents = malloc(XATTR_MAX_ENTS * sizeof(xattr_ent_t));
+    int count = xattr_collect(node, ents);
+
+    int total = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        total += ents[ii].name_len + 1;
+    }
+
+    int rv = total;
+    if (size > 0 && size < total) {
+        rv = -ERANGE;
+    } else if (size > 0) {
+        // Inline names come first; present them all in name order
+        qsort(ents, count, sizeof(xattr_ent_t), xattr_compare);
+        for (int ii = 0; ii < count; ++ii) {
+            memcpy(list, ents[ii].name, ents[ii].name_len);
+            list[ents[ii].name_len] = 0;
+            list += ents[ii].name_len + 1;
+        }
+    }
+
+    free(ents);
+    return rv;
+}
+
+/*
+ * Removes the named attribute.
+ */
+int xattr_remove(inode_t* node, const char* name)
+{
+    xattr_ent_t* ents = malloc(XATTR_MAX_ENTS * sizeof(xattr_ent_t));
+    int count = xattr_collect(node, ents);
+    int idx = xattr_find(ents, count, name, strlen(name));
+
+    int rv = -ENODATA;
+    if (idx >= 0) {
+        ents[idx] = ents[--count];
+        rv = xattr_store(node, ents, count);
+    }
+
+    free(ents);
+    return rv;
+}
+
+/*
+ * Releases the inode's xattr block.
+ */
+void xattr_release(inode_t* node)
+{
+    if (node->xattr) {
+        xattr_drop_block(node->xattr);
+        node->xattr = 0;
+    }
+}
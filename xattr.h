@@ -0,0 +1,72 @@
+#ifndef XATTR_H
+#define XATTR_H
+
+#include <stddef.h>
+
+#include "inode.h"
+
+/*
+ * Represents extended attributes.
+ *
+ * An inode's attributes are kept sorted by name. Those that fit go in the
+ * XATTR_INLINE bytes of the inode itself, in name order. The rest go in
+ * one xattr block, which holds the encoded attributes after a header.
+ *
+ * Xattr blocks are never written in place. A change writes a new block and
+ * releases the old one. So inodes with the same attributes can share one
+ * block: a new block's contents are first looked up in an in-memory hash
+ * table of the xattr blocks seen since mount. If a block with the same
+ * bytes is found, it gains a reference instead.
+ *
+ * Lookups of names in blocks go through a small cache of where each value
+ * lies, so hot attributes are found without parsing their block again.
+ */
+
+// Bytes of attributes stored in the inode itself
+#define XATTR_INLINE ((int)sizeof(((inode_t*)0)->xattr_inline))
+
+// setxattr() flags, as in <sys/xattr.h>
+#define NUFS_XATTR_CREATE  1
+#define NUFS_XATTR_REPLACE 2
+
+/*
+ * Copies the value of the named attribute into value, if size is large
+ * enough.
+ *
+ * Returns the length of the value, -ENODATA if there is no such attribute,
+ * or -ERANGE if size is too small. A size of 0 only returns the length.
+ */
+int xattr_get(inode_t* node, const char* name, char* value, size_t size);
+
+/*
+ * Sets the named attribute, creating it or replacing its value. Must be
+ * called inside a transaction.
+ *
+ * Returns 0 on success, -EEXIST or -ENODATA if flags forbid it,
+ * -ERANGE if the name is too long, or -ENOSPC if the attributes no
+ * longer fit in the inode and one block.
+ */
+int xattr_set(inode_t* node, const char* name, const char* value, size_t size, int flags);
+
+/*
+ * Stores the names of the attributes in list, each followed by a null
+ * byte, if size is large enough.
+ *
+ * Returns the length of the list or -ERANGE. A size of 0 only returns the
+ * length.
+ */
+int xattr_list(inode_t* node, char* list, size_t size);
+
+/*
+ * Removes the named attribute. Must be called inside a transaction.
+ *
+ * Returns 0 on success or -ENODATA.
+ */
+int xattr_remove(inode_t* node, const char* name);
+
+/*
+ * Releases the inode's xattr block, when the inode itself is freed.
+ */
+void xattr_release(inode_t* node);
+
+#endif